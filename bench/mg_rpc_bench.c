@@ -0,0 +1,376 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Core bench: a client and a server mg_rpc instance connected with
+ * in-memory pipes (or one instance calling itself through the built-in
+ * local channel), no network involved. Sweeps handler counts, channel
+ * counts, queue depths and frame sizes and reports requests per second,
+ * latency percentiles and heap allocations per request for each run.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mg_rpc.h"
+#include "mg_rpc_channel_local.h"
+
+#include "common/cs_dbg.h"
+#include "mongoose.h"
+
+#include "mg_rpc_bench_pipe.h"
+#include "mg_rpc_bench_util.h"
+
+#define MG_RPC_BENCH_MAX_VALS 16
+#define MG_RPC_BENCH_CLIENT_ID "bench.client"
+
+struct mg_rpc_bench_params {
+  int num_requests;
+  int num_handlers;
+  int num_channels;
+  int depth; /* Calls in flight. */
+  int size;  /* Of the data string in args. */
+  int window;
+  bool local;
+  bool echo;
+};
+
+struct mg_rpc_bench_run;
+
+/* One call in flight, reused for the next one when the result comes. */
+struct mg_rpc_bench_slot {
+  struct mg_rpc_bench_run *r;
+  double start;
+};
+
+struct mg_rpc_bench_run {
+  const struct mg_rpc_bench_params *p;
+  struct mg_rpc *client, *server; /* Same instance for the local channel. */
+  struct mg_rpc_channel **client_chs, **server_chs;
+  struct mg_str *dsts;
+  char *data;
+  struct mg_rpc_bench_slot *slots;
+  int num_sent, num_done, num_errors, target;
+  bool measure;
+  struct mg_rpc_bench_lat lat;
+};
+
+/* Handler methods are not copied, so names are made once for all runs. */
+static struct mg_str *s_methods;
+
+static void mg_rpc_bench_handler(struct mg_rpc_request_info *ri, void *cb_arg,
+                                 struct mg_rpc_frame_info *fi,
+                                 struct mg_str args) {
+  const struct mg_rpc_bench_params *p =
+      (const struct mg_rpc_bench_params *) cb_arg;
+  if (p->echo) {
+    mg_rpc_send_responsef(ri, "%.*s", (int) args.len, args.p);
+  } else {
+    mg_rpc_send_responsef(ri, "{len: %d}", (int) args.len);
+  }
+  (void) fi;
+}
+
+static void mg_rpc_bench_call(struct mg_rpc_bench_slot *s);
+
+static void mg_rpc_bench_result_cb(struct mg_rpc *c, void *cb_arg,
+                                   struct mg_rpc_frame_info *fi,
+                                   struct mg_str result, int error_code,
+                                   struct mg_str error_msg) {
+  struct mg_rpc_bench_slot *s = (struct mg_rpc_bench_slot *) cb_arg;
+  struct mg_rpc_bench_run *r = s->r;
+  if (r->measure) mg_rpc_bench_lat_add(&r->lat, mg_rpc_bench_now() - s->start);
+  if (error_code != 0) {
+    if (r->num_errors++ == 0) {
+      fprintf(stderr, "error %d: %.*s\n", error_code, (int) error_msg.len,
+              error_msg.p);
+    }
+  }
+  r->num_done++;
+  if (r->num_sent < r->target) mg_rpc_bench_call(s);
+  (void) c;
+  (void) fi;
+  (void) result;
+}
+
+static void mg_rpc_bench_call(struct mg_rpc_bench_slot *s) {
+  struct mg_rpc_bench_run *r = s->r;
+  const struct mg_rpc_bench_params *p = r->p;
+  struct mg_rpc_call_opts opts;
+  memset(&opts, 0, sizeof(opts));
+  opts.dst = r->dsts[r->num_sent % (p->local ? 1 : p->num_channels)];
+  opts.timeout_ms = -1;
+  struct mg_str method = s_methods[r->num_sent % p->num_handlers];
+  r->num_sent++;
+  s->start = mg_rpc_bench_now();
+  if (!mg_rpc_callf(r->client, method, mg_rpc_bench_result_cb, s, &opts,
+                    "{data: %Q}", r->data)) {
+    r->num_errors++;
+    r->num_done++;
+  }
+}
+
+/* Pumps frames until target calls are done. Returns false if stuck. */
+static bool mg_rpc_bench_loop(struct mg_rpc_bench_run *r, int target) {
+  const struct mg_rpc_bench_params *p = r->p;
+  r->num_sent = r->num_done = 0;
+  r->target = target;
+  for (int i = 0; i < p->depth && r->num_sent < target; i++) {
+    mg_rpc_bench_call(&r->slots[i]);
+  }
+  while (r->num_done < target) {
+    int n = mg_rpc_bench_run_cbs();
+    for (int i = 0; !p->local && i < p->num_channels; i++) {
+      n += mg_rpc_bench_pipe_pump(r->server_chs[i]);
+      n += mg_rpc_bench_pipe_pump(r->client_chs[i]);
+    }
+    if (n == 0) {
+      fprintf(stderr, "stuck after %d of %d calls\n", r->num_done, target);
+      return false;
+    }
+  }
+  return true;
+}
+
+static struct mg_rpc *mg_rpc_bench_instance(const char *id, int depth) {
+  struct mg_rpc_cfg *cfg = (struct mg_rpc_cfg *) calloc(1, sizeof(*cfg));
+  cfg->id = strdup(id);
+  /* Room for all the calls and responses to them. */
+  cfg->max_queue_length = 2 * depth + 16;
+  return mg_rpc_create(cfg);
+}
+
+static bool mg_rpc_bench_setup(struct mg_rpc_bench_run *r) {
+  const struct mg_rpc_bench_params *p = r->p;
+  char buf[32];
+  int num_chs = (p->local ? 1 : p->num_channels);
+  r->client = mg_rpc_bench_instance(MG_RPC_BENCH_CLIENT_ID, p->depth);
+  r->dsts = (struct mg_str *) calloc(num_chs, sizeof(*r->dsts));
+  r->client_chs =
+      (struct mg_rpc_channel **) calloc(num_chs, sizeof(*r->client_chs));
+  r->server_chs =
+      (struct mg_rpc_channel **) calloc(num_chs, sizeof(*r->server_chs));
+  if (r->client == NULL) return false;
+  if (p->local) {
+    struct mg_rpc_channel_local_cfg lcfg = {.sync = false};
+    r->server = r->client;
+    r->client_chs[0] = mg_rpc_channel_local(&lcfg);
+    if (r->client_chs[0] == NULL) return false;
+    r->dsts[0] = mg_strdup(mg_mk_str(MG_RPC_LOCAL_DST));
+    mg_rpc_add_local_id(r->client, r->dsts[0]);
+    mg_rpc_add_channel(r->client, r->dsts[0], r->client_chs[0]);
+  } else {
+    r->server = mg_rpc_bench_instance("bench.srv0", p->depth);
+    if (r->server == NULL) return false;
+    for (int i = 0; i < num_chs; i++) {
+      snprintf(buf, sizeof(buf), "bench.srv%d", i);
+      r->dsts[i] = mg_strdup(mg_mk_str(buf));
+      if (i > 0) mg_rpc_add_local_id(r->server, r->dsts[i]);
+      if (!mg_rpc_bench_pipe(p->window, &r->client_chs[i],
+                             &r->server_chs[i])) {
+        return false;
+      }
+      mg_rpc_add_channel(r->client, r->dsts[i], r->client_chs[i]);
+      /* Learns the client's address from the first frame. */
+      mg_rpc_add_channel(r->server, mg_mk_str(""), r->server_chs[i]);
+    }
+    mg_rpc_connect(r->server);
+  }
+  mg_rpc_connect(r->client);
+  for (int i = 0; i < p->num_handlers; i++) {
+    mg_rpc_add_handler(r->server, s_methods[i].p, "", mg_rpc_bench_handler,
+                       (void *) p);
+  }
+  r->data = (char *) malloc(p->size + 1);
+  memset(r->data, 'x', p->size);
+  r->data[p->size] = '\0';
+  r->slots =
+      (struct mg_rpc_bench_slot *) calloc(p->depth, sizeof(*r->slots));
+  for (int i = 0; i < p->depth; i++) r->slots[i].r = r;
+  mg_rpc_bench_lat_init(&r->lat, p->num_requests);
+  return true;
+}
+
+static void mg_rpc_bench_teardown(struct mg_rpc_bench_run *r) {
+  const struct mg_rpc_bench_params *p = r->p;
+  int num_chs = (p->local ? 1 : p->num_channels);
+  struct mg_rpc_channel *lch = (p->local ? r->client_chs[0] : NULL);
+  /* Pipe ends are destroyed by the instances, both sides close together. */
+  if (r->client != NULL) {
+    mg_rpc_disconnect(r->client);
+    mg_rpc_free(r->client);
+  }
+  if (r->server != NULL && r->server != r->client) mg_rpc_free(r->server);
+  /* Local channel is persistent, it survives the instance. */
+  if (lch != NULL) lch->ch_destroy(lch);
+  for (int i = 0; i < num_chs && r->dsts != NULL; i++) {
+    free((void *) r->dsts[i].p);
+  }
+  free(r->dsts);
+  free(r->client_chs);
+  free(r->server_chs);
+  free(r->data);
+  free(r->slots);
+  mg_rpc_bench_lat_free(&r->lat);
+}
+
+static bool mg_rpc_bench_run_one(const struct mg_rpc_bench_params *p) {
+  struct mg_rpc_bench_run r;
+  struct mg_rpc_bench_allocs a0, a1;
+  memset(&r, 0, sizeof(r));
+  r.p = p;
+  bool ok = mg_rpc_bench_setup(&r);
+  /* Warms up the instances: hash tables, free lists and buffers. */
+  int warmup = p->num_requests / 10;
+  if (warmup < 2 * p->depth) warmup = 2 * p->depth;
+  if (ok) ok = mg_rpc_bench_loop(&r, warmup);
+  if (ok) {
+    r.num_errors = 0;
+    r.measure = true;
+    mg_rpc_bench_allocs_get(&a0);
+    double start = mg_rpc_bench_now();
+    ok = mg_rpc_bench_loop(&r, p->num_requests);
+    double elapsed = mg_rpc_bench_now() - start;
+    mg_rpc_bench_allocs_get(&a1);
+    r.measure = false;
+    double n = r.num_done;
+    printf("%8d %5d %5d %6d %10.0f %8.1f %8.1f %10.2f %9.0f %6d\n",
+           p->num_handlers, (p->local ? 1 : p->num_channels), p->depth,
+           p->size, (elapsed > 0 ? n / elapsed : 0),
+           mg_rpc_bench_lat_pct(&r.lat, 50) * 1e6,
+           mg_rpc_bench_lat_pct(&r.lat, 99) * 1e6, (a1.num - a0.num) / n,
+           (a1.bytes - a0.bytes) / n, r.num_errors);
+    fflush(stdout);
+  }
+  mg_rpc_bench_teardown(&r);
+  return ok;
+}
+
+static void mg_rpc_bench_usage(const char *argv0) {
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  -n N     requests per run, default 20000\n"
+          "  -H LIST  handler counts, default 1,64,1024\n"
+          "  -c LIST  channel counts, default 1,8\n"
+          "  -q LIST  queue depths (calls in flight), default 1,16,128\n"
+          "  -s LIST  args sizes in bytes, default 16,1024\n"
+          "  -w N     channel send window, default 1\n"
+          "  -e       respond with the args instead of a short result\n"
+          "  -l       call through the local channel, -c and -w are ignored\n"
+          "  -v       debug log\n"
+          "LIST is comma-separated, e.g. 1,16,256. A run is made for each\n"
+          "combination.\n",
+          argv0);
+}
+
+static bool mg_rpc_bench_list_arg(const char *s, int *vals, int *num_vals) {
+  *num_vals = mg_rpc_bench_parse_list(s, vals, MG_RPC_BENCH_MAX_VALS);
+  return (*num_vals > 0);
+}
+
+int main(int argc, char **argv) {
+  struct mg_rpc_bench_params p;
+  int handlers[MG_RPC_BENCH_MAX_VALS] = {1, 64, 1024}, num_handlers = 3;
+  int channels[MG_RPC_BENCH_MAX_VALS] = {1, 8}, num_channels = 2;
+  int depths[MG_RPC_BENCH_MAX_VALS] = {1, 16, 128}, num_depths = 3;
+  int sizes[MG_RPC_BENCH_MAX_VALS] = {16, 1024}, num_sizes = 2;
+  int opt, max_handlers = 0, res = EXIT_SUCCESS;
+  struct mg_mgr mgr;
+  memset(&p, 0, sizeof(p));
+  p.num_requests = 20000;
+  p.window = 1;
+  cs_log_set_level(LL_ERROR);
+  while ((opt = getopt(argc, argv, "n:H:c:q:s:w:elv")) != -1) {
+    bool ok = true;
+    switch (opt) {
+      case 'n':
+        ok = ((p.num_requests = atoi(optarg)) > 0);
+        break;
+      case 'H':
+        ok = mg_rpc_bench_list_arg(optarg, handlers, &num_handlers);
+        break;
+      case 'c':
+        ok = mg_rpc_bench_list_arg(optarg, channels, &num_channels);
+        break;
+      case 'q':
+        ok = mg_rpc_bench_list_arg(optarg, depths, &num_depths);
+        break;
+      case 's':
+        ok = mg_rpc_bench_list_arg(optarg, sizes, &num_sizes);
+        break;
+      case 'w':
+        ok = ((p.window = atoi(optarg)) > 0);
+        break;
+      case 'e':
+        p.echo = true;
+        break;
+      case 'l':
+        p.local = true;
+        break;
+      case 'v':
+        cs_log_set_level(LL_DEBUG);
+        break;
+      default:
+        ok = false;
+    }
+    if (!ok) {
+      mg_rpc_bench_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (p.local) num_channels = 1;
+
+  for (int i = 0; i < num_handlers; i++) {
+    if (handlers[i] > max_handlers) max_handlers = handlers[i];
+  }
+  s_methods = (struct mg_str *) calloc(max_handlers, sizeof(*s_methods));
+  for (int i = 0; i < max_handlers; i++) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "Bench.Method%d", i);
+    s_methods[i] = mg_strdup_nul(mg_mk_str(buf));
+  }
+
+  mg_mgr_init(&mgr, NULL);
+  mg_rpc_bench_set_mgr(&mgr);
+
+  printf("# %s, %d requests per run%s%s\n",
+         (p.local ? "local channel" : "pipe channels"), p.num_requests,
+         (p.echo ? ", echo" : ""),
+         (mg_rpc_bench_allocs_counted() ? "" : ", allocations not counted"));
+  if (!p.local) printf("# send window %d\n", p.window);
+  printf("%8s %5s %5s %6s %10s %8s %8s %10s %9s %6s\n", "handlers", "chans",
+         "depth", "size", "req/s", "p50 us", "p99 us", "allocs/req",
+         "bytes/req", "errors");
+  for (int hi = 0; hi < num_handlers; hi++) {
+    for (int ci = 0; ci < num_channels; ci++) {
+      for (int qi = 0; qi < num_depths; qi++) {
+        for (int si = 0; si < num_sizes; si++) {
+          p.num_handlers = handlers[hi];
+          p.num_channels = channels[ci];
+          p.depth = depths[qi];
+          p.size = sizes[si];
+          if (!mg_rpc_bench_run_one(&p)) res = EXIT_FAILURE;
+        }
+      }
+    }
+  }
+
+  mg_mgr_free(&mgr);
+  return res;
+}
@@ -0,0 +1,246 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mg_rpc_bench_pipe.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mg_rpc.h"
+
+#include "common/mbuf.h"
+#include "common/queue.h"
+
+struct mg_rpc_bench_pipe_msg {
+  struct mbuf fb; /* Headroom, then the frame. */
+  STAILQ_ENTRY(mg_rpc_bench_pipe_msg) msgs;
+};
+
+STAILQ_HEAD(mg_rpc_bench_pipe_msgs, mg_rpc_bench_pipe_msg);
+
+/*
+ * Shared by the ends. Messages are reused, so once warmed up the pipe
+ * itself doesn't allocate.
+ */
+struct mg_rpc_bench_pipe_shared {
+  struct mg_rpc_bench_pipe_msgs free_msgs;
+  int refcnt;
+};
+
+struct mg_rpc_bench_pipe_data {
+  struct mg_rpc_bench_pipe_shared *sh;
+  struct mg_rpc_channel *peer;         /* NULL once it's destroyed. */
+  struct mg_rpc_bench_pipe_msgs inbox; /* Sent by the peer. */
+  int inbox_len;
+  int window;
+  bool is_open;
+  bool in_pump;
+  bool is_destroyed; /* While pumping, freed when done. */
+};
+
+static struct mg_rpc_bench_pipe_data *mg_rpc_bench_pipe_data(
+    struct mg_rpc_channel *ch) {
+  return (struct mg_rpc_bench_pipe_data *) ch->channel_data;
+}
+
+static void mg_rpc_bench_pipe_free_msgs(struct mg_rpc_bench_pipe_msgs *msgs) {
+  struct mg_rpc_bench_pipe_msg *m;
+  while ((m = STAILQ_FIRST(msgs)) != NULL) {
+    STAILQ_REMOVE_HEAD(msgs, msgs);
+    mbuf_free(&m->fb);
+    free(m);
+  }
+}
+
+static void mg_rpc_bench_pipe_free(struct mg_rpc_channel *ch) {
+  struct mg_rpc_bench_pipe_data *chd = mg_rpc_bench_pipe_data(ch);
+  mg_rpc_bench_pipe_free_msgs(&chd->inbox);
+  if (--chd->sh->refcnt == 0) {
+    mg_rpc_bench_pipe_free_msgs(&chd->sh->free_msgs);
+    free(chd->sh);
+  }
+  free(chd);
+  free(ch);
+}
+
+/* Takes over fb if it's not NULL, copies f otherwise. */
+static bool mg_rpc_bench_pipe_send(struct mg_rpc_channel *ch,
+                                   const struct mg_str f, struct mbuf *fb) {
+  struct mg_rpc_bench_pipe_data *chd = mg_rpc_bench_pipe_data(ch);
+  if (!chd->is_open || chd->peer == NULL) return false;
+  struct mg_rpc_bench_pipe_data *pd = mg_rpc_bench_pipe_data(chd->peer);
+  struct mg_rpc_bench_pipe_msg *m = STAILQ_FIRST(&chd->sh->free_msgs);
+  if (m != NULL) {
+    STAILQ_REMOVE_HEAD(&chd->sh->free_msgs, msgs);
+  } else {
+    m = (struct mg_rpc_bench_pipe_msg *) calloc(1, sizeof(*m));
+    if (m == NULL) return false;
+  }
+  if (fb != NULL) {
+    m->fb = *fb;
+    mbuf_init(fb, 0);
+  } else {
+    mbuf_init(&m->fb, MG_RPC_CHANNEL_FRAME_HEADROOM + f.len);
+    m->fb.len = MG_RPC_CHANNEL_FRAME_HEADROOM;
+    mbuf_append(&m->fb, f.p, f.len);
+  }
+  STAILQ_INSERT_TAIL(&pd->inbox, m, msgs);
+  pd->inbox_len++;
+  return true;
+}
+
+static bool mg_rpc_bench_pipe_send_frame(struct mg_rpc_channel *ch,
+                                         const struct mg_str f) {
+  return mg_rpc_bench_pipe_send(ch, f, NULL);
+}
+
+static bool mg_rpc_bench_pipe_send_frame_owned(struct mg_rpc_channel *ch,
+                                               struct mbuf *fb) {
+  return mg_rpc_bench_pipe_send(ch, mg_mk_str(NULL), fb);
+}
+
+int mg_rpc_bench_pipe_pump(struct mg_rpc_channel *ch) {
+  struct mg_rpc_bench_pipe_data *chd = mg_rpc_bench_pipe_data(ch);
+  int n = chd->inbox_len, i;
+  chd->in_pump = true;
+  for (i = 0; i < n && !chd->is_destroyed; i++) {
+    struct mg_rpc_bench_pipe_msg *m = STAILQ_FIRST(&chd->inbox);
+    STAILQ_REMOVE_HEAD(&chd->inbox, msgs);
+    chd->inbox_len--;
+    if (chd->is_open) {
+      struct mg_str f =
+          mg_mk_str_n(m->fb.buf + MG_RPC_CHANNEL_FRAME_HEADROOM,
+                      m->fb.len - MG_RPC_CHANNEL_FRAME_HEADROOM);
+      ch->ev_handler(ch, MG_RPC_CHANNEL_FRAME_RECD, &f);
+    }
+    /* Received means sent, as far as the sender's window goes. */
+    struct mg_rpc_channel *sender = chd->peer;
+    if (sender != NULL && mg_rpc_bench_pipe_data(sender)->is_open) {
+      sender->ev_handler(sender, MG_RPC_CHANNEL_FRAME_SENT, (void *) 1);
+    }
+    mbuf_free(&m->fb);
+    STAILQ_INSERT_HEAD(&chd->sh->free_msgs, m, msgs);
+  }
+  chd->in_pump = false;
+  if (chd->is_destroyed) mg_rpc_bench_pipe_free(ch);
+  return i;
+}
+
+static int mg_rpc_bench_pipe_get_send_window(struct mg_rpc_channel *ch) {
+  return mg_rpc_bench_pipe_data(ch)->window;
+}
+
+static void mg_rpc_bench_pipe_ch_connect(struct mg_rpc_channel *ch) {
+  struct mg_rpc_bench_pipe_data *chd = mg_rpc_bench_pipe_data(ch);
+  if (chd->is_open) return;
+  chd->is_open = true;
+  ch->ev_handler(ch, MG_RPC_CHANNEL_OPEN, NULL);
+}
+
+static void mg_rpc_bench_pipe_ch_close(struct mg_rpc_channel *ch) {
+  struct mg_rpc_bench_pipe_data *chd = mg_rpc_bench_pipe_data(ch);
+  if (!chd->is_open) return;
+  struct mg_rpc_channel *peer = chd->peer;
+  chd->is_open = false;
+  /* May destroy ch, which unlinks it from the peer. */
+  ch->ev_handler(ch, MG_RPC_CHANNEL_CLOSED, NULL);
+  if (peer != NULL) peer->ch_close(peer);
+}
+
+static void mg_rpc_bench_pipe_ch_destroy(struct mg_rpc_channel *ch) {
+  struct mg_rpc_bench_pipe_data *chd = mg_rpc_bench_pipe_data(ch);
+  if (chd->peer != NULL) mg_rpc_bench_pipe_data(chd->peer)->peer = NULL;
+  chd->peer = NULL;
+  if (chd->in_pump) {
+    chd->is_destroyed = true;
+    return;
+  }
+  mg_rpc_bench_pipe_free(ch);
+}
+
+static const char *mg_rpc_bench_pipe_get_type(struct mg_rpc_channel *ch) {
+  (void) ch;
+  return "bench";
+}
+
+static char *mg_rpc_bench_pipe_get_info(struct mg_rpc_channel *ch) {
+  (void) ch;
+  return NULL;
+}
+
+static bool mg_rpc_bench_pipe_get_authn_info(
+    struct mg_rpc_channel *ch, const char *auth_domain, const char *auth_file,
+    struct mg_rpc_authn_info *authn) {
+  (void) ch;
+  (void) auth_domain;
+  (void) auth_file;
+  (void) authn;
+  return false;
+}
+
+static struct mg_rpc_channel *mg_rpc_bench_pipe_end(
+    struct mg_rpc_bench_pipe_shared *sh, int window) {
+  struct mg_rpc_channel *ch = (struct mg_rpc_channel *) calloc(1, sizeof(*ch));
+  struct mg_rpc_bench_pipe_data *chd =
+      (struct mg_rpc_bench_pipe_data *) calloc(1, sizeof(*chd));
+  if (ch == NULL || chd == NULL) {
+    free(ch);
+    free(chd);
+    return NULL;
+  }
+  chd->sh = sh;
+  chd->window = (window > 0 ? window : 1);
+  STAILQ_INIT(&chd->inbox);
+  sh->refcnt++;
+  ch->ch_connect = mg_rpc_bench_pipe_ch_connect;
+  ch->send_frame = mg_rpc_bench_pipe_send_frame;
+  ch->send_frame_owned = mg_rpc_bench_pipe_send_frame_owned;
+  ch->get_send_window = mg_rpc_bench_pipe_get_send_window;
+  ch->ch_close = mg_rpc_bench_pipe_ch_close;
+  ch->ch_destroy = mg_rpc_bench_pipe_ch_destroy;
+  ch->get_type = mg_rpc_bench_pipe_get_type;
+  ch->is_persistent = mg_rpc_channel_false;
+  ch->is_broadcast_enabled = mg_rpc_channel_false;
+  ch->get_info = mg_rpc_bench_pipe_get_info;
+  ch->get_authn_info = mg_rpc_bench_pipe_get_authn_info;
+  ch->channel_data = chd;
+  return ch;
+}
+
+bool mg_rpc_bench_pipe(int window, struct mg_rpc_channel **a,
+                       struct mg_rpc_channel **b) {
+  struct mg_rpc_bench_pipe_shared *sh =
+      (struct mg_rpc_bench_pipe_shared *) calloc(1, sizeof(*sh));
+  if (sh == NULL) return false;
+  STAILQ_INIT(&sh->free_msgs);
+  *a = mg_rpc_bench_pipe_end(sh, window);
+  *b = mg_rpc_bench_pipe_end(sh, window);
+  if (*a == NULL || *b == NULL) {
+    /* At most one of them is there, sh goes with it. */
+    if (*a != NULL) {
+      mg_rpc_bench_pipe_free(*a);
+    } else if (*b != NULL) {
+      mg_rpc_bench_pipe_free(*b);
+    } else {
+      free(sh);
+    }
+    return false;
+  }
+  mg_rpc_bench_pipe_data(*a)->peer = *b;
+  mg_rpc_bench_pipe_data(*b)->peer = *a;
+  return true;
+}
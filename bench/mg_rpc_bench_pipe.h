@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * In-memory channel pair connecting two mg_rpc instances. Frames are
+ * passed on serialized, exactly as a network channel would, but nothing
+ * moves until the receiving end is pumped, which lets benches run the
+ * whole send, parse and dispatch path without any I/O.
+ */
+
+#ifndef CS_MOS_LIBS_RPC_COMMON_BENCH_MG_RPC_BENCH_PIPE_H_
+#define CS_MOS_LIBS_RPC_COMMON_BENCH_MG_RPC_BENCH_PIPE_H_
+
+#include <stdbool.h>
+
+#include "mg_rpc_channel.h"
+
+/*
+ * Creates connected channels a and b. Each end accepts up to window frames
+ * until the other end is pumped. Ends are not persistent: closing one closes
+ * both, and they are destroyed by their mg_rpc instances.
+ */
+bool mg_rpc_bench_pipe(int window, struct mg_rpc_channel **a,
+                       struct mg_rpc_channel **b);
+
+/*
+ * Delivers frames that were waiting for ch when called, confirming each one
+ * to the sending end. Returns the number delivered.
+ */
+int mg_rpc_bench_pipe_pump(struct mg_rpc_channel *ch);
+
+#endif /* CS_MOS_LIBS_RPC_COMMON_BENCH_MG_RPC_BENCH_PIPE_H_ */
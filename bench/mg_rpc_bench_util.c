@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mg_rpc_bench_util.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+double mg_rpc_bench_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#ifdef __GLIBC__
+/*
+ * Interposed for the whole process, so that allocations made by libc on
+ * behalf of the library (strdup and the like) are counted too.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static uint64_t s_num_allocs, s_alloc_bytes;
+
+void *malloc(size_t size) {
+  s_num_allocs++;
+  s_alloc_bytes += size;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+  s_num_allocs++;
+  s_alloc_bytes += nmemb * size;
+  return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  s_num_allocs++;
+  s_alloc_bytes += size;
+  return __libc_realloc(ptr, size);
+}
+
+bool mg_rpc_bench_allocs_counted(void) {
+  return true;
+}
+
+void mg_rpc_bench_allocs_get(struct mg_rpc_bench_allocs *a) {
+  a->num = s_num_allocs;
+  a->bytes = s_alloc_bytes;
+}
+#else
+bool mg_rpc_bench_allocs_counted(void) {
+  return false;
+}
+
+void mg_rpc_bench_allocs_get(struct mg_rpc_bench_allocs *a) {
+  memset(a, 0, sizeof(*a));
+}
+#endif
+
+void mg_rpc_bench_lat_init(struct mg_rpc_bench_lat *l, size_t size) {
+  memset(l, 0, sizeof(*l));
+  if (size == 0) return;
+  l->samples = (double *) calloc(size, sizeof(*l->samples));
+  if (l->samples != NULL) l->size = size;
+}
+
+void mg_rpc_bench_lat_add(struct mg_rpc_bench_lat *l, double v) {
+  if (l->num == l->size) {
+    /* Only when running for a time rather than a number of requests. */
+    size_t new_size = (l->size > 0 ? l->size * 2 : 1024);
+    double *s = (double *) realloc(l->samples, new_size * sizeof(*s));
+    if (s == NULL) return;
+    l->samples = s;
+    l->size = new_size;
+  }
+  l->samples[l->num++] = v;
+}
+
+static int mg_rpc_bench_cmp_double(const void *a, const void *b) {
+  double da = *(const double *) a, db = *(const double *) b;
+  return (da < db ? -1 : (da > db ? 1 : 0));
+}
+
+double mg_rpc_bench_lat_pct(struct mg_rpc_bench_lat *l, double p) {
+  if (l->num == 0) return 0;
+  qsort(l->samples, l->num, sizeof(*l->samples), mg_rpc_bench_cmp_double);
+  size_t i = (size_t)(p / 100.0 * (l->num - 1) + 0.5);
+  if (i >= l->num) i = l->num - 1;
+  return l->samples[i];
+}
+
+void mg_rpc_bench_lat_reset(struct mg_rpc_bench_lat *l) {
+  l->num = 0;
+}
+
+void mg_rpc_bench_lat_free(struct mg_rpc_bench_lat *l) {
+  free(l->samples);
+  memset(l, 0, sizeof(*l));
+}
+
+int mg_rpc_bench_parse_list(const char *s, int *vals, int max_vals) {
+  int num = 0;
+  while (*s != '\0') {
+    char *end = NULL;
+    long v = strtol(s, &end, 10);
+    if (end == s || v <= 0 || v > 1000000 || num == max_vals) return -1;
+    vals[num++] = (int) v;
+    s = end;
+    if (*s == ',') {
+      s++;
+      if (*s == '\0') return -1;
+    } else if (*s != '\0') {
+      return -1;
+    }
+  }
+  return (num > 0 ? num : -1);
+}
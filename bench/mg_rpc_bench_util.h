@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Bits shared by the benches: host event loop glue, timing, allocation
+ * counting and latency percentiles.
+ */
+
+#ifndef CS_MOS_LIBS_RPC_COMMON_BENCH_MG_RPC_BENCH_UTIL_H_
+#define CS_MOS_LIBS_RPC_COMMON_BENCH_MG_RPC_BENCH_UTIL_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mongoose.h"
+
+/* Manager returned by mgos_get_mgr(). */
+void mg_rpc_bench_set_mgr(struct mg_mgr *mgr);
+
+/*
+ * Runs callbacks queued with mgos_invoke_cb so far, the ones they queue are
+ * left for the next round, same as on a device. Returns the number run.
+ */
+int mg_rpc_bench_run_cbs(void);
+
+/* Monotonic clock, in seconds. */
+double mg_rpc_bench_now(void);
+
+/*
+ * Heap calls made by the process so far. Counted by interposing malloc,
+ * which is only done with glibc, elsewhere the counters stay at 0.
+ */
+struct mg_rpc_bench_allocs {
+  uint64_t num;   /* malloc, calloc and realloc calls. */
+  uint64_t bytes; /* Requested by them. */
+};
+
+bool mg_rpc_bench_allocs_counted(void);
+void mg_rpc_bench_allocs_get(struct mg_rpc_bench_allocs *a);
+
+/* Latency samples, in seconds. */
+struct mg_rpc_bench_lat {
+  double *samples;
+  size_t num, size;
+};
+
+/* Preallocates size samples, so that adding them does not allocate. */
+void mg_rpc_bench_lat_init(struct mg_rpc_bench_lat *l, size_t size);
+void mg_rpc_bench_lat_add(struct mg_rpc_bench_lat *l, double v);
+/* p-th percentile (0 - 100), sorts the samples. 0 if there are none. */
+double mg_rpc_bench_lat_pct(struct mg_rpc_bench_lat *l, double p);
+void mg_rpc_bench_lat_reset(struct mg_rpc_bench_lat *l);
+void mg_rpc_bench_lat_free(struct mg_rpc_bench_lat *l);
+
+/*
+ * Parses a comma-separated list of positive integers, e.g. "1,16,256".
+ * Returns the number of values, or -1 if s is not a valid list or has more
+ * than max_vals of them.
+ */
+int mg_rpc_bench_parse_list(const char *s, int *vals, int max_vals);
+
+#endif /* CS_MOS_LIBS_RPC_COMMON_BENCH_MG_RPC_BENCH_UTIL_H_ */
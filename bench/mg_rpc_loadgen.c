@@ -0,0 +1,425 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * WebSocket load generator: N client mg_rpc instances, each with its own
+ * outbound WS channel, keep calls in flight against a server for a while
+ * and report requests per second and latency percentiles. The server is
+ * either a device (or anything else speaking mg_rpc over WS) given by URL,
+ * or an mg_rpc instance run in-process on the same manager.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mg_rpc.h"
+#include "mg_rpc_channel_ws.h"
+
+#include "common/cs_dbg.h"
+#include "mongoose.h"
+
+#include "mg_rpc_bench_util.h"
+
+#define MG_RPC_LOADGEN_DEFAULT_LISTEN "127.0.0.1:8910"
+#define MG_RPC_LOADGEN_CALL_TIMEOUT_MS 10000
+/* Time allowed for the clients to connect, and for calls to finish. */
+#define MG_RPC_LOADGEN_SETTLE_TIME 5.0
+
+struct mg_rpc_loadgen_client;
+
+struct mg_rpc_loadgen_slot {
+  struct mg_rpc_loadgen_client *cl;
+  double start;
+  bool in_flight;
+};
+
+struct mg_rpc_loadgen_client {
+  struct mg_rpc *c;
+  bool is_open;
+  struct mg_rpc_loadgen_slot *slots;
+};
+
+struct mg_rpc_loadgen {
+  const char *url;
+  const char *method;
+  char *args;
+  int num_clients, depth, duration;
+  bool deflate, cbor, stats;
+  struct mg_rpc_loadgen_client *clients;
+  struct mg_rpc *server; /* In-process one, if there's no url. */
+  int num_open;
+  bool running, measure;
+  uint64_t num_ok, num_errors;
+  struct mg_rpc_bench_lat lat;
+};
+
+static struct mg_rpc_loadgen s_lg;
+
+/* In-process server */
+
+static void mg_rpc_loadgen_echo_handler(struct mg_rpc_request_info *ri,
+                                        void *cb_arg,
+                                        struct mg_rpc_frame_info *fi,
+                                        struct mg_str args) {
+  mg_rpc_send_responsef(ri, "%.*s", (int) args.len, args.p);
+  (void) cb_arg;
+  (void) fi;
+}
+
+static void mg_rpc_loadgen_server_handler(struct mg_connection *nc, int ev,
+                                          void *ev_data, void *user_data) {
+  if (ev == MG_EV_HTTP_REQUEST) {
+    mg_http_send_error(nc, 404, NULL);
+  } else if (ev == MG_EV_WEBSOCKET_HANDSHAKE_REQUEST) {
+    /* Accepts compression if offered, leaves it to mongoose otherwise. */
+    mg_rpc_channel_ws_in_handshake(nc, (struct http_message *) ev_data);
+  } else if (ev == MG_EV_WEBSOCKET_HANDSHAKE_DONE) {
+    struct mg_rpc_channel_ws_in_cfg chcfg;
+    memset(&chcfg, 0, sizeof(chcfg));
+    chcfg.deflate_min_size = 256;
+    chcfg.max_inflated_size = 16384;
+    struct mg_rpc_channel *ch = mg_rpc_channel_ws_in_opt(nc, &chcfg);
+    mg_rpc_add_channel(s_lg.server, mg_mk_str(""), ch);
+    ch->ev_handler(ch, MG_RPC_CHANNEL_OPEN, NULL);
+  }
+  (void) user_data;
+}
+
+static bool mg_rpc_loadgen_start_server(struct mg_mgr *mgr,
+                                        const char *listen_addr) {
+  struct mg_rpc_cfg *cfg = (struct mg_rpc_cfg *) calloc(1, sizeof(*cfg));
+  cfg->id = strdup("bench.server");
+  cfg->max_queue_length = 25;
+  s_lg.server = mg_rpc_create(cfg);
+  if (s_lg.server == NULL) return false;
+  mg_rpc_add_list_handler(s_lg.server);
+  mg_rpc_add_handler(s_lg.server, "Bench.Echo", "",
+                     mg_rpc_loadgen_echo_handler, NULL);
+  struct mg_connection *lc =
+      mg_bind(mgr, listen_addr, MG_CB(mg_rpc_loadgen_server_handler, NULL));
+  if (lc == NULL) {
+    fprintf(stderr, "failed to listen on %s\n", listen_addr);
+    return false;
+  }
+  mg_set_protocol_http_websocket(lc);
+  return true;
+}
+
+/* Clients */
+
+static void mg_rpc_loadgen_call(struct mg_rpc_loadgen_slot *s);
+
+static void mg_rpc_loadgen_result_cb(struct mg_rpc *c, void *cb_arg,
+                                     struct mg_rpc_frame_info *fi,
+                                     struct mg_str result, int error_code,
+                                     struct mg_str error_msg) {
+  struct mg_rpc_loadgen_slot *s = (struct mg_rpc_loadgen_slot *) cb_arg;
+  s->in_flight = false;
+  if (s_lg.measure) {
+    if (error_code == 0) {
+      s_lg.num_ok++;
+      mg_rpc_bench_lat_add(&s_lg.lat, mg_rpc_bench_now() - s->start);
+    } else if (s_lg.num_errors++ == 0) {
+      fprintf(stderr, "error %d: %.*s\n", error_code, (int) error_msg.len,
+              error_msg.p);
+    }
+  }
+  if (s_lg.running && s->cl->is_open) mg_rpc_loadgen_call(s);
+  (void) c;
+  (void) fi;
+  (void) result;
+}
+
+static void mg_rpc_loadgen_call(struct mg_rpc_loadgen_slot *s) {
+  struct mg_rpc_call_opts opts;
+  memset(&opts, 0, sizeof(opts));
+  opts.timeout_ms = MG_RPC_LOADGEN_CALL_TIMEOUT_MS;
+  s->start = mg_rpc_bench_now();
+  s->in_flight = true;
+  bool ok = (s_lg.args != NULL
+                 ? mg_rpc_callf(s->cl->c, mg_mk_str(s_lg.method),
+                                mg_rpc_loadgen_result_cb, s, &opts,
+                                "{data: %Q}", s_lg.args)
+                 : mg_rpc_callf(s->cl->c, mg_mk_str(s_lg.method),
+                                mg_rpc_loadgen_result_cb, s, &opts, NULL));
+  if (!ok) {
+    s->in_flight = false;
+    if (s_lg.measure) s_lg.num_errors++;
+  }
+}
+
+static void mg_rpc_loadgen_observer(struct mg_rpc *c, void *cb_arg,
+                                    enum mg_rpc_event ev, void *ev_arg) {
+  struct mg_rpc_loadgen_client *cl = (struct mg_rpc_loadgen_client *) cb_arg;
+  if (ev == MG_RPC_EV_CHANNEL_OPEN) {
+    cl->is_open = true;
+    s_lg.num_open++;
+    /* Calls that were in flight when the channel went away time out. */
+    for (int i = 0; s_lg.running && i < s_lg.depth; i++) {
+      if (!cl->slots[i].in_flight) mg_rpc_loadgen_call(&cl->slots[i]);
+    }
+  } else if (ev == MG_RPC_EV_CHANNEL_CLOSED) {
+    if (cl->is_open) s_lg.num_open--;
+    cl->is_open = false;
+  }
+  (void) c;
+  (void) ev_arg;
+}
+
+static bool mg_rpc_loadgen_add_client(struct mg_mgr *mgr, int i) {
+  struct mg_rpc_loadgen_client *cl = &s_lg.clients[i];
+  char id[32];
+  snprintf(id, sizeof(id), "bench.client%d", i);
+  struct mg_rpc_cfg *cfg = (struct mg_rpc_cfg *) calloc(1, sizeof(*cfg));
+  cfg->id = strdup(id);
+  cfg->max_queue_length = s_lg.depth + 25;
+  cl->c = mg_rpc_create(cfg);
+  if (cl->c == NULL) return false;
+  struct mg_rpc_channel_ws_out_cfg chcfg;
+  memset(&chcfg, 0, sizeof(chcfg));
+  chcfg.server_address = mg_mk_str(s_lg.url);
+  chcfg.reconnect_interval_min = 1;
+  chcfg.reconnect_interval_max = 5;
+  chcfg.cbor = s_lg.cbor;
+  chcfg.deflate = s_lg.deflate;
+  chcfg.deflate_min_size = 256;
+  chcfg.max_inflated_size = 16384;
+  struct mg_rpc_channel *ch = mg_rpc_channel_ws_out(mgr, &chcfg);
+  if (ch == NULL) return false;
+  mg_rpc_add_channel(cl->c, mg_mk_str(MG_RPC_DST_DEFAULT), ch);
+  cl->slots = (struct mg_rpc_loadgen_slot *) calloc(s_lg.depth,
+                                                    sizeof(*cl->slots));
+  for (int j = 0; j < s_lg.depth; j++) cl->slots[j].cl = cl;
+  mg_rpc_add_observer(cl->c, mg_rpc_loadgen_observer, cl);
+  mg_rpc_connect(cl->c);
+  return true;
+}
+
+/* RPC.Stats of the server, from the first client */
+
+static bool s_stats_done;
+
+static void mg_rpc_loadgen_stats_cb(struct mg_rpc *c, void *cb_arg,
+                                    struct mg_rpc_frame_info *fi,
+                                    struct mg_str result, int error_code,
+                                    struct mg_str error_msg) {
+  if (cb_arg != NULL) {
+    if (error_code == 0) {
+      printf("RPC.Stats: %.*s\n", (int) result.len, result.p);
+    } else {
+      printf("RPC.Stats: error %d: %.*s\n", error_code, (int) error_msg.len,
+             error_msg.p);
+    }
+  }
+  s_stats_done = true;
+  (void) c;
+  (void) fi;
+}
+
+/* Resets the counters before the run, reports them after it. */
+static void mg_rpc_loadgen_stats(struct mg_mgr *mgr, bool report) {
+  struct mg_rpc_call_opts opts;
+  memset(&opts, 0, sizeof(opts));
+  opts.timeout_ms = MG_RPC_LOADGEN_CALL_TIMEOUT_MS;
+  s_stats_done = false;
+  if (!mg_rpc_callf(s_lg.clients[0].c, mg_mk_str("RPC.Stats"),
+                    mg_rpc_loadgen_stats_cb, (report ? &s_lg : NULL), &opts,
+                    "{reset: %B}", true)) {
+    return;
+  }
+  while (!s_stats_done) {
+    mg_mgr_poll(mgr, 10);
+    mg_rpc_bench_run_cbs();
+  }
+}
+
+static void mg_rpc_loadgen_poll(struct mg_mgr *mgr, double until,
+                                bool (*done)(void)) {
+  while (mg_rpc_bench_now() < until && (done == NULL || !done())) {
+    mg_mgr_poll(mgr, 1);
+    mg_rpc_bench_run_cbs();
+  }
+}
+
+static bool mg_rpc_loadgen_all_open(void) {
+  return (s_lg.num_open == s_lg.num_clients);
+}
+
+static bool mg_rpc_loadgen_all_done(void) {
+  for (int i = 0; i < s_lg.num_clients; i++) {
+    for (int j = 0; j < s_lg.depth; j++) {
+      if (s_lg.clients[i].slots[j].in_flight) return false;
+    }
+  }
+  return true;
+}
+
+static void mg_rpc_loadgen_usage(const char *argv0) {
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  -u URL     server, ws://host:port/rpc; default is to run one\n"
+          "             in-process, listening on -l\n"
+          "  -l ADDR    listen address of the in-process server, default "
+          MG_RPC_LOADGEN_DEFAULT_LISTEN "\n"
+          "  -N N       concurrent clients, default 10\n"
+          "  -q N       calls in flight per client, default 1\n"
+          "  -t SECS    duration, default 10\n"
+          "  -m METHOD  method to call, default RPC.Ping (Bench.Echo is\n"
+          "             also there on the in-process server)\n"
+          "  -s N       pass {data: \"xxx...\"} of N bytes as args\n"
+          "  -z         offer permessage-deflate\n"
+          "  -b         use CBOR\n"
+          "  -S         reset the server's RPC.Stats before the run and\n"
+          "             print them after it\n"
+          "  -v         debug log\n",
+          argv0);
+}
+
+int main(int argc, char **argv) {
+  const char *listen_addr = MG_RPC_LOADGEN_DEFAULT_LISTEN;
+  int opt, size = 0;
+  char url[100];
+  struct mg_mgr mgr;
+  s_lg.method = "RPC.Ping";
+  s_lg.num_clients = 10;
+  s_lg.depth = 1;
+  s_lg.duration = 10;
+  cs_log_set_level(LL_ERROR);
+  while ((opt = getopt(argc, argv, "u:l:N:q:t:m:s:zbSv")) != -1) {
+    bool ok = true;
+    switch (opt) {
+      case 'u':
+        s_lg.url = optarg;
+        break;
+      case 'l':
+        listen_addr = optarg;
+        break;
+      case 'N':
+        ok = ((s_lg.num_clients = atoi(optarg)) > 0);
+        break;
+      case 'q':
+        ok = ((s_lg.depth = atoi(optarg)) > 0);
+        break;
+      case 't':
+        ok = ((s_lg.duration = atoi(optarg)) > 0);
+        break;
+      case 'm':
+        s_lg.method = optarg;
+        break;
+      case 's':
+        ok = ((size = atoi(optarg)) > 0);
+        break;
+      case 'z':
+        s_lg.deflate = true;
+        break;
+      case 'b':
+        s_lg.cbor = true;
+        break;
+      case 'S':
+        s_lg.stats = true;
+        break;
+      case 'v':
+        cs_log_set_level(LL_DEBUG);
+        break;
+      default:
+        ok = false;
+    }
+    if (!ok) {
+      mg_rpc_loadgen_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (size > 0) {
+    s_lg.args = (char *) malloc(size + 1);
+    memset(s_lg.args, 'x', size);
+    s_lg.args[size] = '\0';
+  }
+
+  mg_mgr_init(&mgr, NULL);
+  mg_rpc_bench_set_mgr(&mgr);
+  if (s_lg.url == NULL) {
+    if (!mg_rpc_loadgen_start_server(&mgr, listen_addr)) return EXIT_FAILURE;
+    snprintf(url, sizeof(url), "ws://%s/rpc", listen_addr);
+    s_lg.url = url;
+  }
+  s_lg.clients = (struct mg_rpc_loadgen_client *) calloc(
+      s_lg.num_clients, sizeof(*s_lg.clients));
+  for (int i = 0; i < s_lg.num_clients; i++) {
+    if (!mg_rpc_loadgen_add_client(&mgr, i)) {
+      fprintf(stderr, "failed to create client %d\n", i);
+      return EXIT_FAILURE;
+    }
+  }
+
+  mg_rpc_loadgen_poll(&mgr, mg_rpc_bench_now() + MG_RPC_LOADGEN_SETTLE_TIME,
+                      mg_rpc_loadgen_all_open);
+  printf("# %s, %d of %d clients connected, %d in flight each, %s%s\n",
+         s_lg.url, s_lg.num_open, s_lg.num_clients, s_lg.depth, s_lg.method,
+         (s_lg.deflate ? ", deflate" : ""));
+  if (s_lg.num_open == 0) return EXIT_FAILURE;
+  if (s_lg.stats) mg_rpc_loadgen_stats(&mgr, false /* report */);
+
+  struct mg_rpc_bench_allocs a0, a1;
+  /* Big enough for most runs, growing it would show up as allocations. */
+  mg_rpc_bench_lat_init(&s_lg.lat, 1 << 20);
+  s_lg.running = s_lg.measure = true;
+  mg_rpc_bench_allocs_get(&a0);
+  double start = mg_rpc_bench_now(), last = start;
+  uint64_t last_ok = 0;
+  for (int i = 0; i < s_lg.num_clients; i++) {
+    struct mg_rpc_loadgen_client *cl = &s_lg.clients[i];
+    for (int j = 0; cl->is_open && j < s_lg.depth; j++) {
+      mg_rpc_loadgen_call(&cl->slots[j]);
+    }
+  }
+  while (mg_rpc_bench_now() < start + s_lg.duration) {
+    mg_rpc_loadgen_poll(&mgr, last + 1, NULL);
+    double now = mg_rpc_bench_now();
+    printf("%6.1f s %10.0f req/s %8llu errors %4d open\n", now - start,
+           (s_lg.num_ok - last_ok) / (now - last),
+           (unsigned long long) s_lg.num_errors, s_lg.num_open);
+    fflush(stdout);
+    last = now;
+    last_ok = s_lg.num_ok;
+  }
+  double elapsed = mg_rpc_bench_now() - start;
+  mg_rpc_bench_allocs_get(&a1);
+  s_lg.measure = false;
+  s_lg.running = false;
+  mg_rpc_loadgen_poll(&mgr, mg_rpc_bench_now() + MG_RPC_LOADGEN_SETTLE_TIME,
+                      mg_rpc_loadgen_all_done);
+
+  printf("%llu ok, %llu errors in %.1f s: %.0f req/s, "
+         "latency p50 %.1f us, p99 %.1f us, p99.9 %.1f us\n",
+         (unsigned long long) s_lg.num_ok,
+         (unsigned long long) s_lg.num_errors, elapsed, s_lg.num_ok / elapsed,
+         mg_rpc_bench_lat_pct(&s_lg.lat, 50) * 1e6,
+         mg_rpc_bench_lat_pct(&s_lg.lat, 99) * 1e6,
+         mg_rpc_bench_lat_pct(&s_lg.lat, 99.9) * 1e6);
+  if (mg_rpc_bench_allocs_counted() && s_lg.num_ok > 0) {
+    /* Clients too, and the server if it's in-process. */
+    printf("allocations per request, whole process: %.2f (%.0f bytes)\n",
+           (double) (a1.num - a0.num) / s_lg.num_ok,
+           (double) (a1.bytes - a0.bytes) / s_lg.num_ok);
+  }
+  if (s_lg.stats) mg_rpc_loadgen_stats(&mgr, true /* report */);
+
+  mg_mgr_free(&mgr);
+  return (s_lg.num_errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Frame parse microbench: mg_rpc_parse_frame against the json_scanf based
+ * parse it replaced, kept here as the reference. Both are run over the
+ * same set of typical frames, results are checked to agree first.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mg_rpc.h"
+
+#include "common/cs_dbg.h"
+#include "frozen.h"
+#include "mongoose.h"
+
+#include "mg_rpc_bench_util.h"
+
+struct mg_rpc_parse_bench_frame {
+  const char *name;
+  const char *json;
+};
+
+static const struct mg_rpc_parse_bench_frame s_frames[] = {
+    {"call", "{\"id\":1942,\"src\":\"mos\",\"method\":\"Sys.GetInfo\"}"},
+    {"call+args",
+     "{\"id\":1943,\"src\":\"cloud.example.net\",\"dst\":\"esp32_0C1A2B\","
+     "\"tag\":\"t1\",\"method\":\"Config.Set\",\"args\":{\"config\":{"
+     "\"wifi\":{\"sta\":{\"enable\":true,\"ssid\":\"Office\",\"pass\":"
+     "\"secret-pass\"},\"ap\":{\"enable\":false}},\"debug\":{\"level\":2},"
+     "\"mqtt\":{\"enable\":true,\"server\":\"mqtt.example.net:8883\","
+     "\"client_id\":\"esp32_0C1A2B\",\"ssl_ca_cert\":\"ca.pem\"}},"
+     "\"save\":true,\"reboot\":false}}"},
+    {"call+auth",
+     "{\"id\":1944,\"src\":\"mos\",\"method\":\"FS.Get\",\"args\":{"
+     "\"filename\":\"conf9.json\",\"offset\":0,\"len\":512},\"auth\":{"
+     "\"realm\":\"esp32_0C1A2B\",\"username\":\"admin\",\"nonce\":1700000000,"
+     "\"cnonce\":\"4f1d8a2c\",\"response\":"
+     "\"6629fae49393a05397450978507c4ef1\"}}"},
+    {"result",
+     "{\"id\":1942,\"src\":\"esp32_0C1A2B\",\"dst\":\"mos\",\"result\":{"
+     "\"id\":\"esp32_0C1A2B\",\"app\":\"demo\",\"fw_version\":\"1.0\","
+     "\"fw_id\":\"20181024-101149/g1a2b3c4\",\"mac\":\"240AC40C1A2B\","
+     "\"arch\":\"esp32\",\"uptime\":81234,\"ram_size\":294528,\"ram_free\":"
+     "187992,\"ram_min_free\":171224,\"fs_size\":233681,\"fs_free\":"
+     "147824,\"wifi\":{\"sta_ip\":\"192.168.1.23\",\"ap_ip\":\"\",\"status\":"
+     "\"got ip\",\"ssid\":\"Office\"}}}"},
+    {"result-str",
+     "{\"id\":1945,\"src\":\"esp32_0C1A2B\",\"dst\":\"mos\",\"result\":"
+     "\"ok\"}"},
+    {"error",
+     "{\"id\":1946,\"src\":\"esp32_0C1A2B\",\"dst\":\"mos\",\"error\":{"
+     "\"code\":404,\"message\":\"No handler for Sys.Frobnicate\"}}"},
+};
+
+#define MG_RPC_PARSE_BENCH_NUM_FRAMES \
+  ((int) (sizeof(s_frames) / sizeof(s_frames[0])))
+
+/* mg_rpc_parse_frame as it was, one json_scanf with a key per field. */
+static bool mg_rpc_parse_frame_scanf(const struct mg_str f,
+                                     struct mg_rpc_frame *frame) {
+  struct json_token src, dst, tag;
+  struct json_token method, args;
+  struct json_token result, error_msg;
+  struct json_token auth;
+  memset(frame, 0, sizeof(*frame));
+  memset(&src, 0, sizeof(src));
+  memset(&dst, 0, sizeof(dst));
+  memset(&tag, 0, sizeof(tag));
+  memset(&method, 0, sizeof(method));
+  memset(&args, 0, sizeof(args));
+  memset(&result, 0, sizeof(result));
+  memset(&error_msg, 0, sizeof(error_msg));
+  memset(&auth, 0, sizeof(auth));
+  if (json_scanf(f.p, f.len,
+                 "{v:%d id:%lld src:%T dst:%T tag:%T"
+                 "method:%T args:%T "
+                 "auth:%T "
+                 "result:%T error:{code:%d message:%T}}",
+                 &frame->version, &frame->id, &src, &dst, &tag, &method, &args,
+                 &auth, &result, &frame->error_code, &error_msg) < 1) {
+    return false;
+  }
+  if (result.type == JSON_TYPE_STRING) {
+    result.ptr--;
+    result.len += 2;
+  }
+  frame->src = mg_mk_str_n(src.ptr, src.len);
+  frame->dst = mg_mk_str_n(dst.ptr, dst.len);
+  frame->tag = mg_mk_str_n(tag.ptr, tag.len);
+  frame->method = mg_mk_str_n(method.ptr, method.len);
+  frame->args = mg_mk_str_n(args.ptr, args.len);
+  frame->result = mg_mk_str_n(result.ptr, result.len);
+  frame->error_msg = mg_mk_str_n(error_msg.ptr, error_msg.len);
+  frame->auth = mg_mk_str_n(auth.ptr, auth.len);
+  return true;
+}
+
+static bool mg_rpc_parse_bench_same(const struct mg_rpc_frame *a,
+                                    const struct mg_rpc_frame *b) {
+  return (a->version == b->version && a->id == b->id &&
+          a->error_code == b->error_code && mg_strcmp(a->src, b->src) == 0 &&
+          mg_strcmp(a->dst, b->dst) == 0 && mg_strcmp(a->tag, b->tag) == 0 &&
+          mg_strcmp(a->method, b->method) == 0 &&
+          mg_strcmp(a->args, b->args) == 0 &&
+          mg_strcmp(a->result, b->result) == 0 &&
+          mg_strcmp(a->error_msg, b->error_msg) == 0 &&
+          mg_strcmp(a->auth, b->auth) == 0);
+}
+
+typedef bool (*mg_rpc_parse_bench_fn_t)(const struct mg_str f,
+                                        struct mg_rpc_frame *frame);
+
+/* Keeps the parses from being optimized away. */
+static volatile int64_t s_sink;
+
+/* Returns ns per parse. */
+static double mg_rpc_parse_bench_time(mg_rpc_parse_bench_fn_t fn,
+                                      const struct mg_str f, int n) {
+  struct mg_rpc_frame frame;
+  for (int i = 0; i < n / 10 + 1; i++) fn(f, &frame);
+  double start = mg_rpc_bench_now();
+  for (int i = 0; i < n; i++) {
+    fn(f, &frame);
+    s_sink += frame.id + (int64_t) frame.args.len + (int64_t) frame.result.len;
+  }
+  return (mg_rpc_bench_now() - start) * 1e9 / n;
+}
+
+static void mg_rpc_parse_bench_usage(const char *argv0) {
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  -n N     parses per frame and parser, default 200000\n",
+          argv0);
+}
+
+int main(int argc, char **argv) {
+  int opt, n = 200000, res = EXIT_SUCCESS;
+  cs_log_set_level(LL_ERROR);
+  while ((opt = getopt(argc, argv, "n:")) != -1) {
+    if (opt != 'n' || (n = atoi(optarg)) <= 0) {
+      mg_rpc_parse_bench_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  printf("# %d parses per frame and parser\n", n);
+  printf("%-10s %5s %10s %10s %8s %10s\n", "frame", "size", "scanf ns",
+         "parse ns", "speedup", "parse MB/s");
+  for (int i = 0; i < MG_RPC_PARSE_BENCH_NUM_FRAMES; i++) {
+    const struct mg_str f = mg_mk_str(s_frames[i].json);
+    struct mg_rpc_frame a, b;
+    if (!mg_rpc_parse_frame_scanf(f, &a) || !mg_rpc_parse_frame(f, &b) ||
+        !mg_rpc_parse_bench_same(&a, &b)) {
+      fprintf(stderr, "%s: parsers disagree\n", s_frames[i].name);
+      res = EXIT_FAILURE;
+      continue;
+    }
+    double ns_scanf = mg_rpc_parse_bench_time(mg_rpc_parse_frame_scanf, f, n);
+    double ns_parse = mg_rpc_parse_bench_time(mg_rpc_parse_frame, f, n);
+    printf("%-10s %5d %10.1f %10.1f %7.2fx %10.1f\n", s_frames[i].name,
+           (int) f.len, ns_scanf, ns_parse,
+           (ns_parse > 0 ? ns_scanf / ns_parse : 0),
+           (ns_parse > 0 ? f.len * 1e3 / ns_parse : 0));
+    fflush(stdout);
+  }
+  return res;
+}
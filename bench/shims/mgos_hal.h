@@ -0,0 +1,35 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Host stand-in for the parts of mgos_hal.h the library uses, see
+ * mgos_shims.c.
+ */
+
+#ifndef CS_MOS_LIBS_RPC_COMMON_BENCH_SHIMS_MGOS_HAL_H_
+#define CS_MOS_LIBS_RPC_COMMON_BENCH_SHIMS_MGOS_HAL_H_
+
+#include <stdbool.h>
+
+typedef void (*mgos_cb_t)(void *arg);
+
+/* Queued, run by mg_rpc_bench_run_cbs(). */
+bool mgos_invoke_cb(mgos_cb_t cb, void *arg, bool from_isr);
+
+double mgos_uptime(void);
+
+#endif /* CS_MOS_LIBS_RPC_COMMON_BENCH_SHIMS_MGOS_HAL_H_ */
@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Host implementations of the mgos APIs used by the library, enough to
+ * run it on a plain mongoose manager.
+ */
+
+#include <stddef.h>
+
+#include "mgos_hal.h"
+#include "mgos_mongoose.h"
+#include "mgos_sys_config.h"
+#include "mgos_timers.h"
+
+#include "mg_rpc_bench_util.h"
+
+/* Deferred local channel deliveries and offloaded handlers go here. */
+#define MGOS_SHIMS_CB_QUEUE_SIZE 4096
+
+struct mgos_shims_cb {
+  mgos_cb_t cb;
+  void *arg;
+};
+
+static struct mg_mgr *s_mgr;
+static struct mgos_shims_cb s_cbs[MGOS_SHIMS_CB_QUEUE_SIZE];
+static size_t s_cbs_head, s_cbs_len;
+
+void mg_rpc_bench_set_mgr(struct mg_mgr *mgr) {
+  s_mgr = mgr;
+}
+
+struct mg_mgr *mgos_get_mgr(void) {
+  return s_mgr;
+}
+
+double mgos_uptime(void) {
+  return mg_rpc_bench_now();
+}
+
+bool mgos_invoke_cb(mgos_cb_t cb, void *arg, bool from_isr) {
+  if (s_cbs_len == MGOS_SHIMS_CB_QUEUE_SIZE) return false;
+  struct mgos_shims_cb *e =
+      &s_cbs[(s_cbs_head + s_cbs_len++) % MGOS_SHIMS_CB_QUEUE_SIZE];
+  e->cb = cb;
+  e->arg = arg;
+  (void) from_isr;
+  return true;
+}
+
+int mg_rpc_bench_run_cbs(void) {
+  size_t n = s_cbs_len;
+  for (size_t i = 0; i < n; i++) {
+    struct mgos_shims_cb e = s_cbs[s_cbs_head];
+    s_cbs_head = (s_cbs_head + 1) % MGOS_SHIMS_CB_QUEUE_SIZE;
+    s_cbs_len--;
+    e.cb(e.arg);
+  }
+  return (int) n;
+}
+
+const char *mgos_sys_config_get_rpc_auth_domain(void) {
+  return NULL;
+}
+
+const char *mgos_sys_config_get_rpc_auth_file(void) {
+  return NULL;
+}
+
+int mgos_sys_config_get_rpc_ws_reconnect_interval_min(void) {
+  return 1;
+}
+
+int mgos_sys_config_get_rpc_ws_reconnect_interval_max(void) {
+  return 60;
+}
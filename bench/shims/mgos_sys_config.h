@@ -0,0 +1,31 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Only the settings the library reads directly. Benches pass everything
+ * else in mg_rpc_cfg and channel configs.
+ */
+
+#ifndef CS_MOS_LIBS_RPC_COMMON_BENCH_SHIMS_MGOS_SYS_CONFIG_H_
+#define CS_MOS_LIBS_RPC_COMMON_BENCH_SHIMS_MGOS_SYS_CONFIG_H_
+
+const char *mgos_sys_config_get_rpc_auth_domain(void);
+const char *mgos_sys_config_get_rpc_auth_file(void);
+int mgos_sys_config_get_rpc_ws_reconnect_interval_min(void);
+int mgos_sys_config_get_rpc_ws_reconnect_interval_max(void);
+
+#endif /* CS_MOS_LIBS_RPC_COMMON_BENCH_SHIMS_MGOS_SYS_CONFIG_H_ */
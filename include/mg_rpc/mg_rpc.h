@@ -32,12 +32,42 @@ extern "C" {
 #endif
 
 struct mg_rpc;
+struct mg_mgr;
 
 struct mg_rpc_cfg {
   char *id;
   char *psk;
-  int max_queue_length;
+  int max_frame_size;           /* Incoming frames, 0 - no limit. */
+  int max_queue_length;         /* Total, for all channels. */
+  int max_channel_queue_length; /* Per channel, 0 - no limit. */
+  /* Broadcasts held per busy channel, 0 - busy channels miss them. */
+  int max_broadcast_queue_length;
   int default_out_channel_idle_close_timeout;
+  /*
+   * Up to max_warm_out_channels channels opened for URI destinations are
+   * closed after out_channel_keep_warm_timeout of inactivity instead.
+   */
+  int max_warm_out_channels;
+  int out_channel_keep_warm_timeout;
+  int default_call_timeout_ms; /* Used if mg_rpc_call_opts::timeout_ms is 0 */
+  /*
+   * Requests per second accepted from a single channel, 0 - no limit.
+   * Up to rate_burst (0 - same as rate_limit) can arrive at once. Requests
+   * over the limit are answered with MG_RPC_ERR_TOO_MANY_REQUESTS.
+   */
+  int rate_limit;
+  int rate_burst;
+  /*
+   * Offloaded requests pending at once, running or waiting to run, 0 - no
+   * limit. See mg_rpc_handler_opts::offload.
+   */
+  int max_offload_queue_length;
+  /*
+   * Streamed results of outgoing calls are collected up to this size,
+   * 0 - no limit. Calls with larger results fail with
+   * MG_RPC_ERR_RESULT_TOO_BIG.
+   */
+  int max_stream_result_size;
 };
 
 struct mg_rpc_frame {
@@ -48,6 +78,11 @@ struct mg_rpc_frame {
   struct mg_str method, args;
   struct mg_str result, error_msg;
   struct mg_str auth;
+  /* Raw args, if the frame arrived CBOR-encoded. */
+  struct mg_str args_cbor;
+  /* Part of a streamed result (escaped JSON string) and if it is the last. */
+  struct mg_str chunk;
+  bool last_chunk;
 };
 
 /* Note: Must be freed with mg_rpc_authn_info_free. */
@@ -68,6 +103,18 @@ struct mg_rpc_channel_info {
 /* Create mg_rpc instance. Takes over cfg, which must be heap-allocated. */
 struct mg_rpc *mg_rpc_create(struct mg_rpc_cfg *cfg);
 
+/*
+ * Set the manager outbound channels to URI destinations are created on,
+ * mgos_get_mgr() by default. Instances on different managers (e.g. one per
+ * thread) share nothing and can be connected with mg_rpc_channel_shard
+ * channels; each must only be used from the thread that runs its manager.
+ * Call deadlines and outbound channel timers run on the manager too, so this
+ * should be done before any calls are made. Note that mgos_invoke_cb
+ * deliveries (offloaded handlers, deferred local channel) still run on the
+ * main task, so instances on other threads should not use them.
+ */
+void mg_rpc_set_mgr(struct mg_rpc *c, struct mg_mgr *mgr);
+
 /*
  * Adds a channel to the instance.
  * If dst is empty, it will be learned when first frame arrives from the other
@@ -93,6 +140,18 @@ void mg_rpc_add_local_id(struct mg_rpc *c, const struct mg_str id);
 /* Auxiliary information about the request or response. */
 struct mg_rpc_frame_info {
   const char *channel_type; /* Type of the channel this message arrived on. */
+  /*
+   * If the request arrived CBOR-encoded, raw CBOR of the args.
+   * Valid for the duration of the handler call only.
+   */
+  struct mg_str args_cbor;
+  /*
+   * Args decoded according to mg_rpc_handler_opts::args_offsets, if set.
+   * Bit i of args_present is set if field i of args_fmt was present (and not
+   * null). Strings are freed after the handler call.
+   */
+  void *args_struct;
+  uint32_t args_present;
 };
 
 /* Signature of the function that receives response to a request. */
@@ -101,6 +160,18 @@ typedef void (*mg_result_cb_t)(struct mg_rpc *c, void *cb_arg,
                                struct mg_str result, int error_code,
                                struct mg_str error_msg);
 
+/*
+ * Queueing priority of outgoing frames. Frames waiting for a channel are sent
+ * in priority order and when the queue is full, lower priority frames are
+ * evicted to make room for higher priority ones.
+ */
+enum mg_rpc_priority {
+  MG_RPC_PRIO_DEFAULT = 0, /* Normal, or low for calls without a callback. */
+  MG_RPC_PRIO_LOW,
+  MG_RPC_PRIO_NORMAL,
+  MG_RPC_PRIO_HIGH, /* Used for responses. */
+};
+
 /*
  * RPC call options.
  */
@@ -112,8 +183,21 @@ struct mg_rpc_call_opts {
   bool no_queue;     /* Don't enqueue frame if destination is unavailable */
   bool broadcast;    /* If set, then the frame is sent out via all the channels
                         open at the time of sending. Implies no_queue. */
+  int timeout_ms;    /* If no response arrives within this time, cb is invoked
+                        with MG_RPC_ERR_TIMEOUT. 0 - use the default from cfg,
+                        < 0 - wait forever. */
+  enum mg_rpc_priority prio;
 };
 
+/* Error code passed to mg_result_cb_t when a call times out. */
+#define MG_RPC_ERR_TIMEOUT 504
+/* Error code passed to mg_result_cb_t when a queued call is evicted. */
+#define MG_RPC_ERR_QUEUE_FULL 503
+/* Error returned to callers over a rate limit, see mg_rpc_cfg::rate_limit. */
+#define MG_RPC_ERR_TOO_MANY_REQUESTS 429
+/* Error code passed to mg_result_cb_t, see max_stream_result_size. */
+#define MG_RPC_ERR_RESULT_TOO_BIG 413
+
 /*
  * Make an RPC call.
  * The destination RPC server is specified by `opts`, and destination
@@ -128,14 +212,19 @@ struct mg_rpc_call_opts {
  * mg_rpc_callf(mgos_rpc_get_global(), mg_mk_str("My.Func"), NULL, NULL, &opts,
  *              "{param1: %Q, param2: %d}", "jaja", 1234);
  * ```
- * It is possible to call RPC services running locally. In this case,
- * include the https://github.com/mongoose-os-libs/rpc-loopback library,
- * and use `MGOS_RPC_LOOPBACK_ADDR` special destination address:
+ * It is possible to call RPC services running locally, using the built-in
+ * local channel (`rpc.local.enable`) and its `MG_RPC_LOCAL_DST` address.
+ * Envelopes are not serialized on the way, only args and results are JSON:
  *
  * ```c
- * #include "mg_rpc_channel_loopback.h"
- * struct mg_rpc_call_opts opts = {.dst = mg_mk_str(MGOS_RPC_LOOPBACK_ADDR) };
+ * #include "mg_rpc_channel_local.h"
+ * struct mg_rpc_call_opts opts = {.dst = mg_mk_str(MG_RPC_LOCAL_DST) };
  * ```
+ *
+ * The https://github.com/mongoose-os-libs/rpc-loopback library and its
+ * `MGOS_RPC_LOOPBACK_ADDR` address can be used as well.
+ * Response callback may be invoked before mg_rpc_callf returns, if the
+ * channel delivers synchronously (`rpc.local.sync`).
  */
 
 bool mg_rpc_callf(struct mg_rpc *c, const struct mg_str method,
@@ -149,11 +238,37 @@ bool mg_rpc_vcallf(struct mg_rpc *c, const struct mg_str method,
                    const struct mg_rpc_call_opts *opts, const char *args_jsonf,
                    va_list ap);
 
+/*
+ * Prepared call: method and options are fixed, frame envelope is formatted
+ * once and the frame buffer is reused, which makes repeated calls (e.g.
+ * periodic notifications) cheaper. Broadcast calls cannot be prepared.
+ * Must be freed with mg_rpc_prepared_call_free.
+ */
+struct mg_rpc_prepared_call;
+
+struct mg_rpc_prepared_call *mg_rpc_prepare_call(
+    struct mg_rpc *c, const struct mg_str method,
+    const struct mg_rpc_call_opts *opts);
+
+bool mg_rpc_prepared_callf(struct mg_rpc_prepared_call *pc, mg_result_cb_t cb,
+                           void *cb_arg, const char *args_jsonf, ...);
+
+bool mg_rpc_prepared_vcallf(struct mg_rpc_prepared_call *pc,
+                            mg_result_cb_t cb, void *cb_arg,
+                            const char *args_jsonf, va_list ap);
+
+void mg_rpc_prepared_call_free(struct mg_rpc_prepared_call *pc);
+
 /*
  * Incoming request info.
  * This structure is passed to request handlers and must be passed back
  * when a response is ready.
  */
+/*
+ * Request info is allocated by mg_rpc together with the strings it refers to,
+ * it can only be disposed of by sending a response or with
+ * mg_rpc_free_request_info. String fields must not be replaced.
+ */
 struct mg_rpc_request_info {
   struct mg_rpc *rpc;
   int64_t id;           /* Request id. */
@@ -187,21 +302,100 @@ typedef void (*mg_handler_cb_t)(struct mg_rpc_request_info *ri, void *cb_arg,
 void mg_rpc_add_handler(struct mg_rpc *c, const char *method,
                         const char *args_fmt, mg_handler_cb_t cb, void *cb_arg);
 
+/* Method handler options. */
+struct mg_rpc_handler_opts {
+  const char *args_fmt; /* Arguments format string */
+  /*
+   * If > 0, the method is idempotent and its results are cached for this
+   * long: repeated calls with the same args are answered from the cache,
+   * without invoking the handler, and identical calls which arrive while one
+   * is being handled get the same response. Errors are not cached.
+   * Cache key is method and args only, so this is not suitable for methods
+   * whose result depends on the caller.
+   */
+  int cache_ttl_ms;
+  /*
+   * Calls per second accepted for the method, from all callers, 0 - no
+   * limit. Same as mg_rpc_cfg::rate_limit otherwise.
+   */
+  int rate_limit;
+  int rate_burst;
+  /*
+   * Run the handler off the event loop, using the executor set with
+   * mg_rpc_set_offload_executor. Args and fi are copied and stay valid for
+   * the duration of the call, as usual. From the executor's context the
+   * handler may only respond, with mg_rpc_send_responsef,
+   * mg_rpc_send_errorf or mg_rpc_send_error_jsonf: the response is
+   * formatted there and handed to the event loop with mgos_invoke_cb.
+   * Requests over mg_rpc_cfg::max_offload_queue_length get
+   * MG_RPC_ERR_QUEUE_FULL. With no executor set, the handler runs on the
+   * event loop like any other.
+   */
+  bool offload;
+  /* Offloaded calls of the method running at once, 0 - no limit. */
+  int max_concurrency;
+  /*
+   * Decode args into a struct of args_size bytes before invoking the
+   * handler, see mg_rpc_frame_info::args_struct. args_offsets has the offset
+   * of the member for each field of args_fmt, in order. args_fmt must then
+   * be a flat object of up to 32 fields, each one of %d (int), %u (unsigned
+   * int), %ld (long), %lld (int64_t), %f (float), %lf (double), %B (bool) or
+   * %Q (char *). Args of a wrong type or shape get a 400 and the handler is
+   * not invoked. args_fmt is compiled once, when the handler is added.
+   */
+  const size_t *args_offsets;
+  size_t args_size;
+};
+
+/* Add a method handler with options. opts can be NULL. */
+void mg_rpc_add_handler_opt(struct mg_rpc *c, const char *method,
+                            mg_handler_cb_t cb, void *cb_arg,
+                            const struct mg_rpc_handler_opts *opts);
+
+/*
+ * Add handlers of `from` that c does not have yet, with the same options.
+ * Lets instances serve a common set of methods registered once: handler
+ * state (caches, limits, stats) is per instance, `from` is only read.
+ */
+void mg_rpc_add_handlers_from(struct mg_rpc *c, const struct mg_rpc *from);
+
+/*
+ * Runs fn(arg) for an offloaded handler, e.g. on a worker task. Returns false
+ * if it could not be scheduled.
+ */
+typedef bool (*mg_rpc_offload_executor_t)(void (*fn)(void *arg), void *arg);
+
+/*
+ * Set the executor for offloaded handlers, e.g. one posting to a worker
+ * task's queue. There is none by default (ex = NULL), and offloaded
+ * handlers then run inline, on the event loop.
+ */
+void mg_rpc_set_offload_executor(struct mg_rpc *c,
+                                 mg_rpc_offload_executor_t ex);
+
 /*
  * Signature of an incoming requests prehandler, which is called right before
  * calling the actual handler.
  *
  * If it returns false, the further request processing is not performed. It's
- * called for existing handlers only.
+ * called for existing handlers only, after rate limits are checked.
+ * Prehandler that returns false must have responded to (and freed) ri.
  */
 typedef bool (*mg_prehandler_cb_t)(struct mg_rpc_request_info *ri, void *cb_arg,
                                    struct mg_rpc_frame_info *fi,
                                    struct mg_str args);
 
-/* Set a generic method prehandler. */
+/* Set a generic method prehandler, replacing all prehandlers added so far. */
 void mg_rpc_set_prehandler(struct mg_rpc *c, mg_prehandler_cb_t cb,
                            void *cb_arg);
 
+/*
+ * Add a prehandler to the end of the chain. Prehandlers are called in the
+ * order they were added, until one of them returns false.
+ */
+void mg_rpc_add_prehandler(struct mg_rpc *c, mg_prehandler_cb_t cb,
+                           void *cb_arg);
+
 /*
  * Respond to an incoming request.
  * result_json_fmt can be NULL, in which case no result is included.
@@ -226,6 +420,43 @@ bool mg_rpc_send_errorf(struct mg_rpc_request_info *ri, int error_code,
 bool mg_rpc_send_error_jsonf(struct mg_rpc_request_info *ri, int error_code,
                              const char *error_json_fmt, ...);
 
+/*
+ * Streamed responses, for results that are too big to format in one go.
+ * Result is sent as a sequence of JSON fragments which, concatenated, form
+ * the result value. Only one chunk is buffered at a time: if
+ * mg_rpc_send_response_chunkf returns false, the channel is busy and the
+ * chunk should be sent again when cb is invoked.
+ * cb is invoked when the channel can take more, or with ok = false if it
+ * has closed, in which case the stream should be ended.
+ * Channels that support it (HTTP) stream the response natively, others get
+ * a series of frames with "chunk" members, the last one has "last": true.
+ * Not available for requests that arrived in a batch.
+ */
+typedef void (*mg_rpc_stream_cb_t)(struct mg_rpc_request_info *ri,
+                                   void *cb_arg, bool ok);
+
+bool mg_rpc_send_response_begin(struct mg_rpc_request_info *ri,
+                                mg_rpc_stream_cb_t cb, void *cb_arg);
+
+bool mg_rpc_send_response_chunkf(struct mg_rpc_request_info *ri,
+                                 const char *chunk_json_fmt, ...);
+
+/*
+ * Finishes streamed response. `ri` is freed by the call.
+ * Returns false if the end of the response could not be sent.
+ */
+bool mg_rpc_send_response_end(struct mg_rpc_request_info *ri);
+
+/*
+ * Frames sent between mg_rpc_batch_begin and mg_rpc_batch_commit (calls
+ * and responses alike) are held back and on commit sent as one array frame
+ * per channel. The other side must support batches.
+ * Batches can be nested, frames are sent when the outermost one is
+ * committed.
+ */
+void mg_rpc_batch_begin(struct mg_rpc *c);
+bool mg_rpc_batch_commit(struct mg_rpc *c);
+
 /* Returns true if the instance has an open default channel. */
 bool mg_rpc_is_connected(struct mg_rpc *c);
 
@@ -237,6 +468,13 @@ bool mg_rpc_can_send(struct mg_rpc *c);
 enum mg_rpc_event {
   MG_RPC_EV_CHANNEL_OPEN,   /* struct mg_str *dst */
   MG_RPC_EV_CHANNEL_CLOSED, /* struct mg_str *dst */
+  /*
+   * Outgoing queue has overflown: frames are being dropped or evicted.
+   * Sent once, until MG_RPC_EV_QUEUE_DRAINED.
+   */
+  MG_RPC_EV_QUEUE_FULL, /* NULL */
+  /* Queue is down to half of max_queue_length again. */
+  MG_RPC_EV_QUEUE_DRAINED, /* NULL */
 };
 typedef void (*mg_observer_cb_t)(struct mg_rpc *c, void *cb_arg,
                                  enum mg_rpc_event ev, void *ev_arg);
@@ -253,13 +491,55 @@ void mg_rpc_free(struct mg_rpc *c);
  * mg_rpc_channel_info_free_all() or individuallt with
  * mg_rpc_channel_info_free().
  * Note: mg_rpc_channel_info_free_all does not free the pointer passed to it.
+ * For polling, mg_rpc_foreach_channel is cheaper.
  */
 bool mg_rpc_get_channel_info(struct mg_rpc *c, struct mg_rpc_channel_info **ci,
                              int *num_ci);
 void mg_rpc_channel_info_free(struct mg_rpc_channel_info *ci);
 void mg_rpc_channel_info_free_all(struct mg_rpc_channel_info *ci, int num_ci);
 
-/* Enable RPC.List handler that returns a list of all registered endpoints */
+/*
+ * Per-channel counters, kept since the channel was added. Bytes are sizes of
+ * serialized frames, frames passed to channels parsed only count as frames.
+ */
+struct mg_rpc_channel_counters {
+  uint32_t frames_in, frames_out;
+  uint64_t bytes_in, bytes_out;
+  double last_activity; /* mgos_uptime() of the last frame, 0 - none yet. */
+};
+
+/* Borrowed view of a channel, only valid for the duration of the callback. */
+struct mg_rpc_channel_view {
+  struct mg_rpc_channel *ch;
+  struct mg_str type;
+  struct mg_str dst;
+  struct mg_str info; /* In the buffer passed to mg_rpc_foreach_channel. */
+  int queue_len;      /* Frames waiting for the channel. */
+  int num_in_flight;  /* Frames sent, not confirmed by the channel yet. */
+  const struct mg_rpc_channel_counters *counters;
+  unsigned int is_open : 1;
+  unsigned int is_persistent : 1;
+  unsigned int is_broadcast_enabled : 1;
+};
+
+/* Return false to stop iterating. */
+typedef bool (*mg_rpc_channel_visitor_t)(const struct mg_rpc_channel_view *cv,
+                                         void *cb_arg);
+
+/*
+ * Calls cb for each channel without copying anything. Peer info is written
+ * into info_buf, which is reused for every channel (NULL - no info).
+ * Channels must not be added or removed from the callback.
+ * Returns the number of channels visited.
+ */
+int mg_rpc_foreach_channel(struct mg_rpc *c, char *info_buf, size_t info_size,
+                           mg_rpc_channel_visitor_t cb, void *cb_arg);
+
+/*
+ * Enable RPC.List handler that returns a list of all registered endpoints,
+ * along with RPC.Describe, RPC.Ping and RPC.Stats (frame, queue and latency
+ * counters).
+ */
 void mg_rpc_add_list_handler(struct mg_rpc *c);
 
 /*
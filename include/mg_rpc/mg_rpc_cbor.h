@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * CBOR (RFC 7049) encoding of RPC frames. Internally frames are JSON,
+ * channels that talk CBOR to their peers transcode at the edge, or encode
+ * parsed frames directly.
+ */
+
+#ifndef CS_MOS_LIBS_RPC_COMMON_SRC_MG_RPC_MG_RPC_CBOR_H_
+#define CS_MOS_LIBS_RPC_COMMON_SRC_MG_RPC_MG_RPC_CBOR_H_
+
+#include <stdbool.h>
+
+#include "mg_rpc.h"
+#include "mg_rpc_channel.h"
+
+#include "common/mbuf.h"
+#include "common/mg_str.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Appends CBOR encoding of the JSON value to out. */
+bool mg_rpc_json_to_cbor(const struct mg_str json, struct mbuf *out);
+
+/*
+ * Appends JSON representation of the CBOR item to out.
+ * Byte strings become base64 strings, tags are dropped.
+ */
+bool mg_rpc_cbor_to_json(const struct mg_str cbor, struct mbuf *out);
+
+/* Returns true if the item is a CBOR array, i.e. a batch of frames. */
+bool mg_rpc_cbor_is_array(const struct mg_str cbor);
+
+/*
+ * Decodes CBOR-encoded frame. Envelope strings point into cbor,
+ * args, result and auth are transcoded to JSON and stored in buf, which
+ * the caller must free once the frame has been handled.
+ * Raw CBOR of args is available as frame->args_cbor.
+ */
+bool mg_rpc_cbor_parse_frame(const struct mg_str cbor,
+                             struct mg_rpc_frame *frame, struct mbuf *buf);
+
+/*
+ * Appends CBOR encoding of the frame to out, without going through JSON.
+ * Only args, result and auth, which are JSON, are transcoded; args_cbor is
+ * used as is if present. Chunks are not supported.
+ */
+bool mg_rpc_cbor_encode_frame(const struct mg_rpc_frame *frame,
+                              struct mbuf *out);
+
+/*
+ * Delivers CBOR frame received by the channel. Single frames are delivered
+ * parsed, batches and invalid frames go through the JSON path.
+ */
+void mg_rpc_cbor_frame_recd(struct mg_rpc_channel *ch, const struct mg_str f);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CS_MOS_LIBS_RPC_COMMON_SRC_MG_RPC_MG_RPC_CBOR_H_ */
@@ -28,6 +28,20 @@ extern "C" {
 #endif
 
 struct mg_rpc_authn_info;
+struct mg_rpc_frame;
+struct mbuf;
+
+/*
+ * Space reserved in front of frames passed to send_frame_owned, channels can
+ * put their own framing there.
+ */
+#define MG_RPC_CHANNEL_FRAME_HEADROOM 4
+
+enum mg_rpc_channel_stream_op {
+  MG_RPC_CHANNEL_STREAM_BEGIN, /* Frame up to and including "result": */
+  MG_RPC_CHANNEL_STREAM_DATA,  /* Fragment of the result. */
+  MG_RPC_CHANNEL_STREAM_END,   /* Remainder of the frame. */
+};
 
 enum mg_rpc_channel_event {
   MG_RPC_CHANNEL_OPEN,
@@ -45,6 +59,51 @@ struct mg_rpc_channel {
 
   bool (*send_frame)(struct mg_rpc_channel *ch, const struct mg_str f);
 
+  /*
+   * Optional variant of send_frame that can take over the frame buffer.
+   * fb contains MG_RPC_CHANNEL_FRAME_HEADROOM bytes of headroom followed by
+   * the frame. Channel that adopts the buffer must leave fb empty
+   * (mbuf_init(fb, 0)), whatever is left in fb is freed by the caller.
+   *
+   * Only the inbound WebSocket channel implements it, and it only adopts
+   * uncompressed JSON frames of 126 - 64K bytes when its send buffer is
+   * empty; other frames are copied. Channels without it (outbound
+   * WebSocket, HTTP, local, sharded) get the frame through send_frame and
+   * copy it.
+   */
+  bool (*send_frame_owned)(struct mg_rpc_channel *ch, struct mbuf *fb);
+
+  /*
+   * Optional, for channels that stay within the process or encode frames
+   * other than as JSON (CBOR): takes the frame without it being serialized.
+   * Used instead of send_frame for calls and results when the channel can
+   * send and has nothing queued. The frame and the strings it points to are
+   * only valid for the duration of the call. Accounted for and confirmed
+   * like send_frame. If the frame is refused, it is serialized and sent
+   * (or queued) as usual. Channels may set and clear it as they go, e.g.
+   * once encoding has been agreed on with the peer.
+   */
+  bool (*send_parsed_frame)(struct mg_rpc_channel *ch,
+                            const struct mg_rpc_frame *frame);
+
+  /*
+   * Max number of frames that can be in flight, i.e. accepted by send_frame
+   * but not yet confirmed with MG_RPC_CHANNEL_FRAME_SENT. Channel must emit
+   * one MG_RPC_CHANNEL_FRAME_SENT for each accepted frame and may still
+   * refuse frames (return false) before the window is full.
+   * If NULL, the window is 1.
+   */
+  int (*get_send_window)(struct mg_rpc_channel *ch);
+
+  /*
+   * Optional, streamed responses. Ops are subject to the send window and
+   * confirmed with MG_RPC_CHANNEL_FRAME_SENT like frames, except that END
+   * must always be accepted. Returning false for BEGIN declines streaming.
+   */
+  bool (*send_stream)(struct mg_rpc_channel *ch,
+                      enum mg_rpc_channel_stream_op op,
+                      const struct mg_str data);
+
   /*
    * Close tells the channel to wind down.
    * This applies to persistent channels as well: if a channel is told to close,
@@ -71,6 +130,12 @@ struct mg_rpc_channel {
   /* Return free form information about the peer. Caller must free() it. */
   char *(*get_info)(struct mg_rpc_channel *ch);
 
+  /*
+   * Optional, get_info without the allocation: writes NUL-terminated info
+   * into buf, truncated to fit. Returns its length.
+   */
+  size_t (*write_info)(struct mg_rpc_channel *ch, char *buf, size_t size);
+
   /*
    * Get authentication info, if present, from the channel and populate it into
    * the given authn struct. Returns true if the authn info is present; false
@@ -80,6 +145,13 @@ struct mg_rpc_channel {
                          const char *auth_file,
                          struct mg_rpc_authn_info *authn);
 
+  /*
+   * Optional. Remember authentication for the rest of the session, later
+   * get_authn_info calls will return it. Channel makes its own copy.
+   */
+  void (*set_authn_info)(struct mg_rpc_channel *ch,
+                         const struct mg_rpc_authn_info *authn);
+
   /*
    * Send "not authorized" response in a channel-specific way. If channel
    * doesn't have specific way to send 401, this pointer should be NULL.
@@ -96,6 +168,21 @@ struct mg_rpc_channel {
 bool mg_rpc_channel_true(struct mg_rpc_channel *ch);
 bool mg_rpc_channel_false(struct mg_rpc_channel *ch);
 
+/*
+ * Writes channel info into buf, using write_info if the channel has it and
+ * get_info otherwise. buf is always NUL-terminated (if size > 0).
+ */
+size_t mg_rpc_channel_write_info(struct mg_rpc_channel *ch, char *buf,
+                                 size_t size);
+
+/*
+ * Checks an incoming frame against max_frame_size of the instance the
+ * channel belongs to. Frames that are too big are counted as invalid and
+ * a non-persistent channel is closed. FRAME_RECD frames are checked by
+ * mg_rpc, channels that decode frames themselves should check them first.
+ */
+bool mg_rpc_channel_frame_size_ok(struct mg_rpc_channel *ch, size_t len);
+
 #ifdef __cplusplus
 }
 #endif
@@ -29,8 +29,10 @@ extern "C" {
 #endif
 
 /*
- * Creates a new http channel. Should be called for each incoming http request;
- * `nc` is an incoming connection.
+ * Creates a new http channel for the incoming connection `nc`. The channel
+ * lives as long as the connection and handles all the requests made over it
+ * (HTTP/1.1 keep-alive), one at a time; it takes over `nc->handler`, passing
+ * all the events on to the original one.
  *
  * Default authn parameters (`default_auth_domain`, `default_auth_file`) will
  * be used if those passed to `struct mg_rpc_channel::get_authn_info()` and
@@ -40,6 +42,11 @@ struct mg_rpc_channel *mg_rpc_channel_http(struct mg_connection *nc,
                                            const char *default_auth_domain,
                                            const char *default_auth_file);
 
+/*
+ * Returns the channel previously created for `nc`, or NULL if there is none.
+ */
+struct mg_rpc_channel *mg_rpc_channel_http_get(struct mg_connection *nc);
+
 /*
  * Should be called by the http endpoint handler, on the event
  * `MG_EV_HTTP_REQUEST`.
@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CS_MOS_LIBS_RPC_COMMON_SRC_MG_RPC_MG_RPC_CHANNEL_LOCAL_H_
+#define CS_MOS_LIBS_RPC_COMMON_SRC_MG_RPC_MG_RPC_CHANNEL_LOCAL_H_
+
+#include <stdbool.h>
+
+#include "mg_rpc_channel.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Destination of the built-in local channel: calls to it are served by
+ * the handlers of the same instance. Calls and results are passed on as
+ * parsed frames, without being serialized.
+ */
+#define MG_RPC_LOCAL_DST "RPC.SELF"
+
+struct mg_rpc_channel_local_cfg {
+  /*
+   * Deliver frames right away, from within the send. Handlers then run
+   * before mg_rpc_callf returns, and so may the result callback. Frames
+   * sent from there don't recurse into the queue processing: they are
+   * picked up once the outer send returns. Otherwise delivery is
+   * deferred to the next main loop iteration.
+   */
+  bool sync;
+};
+
+struct mg_rpc_channel *mg_rpc_channel_local(
+    const struct mg_rpc_channel_local_cfg *cfg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CS_MOS_LIBS_RPC_COMMON_SRC_MG_RPC_MG_RPC_CHANNEL_LOCAL_H_ */
@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CS_MOS_LIBS_RPC_COMMON_SRC_MG_RPC_MG_RPC_CHANNEL_SHARD_H_
+#define CS_MOS_LIBS_RPC_COMMON_SRC_MG_RPC_MG_RPC_CHANNEL_SHARD_H_
+
+#include <stdbool.h>
+
+#include "mg_rpc_channel.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Pair of channels connecting two mg_rpc instances that may run on
+ * different threads: frames sent on one end are received on the other.
+ * Each direction is a lock-free single producer, single consumer ring of
+ * ring_size (rounded up to a power of 2) frames.
+ *
+ * Add each end to its instance with the address of the other instance,
+ * e.g. mg_rpc_add_channel(c1, mg_mk_str("shard2"), a), then have each
+ * thread call mg_rpc_channel_shard_poll on its end regularly.
+ */
+bool mg_rpc_channel_shard_pair(int ring_size, struct mg_rpc_channel **a,
+                               struct mg_rpc_channel **b);
+
+/*
+ * Delivers frames that arrived from the other end and confirms frames the
+ * other end has taken. Must be called by the thread using this end, all
+ * channel events are emitted from here.
+ */
+void mg_rpc_channel_shard_poll(struct mg_rpc_channel *ch);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CS_MOS_LIBS_RPC_COMMON_SRC_MG_RPC_MG_RPC_CHANNEL_SHARD_H_ */
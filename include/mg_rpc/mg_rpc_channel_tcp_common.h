@@ -7,5 +7,7 @@
 #include "mongoose.h"
 
 char *mg_rpc_channel_tcp_get_info(struct mg_connection *c);
+size_t mg_rpc_channel_tcp_write_info(struct mg_connection *c, char *buf,
+                                     size_t size);
 
 #endif /* CS_MOS_LIBS_RPC_COMMON_SRC_MG_RPC_MG_RPC_CHANNEL_TCP_COMMON_H_ */
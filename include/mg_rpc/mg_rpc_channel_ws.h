@@ -19,6 +19,7 @@
 #define CS_MOS_LIBS_RPC_COMMON_SRC_MG_RPC_MG_RPC_CHANNEL_WS_H_
 
 #include "mg_rpc_channel.h"
+#include "mg_rpc_timer.h"
 
 #include "common/mg_str.h"
 #include "mongoose.h"
@@ -27,7 +28,49 @@
 extern "C" {
 #endif
 
+struct mg_rpc_channel_ws_in_cfg {
+  /*
+   * Keep accepting frames until this many bytes are waiting to be sent.
+   * 0 - send one frame at a time.
+   */
+  int send_high_water_mark;
+  /*
+   * permessage-deflate is used if it was agreed on in
+   * mg_rpc_channel_ws_in_handshake. Frames smaller than deflate_min_size
+   * are sent as is.
+   */
+  int deflate_min_size;
+  /* Incoming compressed frames larger than this are refused, 0 - no limit. */
+  int max_inflated_size;
+  /* Handshake: accept permessage-deflate, if offered. */
+  bool deflate;
+  /*
+   * Handshake: accept the CBOR subprotocol, if offered. Responses and calls
+   * to the client are then CBOR-encoded. Received frames are decoded
+   * according to their type either way.
+   */
+  bool cbor;
+};
+
 struct mg_rpc_channel *mg_rpc_channel_ws_in(struct mg_connection *nc);
+struct mg_rpc_channel *mg_rpc_channel_ws_in_opt(
+    struct mg_connection *nc, const struct mg_rpc_channel_ws_in_cfg *cfg);
+
+/*
+ * Answers WebSocket handshake request, accepting permessage-deflate
+ * (RFC 7692) and the CBOR subprotocol as allowed by cfg, if the client
+ * offers them. Call on MG_EV_WEBSOCKET_HANDSHAKE_REQUEST, before the
+ * connection is passed to mg_rpc_channel_ws_in_opt. Returns false if the
+ * request was left to mongoose to answer: nothing was offered that needs
+ * an answer from us.
+ */
+bool mg_rpc_channel_ws_in_handshake_opt(
+    struct mg_connection *nc, struct http_message *hm,
+    const struct mg_rpc_channel_ws_in_cfg *cfg);
+
+/* Same, accepting both compression and CBOR. */
+bool mg_rpc_channel_ws_in_handshake(struct mg_connection *nc,
+                                    struct http_message *hm);
 
 struct mg_rpc_channel_ws_out_cfg {
   struct mg_str server_address;
@@ -39,11 +82,33 @@ struct mg_rpc_channel_ws_out_cfg {
   int reconnect_interval_min;
   int reconnect_interval_max;
   int idle_close_timeout;
+  int send_high_water_mark; /* See mg_rpc_channel_ws_in_cfg. */
+  /*
+   * Offer CBOR encoding to the server as a WS subprotocol, JSON is used
+   * unless the server picks it.
+   */
+  bool cbor;
+  /* Offer permessage-deflate to the server, see mg_rpc_channel_ws_in_cfg. */
+  bool deflate;
+  int deflate_min_size;
+  int max_inflated_size;
+  /*
+   * Reconnect and idle timers, must run on the channel's manager.
+   * NULL - mg_rpc_timers_default().
+   */
+  struct mg_rpc_timers *timers;
 };
 
 struct mg_rpc_channel *mg_rpc_channel_ws_out(
     struct mg_mgr *mgr, const struct mg_rpc_channel_ws_out_cfg *cfg);
 
+/*
+ * Mixes something unique to the device (id, MAC address) into the random
+ * part of reconnect intervals, so that devices don't reconnect in lockstep.
+ * Can be called more than once.
+ */
+void mg_rpc_channel_ws_out_seed_jitter(const struct mg_str seed);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Raw DEFLATE (RFC 1951) for channels that compress frames on the wire.
+ * Whole buffers only, no streaming: frames are in RAM anyway.
+ */
+
+#ifndef CS_MOS_LIBS_RPC_COMMON_SRC_MG_RPC_MG_RPC_DEFLATE_H_
+#define CS_MOS_LIBS_RPC_COMMON_SRC_MG_RPC_MG_RPC_DEFLATE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "common/mbuf.h"
+#include "common/mg_str.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Appends compressed data to out. Matches reach back at most
+ * 1 << window_bits bytes (8 - 15), fixed Huffman codes are used.
+ * Output is not final and ends with a sync flush marker, an empty stored
+ * block (00 00 ff ff), same as zlib with Z_SYNC_FLUSH.
+ */
+bool mg_rpc_deflate(const struct mg_str data, int window_bits,
+                    struct mbuf *out);
+
+/*
+ * Appends decompressed data to out. Input may end on a block boundary
+ * without a final block. Fails if output would exceed max_len
+ * (0 - no limit).
+ */
+bool mg_rpc_inflate(const struct mg_str data, size_t max_len,
+                    struct mbuf *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CS_MOS_LIBS_RPC_COMMON_SRC_MG_RPC_MG_RPC_DEFLATE_H_ */
@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Digest authentication against htdigest files, with credentials cached
+ * in memory. Files are re-read only when they change.
+ */
+
+#ifndef CS_MOS_LIBS_RPC_COMMON_SRC_MG_RPC_MG_RPC_HTDIGEST_H_
+#define CS_MOS_LIBS_RPC_COMMON_SRC_MG_RPC_MG_RPC_HTDIGEST_H_
+
+#include <stdbool.h>
+
+#include "common/mg_str.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Checks digest response against credentials in the htdigest file.
+ * Returns 1 if the response is correct, 0 if it is not and -1 if the file
+ * could not be read.
+ */
+int mg_rpc_htdigest_check(const char *file, struct mg_str method,
+                          struct mg_str uri, struct mg_str username,
+                          struct mg_str cnonce, struct mg_str response,
+                          struct mg_str qop, struct mg_str nc,
+                          struct mg_str nonce, struct mg_str realm);
+
+/* Drops cached credentials, all files will be re-read on next check. */
+void mg_rpc_htdigest_invalidate(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CS_MOS_LIBS_RPC_COMMON_SRC_MG_RPC_MG_RPC_HTDIGEST_H_ */
@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Timers shared by everything running on a manager: channel reconnects and
+ * idle closes, call deadlines. Hierarchical timing wheel: setting and
+ * clearing timers is O(1), no memory is allocated, and one mongoose timer
+ * drives the lot, however many timers there are.
+ */
+
+#ifndef CS_MOS_LIBS_RPC_COMMON_SRC_MG_RPC_MG_RPC_TIMER_H_
+#define CS_MOS_LIBS_RPC_COMMON_SRC_MG_RPC_MG_RPC_TIMER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common/queue.h"
+#include "mongoose.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct mg_rpc_timers;
+
+typedef void (*mg_rpc_timer_cb_t)(void *arg);
+
+/* Embedded into its owner, contents are private. */
+struct mg_rpc_timer {
+  struct mg_rpc_timers *timers;
+  uint64_t expires; /* In ticks. */
+  mg_rpc_timer_cb_t cb;
+  void *arg;
+  bool is_set;
+  LIST_ENTRY(mg_rpc_timer) entries;
+};
+
+/* Creates timers driven by the manager, they only fire from its poll. */
+struct mg_rpc_timers *mg_rpc_timers_create(struct mg_mgr *mgr);
+
+/* Timers still set are dropped without firing. */
+void mg_rpc_timers_free(struct mg_rpc_timers *ts);
+
+/* Timers on mgos_get_mgr(), created on first use. */
+struct mg_rpc_timers *mg_rpc_timers_default(void);
+
+void mg_rpc_timer_init(struct mg_rpc_timer *t, struct mg_rpc_timers *ts,
+                       mg_rpc_timer_cb_t cb, void *arg);
+
+/* Sets the timer to fire once, in delay seconds. Re-sets if already set. */
+void mg_rpc_timer_set(struct mg_rpc_timer *t, double delay);
+
+/*
+ * Makes sure the timer does not fire earlier than in delay seconds, sets
+ * it if it isn't. Cheaper than mg_rpc_timer_set, meant for idle timers
+ * that are pushed back on every bit of activity.
+ */
+void mg_rpc_timer_extend(struct mg_rpc_timer *t, double delay);
+
+void mg_rpc_timer_clear(struct mg_rpc_timer *t);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CS_MOS_LIBS_RPC_COMMON_SRC_MG_RPC_MG_RPC_TIMER_H_ */
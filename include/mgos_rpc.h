@@ -34,6 +34,12 @@ extern "C" {
 
 bool mgos_rpc_common_init(void);
 struct mg_rpc *mgos_rpc_get_global(void);
+
+/*
+ * Reload rpc.acl_file. ACL is loaded at init and when rpc.acl_file changes,
+ * this needs to be called if the file is modified.
+ */
+bool mgos_rpc_acl_reload(void);
 struct mg_rpc_cfg *mgos_rpc_cfg_from_sys(const struct mgos_config *scfg);
 void mgos_rpc_channel_ws_out_cfg_from_sys(
     const struct mgos_config *scfg, struct mg_rpc_channel_ws_out_cfg *chcfg);
@@ -69,6 +75,8 @@ int mgos_print_sys_info(struct json_out *out);
 enum mgos_rpc_event {
   MGOS_RPC_EV_CHANNEL_OPEN = MGOS_RPC_EVENT_BASE, /* struct mg_str *dst */
   MGOS_RPC_EV_CHANNEL_CLOSED,                     /* struct mg_str *dst */
+  MGOS_RPC_EV_QUEUE_FULL,                         /* NULL */
+  MGOS_RPC_EV_QUEUE_DRAINED,                      /* NULL */
 };
 
 #ifdef __cplusplus
@@ -15,12 +15,15 @@
  * limitations under the License.
  */
 
+#include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "mg_rpc.h"
 #include "mg_rpc_channel.h"
 #include "mg_rpc_channel_ws.h"
+#include "mg_rpc_htdigest.h"
+#include "mg_rpc_timer.h"
 
 #include "common/cs_dbg.h"
 #include "common/json_utils.h"
@@ -28,65 +31,305 @@
 
 #include "mongoose.h"
 
+#include "mgos_hal.h"
 #include "mgos_mongoose.h"
 #include "mgos_sys_config.h"
+#include "mgos_timers.h"
+
+/*
+ * Latency histogram: bucket 0 counts latencies under 1 ms, bucket i under
+ * 2^i ms, the last one everything above.
+ */
+#define MG_RPC_STATS_NUM_BUCKETS 13
+
+/* Channel types counted separately, the rest go into the last slot. */
+#define MG_RPC_STATS_NUM_CH_TYPES 8
+
+struct mg_rpc_ch_type_stats {
+  const char *type; /* As returned by get_type(), NULL if the slot is free. */
+  uint32_t frames_in, frames_out;
+};
+
+/* Counters, fixed-size so that updating them never allocates. */
+struct mg_rpc_stats {
+  struct mg_rpc_ch_type_stats ch_types[MG_RPC_STATS_NUM_CH_TYPES];
+  uint32_t invalid_frames;
+  uint32_t dropped_frames;
+  uint32_t evicted_frames;
+  int queue_len_hwm;
+  uint32_t calls_timed_out;
+  uint32_t rate_limited; /* Requests rejected with a 429. */
+  uint32_t call_latency[MG_RPC_STATS_NUM_BUCKETS]; /* Response round trip. */
+};
 
 struct mg_rpc {
   struct mg_rpc_cfg *cfg;
+  struct mg_mgr *mgr; /* For outbound channels. */
+  /* Deadlines, outbound channels. mg_rpc_timers_default() unless own. */
+  struct mg_rpc_timers *timers;
+  bool own_timers;
   int64_t next_id;
   int queue_len;
   struct mbuf local_ids;
 
-  mg_prehandler_cb_t prehandler;
-  void *prehandler_arg;
+  SLIST_HEAD(prehandlers, mg_rpc_prehandler_info) prehandlers;
 
   SLIST_HEAD(handlers, mg_rpc_handler_info) handlers;
+  /*
+   * Open-addressing (linear probing) index over handlers, keyed by method.
+   * Size is a power of 2 and load is kept under 1/2. Handlers are never
+   * removed, so there are no tombstones.
+   */
+  struct mg_rpc_handler_info **htab;
+  size_t htab_size;
+  size_t num_handlers;
   SLIST_HEAD(channels, mg_rpc_channel_info_internal) channels;
-  SLIST_HEAD(requests, mg_rpc_sent_request_info) requests;
+  /*
+   * Routing index: channels with known dst, hashed by canonical dst into
+   * num_dst_buckets (power of 2) chains. Default route is kept separately.
+   */
+  SLIST_HEAD(dst_index, mg_rpc_channel_info_internal) * dst_buckets;
+  size_t num_dst_buckets;
+  size_t num_dst_channels;
+  struct mg_rpc_channel_info_internal *default_ci;
+  /*
+   * Requests we are waiting for responses to. Hashed by id into
+   * num_req_buckets (power of 2) chains.
+   */
+  SLIST_HEAD(requests, mg_rpc_sent_request_info) * req_buckets;
+  size_t num_req_buckets;
+  size_t num_requests;
   SLIST_HEAD(observers, mg_rpc_observer_info) observers;
+  /*
+   * Frames which could not be bound to a channel when they were queued.
+   * Frames for known channels are queued on the channels themselves.
+   */
   STAILQ_HEAD(queue, mg_rpc_queue_entry) queue;
+  SLIST_HEAD(queued_dsts, mg_rpc_queued_dst) queued_dsts;
+  struct mg_rpc_req_block *free_req_blocks;
+  int num_free_req_blocks;
+  /* Requests with a streamed response in progress. */
+  SLIST_HEAD(streams, mg_rpc_req_block) streams;
+  uint32_t stream_notify_gen; /* Round of mg_rpc_notify_streams. */
+  int batch_depth; /* mg_rpc_batch_begin nesting. */
+  int num_warm_out_channels;
+  bool queue_full; /* MG_RPC_EV_QUEUE_FULL was sent. */
+  struct mg_rpc_stats stats;
+  mg_rpc_offload_executor_t offload_executor;
+  /* Offloaded requests handed to the executor and not done with yet. */
+  int num_offloaded;
+  /* Offloaded requests waiting for their method's concurrency cap. */
+  STAILQ_HEAD(offload_queue, mg_rpc_offload_job) offload_queue;
+  int offload_queue_len;
+};
+
+enum mg_rpc_arg_type {
+  MG_RPC_ARG_INT,
+  MG_RPC_ARG_UINT,
+  MG_RPC_ARG_LONG,
+  MG_RPC_ARG_INT64,
+  MG_RPC_ARG_FLOAT,
+  MG_RPC_ARG_DOUBLE,
+  MG_RPC_ARG_BOOL,
+  MG_RPC_ARG_STRING,
+};
+
+#define MG_RPC_MAX_ARGS 32
+
+/* Field of a compiled args_fmt. */
+struct mg_rpc_arg_field {
+  struct mg_str name; /* Points into args_fmt. */
+  enum mg_rpc_arg_type type;
+  size_t offset; /* In the decoded struct. */
+};
+
+/* Token bucket, for rate limits. */
+struct mg_rpc_rate_limiter {
+  float tokens;
+  double last; /* mgos_uptime() of the last refill, 0 - not used yet. */
 };
 
 struct mg_rpc_handler_info {
   const char *method;
+  size_t method_len;
+  uint32_t method_hash;
   const char *args_fmt;
   mg_handler_cb_t cb;
   void *cb_arg;
+  int cache_ttl_ms; /* See mg_rpc_handler_opts. */
+  int rate_limit, rate_burst;
+  struct mg_rpc_rate_limiter rl;
+  bool offload;
+  int max_concurrency;
+  int num_offloaded; /* Running now. */
+  /* Compiled args_fmt, NULL if it is not a flat object. */
+  struct mg_rpc_arg_field *args;
+  int num_args;
+  const size_t *args_offsets; /* Decode args if set. */
+  size_t args_size;
+  /* Time from invocation until the request is done with. */
+  uint32_t latency[MG_RPC_STATS_NUM_BUCKETS];
+  int num_cache_entries;
+  SLIST_HEAD(cache_entries, mg_rpc_cache_entry) cache;
   SLIST_ENTRY(mg_rpc_handler_info) handlers;
 };
 
+/* Max number of distinct args cached per method. */
+#define MG_RPC_CACHE_MAX_ENTRIES 4
+
+/* Result of an idempotent method call, see mg_rpc_handler_opts. */
+struct mg_rpc_cache_entry {
+  struct mg_rpc_handler_info *hi;
+  struct mbuf args;   /* Cache key, along with the method. */
+  struct mbuf result; /* Response payload: "result":... */
+  double expires;     /* mgos_uptime(). */
+  /* Request being handled, NULL once the result is in. */
+  struct mg_rpc_req_block *leader;
+  /* Identical requests which arrived meanwhile, get the leader's response. */
+  SLIST_HEAD(cache_waiters, mg_rpc_req_block) waiters;
+  SLIST_ENTRY(mg_rpc_cache_entry) entries;
+};
+
 struct mg_rpc_channel_info_internal {
   struct mg_str dst;
+  struct mg_str canon_dst; /* Canonical form of dst, used for routing. */
+  uint32_t dst_hash;       /* Hash of canon_dst. */
   struct mg_rpc_channel *ch;
   unsigned int is_open : 1;
-  unsigned int is_busy : 1;
+  int num_in_flight; /* Frames sent but not confirmed yet. */
+  unsigned int is_indexed : 1; /* Is in mg_rpc::dst_buckets. */
+  /* Outbound channel for a URI dst, kept warm for longer when idle. */
+  unsigned int is_warm : 1;
+  /* FRAME_SENT is being handled, and another one came in meanwhile. */
+  unsigned int in_frame_sent : 1;
+  unsigned int frame_sent_again : 1;
+  int queue_len;
+  int num_queued_broadcasts; /* Part of queue_len. */
+  struct mg_rpc_rate_limiter rl; /* Requests coming in, mg_rpc_cfg limits. */
+  struct mg_rpc_channel_counters counters;
+  struct queue queue;
   SLIST_ENTRY(mg_rpc_channel_info_internal) channels;
+  SLIST_ENTRY(mg_rpc_channel_info_internal) dst_index;
 };
 
 struct mg_rpc_sent_request_info {
   int64_t id;
   mg_result_cb_t cb;
   void *cb_arg;
+  double deadline; /* mgos_uptime(), 0 if none. */
+  struct mg_rpc *c;
+  struct mg_rpc_timer deadline_timer;
+  struct mbuf result; /* Streamed result, collected so far. */
+  double sent_at;     /* mgos_uptime(). */
   SLIST_ENTRY(mg_rpc_sent_request_info) requests;
 };
 
-struct mg_rpc_queue_entry {
+/* Destination of queued frames, shared by all the entries going there. */
+struct mg_rpc_queued_dst {
   struct mg_str dst;
-  struct mg_str frame;
+  int refcnt;
+  SLIST_ENTRY(mg_rpc_queued_dst) queued_dsts;
+};
+
+/* Broadcast frame, formatted once and shared by all the channels. */
+struct mg_rpc_shared_frame {
+  struct mbuf frame; /* No headroom, channels can't take it over. */
+  int refcnt;
+};
+
+struct mg_rpc_queue_entry {
+  struct mg_rpc_queued_dst *dst; /* NULL if empty. */
+  struct mbuf frame;             /* Starts with the channel headroom. */
+  struct mg_rpc_shared_frame *shared; /* Instead of frame, for broadcasts. */
   /*
-   * If this item has been assigned to a particular channel, use it.
-   * Otherwise perform lookup by dst.
+   * Channel this entry is queued on, NULL if it's on the mg_rpc queue and
+   * is waiting for a route to dst to appear.
    */
   struct mg_rpc_channel_info_internal *ci;
+  /*
+   * Id of the frame, 0 if it has none or is an array. Responses are never
+   * evicted, so it is only looked up for our own calls.
+   */
+  int64_t id;
+  /*
+   * Channel was chosen by dst rather than requested explicitly, so if it
+   * goes away the entry can be routed again.
+   */
+  unsigned int by_dst : 1;
+  /* Sent between mg_rpc_batch_begin and commit, will be coalesced. */
+  unsigned int in_batch : 1;
+  /*
+   * Frames of a batch coalesced into an array. Not evicted: the calls in
+   * it would be lost without their callers knowing.
+   */
+  unsigned int is_array : 1;
+  unsigned int prio : 2; /* enum mg_rpc_priority, never DEFAULT. */
   STAILQ_ENTRY(mg_rpc_queue_entry) queue;
 };
 
+struct mg_rpc_prehandler_info {
+  mg_prehandler_cb_t cb;
+  void *cb_arg;
+  SLIST_ENTRY(mg_rpc_prehandler_info) prehandlers;
+};
+
 struct mg_rpc_observer_info {
   mg_observer_cb_t cb;
   void *cb_arg;
   SLIST_ENTRY(mg_rpc_observer_info) observers;
 };
 
+#define MG_RPC_HTAB_MIN_SIZE 16
+
+/* FNV-1a */
+static uint32_t mg_rpc_hash(const struct mg_str s) {
+  uint32_t h = 2166136261U;
+  for (size_t i = 0; i < s.len; i++) {
+    h ^= (uint8_t) s.p[i];
+    h *= 16777619U;
+  }
+  return h;
+}
+
+static struct mg_rpc_handler_info **mg_rpc_htab_slot(
+    struct mg_rpc_handler_info **htab, size_t htab_size, uint32_t hash,
+    const struct mg_str method) {
+  size_t mask = htab_size - 1;
+  for (size_t i = (hash & mask);; i = (i + 1) & mask) {
+    struct mg_rpc_handler_info *hi = htab[i];
+    if (hi == NULL ||
+        (hi->method_hash == hash && hi->method_len == method.len &&
+         memcmp(hi->method, method.p, method.len) == 0)) {
+      return &htab[i];
+    }
+  }
+}
+
+static struct mg_rpc_handler_info *mg_rpc_find_handler(
+    struct mg_rpc *c, const struct mg_str method) {
+  if (c->htab_size == 0) return NULL;
+  return *mg_rpc_htab_slot(c->htab, c->htab_size, mg_rpc_hash(method), method);
+}
+
+static bool mg_rpc_htab_grow(struct mg_rpc *c) {
+  size_t new_size = (c->htab_size > 0 ? c->htab_size * 2 : MG_RPC_HTAB_MIN_SIZE);
+  struct mg_rpc_handler_info **new_htab =
+      (struct mg_rpc_handler_info **) calloc(new_size, sizeof(*new_htab));
+  if (new_htab == NULL) return false;
+  /* List head is the most recently added, so it wins for duplicate methods. */
+  struct mg_rpc_handler_info *hi;
+  SLIST_FOREACH(hi, &c->handlers, handlers) {
+    struct mg_rpc_handler_info **slot =
+        mg_rpc_htab_slot(new_htab, new_size, hi->method_hash,
+                         mg_mk_str_n(hi->method, hi->method_len));
+    if (*slot == NULL) *slot = hi;
+  }
+  free(c->htab);
+  c->htab = new_htab;
+  c->htab_size = new_size;
+  return true;
+}
+
 static int64_t mg_rpc_get_id(struct mg_rpc *c) {
   c->next_id += rand();
   return c->next_id;
@@ -100,6 +343,49 @@ static void mg_rpc_call_observers(struct mg_rpc *c, enum mg_rpc_event ev,
   }
 }
 
+static void mg_rpc_stats_add_latency(uint32_t *hist, double since) {
+  unsigned int ms = (unsigned int) ((mgos_uptime() - since) * 1000);
+  int i = 0;
+  while (ms > 0 && i < MG_RPC_STATS_NUM_BUCKETS - 1) {
+    ms >>= 1;
+    i++;
+  }
+  hist[i]++;
+}
+
+/*
+ * Types are static strings, so the pointer is compared first. Types that
+ * don't fit share the last slot.
+ */
+static struct mg_rpc_ch_type_stats *mg_rpc_stats_ch_type(
+    struct mg_rpc *c, struct mg_rpc_channel *ch) {
+  const char *type = ch->get_type(ch);
+  struct mg_rpc_ch_type_stats *cts = c->stats.ch_types;
+  int i;
+  for (i = 0; i < MG_RPC_STATS_NUM_CH_TYPES - 1; i++) {
+    if (cts[i].type == NULL) {
+      cts[i].type = type;
+      break;
+    }
+    if (cts[i].type == type || strcmp(cts[i].type, type) == 0) break;
+  }
+  return &cts[i];
+}
+
+/* One frame of len bytes (0 - passed parsed) went in or out. */
+static void mg_rpc_ci_count(struct mg_rpc_channel_info_internal *ci, bool out,
+                            size_t len) {
+  struct mg_rpc_channel_counters *cnt = &ci->counters;
+  if (out) {
+    cnt->frames_out++;
+    cnt->bytes_out += len;
+  } else {
+    cnt->frames_in++;
+    cnt->bytes_in += len;
+  }
+  cnt->last_activity = mgos_uptime();
+}
+
 static struct mg_rpc_channel_info_internal *mg_rpc_get_channel_info_internal(
     struct mg_rpc *c, const struct mg_rpc_channel *ch) {
   struct mg_rpc_channel_info_internal *ci;
@@ -123,100 +409,226 @@ static bool canonicalize_dst_uri(const struct mg_str sch,
                           uri) == 0);
 }
 
-static bool dst_is_equal(const struct mg_str d1, const struct mg_str d2) {
-  unsigned int port1, port2;
-  struct mg_str sch1, ui1, host1, path1, qs1, f1;
-  struct mg_str sch2, ui2, host2, path2, qs2, f2;
-  bool iu1, iu2, result = false;
-  iu1 = (mg_parse_uri(d1, &sch1, &ui1, &host1, &port1, &path1, &qs1, &f1) == 0);
-  iu2 = (mg_parse_uri(d2, &sch2, &ui2, &host2, &port2, &path2, &qs2, &f2) == 0);
-  if (!iu1 && !iu2) {
-    result = (mg_strcmp(d1, d2) == 0);
-  } else if (iu1 && iu2) {
-    struct mg_str u1, u2;
-    if (canonicalize_dst_uri(sch1, ui1, host1, port1, path1, qs1, &u1) &&
-        canonicalize_dst_uri(sch2, ui2, host2, port2, path2, qs2, &u2)) {
-      result = (mg_strcmp(u1, u2) == 0);
+/*
+ * Returns canonical form of a destination, which is what routing compares.
+ * URIs are re-assembled without the fragment and with normalized path.
+ * The result is heap-allocated.
+ */
+static struct mg_str mg_rpc_canonicalize_dst(const struct mg_str dst) {
+  unsigned int port = 0;
+  struct mg_str sch, ui, host, path, qs, f, res = MG_NULL_STR;
+  if (mg_parse_uri(dst, &sch, &ui, &host, &port, &path, &qs, &f) != 0 ||
+      !canonicalize_dst_uri(sch, ui, host, port, path, qs, &res)) {
+    free((void *) res.p);
+    res = mg_strdup(dst);
+  }
+  return res;
+}
+
+#define MG_RPC_DST_BUCKETS_MIN 8
+
+static bool mg_rpc_dst_buckets_grow(struct mg_rpc *c) {
+  size_t new_num = (c->num_dst_buckets > 0 ? c->num_dst_buckets * 2
+                                           : MG_RPC_DST_BUCKETS_MIN);
+  struct dst_index *new_buckets =
+      (struct dst_index *) calloc(new_num, sizeof(*new_buckets));
+  if (new_buckets == NULL) return false;
+  for (size_t i = 0; i < c->num_dst_buckets; i++) {
+    struct mg_rpc_channel_info_internal *ci;
+    while ((ci = SLIST_FIRST(&c->dst_buckets[i])) != NULL) {
+      SLIST_REMOVE_HEAD(&c->dst_buckets[i], dst_index);
+      SLIST_INSERT_HEAD(&new_buckets[ci->dst_hash & (new_num - 1)], ci,
+                        dst_index);
+    }
+  }
+  free(c->dst_buckets);
+  c->dst_buckets = new_buckets;
+  c->num_dst_buckets = new_num;
+  return true;
+}
+
+/* Adds channel to the routing index, if its dst is known. */
+static void mg_rpc_index_channel(struct mg_rpc *c,
+                                 struct mg_rpc_channel_info_internal *ci) {
+  if (ci->dst.len == 0 || ci->is_indexed) return;
+  if (mg_vcmp(&ci->dst, MG_RPC_DST_DEFAULT) == 0) {
+    if (c->default_ci == NULL) c->default_ci = ci;
+    return;
+  }
+  if (c->num_dst_channels >= c->num_dst_buckets &&
+      !mg_rpc_dst_buckets_grow(c) && c->num_dst_buckets == 0) {
+    return;
+  }
+  ci->canon_dst = mg_rpc_canonicalize_dst(ci->dst);
+  ci->dst_hash = mg_rpc_hash(ci->canon_dst);
+  SLIST_INSERT_HEAD(&c->dst_buckets[ci->dst_hash & (c->num_dst_buckets - 1)],
+                    ci, dst_index);
+  ci->is_indexed = true;
+  c->num_dst_channels++;
+}
+
+static void mg_rpc_unindex_channel(struct mg_rpc *c,
+                                   struct mg_rpc_channel_info_internal *ci) {
+  if (c->default_ci == ci) {
+    struct mg_rpc_channel_info_internal *cii;
+    c->default_ci = NULL;
+    /* Like before, the oldest default channel is preferred. */
+    SLIST_FOREACH(cii, &c->channels, channels) {
+      if (cii != ci && mg_vcmp(&cii->dst, MG_RPC_DST_DEFAULT) == 0) {
+        c->default_ci = cii;
+      }
+    }
+  }
+  if (ci->is_indexed) {
+    SLIST_REMOVE(&c->dst_buckets[ci->dst_hash & (c->num_dst_buckets - 1)], ci,
+                 mg_rpc_channel_info_internal, dst_index);
+    ci->is_indexed = false;
+    c->num_dst_channels--;
+  }
+  free((void *) ci->canon_dst.p);
+  ci->canon_dst = mg_mk_str(NULL);
+}
+
+static struct mg_rpc_channel_info_internal *mg_rpc_find_channel_by_dst(
+    struct mg_rpc *c, const struct mg_str canon_dst) {
+  struct mg_rpc_channel_info_internal *ci;
+  if (c->num_dst_buckets == 0) return NULL;
+  uint32_t h = mg_rpc_hash(canon_dst);
+  SLIST_FOREACH(ci, &c->dst_buckets[h & (c->num_dst_buckets - 1)],
+                dst_index) {
+    if (ci->dst_hash == h && mg_strcmp(ci->canon_dst, canon_dst) == 0) {
+      return ci;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Applies outbound channel parameters from the dst URI fragment
+ * ("#k1=v1&k2=v2"), in one pass over it.
+ */
+static void mg_rpc_parse_out_channel_params(
+    const struct mg_str fragment, struct mg_rpc_channel_ws_out_cfg *chcfg) {
+  char val_buf[MG_MAX_PATH];
+  const char *p = fragment.p, *end = fragment.p + fragment.len;
+  while (p < end) {
+    const char *amp = p;
+    while (amp < end && *amp != '&') amp++;
+    struct mg_str k = mg_mk_str_n(p, amp - p), v = MG_NULL_STR;
+    const char *eq = mg_strchr(k, '=');
+    p = amp + 1;
+    if (eq == NULL) continue;
+    v = mg_mk_str_n(eq + 1, k.p + k.len - (eq + 1));
+    k.len = eq - k.p;
+    if (mg_url_decode(v.p, v.len, val_buf, sizeof(val_buf),
+                      1 /* is_form_url_encoded */) <= 0) {
+      continue;
+    }
+    if (mg_vcmp(&k, "reconnect_interval_min") == 0) {
+      chcfg->reconnect_interval_min = atoi(val_buf);
+    } else if (mg_vcmp(&k, "reconnect_interval_max") == 0) {
+      chcfg->reconnect_interval_max = atoi(val_buf);
+    } else if (mg_vcmp(&k, "idle_close_timeout") == 0) {
+      chcfg->idle_close_timeout = atoi(val_buf);
+#if MG_ENABLE_SSL
+    } else if (mg_vcmp(&k, "ssl_ca_file") == 0) {
+      free((void *) chcfg->ssl_ca_file.p);
+      chcfg->ssl_ca_file = mg_strdup(mg_mk_str(val_buf));
+    } else if (mg_vcmp(&k, "ssl_client_cert_file") == 0) {
+      free((void *) chcfg->ssl_client_cert_file.p);
+      chcfg->ssl_client_cert_file = mg_strdup(mg_mk_str(val_buf));
+    } else if (mg_vcmp(&k, "ssl_server_name") == 0) {
+      free((void *) chcfg->ssl_server_name.p);
+      chcfg->ssl_server_name = mg_strdup(mg_mk_str(val_buf));
+#endif
     }
-    free((void *) u1.p);
-    free((void *) u2.p);
-  } else {
-    /* URI vs simple ID comparisons remain undefined for now. */
-    result = false;
   }
-  return result;
 }
 
 static struct mg_rpc_channel_info_internal *
 mg_rpc_get_channel_info_internal_by_dst(struct mg_rpc *c, struct mg_str *dst) {
   struct mg_rpc_channel_info_internal *ci;
-  struct mg_rpc_channel_info_internal *default_ch = NULL;
   if (c == NULL) return NULL;
   struct mg_str scheme, user_info, host, path, query, fragment;
   unsigned int port = 0;
-  bool is_uri =
-      (dst->len > 0 && (mg_parse_uri(*dst, &scheme, &user_info, &host, &port,
-                                     &path, &query, &fragment) == 0) &&
-       scheme.len > 0);
-  SLIST_FOREACH(ci, &c->channels, channels) {
+  /* Scheme is only present if there is "://" in the string. */
+  bool is_uri = (dst->len > 0 && mg_strstr(*dst, mg_mk_str("://")) != NULL);
+  if (dst->len == 0 || mg_vcmp(dst, MG_RPC_DST_DEFAULT) == 0) {
     /* For implied destinations we use default route. */
-    if (dst->len != 0 && dst_is_equal(*dst, ci->dst)) {
-      goto out;
+    ci = c->default_ci;
+    goto out;
+  }
+  /*
+   * Canonical form of a URI rarely differs from the original, except for the
+   * fragment, so try without parsing first.
+   */
+  struct mg_str key = *dst;
+  if (is_uri) {
+    const char *fp = mg_strchr(key, '#');
+    if (fp != NULL) key.len = fp - key.p;
+  }
+  ci = mg_rpc_find_channel_by_dst(c, key);
+  if (ci != NULL) goto out;
+  if (!is_uri) {
+    /*
+     * Scheme-less destinations like "host:port/path" still parse as URIs and
+     * are indexed in canonical form, so look that up before the default.
+     */
+    struct mg_str canon_dst = mg_rpc_canonicalize_dst(*dst);
+    if (mg_strcmp(canon_dst, key) != 0) {
+      ci = mg_rpc_find_channel_by_dst(c, canon_dst);
     }
-    if (mg_vcmp(&ci->dst, MG_RPC_DST_DEFAULT) == 0) default_ch = ci;
+    free((void *) canon_dst.p);
+    if (ci == NULL) ci = c->default_ci;
+    goto out;
   }
+  is_uri = (mg_parse_uri(*dst, &scheme, &user_info, &host, &port, &path,
+                         &query, &fragment) == 0 &&
+            scheme.len > 0);
   /* If destination is a URI, maybe it tells us to open an outgoing channel. */
   if (is_uri) {
     /* At the moment we treat HTTP channels like WS */
     if (mg_vcmp(&scheme, "ws") == 0 || mg_vcmp(&scheme, "wss") == 0 ||
         mg_vcmp(&scheme, "http") == 0 || mg_vcmp(&scheme, "https") == 0) {
-      char val_buf[MG_MAX_PATH];
       struct mg_rpc_channel_ws_out_cfg chcfg;
       memset(&chcfg, 0, sizeof(chcfg));
       struct mg_str canon_dst = MG_NULL_STR;
       canonicalize_dst_uri(scheme, user_info, host, port, path, query,
                            &canon_dst);
-      chcfg.server_address = canon_dst;
-#if MG_ENABLE_SSL
-      if (mg_get_http_var(&fragment, "ssl_ca_file", val_buf, sizeof(val_buf)) >
-          0) {
-        chcfg.ssl_ca_file = mg_strdup(mg_mk_str(val_buf));
-      }
-      if (mg_get_http_var(&fragment, "ssl_client_cert_file", val_buf,
-                          sizeof(val_buf)) > 0) {
-        chcfg.ssl_client_cert_file = mg_strdup(mg_mk_str(val_buf));
-      }
-      if (mg_get_http_var(&fragment, "ssl_server_name", val_buf,
-                          sizeof(val_buf)) > 0) {
-        chcfg.ssl_server_name = mg_strdup(mg_mk_str(val_buf));
-      }
-#endif
-      if (mg_get_http_var(&fragment, "reconnect_interval_min", val_buf,
-                          sizeof(val_buf)) > 0) {
-        chcfg.reconnect_interval_min = atoi(val_buf);
-      } else {
-        chcfg.reconnect_interval_min =
-            mgos_sys_config_get_rpc_ws_reconnect_interval_min();
+      ci = mg_rpc_find_channel_by_dst(c, canon_dst);
+      if (ci != NULL) {
+        free((void *) canon_dst.p);
+        goto out;
       }
-      if (mg_get_http_var(&fragment, "reconnect_interval_max", val_buf,
-                          sizeof(val_buf)) > 0) {
-        chcfg.reconnect_interval_max = atoi(val_buf);
-      } else {
-        chcfg.reconnect_interval_max =
-            mgos_sys_config_get_rpc_ws_reconnect_interval_max();
-      }
-      if (mg_get_http_var(&fragment, "idle_close_timeout", val_buf,
-                          sizeof(val_buf)) > 0) {
-        chcfg.idle_close_timeout = atoi(val_buf);
-      } else {
+      chcfg.server_address = canon_dst;
+      chcfg.reconnect_interval_min =
+          mgos_sys_config_get_rpc_ws_reconnect_interval_min();
+      chcfg.reconnect_interval_max =
+          mgos_sys_config_get_rpc_ws_reconnect_interval_max();
+      chcfg.idle_close_timeout = -1;
+      chcfg.timers = c->timers;
+      mg_rpc_parse_out_channel_params(fragment, &chcfg);
+      /* A few channels are kept around for longer, unless told otherwise. */
+      bool is_warm = false;
+      if (chcfg.idle_close_timeout < 0) {
         chcfg.idle_close_timeout =
             c->cfg->default_out_channel_idle_close_timeout;
+        if (chcfg.idle_close_timeout > 0 &&
+            c->num_warm_out_channels < c->cfg->max_warm_out_channels &&
+            c->cfg->out_channel_keep_warm_timeout >
+                chcfg.idle_close_timeout) {
+          chcfg.idle_close_timeout = c->cfg->out_channel_keep_warm_timeout;
+          is_warm = true;
+        }
       }
 
-      struct mg_rpc_channel *ch = mg_rpc_channel_ws_out(mgos_get_mgr(), &chcfg);
+      struct mg_rpc_channel *ch = mg_rpc_channel_ws_out(c->mgr, &chcfg);
       if (ch != NULL) {
+        /* Indexed right away, so later calls share it while it connects. */
         ci = mg_rpc_add_channel_internal(c, canon_dst, ch);
         if (ci != NULL) {
+          ci->is_warm = is_warm;
+          if (is_warm) c->num_warm_out_channels++;
           ch->ch_connect(ch);
         }
       } else {
@@ -236,7 +648,7 @@ mg_rpc_get_channel_info_internal_by_dst(struct mg_rpc *c, struct mg_str *dst) {
       ci = NULL;
     }
   } else {
-    ci = default_ch;
+    ci = c->default_ci;
   }
 out:
   LOG(LL_DEBUG, ("'%.*s' -> %p", (int) dst->len, dst->p, (ci ? ci->ch : NULL)));
@@ -250,24 +662,590 @@ out:
   return ci;
 }
 
-static bool mg_rpc_handle_request(struct mg_rpc *c,
-                                  struct mg_rpc_channel_info_internal *ci,
-                                  const struct mg_rpc_frame *frame) {
-  struct mg_rpc_request_info *ri =
-      (struct mg_rpc_request_info *) calloc(1, sizeof(*ri));
+#define MG_RPC_REQ_BUCKETS_MIN 16
+
+static size_t mg_rpc_req_bucket(size_t num_buckets, int64_t id) {
+  uint64_t h = (uint64_t) id;
+  h ^= (h >> 33);
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= (h >> 33);
+  return (size_t)(h & (num_buckets - 1));
+}
+
+static bool mg_rpc_req_buckets_grow(struct mg_rpc *c) {
+  size_t new_num = (c->num_req_buckets > 0 ? c->num_req_buckets * 2
+                                           : MG_RPC_REQ_BUCKETS_MIN);
+  struct requests *new_buckets =
+      (struct requests *) calloc(new_num, sizeof(*new_buckets));
+  if (new_buckets == NULL) return false;
+  for (size_t i = 0; i < c->num_req_buckets; i++) {
+    struct mg_rpc_sent_request_info *ri;
+    while ((ri = SLIST_FIRST(&c->req_buckets[i])) != NULL) {
+      SLIST_REMOVE_HEAD(&c->req_buckets[i], requests);
+      SLIST_INSERT_HEAD(&new_buckets[mg_rpc_req_bucket(new_num, ri->id)], ri,
+                        requests);
+    }
+  }
+  free(c->req_buckets);
+  c->req_buckets = new_buckets;
+  c->num_req_buckets = new_num;
+  return true;
+}
+
+static void mg_rpc_deadline_cb(void *arg);
+
+static bool mg_rpc_add_sent_request(struct mg_rpc *c,
+                                    struct mg_rpc_sent_request_info *ri) {
+  if (c->num_requests >= c->num_req_buckets * 2 &&
+      !mg_rpc_req_buckets_grow(c) && c->num_req_buckets == 0) {
+    return false;
+  }
+  ri->sent_at = mgos_uptime();
+  ri->c = c;
+  mg_rpc_timer_init(&ri->deadline_timer, c->timers, mg_rpc_deadline_cb, ri);
+  if (ri->deadline > 0) {
+    mg_rpc_timer_set(&ri->deadline_timer, ri->deadline - ri->sent_at);
+  }
+  SLIST_INSERT_HEAD(&c->req_buckets[mg_rpc_req_bucket(c->num_req_buckets,
+                                                      ri->id)],
+                    ri, requests);
+  c->num_requests++;
+  return true;
+}
+
+static struct mg_rpc_sent_request_info *mg_rpc_find_sent_request(
+    struct mg_rpc *c, int64_t id) {
+  struct mg_rpc_sent_request_info *ri;
+  if (c->num_req_buckets == 0) return NULL;
+  SLIST_FOREACH(ri, &c->req_buckets[mg_rpc_req_bucket(c->num_req_buckets, id)],
+                requests) {
+    if (ri->id == id) break;
+  }
+  return ri;
+}
+
+static struct mg_rpc_sent_request_info *mg_rpc_take_sent_request(
+    struct mg_rpc *c, int64_t id) {
+  struct mg_rpc_sent_request_info *ri = mg_rpc_find_sent_request(c, id);
+  if (ri == NULL) return NULL;
+  SLIST_REMOVE(&c->req_buckets[mg_rpc_req_bucket(c->num_req_buckets, id)], ri,
+               mg_rpc_sent_request_info, requests);
+  c->num_requests--;
+  mg_rpc_timer_clear(&ri->deadline_timer);
+  return ri;
+}
+
+static void mg_rpc_free_sent_request(struct mg_rpc_sent_request_info *ri) {
+  mbuf_free(&ri->result);
+  free(ri);
+}
+
+static void mg_rpc_deadline_cb(void *arg) {
+  struct mg_rpc_sent_request_info *ri =
+      (struct mg_rpc_sent_request_info *) arg;
+  struct mg_rpc *c = ri->c;
+  struct mg_rpc_frame_info fi;
+  mg_rpc_take_sent_request(c, ri->id);
+  memset(&fi, 0, sizeof(fi));
+  fi.channel_type = "";
+  LOG(LL_DEBUG, ("Request %lld timed out", (long long int) ri->id));
+  c->stats.calls_timed_out++;
+  ri->cb(c, ri->cb_arg, &fi, mg_mk_str(NULL), MG_RPC_ERR_TIMEOUT,
+         mg_mk_str("timed out"));
+  mg_rpc_free_sent_request(ri);
+}
+
+static bool mg_rpc_dispatch_mbuf(struct mg_rpc *c,
+                                 struct mg_rpc_channel_info_internal *ci,
+                                 bool by_dst, const struct mg_str dst,
+                                 bool enqueue, enum mg_rpc_priority prio,
+                                 int64_t id, struct mbuf *fb);
+static void mg_rpc_build_frame(struct mg_rpc *c, struct mbuf *fb,
+                               const struct mg_str src, const struct mg_str dst,
+                               int64_t id, const struct mg_str tag,
+                               const struct mg_str key,
+                               struct mg_str payload_prefix_json,
+                               const char *payload_jsonf, va_list ap);
+static void mg_rpc_build_framef(struct mg_rpc *c, struct mbuf *fb,
+                                const struct mg_str src,
+                                const struct mg_str dst, int64_t id,
+                                const struct mg_str tag,
+                                struct mg_str payload_prefix_json,
+                                const char *payload_jsonf, ...);
+
+/*
+ * Incoming batch, i.e. an array of frames. Responses to requests in it are
+ * collected and sent back as one array once all of them have been answered.
+ */
+struct mg_rpc_batch {
+  struct mg_rpc *c;
+  struct mg_rpc_channel *ch;
+  struct mbuf resp; /* Channel headroom, then responses so far. */
+  int num_responses;
+  /* Requests still without a response, +1 while the batch is being read. */
+  int refcnt;
+};
+
+static void mg_rpc_batch_unref(struct mg_rpc_batch *b) {
+  if (--b->refcnt > 0) return;
+  struct mg_rpc *c = b->c;
+  if (b->num_responses > 0) {
+    struct mg_rpc_channel_info_internal *ci =
+        mg_rpc_get_channel_info_internal(c, b->ch);
+    mbuf_append(&b->resp, "]", 1);
+    if (ci != NULL) {
+      mg_rpc_dispatch_mbuf(c, ci, false /* by_dst */, mg_mk_str(""),
+                           true /* enqueue */, MG_RPC_PRIO_HIGH, 0 /* id */,
+                           &b->resp);
+    } else {
+      LOG(LL_ERROR, ("%p Channel is gone, dropping %d batched responses",
+                     b->ch, b->num_responses));
+    }
+  }
+  mbuf_free(&b->resp);
+  memset(b, 0, sizeof(*b));
+  free(b);
+}
+
+static void mg_rpc_batch_add_response(struct mg_rpc_batch *b,
+                                      struct mg_rpc_request_info *ri,
+                                      struct mg_str payload_prefix_json,
+                                      const char *payload_jsonf, va_list ap) {
+  mbuf_append(&b->resp, (b->num_responses > 0 ? "," : "["), 1);
+  mg_rpc_build_frame(b->c, &b->resp, ri->dst, ri->src, ri->id, ri->tag,
+                     mg_mk_str(""), payload_prefix_json, payload_jsonf, ap);
+  b->num_responses++;
+}
+
+/*
+ * Info for an incoming request and copies of its strings are allocated as
+ * one block. Most requests fit in MG_RPC_REQ_BLOCK_SIZE, blocks of this size
+ * are kept on a free list for reuse.
+ */
+#define MG_RPC_REQ_BLOCK_SIZE 256
+#define MG_RPC_REQ_BLOCK_POOL_SIZE 4
+
+struct mg_rpc_batch;
+
+struct mg_rpc_req_block {
+  struct mg_rpc_request_info ri; /* Note: Has to be first */
+  size_t size;                   /* Size of the whole block. */
+  struct mg_rpc_batch *batch;    /* Batch the request came in, if any. */
+  struct mg_rpc_req_block *next_free;
+  /* Streamed response, see mg_rpc_send_response_begin. */
+  mg_rpc_stream_cb_t stream_cb;
+  void *stream_cb_arg;
+  unsigned int is_streaming : 1;
+  unsigned int stream_broken : 1; /* Channel closed mid-stream. */
+  uint32_t stream_notify_gen;     /* Last round it was notified in. */
+  SLIST_ENTRY(mg_rpc_req_block) streams;
+  /* Cache entry this request is the leader of, if any. */
+  struct mg_rpc_cache_entry *cache_entry;
+  /* Handler invoked for the request and when, for latency stats. */
+  struct mg_rpc_handler_info *hi;
+  double start;
+  SLIST_ENTRY(mg_rpc_req_block) cache_waiters;
+  /* Handler runs off the event loop, counted in hi->num_offloaded. */
+  unsigned int is_offloaded : 1;
+  unsigned int offload_response_back : 1; /* Response is in the loop now. */
+  char data[]; /* String data. */
+};
+
+/* Offloaded handler invocation, with copies of fi and args. */
+struct mg_rpc_offload_job {
+  struct mg_rpc_req_block *rb;
+  struct mg_rpc_handler_info *hi;
+  struct mg_rpc_frame_info fi;
+  struct mg_str args;
+  STAILQ_ENTRY(mg_rpc_offload_job) jobs;
+  char data[];
+};
+
+/* Response of an offloaded handler, on its way to the event loop. */
+struct mg_rpc_offload_response {
+  struct mg_rpc_request_info *ri;
+  struct mbuf payload;
+};
+
+static void mg_rpc_batch_ref(struct mg_rpc_req_block *rb,
+                             struct mg_rpc_batch *b) {
+  rb->batch = b;
+  b->refcnt++;
+}
+
+/* Copies s into the block at *pos. Empty strings take no space. */
+static struct mg_str mg_rpc_req_block_str(char **pos, const struct mg_str s) {
+  struct mg_str r = MG_NULL_STR;
+  if (s.len == 0) return r;
+  memcpy(*pos, s.p, s.len);
+  r.p = *pos;
+  r.len = s.len;
+  *pos += s.len;
+  return r;
+}
+
+static struct mg_rpc_request_info *mg_rpc_new_request_info(
+    struct mg_rpc *c, const struct mg_rpc_frame *frame) {
+  struct mg_rpc_req_block *b;
+  size_t size = sizeof(*b) + frame->src.len + frame->dst.len +
+                frame->tag.len + frame->auth.len + frame->method.len;
+  if (size <= MG_RPC_REQ_BLOCK_SIZE) {
+    size = MG_RPC_REQ_BLOCK_SIZE;
+    if (c->free_req_blocks != NULL) {
+      b = c->free_req_blocks;
+      c->free_req_blocks = b->next_free;
+      c->num_free_req_blocks--;
+    } else {
+      b = (struct mg_rpc_req_block *) malloc(size);
+    }
+  } else {
+    b = (struct mg_rpc_req_block *) malloc(size);
+  }
+  if (b == NULL) return NULL;
+  memset(b, 0, sizeof(*b));
+  b->size = size;
+  struct mg_rpc_request_info *ri = &b->ri;
+  char *pos = b->data;
   ri->rpc = c;
   ri->id = frame->id;
-  ri->src = mg_strdup(frame->src);
-  ri->dst = mg_strdup(frame->dst);
-  ri->tag = mg_strdup(frame->tag);
-  ri->auth = mg_strdup(frame->auth);
-  ri->method = mg_strdup(frame->method);
-  ri->ch = ci->ch;
+  ri->src = mg_rpc_req_block_str(&pos, frame->src);
+  ri->dst = mg_rpc_req_block_str(&pos, frame->dst);
+  ri->tag = mg_rpc_req_block_str(&pos, frame->tag);
+  ri->auth = mg_rpc_req_block_str(&pos, frame->auth);
+  ri->method = mg_rpc_req_block_str(&pos, frame->method);
+  return ri;
+}
 
-  struct mg_rpc_handler_info *hi;
-  SLIST_FOREACH(hi, &c->handlers, handlers) {
-    if (mg_vcmp(&ri->method, hi->method) == 0) break;
+static bool mg_rpc_dispatch_response(struct mg_rpc_request_info *ri,
+                                     struct mg_str payload_prefix_json,
+                                     const char *payload_jsonf, va_list ap);
+
+static void mg_rpc_cache_entry_free(struct mg_rpc_cache_entry *e) {
+  SLIST_REMOVE(&e->hi->cache, e, mg_rpc_cache_entry, entries);
+  e->hi->num_cache_entries--;
+  mbuf_free(&e->args);
+  mbuf_free(&e->result);
+  free(e);
+}
+
+/*
+ * Answers the request from the cache or collapses it into an identical call
+ * in progress. Returns false if the handler needs to be invoked, in which
+ * case the request becomes the leader of a new entry.
+ */
+static bool mg_rpc_cache_lookup(struct mg_rpc_handler_info *hi,
+                                struct mg_rpc_request_info *ri,
+                                const struct mg_str args) {
+  struct mg_rpc_req_block *rb = (struct mg_rpc_req_block *) ri;
+  struct mg_rpc_cache_entry *e, *te, *oldest = NULL;
+  double now = mgos_uptime();
+  SLIST_FOREACH_SAFE(e, &hi->cache, entries, te) {
+    bool in_progress = (e->leader != NULL);
+    if (!in_progress && e->expires <= now) {
+      mg_rpc_cache_entry_free(e);
+      continue;
+    }
+    if (mg_strcmp(mg_mk_str_n(e->args.buf, e->args.len), args) != 0) {
+      if (!in_progress && (oldest == NULL || e->expires < oldest->expires)) {
+        oldest = e;
+      }
+      continue;
+    }
+    if (in_progress) {
+      SLIST_INSERT_HEAD(&e->waiters, rb, cache_waiters);
+    } else {
+      va_list dummy;
+      memset(&dummy, 0, sizeof(dummy));
+      mg_rpc_dispatch_response(
+          ri, mg_mk_str_n(e->result.buf, e->result.len), NULL, dummy);
+    }
+    return true;
+  }
+  if (hi->num_cache_entries >= MG_RPC_CACHE_MAX_ENTRIES) {
+    /* All in progress, this one goes uncached. */
+    if (oldest == NULL) return false;
+    mg_rpc_cache_entry_free(oldest);
+  }
+  e = (struct mg_rpc_cache_entry *) calloc(1, sizeof(*e));
+  if (e == NULL) return false;
+  e->hi = hi;
+  mbuf_init(&e->args, args.len);
+  mbuf_append(&e->args, args.p, args.len);
+  mbuf_init(&e->result, 0);
+  SLIST_INIT(&e->waiters);
+  e->leader = rb;
+  rb->cache_entry = e;
+  SLIST_INSERT_HEAD(&hi->cache, e, entries);
+  hi->num_cache_entries++;
+  return false;
+}
+
+/* Leader's response is formatted once, cached and sent to all the waiters. */
+static bool mg_rpc_cache_complete(struct mg_rpc_request_info *ri,
+                                  struct mg_str payload_prefix_json,
+                                  const char *payload_jsonf, va_list ap) {
+  struct mg_rpc_req_block *rb = (struct mg_rpc_req_block *) ri, *w;
+  struct mg_rpc_cache_entry *e = rb->cache_entry;
+  struct json_out out = JSON_OUT_MBUF(&e->result);
+  va_list dummy;
+  memset(&dummy, 0, sizeof(dummy));
+  rb->cache_entry = NULL;
+  e->leader = NULL;
+  e->expires = mgos_uptime() + e->hi->cache_ttl_ms / 1000.0;
+  mbuf_append(&e->result, payload_prefix_json.p, payload_prefix_json.len);
+  if (payload_jsonf != NULL) json_vprintf(&out, payload_jsonf, ap);
+  const struct mg_str payload = mg_mk_str_n(e->result.buf, e->result.len);
+  /* Errors are passed on but not kept, the prefix tells them apart. */
+  bool is_result = (mg_strncmp(payload, mg_mk_str("\"result\""), 8) == 0);
+  bool res = mg_rpc_dispatch_response(ri, payload, NULL, dummy);
+  while ((w = SLIST_FIRST(&e->waiters)) != NULL) {
+    SLIST_REMOVE_HEAD(&e->waiters, cache_waiters);
+    mg_rpc_dispatch_response(&w->ri, payload, NULL, dummy);
   }
+  if (!is_result) mg_rpc_cache_entry_free(e);
+  return res;
+}
+
+static void mg_rpc_call_handler(const struct mg_rpc_handler_info *hi,
+                                struct mg_rpc_request_info *ri,
+                                struct mg_rpc_frame_info *fi,
+                                const struct mg_str args);
+
+static void mg_rpc_offload_run(void *arg) {
+  struct mg_rpc_offload_job *job = (struct mg_rpc_offload_job *) arg;
+  mg_rpc_call_handler(job->hi, &job->rb->ri, &job->fi, job->args);
+  free(job);
+}
+
+static bool mg_rpc_offload_start(struct mg_rpc *c,
+                                 struct mg_rpc_offload_job *job) {
+  struct mg_rpc_req_block *rb = job->rb;
+  bool ok;
+  job->hi->num_offloaded++;
+  c->num_offloaded++;
+  rb->is_offloaded = true;
+  ok = (c->offload_executor != NULL &&
+        c->offload_executor(mg_rpc_offload_run, job));
+  if (!ok) {
+    job->hi->num_offloaded--;
+    c->num_offloaded--;
+    rb->is_offloaded = false;
+    free(job);
+    mg_rpc_send_errorf(&rb->ri, MG_RPC_ERR_QUEUE_FULL,
+                       "Failed to offload the request");
+  }
+  return ok;
+}
+
+/* Starts queued requests whose methods are below their concurrency caps. */
+static void mg_rpc_offload_kick(struct mg_rpc *c) {
+  struct mg_rpc_offload_job *job, *tjob;
+  STAILQ_FOREACH_SAFE(job, &c->offload_queue, jobs, tjob) {
+    struct mg_rpc_handler_info *hi = job->hi;
+    if (hi->max_concurrency > 0 && hi->num_offloaded >= hi->max_concurrency) {
+      continue;
+    }
+    STAILQ_REMOVE(&c->offload_queue, job, mg_rpc_offload_job, jobs);
+    c->offload_queue_len--;
+    mg_rpc_offload_start(c, job);
+  }
+}
+
+/* Copies fi and args and runs the handler off the event loop, or queues it. */
+static void mg_rpc_offload(struct mg_rpc *c, struct mg_rpc_req_block *rb,
+                           struct mg_rpc_handler_info *hi,
+                           const struct mg_rpc_frame_info *fi,
+                           const struct mg_str args) {
+  bool must_wait =
+      (hi->max_concurrency > 0 && hi->num_offloaded >= hi->max_concurrency);
+  /* Whether they wait here or in the executor, all of them take memory. */
+  if (c->cfg->max_offload_queue_length > 0 &&
+      c->num_offloaded + c->offload_queue_len >=
+          c->cfg->max_offload_queue_length) {
+    mg_rpc_send_errorf(&rb->ri, MG_RPC_ERR_QUEUE_FULL,
+                       "Too many requests pending");
+    return;
+  }
+  struct mg_rpc_offload_job *job = (struct mg_rpc_offload_job *) calloc(
+      1, sizeof(*job) + args.len + fi->args_cbor.len);
+  if (job == NULL) {
+    mg_rpc_send_errorf(&rb->ri, MG_RPC_ERR_QUEUE_FULL, "Out of memory");
+    return;
+  }
+  job->rb = rb;
+  job->hi = hi;
+  job->fi = *fi;
+  memcpy(job->data, args.p, args.len);
+  job->args = mg_mk_str_n(job->data, args.len);
+  if (fi->args_cbor.len > 0) {
+    memcpy(job->data + args.len, fi->args_cbor.p, fi->args_cbor.len);
+    job->fi.args_cbor = mg_mk_str_n(job->data + args.len, fi->args_cbor.len);
+  }
+  if (must_wait) {
+    STAILQ_INSERT_TAIL(&c->offload_queue, job, jobs);
+    c->offload_queue_len++;
+    return;
+  }
+  mg_rpc_offload_start(c, job);
+}
+
+/* Response formatted off the event loop is sent from here. */
+static void mg_rpc_offload_response_cb(void *arg) {
+  struct mg_rpc_offload_response *r = (struct mg_rpc_offload_response *) arg;
+  struct mg_rpc_req_block *rb = (struct mg_rpc_req_block *) r->ri;
+  va_list dummy;
+  memset(&dummy, 0, sizeof(dummy));
+  rb->offload_response_back = true;
+  mg_rpc_dispatch_response(r->ri, mg_mk_str_n(r->payload.buf, r->payload.len),
+                           NULL, dummy);
+  mbuf_free(&r->payload);
+  free(r);
+}
+
+/* Called in the context of an offloaded handler. */
+static bool mg_rpc_offload_respond(struct mg_rpc_request_info *ri,
+                                   struct mg_str payload_prefix_json,
+                                   const char *payload_jsonf, va_list ap) {
+  struct mg_rpc_offload_response *r =
+      (struct mg_rpc_offload_response *) calloc(1, sizeof(*r));
+  if (r == NULL) return false;
+  struct json_out out = JSON_OUT_MBUF(&r->payload);
+  r->ri = ri;
+  mbuf_init(&r->payload, payload_prefix_json.len + 50);
+  mbuf_append(&r->payload, payload_prefix_json.p, payload_prefix_json.len);
+  if (payload_jsonf != NULL) json_vprintf(&out, payload_jsonf, ap);
+  if (!mgos_invoke_cb(mg_rpc_offload_response_cb, r, false /* from_isr */)) {
+    /* Nothing else can be done safely from here, request is lost. */
+    LOG(LL_ERROR,
+        ("Failed to pass on response to %lld", (long long int) ri->id));
+    mbuf_free(&r->payload);
+    free(r);
+    return false;
+  }
+  return true;
+}
+
+static void mg_rpc_invoke_handler(struct mg_rpc *c, struct mg_rpc_req_block *rb,
+                                  struct mg_rpc_handler_info *hi,
+                                  struct mg_rpc_frame_info *fi,
+                                  const struct mg_str args) {
+  rb->hi = hi;
+  rb->start = mgos_uptime();
+  /*
+   * Without an executor there is nowhere to offload to: deferring to the
+   * main task would still block the event loop, only later.
+   */
+  if (hi->offload && c->offload_executor != NULL) {
+    mg_rpc_offload(c, rb, hi, fi, args);
+  } else {
+    mg_rpc_call_handler(hi, &rb->ri, fi, args);
+  }
+}
+
+/* Leader went away without a response, the next waiter takes over. */
+static void mg_rpc_cache_abandon(struct mg_rpc *c,
+                                 struct mg_rpc_cache_entry *e) {
+  struct mg_rpc_handler_info *hi = e->hi;
+  struct mg_rpc_req_block *w;
+  while ((w = SLIST_FIRST(&e->waiters)) != NULL) {
+    SLIST_REMOVE_HEAD(&e->waiters, cache_waiters);
+    struct mg_rpc_channel_info_internal *ci =
+        mg_rpc_get_channel_info_internal(c, w->ri.ch);
+    if (ci == NULL) {
+      /* Channel is gone, nowhere to send the response to. */
+      mg_rpc_free_request_info(&w->ri);
+      continue;
+    }
+    struct mg_rpc_frame_info fi;
+    memset(&fi, 0, sizeof(fi));
+    fi.channel_type = ci->ch->get_type(ci->ch);
+    e->leader = w;
+    w->cache_entry = e;
+    mg_rpc_invoke_handler(c, w, hi, &fi,
+                          mg_mk_str_n(e->args.buf, e->args.len));
+    return;
+  }
+  mg_rpc_cache_entry_free(e);
+}
+
+/*
+ * Takes a token from the bucket, which holds up to burst (rate if 0) tokens
+ * and gains rate tokens per second.
+ */
+static bool mg_rpc_rate_limiter_take(struct mg_rpc_rate_limiter *rl, int rate,
+                                     int burst, double now) {
+  if (rate <= 0) return true;
+  if (burst <= 0) burst = rate;
+  if (rl->last == 0) {
+    rl->tokens = burst;
+  } else {
+    rl->tokens += (now - rl->last) * rate;
+    if (rl->tokens > burst) rl->tokens = burst;
+  }
+  rl->last = now;
+  if (rl->tokens < 1) return false;
+  rl->tokens -= 1;
+  return true;
+}
+
+/*
+ * Rejects the request with 429. Done before request info is created, the
+ * response is built straight from the frame unless it came in a batch.
+ */
+static void mg_rpc_send_too_many_requests(
+    struct mg_rpc *c, struct mg_rpc_channel_info_internal *ci,
+    const struct mg_rpc_frame *frame, struct mg_rpc_batch *batch) {
+  c->stats.rate_limited++;
+  LOG(LL_DEBUG, ("%p RATE LIMITED %.*s", ci->ch, (int) frame->method.len,
+                 frame->method.p));
+  if (batch != NULL) {
+    struct mg_rpc_request_info *ri = mg_rpc_new_request_info(c, frame);
+    if (ri == NULL) return;
+    ri->ch = ci->ch;
+    mg_rpc_batch_ref((struct mg_rpc_req_block *) ri, batch);
+    mg_rpc_send_errorf(ri, MG_RPC_ERR_TOO_MANY_REQUESTS, "Too many requests");
+    return;
+  }
+  struct mbuf fb, prefb;
+  struct json_out prefbout = JSON_OUT_MBUF(&prefb);
+  mbuf_init(&prefb, 50);
+  json_printf(&prefbout, "error:{code:%d,message:%Q}",
+              MG_RPC_ERR_TOO_MANY_REQUESTS, "Too many requests");
+  mbuf_init(&fb, prefb.len + 100);
+  fb.len = MG_RPC_CHANNEL_FRAME_HEADROOM;
+  mg_rpc_build_framef(c, &fb, frame->dst, frame->src, frame->id, frame->tag,
+                      mg_mk_str_n(prefb.buf, prefb.len), NULL);
+  mbuf_free(&prefb);
+  mg_rpc_dispatch_mbuf(c, ci, false /* by_dst */, mg_mk_str(""),
+                       true /* enqueue */, MG_RPC_PRIO_HIGH, frame->id, &fb);
+}
+
+static bool mg_rpc_handle_request(struct mg_rpc *c,
+                                  struct mg_rpc_channel_info_internal *ci,
+                                  const struct mg_rpc_frame *frame,
+                                  struct mg_rpc_batch *batch) {
+  /*
+   * Checked first, so that a flood costs as little as possible. The channel
+   * bucket is taken for unknown methods too, they'd still cost a 404.
+   */
+  double now = mgos_uptime();
+  struct mg_rpc_handler_info *hi = mg_rpc_find_handler(c, frame->method);
+  if (!mg_rpc_rate_limiter_take(&ci->rl, c->cfg->rate_limit,
+                                c->cfg->rate_burst, now) ||
+      (hi != NULL && !mg_rpc_rate_limiter_take(&hi->rl, hi->rate_limit,
+                                               hi->rate_burst, now))) {
+    mg_rpc_send_too_many_requests(c, ci, frame, batch);
+    return true;
+  }
+  struct mg_rpc_request_info *ri = mg_rpc_new_request_info(c, frame);
+  if (ri == NULL) {
+    LOG(LL_ERROR, ("Out of memory, dropping request %lld",
+                   (long long int) frame->id));
+    return true;
+  }
+  ri->ch = ci->ch;
+  if (batch != NULL) mg_rpc_batch_ref((struct mg_rpc_req_block *) ri, batch);
+
   if (hi == NULL) {
     LOG(LL_ERROR,
         ("No handler for %.*s", (int) frame->method.len, frame->method.p));
@@ -279,99 +1257,517 @@ static bool mg_rpc_handle_request(struct mg_rpc *c,
   struct mg_rpc_frame_info fi;
   memset(&fi, 0, sizeof(fi));
   fi.channel_type = ci->ch->get_type(ci->ch);
+  fi.args_cbor = frame->args_cbor;
   ri->args_fmt = hi->args_fmt;
 
   bool ok = true;
+  struct mg_rpc_prehandler_info *pi;
+  SLIST_FOREACH(pi, &c->prehandlers, prehandlers) {
+    ok = pi->cb(ri, pi->cb_arg, &fi, frame->args);
+    if (!ok) break;
+  }
+
+  if (ok && hi->cache_ttl_ms > 0 && mg_rpc_cache_lookup(hi, ri, frame->args)) {
+    ok = false; /* Answered from the cache or collapsed. */
+  }
+
+  if (ok) {
+    mg_rpc_invoke_handler(c, (struct mg_rpc_req_block *) ri, hi, &fi,
+                          frame->args);
+  }
+
+  return true;
+}
+
+static bool mg_rpc_handle_response(struct mg_rpc *c,
+                                   struct mg_rpc_channel_info_internal *ci,
+                                   int64_t id, struct mg_str result,
+                                   int error_code, struct mg_str error_msg) {
+  if (id == 0) {
+    LOG(LL_ERROR, ("Response without an ID"));
+    return false;
+  }
+
+  struct mg_rpc_sent_request_info *ri = mg_rpc_take_sent_request(c, id);
+  if (ri == NULL) {
+    /*
+     * Response to a request we did not send.
+     * Or (more likely) we did not request a response at all, so be quiet.
+     */
+    return true;
+  }
+  mg_rpc_stats_add_latency(c->stats.call_latency, ri->sent_at);
+  struct mg_rpc_frame_info fi;
+  memset(&fi, 0, sizeof(fi));
+  fi.channel_type = ci->ch->get_type(ci->ch);
+  ri->cb(c, ri->cb_arg, &fi, mg_mk_str_n(result.p, result.len), error_code,
+         mg_mk_str_n(error_msg.p, error_msg.len));
+  mg_rpc_free_sent_request(ri);
+  return true;
+}
+
+/* Part of a streamed response, result is collected until the last chunk. */
+static bool mg_rpc_handle_response_chunk(
+    struct mg_rpc *c, struct mg_rpc_channel_info_internal *ci,
+    const struct mg_rpc_frame *frame) {
+  if (frame->id == 0) {
+    LOG(LL_ERROR, ("Response without an ID"));
+    return false;
+  }
+  struct mg_rpc_sent_request_info *ri = mg_rpc_find_sent_request(c, frame->id);
+  if (ri == NULL) return true;
+  size_t max_size = (c->cfg->max_stream_result_size > 0
+                         ? (size_t) c->cfg->max_stream_result_size
+                         : 0);
+  bool too_big = false;
+  if (frame->chunk.len > 0) {
+    /* Unescaped chunk is never longer than the escaped one. */
+    size_t len = ri->result.len;
+    mbuf_resize(&ri->result, len + frame->chunk.len);
+    int n = json_unescape(frame->chunk.p, frame->chunk.len,
+                          ri->result.buf + len, frame->chunk.len);
+    if (n < 0) return false;
+    ri->result.len += n;
+    too_big = (max_size > 0 && ri->result.len > max_size);
+  }
+  if (!frame->last_chunk && !too_big) return true;
+  /* Call is done either way, the rest of the chunks will be ignored. */
+  ri = mg_rpc_take_sent_request(c, frame->id);
+  mg_rpc_stats_add_latency(c->stats.call_latency, ri->sent_at);
+  struct mg_rpc_frame_info fi;
+  memset(&fi, 0, sizeof(fi));
+  fi.channel_type = ci->ch->get_type(ci->ch);
+  if (too_big) {
+    LOG(LL_ERROR, ("Streamed result of %lld is too big (> %d)",
+                   (long long int) ri->id, (int) max_size));
+    ri->cb(c, ri->cb_arg, &fi, mg_mk_str(NULL), MG_RPC_ERR_RESULT_TOO_BIG,
+           mg_mk_str("result too big"));
+  } else {
+    ri->cb(c, ri->cb_arg, &fi, mg_mk_str_n(ri->result.buf, ri->result.len),
+           0, mg_mk_str(NULL));
+  }
+  mg_rpc_free_sent_request(ri);
+  return true;
+}
+
+/*
+ * Minimal JSON scanner for RPC envelopes. Walks object members in one pass,
+ * nested objects and arrays are skipped over without being parsed.
+ * Like frozen, accepts both quoted and bare keys.
+ */
+struct mg_rpc_json_scanner {
+  const char *p, *end;
+};
+
+enum mg_rpc_json_type {
+  MG_RPC_JSON_STRING,
+  MG_RPC_JSON_OBJECT,
+  MG_RPC_JSON_ARRAY,
+  MG_RPC_JSON_OTHER, /* Number, true, false, null. */
+};
 
-  if (c->prehandler != NULL) {
-    ok = c->prehandler(ri, c->prehandler_arg, &fi, frame->args);
+static bool mg_rpc_json_is_space(char ch) {
+  return (ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n');
+}
+
+static void mg_rpc_json_skip_ws(struct mg_rpc_json_scanner *s) {
+  while (s->p < s->end && mg_rpc_json_is_space(*s->p)) s->p++;
+}
+
+/* Scans a string starting at the opening quote. Contents are not unescaped. */
+static bool mg_rpc_json_scan_string(struct mg_rpc_json_scanner *s,
+                                    struct mg_str *v) {
+  const char *start = ++s->p;
+  while (s->p < s->end && *s->p != '"') {
+    if (*s->p == '\\') s->p++;
+    s->p++;
+  }
+  if (s->p >= s->end) return false;
+  *v = mg_mk_str_n(start, s->p - start);
+  s->p++;
+  return true;
+}
+
+/* Scans a value of any type. Strings are returned without quotes. */
+static bool mg_rpc_json_scan_value(struct mg_rpc_json_scanner *s,
+                                   struct mg_str *v,
+                                   enum mg_rpc_json_type *t) {
+  mg_rpc_json_skip_ws(s);
+  if (s->p >= s->end) return false;
+  const char *start = s->p;
+  char ch = *s->p;
+  if (ch == '"') {
+    *t = MG_RPC_JSON_STRING;
+    return mg_rpc_json_scan_string(s, v);
+  }
+  if (ch == '{' || ch == '[') {
+    int depth = 0;
+    struct mg_str sv;
+    *t = (ch == '{' ? MG_RPC_JSON_OBJECT : MG_RPC_JSON_ARRAY);
+    while (s->p < s->end) {
+      ch = *s->p;
+      if (ch == '"') {
+        if (!mg_rpc_json_scan_string(s, &sv)) return false;
+        continue;
+      }
+      s->p++;
+      if (ch == '{' || ch == '[') {
+        depth++;
+      } else if (ch == '}' || ch == ']') {
+        if (--depth == 0) break;
+      }
+    }
+    if (depth != 0) return false;
+  } else {
+    *t = MG_RPC_JSON_OTHER;
+    while (s->p < s->end && !mg_rpc_json_is_space(*s->p) && *s->p != ',' &&
+           *s->p != '}' && *s->p != ']') {
+      s->p++;
+    }
+    if (s->p == start) return false;
+  }
+  *v = mg_mk_str_n(start, s->p - start);
+  return true;
+}
+
+static bool mg_rpc_json_begin_object(struct mg_rpc_json_scanner *s,
+                                     const struct mg_str obj) {
+  s->p = obj.p;
+  s->end = obj.p + obj.len;
+  mg_rpc_json_skip_ws(s);
+  if (s->p >= s->end || *s->p != '{') return false;
+  s->p++;
+  return true;
+}
+
+/*
+ * Fetches the next member of an object opened with mg_rpc_json_begin_object.
+ * Returns 1 if there is one, 0 at the end of the object and -1 on error.
+ */
+static int mg_rpc_json_next_member(struct mg_rpc_json_scanner *s,
+                                   struct mg_str *key, struct mg_str *v,
+                                   enum mg_rpc_json_type *t) {
+  mg_rpc_json_skip_ws(s);
+  if (s->p < s->end && *s->p == ',') {
+    s->p++;
+    mg_rpc_json_skip_ws(s);
+  }
+  if (s->p >= s->end) return -1;
+  if (*s->p == '}') {
+    s->p++;
+    return 0;
+  }
+  if (*s->p == '"') {
+    if (!mg_rpc_json_scan_string(s, key)) return -1;
+  } else {
+    const char *start = s->p;
+    while (s->p < s->end && (isalnum((unsigned char) *s->p) || *s->p == '_')) {
+      s->p++;
+    }
+    if (s->p == start) return -1;
+    *key = mg_mk_str_n(start, s->p - start);
+  }
+  mg_rpc_json_skip_ws(s);
+  if (s->p >= s->end || *s->p != ':') return -1;
+  s->p++;
+  return (mg_rpc_json_scan_value(s, v, t) ? 1 : -1);
+}
+
+/* Same as mg_rpc_json_next_member, for arrays. */
+static int mg_rpc_json_next_element(struct mg_rpc_json_scanner *s,
+                                    struct mg_str *v,
+                                    enum mg_rpc_json_type *t) {
+  mg_rpc_json_skip_ws(s);
+  if (s->p < s->end && *s->p == ',') {
+    s->p++;
+    mg_rpc_json_skip_ws(s);
+  }
+  if (s->p >= s->end) return -1;
+  if (*s->p == ']') {
+    s->p++;
+    return 0;
+  }
+  return (mg_rpc_json_scan_value(s, v, t) ? 1 : -1);
+}
+
+static int64_t mg_rpc_json_int64(const struct mg_str v) {
+  char buf[24];
+  if (v.len == 0 || v.len >= sizeof(buf)) return 0;
+  memcpy(buf, v.p, v.len);
+  buf[v.len] = '\0';
+  return strtoll(buf, NULL, 10);
+}
+
+static const char *mg_rpc_arg_type_name(enum mg_rpc_arg_type t) {
+  switch (t) {
+    case MG_RPC_ARG_INT:
+      return "int";
+    case MG_RPC_ARG_UINT:
+      return "uint";
+    case MG_RPC_ARG_LONG:
+      return "long";
+    case MG_RPC_ARG_INT64:
+      return "int64";
+    case MG_RPC_ARG_FLOAT:
+      return "float";
+    case MG_RPC_ARG_DOUBLE:
+      return "double";
+    case MG_RPC_ARG_BOOL:
+      return "bool";
+    case MG_RPC_ARG_STRING:
+      return "string";
+  }
+  return "";
+}
+
+/*
+ * Compiles args_fmt of hi, if it is a flat object of scalar fields, e.g.
+ * "{delay_ms: %d, name: %Q}". Anything else is left to json_scanf.
+ */
+static void mg_rpc_compile_args_fmt(struct mg_rpc_handler_info *hi) {
+  static const struct {
+    const char *spec;
+    enum mg_rpc_arg_type type;
+  } specs[] = {
+      {"lld", MG_RPC_ARG_INT64}, {"ld", MG_RPC_ARG_LONG},
+      {"lf", MG_RPC_ARG_DOUBLE}, {"d", MG_RPC_ARG_INT},
+      {"u", MG_RPC_ARG_UINT},    {"f", MG_RPC_ARG_FLOAT},
+      {"B", MG_RPC_ARG_BOOL},    {"Q", MG_RPC_ARG_STRING},
+  };
+  struct mg_rpc_arg_field fields[MG_RPC_MAX_ARGS];
+  int n = 0;
+  if (hi->args_fmt == NULL) return;
+  struct mg_rpc_json_scanner s;
+  if (!mg_rpc_json_begin_object(&s, mg_mk_str(hi->args_fmt))) return;
+  while (true) {
+    struct mg_rpc_arg_field *f = &fields[n];
+    size_t i;
+    mg_rpc_json_skip_ws(&s);
+    if (s.p < s.end && *s.p == '}' && n == 0) break;
+    if (n == MG_RPC_MAX_ARGS) return;
+    if (s.p < s.end && *s.p == '"') {
+      if (!mg_rpc_json_scan_string(&s, &f->name)) return;
+    } else {
+      const char *start = s.p;
+      while (s.p < s.end && (isalnum((unsigned char) *s.p) || *s.p == '_')) {
+        s.p++;
+      }
+      f->name = mg_mk_str_n(start, s.p - start);
+    }
+    mg_rpc_json_skip_ws(&s);
+    if (f->name.len == 0 || s.p >= s.end || *s.p++ != ':') return;
+    mg_rpc_json_skip_ws(&s);
+    if (s.p >= s.end || *s.p++ != '%') return;
+    for (i = 0; i < sizeof(specs) / sizeof(specs[0]); i++) {
+      size_t len = strlen(specs[i].spec);
+      if ((size_t)(s.end - s.p) >= len &&
+          strncmp(s.p, specs[i].spec, len) == 0) {
+        f->type = specs[i].type;
+        s.p += len;
+        break;
+      }
+    }
+    if (i == sizeof(specs) / sizeof(specs[0])) return;
+    f->offset = (hi->args_offsets != NULL ? hi->args_offsets[n] : 0);
+    n++;
+    mg_rpc_json_skip_ws(&s);
+    if (s.p < s.end && *s.p == ',') {
+      s.p++;
+      continue;
+    }
+    if (s.p >= s.end || *s.p != '}') return;
+    break;
   }
+  if (n == 0) return;
+  hi->args = (struct mg_rpc_arg_field *) calloc(n, sizeof(*hi->args));
+  if (hi->args == NULL) return;
+  memcpy(hi->args, fields, n * sizeof(*hi->args));
+  hi->num_args = n;
+}
 
-  if (ok) {
-    hi->cb(ri, hi->cb_arg, &fi, frame->args);
+static void mg_rpc_free_args_struct(const struct mg_rpc_handler_info *hi,
+                                    struct mg_rpc_frame_info *fi) {
+  for (int i = 0; i < hi->num_args; i++) {
+    if (hi->args[i].type != MG_RPC_ARG_STRING) continue;
+    if (!(fi->args_present & (1UL << i))) continue;
+    free(*(char **) ((char *) fi->args_struct + hi->args[i].offset));
   }
+  free(fi->args_struct);
+  fi->args_struct = NULL;
+}
 
-  return true;
+/* Stores v into the struct as field f. Returns false if v does not fit. */
+static bool mg_rpc_decode_arg(const struct mg_rpc_arg_field *f, void *as,
+                              const struct mg_str v,
+                              enum mg_rpc_json_type t) {
+  char buf[32], *end;
+  void *dst = (char *) as + f->offset;
+  if (f->type == MG_RPC_ARG_STRING) {
+    if (t != MG_RPC_JSON_STRING) return false;
+    char *str = (char *) malloc(v.len + 1);
+    int len = (str != NULL ? json_unescape(v.p, v.len, str, v.len) : -1);
+    if (len < 0) {
+      free(str);
+      return false;
+    }
+    str[len] = '\0';
+    *(char **) dst = str;
+    return true;
+  }
+  if (f->type == MG_RPC_ARG_BOOL) {
+    if (mg_vcmp(&v, "true") != 0 && mg_vcmp(&v, "false") != 0) return false;
+    *(bool *) dst = (v.p[0] == 't');
+    return true;
+  }
+  if (t != MG_RPC_JSON_OTHER || v.len >= sizeof(buf)) return false;
+  memcpy(buf, v.p, v.len);
+  buf[v.len] = '\0';
+  switch (f->type) {
+    case MG_RPC_ARG_FLOAT:
+      *(float *) dst = strtof(buf, &end);
+      break;
+    case MG_RPC_ARG_DOUBLE:
+      *(double *) dst = strtod(buf, &end);
+      break;
+    case MG_RPC_ARG_UINT:
+      if (buf[0] == '-') return false;
+      *(unsigned int *) dst = (unsigned int) strtoul(buf, &end, 10);
+      break;
+    case MG_RPC_ARG_INT:
+      *(int *) dst = (int) strtol(buf, &end, 10);
+      break;
+    case MG_RPC_ARG_LONG:
+      *(long *) dst = strtol(buf, &end, 10);
+      break;
+    default:
+      *(int64_t *) dst = strtoll(buf, &end, 10);
+      break;
+  }
+  return (end == buf + v.len);
 }
 
-static bool mg_rpc_handle_response(struct mg_rpc *c,
-                                   struct mg_rpc_channel_info_internal *ci,
-                                   int64_t id, struct mg_str result,
-                                   int error_code, struct mg_str error_msg) {
-  if (id == 0) {
-    LOG(LL_ERROR, ("Response without an ID"));
+/*
+ * Decodes args into a new struct in fi, in one pass. Unknown members are
+ * ignored, as with json_scanf. On error responds with 400 and returns false.
+ */
+static bool mg_rpc_decode_args(const struct mg_rpc_handler_info *hi,
+                               struct mg_rpc_request_info *ri,
+                               struct mg_rpc_frame_info *fi,
+                               const struct mg_str args) {
+  struct mg_rpc_json_scanner s;
+  struct mg_str k, v;
+  enum mg_rpc_json_type t;
+  int res = 0;
+  fi->args_present = 0;
+  fi->args_struct = calloc(1, hi->args_size);
+  if (fi->args_struct == NULL) {
+    mg_rpc_send_errorf(ri, 500, "Out of memory");
     return false;
   }
-
-  struct mg_rpc_sent_request_info *ri;
-  SLIST_FOREACH(ri, &c->requests, requests) {
-    if (ri->id == id) break;
+  if (mg_strstrip(args).len == 0) return true;
+  if (!mg_rpc_json_begin_object(&s, args)) {
+    mg_rpc_free_args_struct(hi, fi);
+    mg_rpc_send_errorf(ri, 400, "Invalid args");
+    return false;
   }
-  if (ri == NULL) {
-    /*
-     * Response to a request we did not send.
-     * Or (more likely) we did not request a response at all, so be quiet.
-     */
-    return true;
+  while ((res = mg_rpc_json_next_member(&s, &k, &v, &t)) > 0) {
+    if (t == MG_RPC_JSON_OTHER && mg_vcmp(&v, "null") == 0) continue;
+    for (int i = 0; i < hi->num_args; i++) {
+      const struct mg_rpc_arg_field *f = &hi->args[i];
+      if (mg_strcmp(k, f->name) != 0 || (fi->args_present & (1UL << i))) {
+        continue;
+      }
+      if (!mg_rpc_decode_arg(f, fi->args_struct, v, t)) {
+        mg_rpc_free_args_struct(hi, fi);
+        mg_rpc_send_errorf(ri, 400, "Invalid value for %.*s",
+                           (int) f->name.len, f->name.p);
+        return false;
+      }
+      fi->args_present |= (1UL << i);
+      break;
+    }
+  }
+  if (res < 0) {
+    mg_rpc_free_args_struct(hi, fi);
+    mg_rpc_send_errorf(ri, 400, "Invalid args");
+    return false;
   }
-  SLIST_REMOVE(&c->requests, ri, mg_rpc_sent_request_info, requests);
-  struct mg_rpc_frame_info fi;
-  memset(&fi, 0, sizeof(fi));
-  fi.channel_type = ci->ch->get_type(ci->ch);
-  ri->cb(c, ri->cb_arg, &fi, mg_mk_str_n(result.p, result.len), error_code,
-         mg_mk_str_n(error_msg.p, error_msg.len));
-  free(ri);
   return true;
 }
 
-bool mg_rpc_parse_frame(const struct mg_str f, struct mg_rpc_frame *frame) {
-  memset(frame, 0, sizeof(*frame));
-
-  struct json_token src, dst, tag;
-  struct json_token method, args;
-  struct json_token result, error_msg;
-  struct json_token auth;
-  memset(&src, 0, sizeof(src));
-  memset(&dst, 0, sizeof(dst));
-  memset(&tag, 0, sizeof(tag));
-  memset(&method, 0, sizeof(method));
-  memset(&args, 0, sizeof(args));
-  memset(&result, 0, sizeof(result));
-  memset(&error_msg, 0, sizeof(error_msg));
-  memset(&auth, 0, sizeof(auth));
-
-  if (json_scanf(f.p, f.len,
-                 "{v:%d id:%lld src:%T dst:%T tag:%T"
-                 "method:%T args:%T "
-                 "auth:%T "
-                 "result:%T error:{code:%d message:%T}}",
-                 &frame->version, &frame->id, &src, &dst, &tag, &method, &args,
-                 &auth, &result, &frame->error_code, &error_msg) < 1) {
-    return false;
+/* Decodes args if the handler wants that, then invokes it. */
+static void mg_rpc_call_handler(const struct mg_rpc_handler_info *hi,
+                                struct mg_rpc_request_info *ri,
+                                struct mg_rpc_frame_info *fi,
+                                const struct mg_str args) {
+  if (hi->args == NULL || hi->args_offsets == NULL) {
+    hi->cb(ri, hi->cb_arg, fi, args);
+    return;
   }
+  if (!mg_rpc_decode_args(hi, ri, fi, args)) return;
+  hi->cb(ri, hi->cb_arg, fi, args);
+  mg_rpc_free_args_struct(hi, fi);
+}
 
-  /*
-   * Frozen returns string values without quotes, but we want quotes here, so
-   * if the result is a string, "widen" it so that quotes are included.
-   */
-  if (result.type == JSON_TYPE_STRING) {
-    result.ptr--;
-    result.len += 2;
-  }
+bool mg_rpc_parse_frame(const struct mg_str f, struct mg_rpc_frame *frame) {
+  struct mg_rpc_json_scanner s, es;
+  struct mg_str k, v;
+  enum mg_rpc_json_type t;
+  int res, num_fields = 0;
 
-  frame->src = mg_mk_str_n(src.ptr, src.len);
-  frame->dst = mg_mk_str_n(dst.ptr, dst.len);
-  frame->tag = mg_mk_str_n(tag.ptr, tag.len);
-  frame->method = mg_mk_str_n(method.ptr, method.len);
-  frame->args = mg_mk_str_n(args.ptr, args.len);
-  frame->result = mg_mk_str_n(result.ptr, result.len);
-  frame->error_msg = mg_mk_str_n(error_msg.ptr, error_msg.len);
-  frame->auth = mg_mk_str_n(auth.ptr, auth.len);
+  memset(frame, 0, sizeof(*frame));
+  if (!mg_rpc_json_begin_object(&s, f)) return false;
+
+  while ((res = mg_rpc_json_next_member(&s, &k, &v, &t)) > 0) {
+    num_fields++;
+    if (mg_vcmp(&k, "id") == 0) {
+      frame->id = mg_rpc_json_int64(v);
+    } else if (mg_vcmp(&k, "src") == 0) {
+      frame->src = v;
+    } else if (mg_vcmp(&k, "dst") == 0) {
+      frame->dst = v;
+    } else if (mg_vcmp(&k, "method") == 0) {
+      frame->method = v;
+    } else if (mg_vcmp(&k, "args") == 0) {
+      frame->args = v;
+    } else if (mg_vcmp(&k, "result") == 0) {
+      /* Result is passed on as JSON, so string results keep their quotes. */
+      if (t == MG_RPC_JSON_STRING) {
+        v.p--;
+        v.len += 2;
+      }
+      frame->result = v;
+    } else if (mg_vcmp(&k, "error") == 0) {
+      if (!mg_rpc_json_begin_object(&es, v)) continue;
+      while ((res = mg_rpc_json_next_member(&es, &k, &v, &t)) > 0) {
+        if (mg_vcmp(&k, "code") == 0) {
+          frame->error_code = (int) mg_rpc_json_int64(v);
+        } else if (mg_vcmp(&k, "message") == 0) {
+          frame->error_msg = v;
+        }
+      }
+      if (res < 0) return false;
+    } else if (mg_vcmp(&k, "tag") == 0) {
+      frame->tag = v;
+    } else if (mg_vcmp(&k, "auth") == 0) {
+      frame->auth = v;
+    } else if (mg_vcmp(&k, "v") == 0) {
+      frame->version = (int) mg_rpc_json_int64(v);
+    } else if (mg_vcmp(&k, "chunk") == 0) {
+      frame->chunk = v;
+    } else if (mg_vcmp(&k, "last") == 0) {
+      frame->last_chunk = (mg_vcmp(&v, "true") == 0);
+    } else {
+      num_fields--;
+    }
+  }
+  if (res < 0 || num_fields == 0) return false;
 
   LOG(LL_DEBUG, ("%lld '%.*s' '%.*s' '%.*s'", (long long int) frame->id,
-                 (int) src.len, (src.len > 0 ? src.ptr : ""), (int) dst.len,
-                 (dst.len > 0 ? dst.ptr : ""), (int) method.len,
-                 (method.len > 0 ? method.ptr : "")));
+                 (int) frame->src.len, (frame->src.len > 0 ? frame->src.p : ""),
+                 (int) frame->dst.len, (frame->dst.len > 0 ? frame->dst.p : ""),
+                 (int) frame->method.len,
+                 (frame->method.len > 0 ? frame->method.p : "")));
 
   return true;
 }
@@ -387,7 +1783,8 @@ static bool is_local_id(struct mg_rpc *c, const struct mg_str id) {
 
 static bool mg_rpc_handle_frame(struct mg_rpc *c,
                                 struct mg_rpc_channel_info_internal *ci,
-                                const struct mg_rpc_frame *frame) {
+                                const struct mg_rpc_frame *frame,
+                                struct mg_rpc_batch *batch) {
   if (!ci->is_open) {
     LOG(LL_ERROR, ("%p Ignored frame from closed channel (%s)", ci->ch,
                    ci->ch->get_type(ci->ch)));
@@ -406,11 +1803,14 @@ static bool mg_rpc_handle_frame(struct mg_rpc *c,
   /* If this channel did not have an associated address, record it now. */
   if (ci->dst.len == 0) {
     ci->dst = mg_strdup(frame->src);
+    mg_rpc_index_channel(c, ci);
   }
   if (frame->method.len > 0) {
-    if (!mg_rpc_handle_request(c, ci, frame)) {
+    if (!mg_rpc_handle_request(c, ci, frame, batch)) {
       return false;
     }
+  } else if (frame->chunk.p != NULL) {
+    if (!mg_rpc_handle_response_chunk(c, ci, frame)) return false;
   } else {
     if (!mg_rpc_handle_response(c, ci, frame->id, frame->result,
                                 frame->error_code, frame->error_msg)) {
@@ -420,34 +1820,267 @@ static bool mg_rpc_handle_frame(struct mg_rpc *c,
   return true;
 }
 
+static bool mg_rpc_is_batch(const struct mg_str f) {
+  for (size_t i = 0; i < f.len; i++) {
+    if (!mg_rpc_json_is_space(f.p[i])) return (f.p[i] == '[');
+  }
+  return false;
+}
+
+static bool mg_rpc_handle_batch(struct mg_rpc *c,
+                                struct mg_rpc_channel_info_internal *ci,
+                                const struct mg_str f) {
+  struct mg_rpc_json_scanner s;
+  struct mg_str v;
+  enum mg_rpc_json_type t;
+  int res;
+  bool ok = true;
+  struct mg_rpc_batch *b = (struct mg_rpc_batch *) calloc(1, sizeof(*b));
+  if (b == NULL) return false;
+  b->c = c;
+  b->ch = ci->ch;
+  b->refcnt = 1;
+  mbuf_init(&b->resp, 100);
+  b->resp.len = MG_RPC_CHANNEL_FRAME_HEADROOM;
+  s.p = f.p;
+  s.end = f.p + f.len;
+  mg_rpc_json_skip_ws(&s);
+  s.p++; /* [ */
+  while ((res = mg_rpc_json_next_element(&s, &v, &t)) > 0) {
+    struct mg_rpc_frame frame;
+    if (t != MG_RPC_JSON_OBJECT || !mg_rpc_parse_frame(v, &frame) ||
+        !mg_rpc_handle_frame(c, ci, &frame, b)) {
+      ok = false;
+      break;
+    }
+  }
+  if (res < 0) ok = false;
+  mg_rpc_batch_unref(b);
+  return ok;
+}
+
 static bool mg_rpc_send_frame(struct mg_rpc_channel_info_internal *ci,
-                              struct mg_str frame);
+                              struct mbuf *fb);
+static bool mg_rpc_send_frame_str(struct mg_rpc_channel_info_internal *ci,
+                                  const struct mg_str f, struct mbuf *fb);
+static void mg_rpc_notify_streams(struct mg_rpc *c,
+                                  struct mg_rpc_channel_info_internal *ci,
+                                  bool ok);
 static bool mg_rpc_dispatch_frame(
     struct mg_rpc *c, const struct mg_str src, const struct mg_str dst,
     int64_t id, const struct mg_str tag, const struct mg_str key,
     struct mg_rpc_channel_info_internal *ci, bool enqueue,
-    struct mg_str payload_prefix_json, const char *payload_jsonf, va_list ap);
+    enum mg_rpc_priority prio, struct mg_str payload_prefix_json,
+    const char *payload_jsonf, va_list ap);
+
+static struct mg_rpc_queued_dst *mg_rpc_intern_dst(struct mg_rpc *c,
+                                                   const struct mg_str dst) {
+  struct mg_rpc_queued_dst *qd;
+  if (dst.len == 0) return NULL;
+  SLIST_FOREACH(qd, &c->queued_dsts, queued_dsts) {
+    if (mg_strcmp(qd->dst, dst) == 0) break;
+  }
+  if (qd == NULL) {
+    qd = (struct mg_rpc_queued_dst *) calloc(1, sizeof(*qd));
+    qd->dst = mg_strdup(dst);
+    SLIST_INSERT_HEAD(&c->queued_dsts, qd, queued_dsts);
+  }
+  qd->refcnt++;
+  return qd;
+}
 
-static void mg_rpc_remove_queue_entry(struct mg_rpc *c,
-                                      struct mg_rpc_queue_entry *qe) {
-  STAILQ_REMOVE(&c->queue, qe, mg_rpc_queue_entry, queue);
-  free((void *) qe->dst.p);
-  free((void *) qe->frame.p);
+static void mg_rpc_release_dst(struct mg_rpc *c, struct mg_rpc_queued_dst *qd) {
+  if (qd == NULL || --qd->refcnt > 0) return;
+  SLIST_REMOVE(&c->queued_dsts, qd, mg_rpc_queued_dst, queued_dsts);
+  free((void *) qd->dst.p);
+  free(qd);
+}
+
+static void mg_rpc_shared_frame_unref(struct mg_rpc_shared_frame *sf) {
+  if (--sf->refcnt > 0) return;
+  mbuf_free(&sf->frame);
+  free(sf);
+}
+
+static enum mg_rpc_priority mg_rpc_call_prio(enum mg_rpc_priority prio,
+                                             mg_result_cb_t cb) {
+  if (prio != MG_RPC_PRIO_DEFAULT) return prio;
+  return (cb != NULL ? MG_RPC_PRIO_NORMAL : MG_RPC_PRIO_LOW);
+}
+
+/* Entries are kept in priority order, FIFO within the same priority. */
+static void mg_rpc_queue_insert(struct queue *q,
+                                struct mg_rpc_queue_entry *qe) {
+  struct mg_rpc_queue_entry *e, *after = NULL;
+  if (qe->prio == MG_RPC_PRIO_LOW) {
+    STAILQ_INSERT_TAIL(q, qe, queue);
+    return;
+  }
+  STAILQ_FOREACH(e, q, queue) {
+    if (e->prio < qe->prio) break;
+    after = e;
+  }
+  if (e == NULL) {
+    STAILQ_INSERT_TAIL(q, qe, queue);
+  } else if (after == NULL) {
+    STAILQ_INSERT_HEAD(q, qe, queue);
+  } else {
+    STAILQ_INSERT_AFTER(q, after, qe, queue);
+  }
+}
+
+static void mg_rpc_queue_overflow(struct mg_rpc *c) {
+  if (c->queue_full) return;
+  c->queue_full = true;
+  LOG(LL_WARN, ("RPC queue is full (%d)", c->queue_len));
+  mg_rpc_call_observers(c, MG_RPC_EV_QUEUE_FULL, NULL);
+}
+
+static void mg_rpc_free_queue_entry(struct mg_rpc *c,
+                                    struct mg_rpc_queue_entry *qe) {
+  if (qe->shared != NULL) {
+    if (qe->ci != NULL) qe->ci->num_queued_broadcasts--;
+    mg_rpc_shared_frame_unref(qe->shared);
+  }
+  mg_rpc_release_dst(c, qe->dst);
+  mbuf_free(&qe->frame);
   memset(qe, 0, sizeof(*qe));
   free(qe);
   c->queue_len--;
+  if (c->queue_full && c->queue_len <= c->cfg->max_queue_length / 2) {
+    c->queue_full = false;
+    mg_rpc_call_observers(c, MG_RPC_EV_QUEUE_DRAINED, NULL);
+  }
 }
 
-static void mg_rpc_process_queue(struct mg_rpc *c) {
+static void mg_rpc_remove_queue_entry(struct mg_rpc *c,
+                                      struct mg_rpc_queue_entry *qe) {
+  if (qe->ci != NULL) {
+    STAILQ_REMOVE(&qe->ci->queue, qe, mg_rpc_queue_entry, queue);
+    qe->ci->queue_len--;
+  } else {
+    STAILQ_REMOVE(&c->queue, qe, mg_rpc_queue_entry, queue);
+  }
+  mg_rpc_free_queue_entry(c, qe);
+}
+
+/* Oldest of the lowest priority entries in q below prio, or best. */
+static struct mg_rpc_queue_entry *mg_rpc_queue_victim(
+    struct queue *q, int prio, struct mg_rpc_queue_entry *best) {
+  struct mg_rpc_queue_entry *e;
+  STAILQ_FOREACH(e, q, queue) {
+    if (e->is_array) continue;
+    if (e->prio < prio && (best == NULL || e->prio < best->prio)) best = e;
+  }
+  return best;
+}
+
+/*
+ * Makes room for an entry of the given priority by evicting a lower priority
+ * one, from the channel's queue or, if ci is NULL, from any queue.
+ * If the evicted frame is a call expecting a response, the caller is
+ * notified with MG_RPC_ERR_QUEUE_FULL.
+ */
+static bool mg_rpc_queue_evict(struct mg_rpc *c,
+                               struct mg_rpc_channel_info_internal *ci,
+                               enum mg_rpc_priority prio) {
+  struct mg_rpc_queue_entry *qe = NULL;
+  if (ci != NULL) {
+    qe = mg_rpc_queue_victim(&ci->queue, prio, NULL);
+  } else {
+    struct mg_rpc_channel_info_internal *cii;
+    qe = mg_rpc_queue_victim(&c->queue, prio, NULL);
+    SLIST_FOREACH(cii, &c->channels, channels) {
+      qe = mg_rpc_queue_victim(&cii->queue, prio, qe);
+    }
+  }
+  if (qe == NULL) return false;
+  c->stats.evicted_frames++;
+  int64_t id = qe->id;
+  LOG(LL_DEBUG, ("%p EVICTED FRAME %lld (prio %d)",
+                 (qe->ci ? qe->ci->ch : NULL), (long long int) id, qe->prio));
+  mg_rpc_queue_overflow(c);
+  mg_rpc_remove_queue_entry(c, qe);
+  struct mg_rpc_sent_request_info *sri =
+      (id != 0 ? mg_rpc_take_sent_request(c, id) : NULL);
+  if (sri != NULL) {
+    struct mg_rpc_frame_info fi;
+    memset(&fi, 0, sizeof(fi));
+    fi.channel_type = "";
+    sri->cb(c, sri->cb_arg, &fi, mg_mk_str(NULL), MG_RPC_ERR_QUEUE_FULL,
+            mg_mk_str("evicted from the queue"));
+    mg_rpc_free_sent_request(sri);
+  }
+  return true;
+}
+
+/*
+ * Sends out as much of the channel's queue as the channel will take.
+ * Entry is taken off the queue before sending: channel may report
+ * FRAME_SENT synchronously, which will bring us back here.
+ */
+static void mg_rpc_process_channel_queue(
+    struct mg_rpc *c, struct mg_rpc_channel_info_internal *ci) {
+  struct mg_rpc_queue_entry *qe;
+  while ((qe = STAILQ_FIRST(&ci->queue)) != NULL) {
+    if (qe->in_batch && c->batch_depth > 0) break;
+    STAILQ_REMOVE_HEAD(&ci->queue, queue);
+    ci->queue_len--;
+    bool sent = (qe->shared != NULL
+                     ? mg_rpc_send_frame_str(
+                           ci, mg_mk_str_n(qe->shared->frame.buf,
+                                           qe->shared->frame.len),
+                           NULL)
+                     : mg_rpc_send_frame(ci, &qe->frame));
+    if (!sent) {
+      STAILQ_INSERT_HEAD(&ci->queue, qe, queue);
+      ci->queue_len++;
+      break;
+    }
+    mg_rpc_free_queue_entry(c, qe);
+  }
+}
+
+/*
+ * Tries to find routes for unbound entries. Those that get one are moved to
+ * their channel's queue. Returns true if any entries were moved.
+ */
+static bool mg_rpc_bind_queue(struct mg_rpc *c) {
+  bool result = false;
   struct mg_rpc_queue_entry *qe, *tqe;
   STAILQ_FOREACH_SAFE(qe, &c->queue, queue, tqe) {
-    struct mg_rpc_channel_info_internal *ci = qe->ci;
-    struct mg_str dst = qe->dst;
-    if (ci == NULL) ci = mg_rpc_get_channel_info_internal_by_dst(c, &dst);
-    if (mg_rpc_send_frame(ci, qe->frame)) {
-      mg_rpc_remove_queue_entry(c, qe);
-    }
+    struct mg_str dst = (qe->dst != NULL ? qe->dst->dst : mg_mk_str(""));
+    struct mg_rpc_channel_info_internal *ci =
+        mg_rpc_get_channel_info_internal_by_dst(c, &dst);
+    if (ci == NULL) continue;
+    STAILQ_REMOVE(&c->queue, qe, mg_rpc_queue_entry, queue);
+    qe->ci = ci;
+    mg_rpc_queue_insert(&ci->queue, qe);
+    ci->queue_len++;
+    result = true;
+  }
+  return result;
+}
+
+static void mg_rpc_process_queue(struct mg_rpc *c) {
+  struct mg_rpc_channel_info_internal *ci;
+  if (!mg_rpc_bind_queue(c)) return;
+  SLIST_FOREACH(ci, &c->channels, channels) {
+    mg_rpc_process_channel_queue(c, ci);
+  }
+}
+
+bool mg_rpc_channel_frame_size_ok(struct mg_rpc_channel *ch, size_t len) {
+  struct mg_rpc *c = (struct mg_rpc *) ch->mg_rpc_data;
+  if (c == NULL || c->cfg->max_frame_size <= 0 ||
+      len <= (size_t) c->cfg->max_frame_size) {
+    return true;
   }
+  c->stats.invalid_frames++;
+  LOG(LL_ERROR, ("%p FRAME TOO BIG (%d > %d)", ch, (int) len,
+                 c->cfg->max_frame_size));
+  if (!ch->is_persistent(ch)) ch->ch_close(ch);
+  return false;
 }
 
 static void mg_rpc_ev_handler(struct mg_rpc_channel *ch,
@@ -462,12 +2095,13 @@ static void mg_rpc_ev_handler(struct mg_rpc_channel *ch,
   switch (ev) {
     case MG_RPC_CHANNEL_OPEN: {
       ci->is_open = true;
-      ci->is_busy = false;
-      char *info = ch->get_info(ch);
+      ci->num_in_flight = 0;
+      char info[64];
+      mg_rpc_channel_write_info(ch, info, sizeof(info));
       LOG(LL_DEBUG, ("%p CHAN OPEN (%s%s%s)", ch, ch->get_type(ch),
-                     (info ? " " : ""), (info ? info : "")));
-      free(info);
+                     (info[0] != '\0' ? " " : ""), info));
       mg_rpc_process_queue(c);
+      mg_rpc_process_channel_queue(c, ci);
       if (ci->dst.len > 0) {
         mg_rpc_call_observers(c, MG_RPC_EV_CHANNEL_OPEN, &ci->dst);
       }
@@ -478,8 +2112,18 @@ static void mg_rpc_ev_handler(struct mg_rpc_channel *ch,
       struct mg_rpc_frame frame;
       LOG(LL_DEBUG,
           ("%p GOT FRAME (%d): %.*s", ch, (int) f->len, (int) f->len, f->p));
-      if (!mg_rpc_parse_frame(*f, &frame) ||
-          !mg_rpc_handle_frame(c, ci, &frame)) {
+      if (!mg_rpc_channel_frame_size_ok(ch, f->len)) break;
+      bool ok;
+      mg_rpc_stats_ch_type(c, ch)->frames_in++;
+      mg_rpc_ci_count(ci, false /* out */, f->len);
+      if (mg_rpc_is_batch(*f)) {
+        ok = mg_rpc_handle_batch(c, ci, *f);
+      } else {
+        ok = (mg_rpc_parse_frame(*f, &frame) &&
+              mg_rpc_handle_frame(c, ci, &frame, NULL /* batch */));
+      }
+      if (!ok) {
+        c->stats.invalid_frames++;
         LOG(LL_ERROR, ("%p INVALID FRAME (%d): '%.*s'", ch, (int) f->len,
                        (int) f->len, f->p));
         if (!ch->is_persistent(ch)) ch->ch_close(ch);
@@ -492,7 +2136,10 @@ static void mg_rpc_ev_handler(struct mg_rpc_channel *ch,
                      (int) frame->src.len, (frame->src.p ? frame->src.p : ""),
                      (int) frame->dst.len, (frame->dst.p ? frame->dst.p : ""),
                      frame->id));
-      if (!mg_rpc_handle_frame(c, ci, frame)) {
+      mg_rpc_stats_ch_type(c, ch)->frames_in++;
+      mg_rpc_ci_count(ci, false /* out */, 0);
+      if (!mg_rpc_handle_frame(c, ci, frame, NULL /* batch */)) {
+        c->stats.invalid_frames++;
         LOG(LL_ERROR,
             ("%p INVALID PARSED FRAME from %.*s: %.*s %.*s", ch,
              (int) frame->src.len, frame->src.p, (int) frame->method.len,
@@ -504,28 +2151,62 @@ static void mg_rpc_ev_handler(struct mg_rpc_channel *ch,
     case MG_RPC_CHANNEL_FRAME_SENT: {
       int success = (intptr_t) ev_data;
       LOG(LL_DEBUG, ("%p FRAME SENT (%d)", ch, success));
-      ci->is_busy = false;
-      mg_rpc_process_queue(c);
+      if (ci->num_in_flight > 0) ci->num_in_flight--;
+      /*
+       * Channels may confirm frames from within send (local channel in sync
+       * mode does), which would get back here from the queue or a stream
+       * callback and recurse for as long as there is something to send.
+       * Nested confirmations are only counted, the outer one loops instead.
+       */
+      if (ci->in_frame_sent) {
+        ci->frame_sent_again = true;
+        break;
+      }
+      ci->in_frame_sent = true;
+      do {
+        ci->frame_sent_again = false;
+        mg_rpc_process_channel_queue(c, ci);
+        /* Either may close the channel and take ci with it. */
+        if ((ci = mg_rpc_get_channel_info_internal(c, ch)) == NULL) break;
+        mg_rpc_notify_streams(c, ci, true /* ok */);
+        if ((ci = mg_rpc_get_channel_info_internal(c, ch)) == NULL) break;
+      } while (ci->frame_sent_again);
+      if (ci != NULL) ci->in_frame_sent = false;
       (void) success;
       break;
     }
     case MG_RPC_CHANNEL_CLOSED: {
       bool remove = !ch->is_persistent(ch);
       LOG(LL_DEBUG, ("%p CHAN CLOSED, remove? %d", ch, remove));
-      ci->is_open = ci->is_busy = false;
+      ci->is_open = false;
+      ci->num_in_flight = 0;
+      mg_rpc_notify_streams(c, ci, false /* ok */);
       if (ci->dst.len > 0) {
         mg_rpc_call_observers(c, MG_RPC_EV_CHANNEL_CLOSED, &ci->dst);
       }
       if (remove) {
-        struct mg_rpc_queue_entry *qe, *tqe;
-        STAILQ_FOREACH_SAFE(qe, &c->queue, queue, tqe) {
-          if (qe->ci == ci) mg_rpc_remove_queue_entry(c, qe);
+        struct mg_rpc_queue_entry *qe;
+        bool rebind = false;
+        while ((qe = STAILQ_FIRST(&ci->queue)) != NULL) {
+          if (qe->by_dst) {
+            /* Give it a chance to find another route. */
+            STAILQ_REMOVE_HEAD(&ci->queue, queue);
+            ci->queue_len--;
+            qe->ci = NULL;
+            mg_rpc_queue_insert(&c->queue, qe);
+            rebind = true;
+          } else {
+            mg_rpc_remove_queue_entry(c, qe);
+          }
         }
+        mg_rpc_unindex_channel(c, ci);
         SLIST_REMOVE(&c->channels, ci, mg_rpc_channel_info_internal, channels);
+        if (ci->is_warm) c->num_warm_out_channels--;
         ch->ch_destroy(ch);
         if (ci->dst.p != NULL) free((void *) ci->dst.p);
         memset(ci, 0, sizeof(*ci));
         free(ci);
+        if (rebind) mg_rpc_process_queue(c);
       }
       break;
     }
@@ -538,9 +2219,11 @@ static struct mg_rpc_channel_info_internal *mg_rpc_add_channel_internal(
       (struct mg_rpc_channel_info_internal *) calloc(1, sizeof(*ci));
   if (dst.len != 0) ci->dst = mg_strdup(dst);
   ci->ch = ch;
+  STAILQ_INIT(&ci->queue);
   ch->mg_rpc_data = c;
   ch->ev_handler = mg_rpc_ev_handler;
   SLIST_INSERT_HEAD(&c->channels, ci, channels);
+  mg_rpc_index_channel(c, ci);
   LOG(LL_DEBUG, ("%p '%.*s' %s", ch, (int) dst.len, dst.p, ch->get_type(ch)));
   return ci;
 }
@@ -574,93 +2257,401 @@ struct mg_rpc *mg_rpc_create(struct mg_rpc_cfg *cfg) {
   struct mg_rpc *c = (struct mg_rpc *) calloc(1, sizeof(*c));
   if (c == NULL) return NULL;
   c->cfg = cfg;
+  c->mgr = mgos_get_mgr();
+  c->timers = mg_rpc_timers_default();
   mbuf_init(&c->local_ids, 0);
   mg_rpc_add_local_id(c, mg_mk_str(c->cfg->id));
 
   SLIST_INIT(&c->handlers);
   SLIST_INIT(&c->channels);
-  SLIST_INIT(&c->requests);
   SLIST_INIT(&c->observers);
+  SLIST_INIT(&c->prehandlers);
+  STAILQ_INIT(&c->offload_queue);
   STAILQ_INIT(&c->queue);
+  SLIST_INIT(&c->queued_dsts);
+  SLIST_INIT(&c->streams);
 
   return c;
 }
 
-static bool mg_rpc_send_frame(struct mg_rpc_channel_info_internal *ci,
-                              const struct mg_str f) {
-  if (ci == NULL || !ci->is_open || ci->is_busy) return false;
-  bool result = ci->ch->send_frame(ci->ch, f);
-  LOG(LL_DEBUG, ("%p SEND FRAME (%d): %.*s -> %d", ci->ch, (int) f.len,
-                 (int) f.len, f.p, result));
-  if (result) ci->is_busy = true;
+void mg_rpc_set_mgr(struct mg_rpc *c, struct mg_mgr *mgr) {
+  if (c == NULL || mgr == c->mgr) return;
+  c->mgr = mgr;
+  if (c->own_timers) mg_rpc_timers_free(c->timers);
+  c->own_timers = (mgr != mgos_get_mgr());
+  c->timers = (c->own_timers ? mg_rpc_timers_create(mgr)
+                             : mg_rpc_timers_default());
+}
+
+static bool mg_rpc_channel_can_send(
+    const struct mg_rpc_channel_info_internal *ci) {
+  if (ci == NULL || !ci->is_open) return false;
+  struct mg_rpc_channel *ch = ci->ch;
+  int window = (ch->get_send_window ? ch->get_send_window(ch) : 1);
+  return (ci->num_in_flight < window);
+}
+
+/*
+ * Sends frame f. If fb is not NULL, f is in it after the headroom and the
+ * channel may take over the buffer, otherwise the frame is copied.
+ */
+static bool mg_rpc_send_frame_str(struct mg_rpc_channel_info_internal *ci,
+                                  const struct mg_str f, struct mbuf *fb) {
+  if (!mg_rpc_channel_can_send(ci)) return false;
+  struct mg_rpc_channel *ch = ci->ch;
+  /* Log before sending, the buffer may not be ours afterwards. */
+  LOG(LL_DEBUG,
+      ("%p SEND FRAME (%d): %.*s", ch, (int) f.len, (int) f.len, f.p));
+  /* Account first, FRAME_SENT may be delivered before send_frame returns. */
+  ci->num_in_flight++;
+  bool result = (fb != NULL && ch->send_frame_owned != NULL
+                     ? ch->send_frame_owned(ch, fb)
+                     : ch->send_frame(ch, f));
+  if (result) {
+    mg_rpc_stats_ch_type((struct mg_rpc *) ch->mg_rpc_data, ch)->frames_out++;
+    mg_rpc_ci_count(ci, true /* out */, f.len);
+  } else {
+    LOG(LL_DEBUG, ("%p SEND FRAME FAILED", ch));
+    if (ci->num_in_flight > 0) ci->num_in_flight--;
+  }
+  return result;
+}
+
+/*
+ * Frame is in fb, after MG_RPC_CHANNEL_FRAME_HEADROOM. If the frame is sent,
+ * channel may have taken over the buffer, fb still needs to be freed.
+ */
+static bool mg_rpc_send_frame(struct mg_rpc_channel_info_internal *ci,
+                              struct mbuf *fb) {
+  return mg_rpc_send_frame_str(
+      ci, mg_mk_str_n(fb->buf + MG_RPC_CHANNEL_FRAME_HEADROOM,
+                      fb->len - MG_RPC_CHANNEL_FRAME_HEADROOM),
+      fb);
+}
+
+/*
+ * Sends broadcast frame to one channel. If the channel is busy, the frame
+ * may wait on its queue, up to max_broadcast_queue_length of them.
+ */
+static bool mg_rpc_broadcast_frame(struct mg_rpc *c,
+                                   struct mg_rpc_channel_info_internal *ci,
+                                   struct mg_rpc_shared_frame *sf,
+                                   enum mg_rpc_priority prio) {
+  const struct mg_str f = mg_mk_str_n(sf->frame.buf, sf->frame.len);
+  if (STAILQ_EMPTY(&ci->queue) && mg_rpc_send_frame_str(ci, f, NULL)) {
+    return true;
+  }
+  if (!ci->is_open ||
+      ci->num_queued_broadcasts >= c->cfg->max_broadcast_queue_length ||
+      (c->queue_len >= c->cfg->max_queue_length &&
+       !mg_rpc_queue_evict(c, NULL, prio))) {
+    c->stats.dropped_frames++;
+    LOG(LL_DEBUG, ("%p DROPPED BROADCAST (%d): %.*s", ci->ch, (int) f.len,
+                   (int) f.len, f.p));
+    return false;
+  }
+  struct mg_rpc_queue_entry *qe =
+      (struct mg_rpc_queue_entry *) calloc(1, sizeof(*qe));
+  qe->ci = ci;
+  qe->shared = sf;
+  qe->prio = prio;
+  sf->refcnt++;
+  mg_rpc_queue_insert(&ci->queue, qe);
+  ci->queue_len++;
+  ci->num_queued_broadcasts++;
+  c->queue_len++;
+  if (c->queue_len > c->stats.queue_len_hwm) {
+    c->stats.queue_len_hwm = c->queue_len;
+  }
+  LOG(LL_DEBUG, ("%p QUEUED BROADCAST (%d)", ci->ch, (int) f.len));
+  return true;
+}
+
+/* Takes over fb if successful. id is that of the frame in fb, if any. */
+static bool mg_rpc_enqueue_frame(struct mg_rpc *c,
+                                 struct mg_rpc_channel_info_internal *ci,
+                                 bool by_dst, bool in_batch, struct mg_str dst,
+                                 enum mg_rpc_priority prio, int64_t id,
+                                 struct mbuf *fb) {
+  if (c->queue_len >= c->cfg->max_queue_length &&
+      !mg_rpc_queue_evict(c, NULL, prio)) {
+    mg_rpc_queue_overflow(c);
+    return false;
+  }
+  if (ci != NULL && c->cfg->max_channel_queue_length > 0 &&
+      ci->queue_len >= c->cfg->max_channel_queue_length &&
+      !mg_rpc_queue_evict(c, ci, prio)) {
+    mg_rpc_queue_overflow(c);
+    return false;
+  }
+  struct mg_rpc_queue_entry *qe =
+      (struct mg_rpc_queue_entry *) calloc(1, sizeof(*qe));
+  qe->dst = mg_rpc_intern_dst(c, dst);
+  qe->ci = ci;
+  qe->by_dst = by_dst;
+  qe->in_batch = in_batch;
+  qe->prio = prio;
+  qe->id = id;
+  mbuf_trim(fb);
+  qe->frame = *fb;
+  mbuf_init(fb, 0);
+  if (ci != NULL) {
+    mg_rpc_queue_insert(&ci->queue, qe);
+    ci->queue_len++;
+  } else {
+    mg_rpc_queue_insert(&c->queue, qe);
+  }
+  LOG(LL_DEBUG, ("%p QUEUED FRAME (%d): %.*s", (ci ? ci->ch : NULL),
+                 (int) (qe->frame.len - MG_RPC_CHANNEL_FRAME_HEADROOM),
+                 (int) (qe->frame.len - MG_RPC_CHANNEL_FRAME_HEADROOM),
+                 qe->frame.buf + MG_RPC_CHANNEL_FRAME_HEADROOM));
+  c->queue_len++;
+  if (c->queue_len > c->stats.queue_len_hwm) {
+    c->stats.queue_len_hwm = c->queue_len;
+  }
+  return true;
+}
+
+/* Appends the frame to fb. */
+static void mg_rpc_build_frame(struct mg_rpc *c, struct mbuf *fb,
+                               const struct mg_str src, const struct mg_str dst,
+                               int64_t id, const struct mg_str tag,
+                               const struct mg_str key,
+                               struct mg_str payload_prefix_json,
+                               const char *payload_jsonf, va_list ap) {
+  struct json_out fout = JSON_OUT_MBUF(fb);
+  json_printf(&fout, "{");
+  if (id != 0) {
+    json_printf(&fout, "id:%lld,", id);
+  }
+  if (src.len > 0) {
+    json_printf(&fout, "src:%.*Q", (int) src.len, src.p);
+  } else {
+    json_printf(&fout, "src:%Q", c->local_ids.buf);
+  }
+  if (dst.len > 0) {
+    json_printf(&fout, ",dst:%.*Q", (int) dst.len, dst.p);
+  }
+  if (tag.len > 0) {
+    json_printf(&fout, ",tag:%.*Q", (int) tag.len, tag.p);
+  }
+  if (key.len > 0) {
+    json_printf(&fout, ",key:%.*Q", (int) key.len, key.p);
+  }
+  if (payload_prefix_json.len > 0) {
+    mbuf_append(fb, ",", 1);
+    mbuf_append(fb, payload_prefix_json.p, payload_prefix_json.len);
+  }
+  if (payload_jsonf != NULL) json_vprintf(&fout, payload_jsonf, ap);
+  json_printf(&fout, "}");
+}
+
+/*
+ * Sends or queues frame in fb, which starts with the channel headroom.
+ * fb stays with the caller: it is empty if the frame was queued or the
+ * channel took over the buffer, otherwise it can be reused.
+ */
+static bool mg_rpc_try_dispatch_mbuf(struct mg_rpc *c,
+                                     struct mg_rpc_channel_info_internal *ci,
+                                     bool by_dst, const struct mg_str dst,
+                                     bool enqueue, enum mg_rpc_priority prio,
+                                     int64_t id, struct mbuf *fb) {
+  bool result = false;
+  /* Within a batch, frames are held on the queue until commit. */
+  if (c->batch_depth > 0 && ci != NULL && enqueue &&
+      mg_rpc_enqueue_frame(c, ci, by_dst, true /* in_batch */, dst, prio, id,
+                           fb)) {
+    result = true;
+  } else if ((ci == NULL || STAILQ_EMPTY(&ci->queue)) &&
+             mg_rpc_send_frame(ci, fb)) {
+    /*
+     * Try sending directly first or put on the queue. Direct send is only
+     * possible if there is nothing queued ahead of this frame.
+     */
+    result = true;
+  } else if (enqueue &&
+             mg_rpc_enqueue_frame(c, ci, by_dst, false /* in_batch */, dst,
+                                  prio, id, fb)) {
+    result = true;
+  } else {
+    c->stats.dropped_frames++;
+    LOG(LL_DEBUG, ("DROPPED FRAME (%d): %.*s",
+                   (int) (fb->len - MG_RPC_CHANNEL_FRAME_HEADROOM),
+                   (int) (fb->len - MG_RPC_CHANNEL_FRAME_HEADROOM),
+                   fb->buf + MG_RPC_CHANNEL_FRAME_HEADROOM));
+  }
+  return result;
+}
+
+/* Same as mg_rpc_try_dispatch_mbuf, but fb is freed. */
+static bool mg_rpc_dispatch_mbuf(struct mg_rpc *c,
+                                 struct mg_rpc_channel_info_internal *ci,
+                                 bool by_dst, const struct mg_str dst,
+                                 bool enqueue, enum mg_rpc_priority prio,
+                                 int64_t id, struct mbuf *fb) {
+  bool result =
+      mg_rpc_try_dispatch_mbuf(c, ci, by_dst, dst, enqueue, prio, id, fb);
+  mbuf_free(fb);
+  return result;
+}
+
+static bool mg_rpc_dispatch_frame(
+    struct mg_rpc *c, const struct mg_str src, const struct mg_str dst,
+    int64_t id, const struct mg_str tag, const struct mg_str key,
+    struct mg_rpc_channel_info_internal *ci, bool enqueue,
+    enum mg_rpc_priority prio, struct mg_str payload_prefix_json,
+    const char *payload_jsonf, va_list ap) {
+  struct mbuf fb;
+  struct mg_str final_dst = dst;
+  bool by_dst = (ci == NULL);
+  if (by_dst) ci = mg_rpc_get_channel_info_internal_by_dst(c, &final_dst);
+  mbuf_init(&fb, 100);
+  fb.len = MG_RPC_CHANNEL_FRAME_HEADROOM; /* Reserve space for the channel. */
+  mg_rpc_build_frame(c, &fb, src, final_dst, id, tag, key, payload_prefix_json,
+                     payload_jsonf, ap);
+  return mg_rpc_dispatch_mbuf(c, ci, by_dst, dst, enqueue, prio, id, &fb);
+}
+
+static bool mg_rpc_takes_parsed_frames(
+    const struct mg_rpc_channel_info_internal *ci) {
+  return (ci != NULL && ci->ch->send_parsed_frame != NULL &&
+          STAILQ_EMPTY(&ci->queue) && mg_rpc_channel_can_send(ci));
+}
+
+static void mg_rpc_build_framef(struct mg_rpc *c, struct mbuf *fb,
+                                const struct mg_str src,
+                                const struct mg_str dst, int64_t id,
+                                const struct mg_str tag,
+                                struct mg_str payload_prefix_json,
+                                const char *payload_jsonf, ...) {
+  va_list ap;
+  va_start(ap, payload_jsonf);
+  mg_rpc_build_frame(c, fb, src, dst, id, tag, mg_mk_str(NULL),
+                     payload_prefix_json, payload_jsonf, ap);
+  va_end(ap);
+}
+
+/*
+ * Hands the frame over without serializing it. If the channel refuses it,
+ * a regular frame is built from the envelope members of the frame and
+ * the already formatted payload.
+ */
+static bool mg_rpc_dispatch_parsed(struct mg_rpc *c,
+                                   struct mg_rpc_channel_info_internal *ci,
+                                   bool by_dst, const struct mg_str dst,
+                                   bool enqueue, enum mg_rpc_priority prio,
+                                   const struct mg_rpc_frame *frame,
+                                   const struct mg_str payload) {
+  struct mg_rpc_channel *ch = ci->ch;
+  LOG(LL_DEBUG, ("%p SEND PARSED FRAME %lld", ch, (long long int) frame->id));
+  /* Account first, same as for serialized frames. */
+  ci->num_in_flight++;
+  if (ch->send_parsed_frame(ch, frame)) {
+    mg_rpc_stats_ch_type(c, ch)->frames_out++;
+    mg_rpc_ci_count(ci, true /* out */, 0);
+    return true;
+  }
+  if (ci->num_in_flight > 0) ci->num_in_flight--;
+  struct mbuf fb;
+  mbuf_init(&fb, 100);
+  fb.len = MG_RPC_CHANNEL_FRAME_HEADROOM;
+  mg_rpc_build_framef(c, &fb, frame->src, frame->dst, frame->id, frame->tag,
+                      payload, NULL);
+  return mg_rpc_dispatch_mbuf(c, ci, by_dst, dst, enqueue, prio, frame->id,
+                              &fb);
+}
+
+/* Call to a channel that takes parsed frames, only args are formatted. */
+static bool mg_rpc_call_parsed(struct mg_rpc *c,
+                               struct mg_rpc_channel_info_internal *ci,
+                               const struct mg_str src, const struct mg_str dst,
+                               const struct mg_str final_dst, int64_t id,
+                               const struct mg_str tag,
+                               const struct mg_str method, bool enqueue,
+                               enum mg_rpc_priority prio,
+                               const struct mg_str pprefix,
+                               const char *args_jsonf, va_list ap) {
+  struct mbuf pb;
+  struct json_out out = JSON_OUT_MBUF(&pb);
+  struct mg_rpc_frame frame;
+  mbuf_init(&pb, pprefix.len + 50);
+  mbuf_append(&pb, pprefix.p, pprefix.len);
+  if (args_jsonf != NULL) json_vprintf(&out, args_jsonf, ap);
+  memset(&frame, 0, sizeof(frame));
+  frame.id = id;
+  frame.src = (src.len > 0 ? src : mg_mk_str(c->local_ids.buf));
+  frame.dst = final_dst;
+  frame.tag = tag;
+  frame.method = method;
+  if (args_jsonf != NULL) {
+    frame.args = mg_mk_str_n(pb.buf + pprefix.len, pb.len - pprefix.len);
+  }
+  bool result =
+      mg_rpc_dispatch_parsed(c, ci, true /* by_dst */, dst, enqueue, prio,
+                             &frame, mg_mk_str_n(pb.buf, pb.len));
+  mbuf_free(&pb);
   return result;
 }
 
-static bool mg_rpc_enqueue_frame(struct mg_rpc *c,
-                                 struct mg_rpc_channel_info_internal *ci,
-                                 struct mg_str dst, struct mg_str f) {
-  if (c->queue_len >= c->cfg->max_queue_length) return false;
-  struct mg_rpc_queue_entry *qe =
-      (struct mg_rpc_queue_entry *) calloc(1, sizeof(*qe));
-  qe->dst = mg_strdup(dst);
-  qe->ci = ci;
-  qe->frame = f;
-  STAILQ_INSERT_TAIL(&c->queue, qe, queue);
-  LOG(LL_DEBUG, ("QUEUED FRAME (%d): %.*s", (int) f.len, (int) f.len, f.p));
-  c->queue_len++;
-  return true;
+/* Result for a channel that takes parsed frames. */
+static bool mg_rpc_respond_parsed(struct mg_rpc_request_info *ri,
+                                  struct mg_rpc_channel_info_internal *ci,
+                                  const char *result_jsonf, va_list ap) {
+  struct mg_rpc *c = ri->rpc;
+  const struct mg_str prefix = mg_mk_str("\"result\":");
+  struct mbuf pb;
+  struct json_out out = JSON_OUT_MBUF(&pb);
+  struct mg_rpc_frame frame;
+  mbuf_init(&pb, 100);
+  mbuf_append(&pb, prefix.p, prefix.len);
+  json_vprintf(&out, result_jsonf, ap);
+  memset(&frame, 0, sizeof(frame));
+  frame.id = ri->id;
+  frame.src = (ri->dst.len > 0 ? ri->dst : mg_mk_str(c->local_ids.buf));
+  frame.dst = ri->src;
+  frame.tag = ri->tag;
+  frame.result = mg_mk_str_n(pb.buf + prefix.len, pb.len - prefix.len);
+  bool result = mg_rpc_dispatch_parsed(
+      c, ci, false /* by_dst */, ri->src, true /* enqueue */,
+      MG_RPC_PRIO_HIGH, &frame, mg_mk_str_n(pb.buf, pb.len));
+  mbuf_free(&pb);
+  return result;
 }
 
-static bool mg_rpc_dispatch_frame(
-    struct mg_rpc *c, const struct mg_str src, const struct mg_str dst,
-    int64_t id, const struct mg_str tag, const struct mg_str key,
-    struct mg_rpc_channel_info_internal *ci, bool enqueue,
-    struct mg_str payload_prefix_json, const char *payload_jsonf, va_list ap) {
-  struct mbuf fb;
-  struct json_out fout = JSON_OUT_MBUF(&fb);
-  struct mg_str final_dst = dst;
-  if (ci == NULL) ci = mg_rpc_get_channel_info_internal_by_dst(c, &final_dst);
-  bool result = false;
-  mbuf_init(&fb, 100);
-  json_printf(&fout, "{");
-  if (id != 0) {
-    json_printf(&fout, "id:%lld,", id);
-  }
-  if (src.len > 0) {
-    json_printf(&fout, "src:%.*Q", (int) src.len, src.p);
-  } else {
-    json_printf(&fout, "src:%Q", c->local_ids.buf);
-  }
-  if (final_dst.len > 0) {
-    json_printf(&fout, ",dst:%.*Q", (int) final_dst.len, final_dst.p);
-  }
-  if (tag.len > 0) {
-    json_printf(&fout, ",tag:%.*Q", (int) tag.len, tag.p);
-  }
-  if (key.len > 0) {
-    json_printf(&fout, ",key:%.*Q", (int) key.len, key.p);
+/*
+ * Sends response to ri, or adds it to the batch ri came in. Frees ri.
+ */
+static bool mg_rpc_dispatch_response(struct mg_rpc_request_info *ri,
+                                     struct mg_str payload_prefix_json,
+                                     const char *payload_jsonf, va_list ap) {
+  bool result = true;
+  struct mg_rpc_req_block *rb = (struct mg_rpc_req_block *) ri;
+  struct mg_rpc_batch *batch = rb->batch;
+  if (rb->is_offloaded && !rb->offload_response_back) {
+    return mg_rpc_offload_respond(ri, payload_prefix_json, payload_jsonf, ap);
   }
-  if (payload_prefix_json.len > 0) {
-    mbuf_append(&fb, ",", 1);
-    mbuf_append(&fb, payload_prefix_json.p, payload_prefix_json.len);
+  if (rb->cache_entry != NULL) {
+    return mg_rpc_cache_complete(ri, payload_prefix_json, payload_jsonf, ap);
   }
-  if (payload_jsonf != NULL) json_vprintf(&fout, payload_jsonf, ap);
-  json_printf(&fout, "}");
-  mbuf_trim(&fb);
-
-  /* Try sending directly first or put on the queue. */
-  struct mg_str f = mg_mk_str_n(fb.buf, fb.len);
-  if (mg_rpc_send_frame(ci, f)) {
-    mbuf_free(&fb);
-    result = true;
-  } else if (enqueue && mg_rpc_enqueue_frame(c, ci, dst, f)) {
-    /* Frame is on the queue, do not free. */
-    result = true;
+  if (batch != NULL) {
+    mg_rpc_batch_add_response(batch, ri, payload_prefix_json, payload_jsonf,
+                              ap);
   } else {
-    LOG(LL_DEBUG,
-        ("DROPPED FRAME (%d): %.*s", (int) fb.len, (int) fb.len, fb.buf));
-    mbuf_free(&fb);
+    struct mg_rpc_channel_info_internal *ci =
+        mg_rpc_get_channel_info_internal(ri->rpc, ri->ch);
+    struct mg_str key = MG_NULL_STR;
+    /* Errors are rare and carry escaped messages, they go the usual way. */
+    if (mg_vcmp(&payload_prefix_json, "\"result\":") == 0 &&
+        mg_rpc_takes_parsed_frames(ci)) {
+      result = mg_rpc_respond_parsed(ri, ci, payload_jsonf, ap);
+    } else {
+      result = mg_rpc_dispatch_frame(ri->rpc, ri->dst, ri->src, ri->id,
+                                     ri->tag, key, ci, true /* enqueue */,
+                                     MG_RPC_PRIO_HIGH, payload_prefix_json,
+                                     payload_jsonf, ap);
+    }
   }
+  mg_rpc_free_request_info(ri);
   return result;
 }
 
@@ -683,6 +2674,9 @@ bool mg_rpc_vcallf(struct mg_rpc *c, const struct mg_str method,
     ri->id = id;
     ri->cb = cb;
     ri->cb_arg = cb_arg;
+    int timeout_ms = (opts != NULL ? opts->timeout_ms : 0);
+    if (timeout_ms == 0) timeout_ms = c->cfg->default_call_timeout_ms;
+    if (timeout_ms > 0) ri->deadline = mgos_uptime() + timeout_ms / 1000.0;
   } else {
     /* No callback - put marker in the frame that no response is expected */
     json_printf(&prefbout, "nr:%B,", true);
@@ -690,36 +2684,58 @@ bool mg_rpc_vcallf(struct mg_rpc *c, const struct mg_str method,
   json_printf(&prefbout, "method:%.*Q", (int) method.len, method.p);
   if (args_jsonf != NULL) json_printf(&prefbout, ",args:");
   const struct mg_str pprefix = mg_mk_str_n(prefb.buf, prefb.len);
-  struct mg_str src = opts->src;
+  struct mg_str src = (opts != NULL ? opts->src : mg_mk_str(NULL));
   if (src.len == 0) src = mg_mk_str(c->cfg->id);
 
+  /* Registered first, the response may come back before the call returns. */
+  if (ri != NULL && !mg_rpc_add_sent_request(c, ri)) {
+    mbuf_free(&prefb);
+    mg_rpc_free_sent_request(ri);
+    return false;
+  }
+
   bool result = false;
-  if (!opts->broadcast) {
+  enum mg_rpc_priority prio =
+      mg_rpc_call_prio((opts != NULL ? opts->prio : MG_RPC_PRIO_DEFAULT), cb);
+  if (opts == NULL || !opts->broadcast) {
     bool enqueue = (opts == NULL ? true : !opts->no_queue);
-    result = mg_rpc_dispatch_frame(c, src, dst, id, tag, key, NULL /* ci */,
-                                   enqueue, pprefix, args_jsonf, ap);
+    struct mg_str final_dst = dst;
+    struct mg_rpc_channel_info_internal *ci =
+        mg_rpc_get_channel_info_internal_by_dst(c, &final_dst);
+    if (key.len == 0 && mg_rpc_takes_parsed_frames(ci)) {
+      result = mg_rpc_call_parsed(c, ci, src, dst, final_dst, id, tag, method,
+                                  enqueue, prio, pprefix, args_jsonf, ap);
+    } else {
+      result = mg_rpc_dispatch_frame(c, src, dst, id, tag, key, NULL /* ci */,
+                                     enqueue, prio, pprefix, args_jsonf, ap);
+    }
   } else {
+    /* Formatted once (ap can only be consumed once anyway), then shared. */
     struct mg_rpc_channel_info_internal *ci;
+    struct mg_rpc_shared_frame *sf =
+        (struct mg_rpc_shared_frame *) calloc(1, sizeof(*sf));
+    sf->refcnt = 1;
+    mbuf_init(&sf->frame, 100);
+    mg_rpc_build_frame(c, &sf->frame, src, dst, id, tag, key, pprefix,
+                       args_jsonf, ap);
+    mbuf_trim(&sf->frame);
     SLIST_FOREACH(ci, &c->channels, channels) {
       if (ci->ch->is_broadcast_enabled == NULL ||
           !ci->ch->is_broadcast_enabled(ci->ch)) {
         continue;
       }
-      result |=
-          mg_rpc_dispatch_frame(c, src, dst, id, tag, key, ci,
-                                false /* enqueue */, pprefix, args_jsonf, ap);
+      result |= mg_rpc_broadcast_frame(c, ci, sf, prio);
     }
+    mg_rpc_shared_frame_unref(sf);
   }
   mbuf_free(&prefb);
 
-  if (result && ri != NULL) {
-    SLIST_INSERT_HEAD(&c->requests, ri, requests);
-    return true;
-  } else {
+  if (!result && ri != NULL) {
     /* Could not send or queue, drop on the floor. */
-    free(ri);
-    return false;
+    ri = mg_rpc_take_sent_request(c, id);
+    if (ri != NULL) mg_rpc_free_sent_request(ri);
   }
+  return result;
 }
 
 bool mg_rpc_callf(struct mg_rpc *c, const struct mg_str method,
@@ -733,23 +2749,143 @@ bool mg_rpc_callf(struct mg_rpc *c, const struct mg_str method,
   return res;
 }
 
+struct mg_rpc_prepared_call {
+  struct mg_rpc *c;
+  struct mg_str dst; /* As given, for routing. */
+  int timeout_ms;
+  bool enqueue;
+  enum mg_rpc_priority prio;
+  /*
+   * Envelope members, escaped: "src":..., ",dst":..., then tag and key,
+   * then ",method":... Frames to URI destinations go without dst.
+   */
+  struct mbuf envelope;
+  size_t dst_off, tag_off, method_off;
+  struct mbuf fb; /* Frame buffer, reused unless queued or adopted. */
+};
+
+struct mg_rpc_prepared_call *mg_rpc_prepare_call(
+    struct mg_rpc *c, const struct mg_str method,
+    const struct mg_rpc_call_opts *opts) {
+  if (c == NULL || (opts != NULL && opts->broadcast)) return NULL;
+  struct mg_rpc_prepared_call *pc =
+      (struct mg_rpc_prepared_call *) calloc(1, sizeof(*pc));
+  if (pc == NULL) return NULL;
+  struct json_out out = JSON_OUT_MBUF(&pc->envelope);
+  struct mg_str src = mg_mk_str(c->cfg->id);
+  pc->c = c;
+  pc->enqueue = true;
+  mbuf_init(&pc->envelope, 100);
+  mbuf_init(&pc->fb, 0);
+  if (opts != NULL) {
+    if (opts->src.len > 0) src = opts->src;
+    pc->dst = mg_strdup(opts->dst);
+    pc->timeout_ms = opts->timeout_ms;
+    pc->enqueue = !opts->no_queue;
+    pc->prio = opts->prio;
+  }
+  json_printf(&out, "src:%.*Q", (int) src.len, src.p);
+  pc->dst_off = pc->envelope.len;
+  if (pc->dst.len > 0) {
+    json_printf(&out, ",dst:%.*Q", (int) pc->dst.len, pc->dst.p);
+  }
+  pc->tag_off = pc->envelope.len;
+  if (opts != NULL && opts->tag.len > 0) {
+    json_printf(&out, ",tag:%.*Q", (int) opts->tag.len, opts->tag.p);
+  }
+  if (opts != NULL && opts->key.len > 0) {
+    json_printf(&out, ",key:%.*Q", (int) opts->key.len, opts->key.p);
+  }
+  pc->method_off = pc->envelope.len;
+  json_printf(&out, ",method:%.*Q", (int) method.len, method.p);
+  return pc;
+}
+
+bool mg_rpc_prepared_vcallf(struct mg_rpc_prepared_call *pc,
+                            mg_result_cb_t cb, void *cb_arg,
+                            const char *args_jsonf, va_list ap) {
+  if (pc == NULL) return false;
+  struct mg_rpc *c = pc->c;
+  struct mbuf *fb = &pc->fb;
+  struct json_out fout = JSON_OUT_MBUF(fb);
+  const char *env = pc->envelope.buf;
+  int64_t id = mg_rpc_get_id(c);
+  struct mg_str final_dst = pc->dst;
+  struct mg_rpc_channel_info_internal *ci =
+      mg_rpc_get_channel_info_internal_by_dst(c, &final_dst);
+  if (fb->size < MG_RPC_CHANNEL_FRAME_HEADROOM) {
+    mbuf_resize(fb, pc->envelope.len + 100);
+  }
+  fb->len = MG_RPC_CHANNEL_FRAME_HEADROOM;
+  json_printf(&fout, "{id:%lld,", id);
+  mbuf_append(fb, env, pc->dst_off);
+  if (final_dst.len > 0) {
+    mbuf_append(fb, env + pc->dst_off, pc->tag_off - pc->dst_off);
+  }
+  mbuf_append(fb, env + pc->tag_off, pc->method_off - pc->tag_off);
+  /* No callback - put marker in the frame that no response is expected */
+  if (cb == NULL) json_printf(&fout, ",nr:%B", true);
+  mbuf_append(fb, env + pc->method_off, pc->envelope.len - pc->method_off);
+  if (args_jsonf != NULL) {
+    json_printf(&fout, ",args:");
+    json_vprintf(&fout, args_jsonf, ap);
+  }
+  json_printf(&fout, "}");
+  struct mg_rpc_sent_request_info *ri = NULL;
+  if (cb != NULL) {
+    ri = (struct mg_rpc_sent_request_info *) calloc(1, sizeof(*ri));
+    ri->id = id;
+    ri->cb = cb;
+    ri->cb_arg = cb_arg;
+    int timeout_ms = pc->timeout_ms;
+    if (timeout_ms == 0) timeout_ms = c->cfg->default_call_timeout_ms;
+    if (timeout_ms > 0) ri->deadline = mgos_uptime() + timeout_ms / 1000.0;
+    if (!mg_rpc_add_sent_request(c, ri)) {
+      fb->len = 0;
+      mg_rpc_free_sent_request(ri);
+      return false;
+    }
+  }
+  bool result =
+      mg_rpc_try_dispatch_mbuf(c, ci, true /* by_dst */, pc->dst, pc->enqueue,
+                               mg_rpc_call_prio(pc->prio, cb), id, fb);
+  fb->len = 0;
+  if (!result && ri != NULL) {
+    ri = mg_rpc_take_sent_request(c, id);
+    if (ri != NULL) mg_rpc_free_sent_request(ri);
+  }
+  return result;
+}
+
+bool mg_rpc_prepared_callf(struct mg_rpc_prepared_call *pc, mg_result_cb_t cb,
+                           void *cb_arg, const char *args_jsonf, ...) {
+  va_list ap;
+  va_start(ap, args_jsonf);
+  bool res = mg_rpc_prepared_vcallf(pc, cb, cb_arg, args_jsonf, ap);
+  va_end(ap);
+  return res;
+}
+
+void mg_rpc_prepared_call_free(struct mg_rpc_prepared_call *pc) {
+  if (pc == NULL) return;
+  free((void *) pc->dst.p);
+  mbuf_free(&pc->envelope);
+  mbuf_free(&pc->fb);
+  free(pc);
+}
+
 bool mg_rpc_send_responsef(struct mg_rpc_request_info *ri,
                            const char *result_json_fmt, ...) {
   struct mbuf prefb;
   bool result = true;
   va_list ap;
-  struct mg_str key = MG_NULL_STR;
-  struct mg_rpc_channel_info_internal *ci;
   if (result_json_fmt == NULL) return mg_rpc_send_responsef(ri, "%s", "null");
-  ci = mg_rpc_get_channel_info_internal(ri->rpc, ri->ch);
   mbuf_init(&prefb, 15);
   mbuf_append(&prefb, "\"result\":", 9);
   va_start(ap, result_json_fmt);
-  result = mg_rpc_dispatch_frame(
-      ri->rpc, ri->dst, ri->src, ri->id, ri->tag, key, ci, true /* enqueue */,
-      mg_mk_str_n(prefb.buf, prefb.len), result_json_fmt, ap);
+  result = mg_rpc_dispatch_response(ri, mg_mk_str_n(prefb.buf, prefb.len),
+                                    result_json_fmt, ap);
   va_end(ap);
-  mg_rpc_free_request_info(ri);
   mbuf_free(&prefb);
   return result;
 }
@@ -782,13 +2918,9 @@ static bool send_errorf(struct mg_rpc_request_info *ri, int error_code,
   json_printf(&prefbout, "}");
   va_list dummy;
   memset(&dummy, 0, sizeof(dummy));
-  struct mg_rpc_channel_info_internal *ci =
-      mg_rpc_get_channel_info_internal(ri->rpc, ri->ch);
-  struct mg_str key = MG_NULL_STR;
-  bool result = mg_rpc_dispatch_frame(
-      ri->rpc, ri->dst, ri->src, ri->id, ri->tag, key, ci, true /* enqueue */,
-      mg_mk_str_n(prefb.buf, prefb.len), NULL, dummy);
-  mg_rpc_free_request_info(ri);
+  bool result =
+      mg_rpc_dispatch_response(ri, mg_mk_str_n(prefb.buf, prefb.len), NULL,
+                               dummy);
   mbuf_free(&prefb);
   return result;
 }
@@ -811,7 +2943,173 @@ bool mg_rpc_send_error_jsonf(struct mg_rpc_request_info *ri, int error_code,
   return ret;
 }
 
+/* Streamed responses */
+
+static struct mg_rpc_channel_info_internal *mg_rpc_stream_ci(
+    struct mg_rpc_request_info *ri) {
+  struct mg_rpc_req_block *rb = (struct mg_rpc_req_block *) ri;
+  if (!rb->is_streaming || rb->stream_broken) return NULL;
+  return mg_rpc_get_channel_info_internal(ri->rpc, ri->ch);
+}
+
+/* Channel is ready for the next chunk if nothing is waiting ahead of it. */
+static bool mg_rpc_stream_can_send(
+    const struct mg_rpc_channel_info_internal *ci) {
+  return (mg_rpc_channel_can_send(ci) && STAILQ_EMPTY(&ci->queue));
+}
+
+/*
+ * Lets producers of streams on the channel know it can take more.
+ * A callback may end any stream, itself or others, or close the channel,
+ * so the list is walked again from the start after each one; streams
+ * already notified in this round are skipped.
+ */
+static void mg_rpc_notify_streams(struct mg_rpc *c,
+                                  struct mg_rpc_channel_info_internal *ci,
+                                  bool ok) {
+  struct mg_rpc_req_block *rb;
+  uint32_t gen = ++c->stream_notify_gen;
+  struct mg_rpc_channel *ch = ci->ch;
+restart:
+  SLIST_FOREACH(rb, &c->streams, streams) {
+    if (rb->ri.ch != ch || rb->stream_broken ||
+        rb->stream_notify_gen == gen) {
+      continue;
+    }
+    if (ok && !mg_rpc_stream_can_send(ci)) break;
+    rb->stream_notify_gen = gen;
+    if (!ok) rb->stream_broken = true;
+    if (rb->stream_cb != NULL) {
+      rb->stream_cb(&rb->ri, rb->stream_cb_arg, ok);
+      /* The channel may have gone too. */
+      if (ok && (ci = mg_rpc_get_channel_info_internal(c, ch)) == NULL) break;
+      goto restart;
+    }
+  }
+}
+
+/* For channels that stream natively. END is always accepted. */
+static bool mg_rpc_send_stream_op(struct mg_rpc_channel_info_internal *ci,
+                                  enum mg_rpc_channel_stream_op op,
+                                  const struct mg_str data) {
+  struct mg_rpc_channel *ch = ci->ch;
+  if (op != MG_RPC_CHANNEL_STREAM_END && !mg_rpc_stream_can_send(ci)) {
+    return false;
+  }
+  ci->num_in_flight++;
+  if (!ch->send_stream(ch, op, data)) {
+    if (ci->num_in_flight > 0) ci->num_in_flight--;
+    return false;
+  }
+  /* Bytes as they go, the frame once it's complete. */
+  ci->counters.bytes_out += data.len;
+  if (op == MG_RPC_CHANNEL_STREAM_END) {
+    ci->counters.frames_out++;
+  }
+  ci->counters.last_activity = mgos_uptime();
+  return true;
+}
+
+/*
+ * For the rest, every chunk is a frame. Only the last one may be queued,
+ * so at most one chunk is buffered.
+ */
+static bool mg_rpc_send_chunk_frame(struct mg_rpc_request_info *ri,
+                                    struct mg_rpc_channel_info_internal *ci,
+                                    const struct mg_str data, bool last) {
+  struct mbuf fb, prefb;
+  struct json_out prefbout = JSON_OUT_MBUF(&prefb);
+  va_list dummy;
+  memset(&dummy, 0, sizeof(dummy));
+  mbuf_init(&prefb, data.len + 20);
+  json_printf(&prefbout, "chunk:%.*Q", (int) data.len, data.p);
+  if (last) json_printf(&prefbout, ",last:%B", true);
+  mbuf_init(&fb, prefb.len + 100);
+  fb.len = MG_RPC_CHANNEL_FRAME_HEADROOM;
+  mg_rpc_build_frame(ri->rpc, &fb, ri->dst, ri->src, ri->id, ri->tag,
+                     mg_mk_str(""), mg_mk_str_n(prefb.buf, prefb.len), NULL,
+                     dummy);
+  mbuf_free(&prefb);
+  return mg_rpc_dispatch_mbuf(ri->rpc, ci, false /* by_dst */, mg_mk_str(""),
+                              last /* enqueue */, MG_RPC_PRIO_HIGH, ri->id,
+                              &fb);
+}
+
+bool mg_rpc_send_response_begin(struct mg_rpc_request_info *ri,
+                                mg_rpc_stream_cb_t cb, void *cb_arg) {
+  struct mg_rpc_req_block *rb = (struct mg_rpc_req_block *) ri;
+  struct mg_rpc *c = ri->rpc;
+  struct mg_rpc_channel_info_internal *ci =
+      mg_rpc_get_channel_info_internal(c, ri->ch);
+  if (rb->batch != NULL || rb->is_streaming || ci == NULL || !ci->is_open) {
+    return false;
+  }
+  if (ci->ch->send_stream != NULL) {
+    struct mbuf fb;
+    va_list dummy;
+    memset(&dummy, 0, sizeof(dummy));
+    mbuf_init(&fb, 100);
+    mg_rpc_build_frame(c, &fb, ri->dst, ri->src, ri->id, ri->tag,
+                       mg_mk_str(""), mg_mk_str("\"result\":"), NULL, dummy);
+    fb.len--; /* Closing brace goes out with END. */
+    bool ok = mg_rpc_send_stream_op(ci, MG_RPC_CHANNEL_STREAM_BEGIN,
+                                    mg_mk_str_n(fb.buf, fb.len));
+    mbuf_free(&fb);
+    if (!ok) return false;
+  }
+  rb->is_streaming = true;
+  rb->stream_cb = cb;
+  rb->stream_cb_arg = cb_arg;
+  rb->stream_notify_gen = c->stream_notify_gen;
+  SLIST_INSERT_HEAD(&c->streams, rb, streams);
+  return true;
+}
+
+bool mg_rpc_send_response_chunkf(struct mg_rpc_request_info *ri,
+                                 const char *chunk_json_fmt, ...) {
+  struct mg_rpc_channel_info_internal *ci = mg_rpc_stream_ci(ri);
+  /* Check first, so that busy channel costs no formatting. */
+  if (ci == NULL || !mg_rpc_stream_can_send(ci)) return false;
+  struct mbuf cb;
+  struct json_out cbout = JSON_OUT_MBUF(&cb);
+  va_list ap;
+  mbuf_init(&cb, 0);
+  va_start(ap, chunk_json_fmt);
+  json_vprintf(&cbout, chunk_json_fmt, ap);
+  va_end(ap);
+  bool result = true;
+  if (cb.len > 0) {
+    struct mg_str chunk = mg_mk_str_n(cb.buf, cb.len);
+    result = (ci->ch->send_stream != NULL
+                  ? mg_rpc_send_stream_op(ci, MG_RPC_CHANNEL_STREAM_DATA, chunk)
+                  : mg_rpc_send_chunk_frame(ri, ci, chunk, false /* last */));
+  }
+  mbuf_free(&cb);
+  return result;
+}
+
+bool mg_rpc_send_response_end(struct mg_rpc_request_info *ri) {
+  struct mg_rpc_channel_info_internal *ci = mg_rpc_stream_ci(ri);
+  bool result = false;
+  if (ci != NULL) {
+    result =
+        (ci->ch->send_stream != NULL
+             ? mg_rpc_send_stream_op(ci, MG_RPC_CHANNEL_STREAM_END,
+                                     mg_mk_str("}"))
+             : mg_rpc_send_chunk_frame(ri, ci, mg_mk_str(""), true /* last */));
+  }
+  if (!result) {
+    LOG(LL_ERROR, ("Failed to finish response to %lld", (long long) ri->id));
+  }
+  mg_rpc_free_request_info(ri);
+  return result;
+}
+
 bool mg_rpc_check_digest_auth(struct mg_rpc_request_info *ri) {
+  if (ri->authn_info.username.len == 0 && ri->ch->set_authn_info != NULL) {
+    /* Channel remembers successful authentication, see if there was one. */
+    ri->ch->get_authn_info(ri->ch, NULL, NULL, &ri->authn_info);
+  }
   if (ri->authn_info.username.len > 0) {
     LOG(LL_DEBUG,
         ("Already have username in request info: \"%.*s\", skip checking",
@@ -820,20 +3118,36 @@ bool mg_rpc_check_digest_auth(struct mg_rpc_request_info *ri) {
   }
 
   if (ri->auth.len > 0) {
-    struct json_token trealm = JSON_INVALID_TOKEN,
-                      tusername = JSON_INVALID_TOKEN,
-                      tnonce = JSON_INVALID_TOKEN, tcnonce = JSON_INVALID_TOKEN,
-                      tresponse = JSON_INVALID_TOKEN;
-
-    if (json_scanf(ri->auth.p, ri->auth.len,
-                   "{realm: %T username %T nonce:%T cnonce:%T response:%T}",
-                   &trealm, &tusername, &tnonce, &tcnonce, &tresponse) == 5) {
-      struct mg_str realm = mg_mk_str_n(trealm.ptr, trealm.len);
-      struct mg_str username = mg_mk_str_n(tusername.ptr, tusername.len);
-      struct mg_str nonce = mg_mk_str_n(tnonce.ptr, tnonce.len);
-      struct mg_str cnonce = mg_mk_str_n(tcnonce.ptr, tcnonce.len);
-      struct mg_str response = mg_mk_str_n(tresponse.ptr, tresponse.len);
+    struct mg_str realm = MG_NULL_STR, username = MG_NULL_STR;
+    struct mg_str nonce = MG_NULL_STR, cnonce = MG_NULL_STR;
+    struct mg_str response = MG_NULL_STR;
+    struct mg_rpc_json_scanner s;
+    struct mg_str k, v;
+    enum mg_rpc_json_type t;
+    int num_parts = 0;
+
+    if (mg_rpc_json_begin_object(&s, ri->auth)) {
+      while (mg_rpc_json_next_member(&s, &k, &v, &t) > 0) {
+        struct mg_str *part = NULL;
+        if (mg_vcmp(&k, "realm") == 0) {
+          part = &realm;
+        } else if (mg_vcmp(&k, "username") == 0) {
+          part = &username;
+        } else if (mg_vcmp(&k, "nonce") == 0) {
+          part = &nonce;
+        } else if (mg_vcmp(&k, "cnonce") == 0) {
+          part = &cnonce;
+        } else if (mg_vcmp(&k, "response") == 0) {
+          part = &response;
+        }
+        if (part == NULL) continue;
+        if (part->p == NULL) num_parts++;
+        /* Empty string still counts as present. */
+        *part = (v.len > 0 ? v : mg_mk_str(""));
+      }
+    }
 
+    if (num_parts == 5) {
       LOG(LL_DEBUG, ("Got auth: Realm:%.*s, Username:%.*s, Nonce: %.*s, "
                      "CNonce:%.*s, Response:%.*s",
                      (int) realm.len, realm.p, (int) username.len, username.p,
@@ -846,29 +3160,28 @@ bool mg_rpc_check_digest_auth(struct mg_rpc_request_info *ri) {
              "\"%s\", got: \"%.*s\"",
              mgos_sys_config_get_rpc_auth_domain(), realm.len, realm.p));
       } else {
-        FILE *htdigest_fp = fopen(mgos_sys_config_get_rpc_auth_file(), "r");
-
-        if (htdigest_fp == NULL) {
-          mg_rpc_send_errorf(ri, 500, "failed to open htdigest file");
-          ri = NULL;
-          return false;
-        }
-
         /*
          * TODO(dfrank): add method to the struct mg_rpc_request_info and use
          * it as either method or uri
          */
-        int authenticated = mg_check_digest_auth(
-            mg_mk_str("dummy_method"), mg_mk_str("dummy_uri"), username, cnonce,
-            response, mg_mk_str("auth"), mg_mk_str("1"), nonce, realm,
-            htdigest_fp);
+        int authenticated = mg_rpc_htdigest_check(
+            mgos_sys_config_get_rpc_auth_file(), mg_mk_str("dummy_method"),
+            mg_mk_str("dummy_uri"), username, cnonce, response,
+            mg_mk_str("auth"), mg_mk_str("1"), nonce, realm);
 
-        fclose(htdigest_fp);
+        if (authenticated < 0) {
+          mg_rpc_send_errorf(ri, 500, "failed to open htdigest file");
+          ri = NULL;
+          return false;
+        }
 
         LOG(LL_DEBUG, ("Authenticated:%d", authenticated));
 
         if (authenticated) {
           ri->authn_info.username = mg_strdup(username);
+          if (ri->ch->set_authn_info != NULL) {
+            ri->ch->set_authn_info(ri->ch, &ri->authn_info);
+          }
           return true;
         }
       }
@@ -888,20 +3201,184 @@ bool mg_rpc_check_digest_auth(struct mg_rpc_request_info *ri) {
 void mg_rpc_add_handler(struct mg_rpc *c, const char *method,
                         const char *args_fmt, mg_handler_cb_t cb,
                         void *cb_arg) {
+  struct mg_rpc_handler_opts opts;
+  memset(&opts, 0, sizeof(opts));
+  opts.args_fmt = args_fmt;
+  mg_rpc_add_handler_opt(c, method, cb, cb_arg, &opts);
+}
+
+void mg_rpc_add_handler_opt(struct mg_rpc *c, const char *method,
+                            mg_handler_cb_t cb, void *cb_arg,
+                            const struct mg_rpc_handler_opts *opts) {
   if (c == NULL) return;
   struct mg_rpc_handler_info *hi =
       (struct mg_rpc_handler_info *) calloc(1, sizeof(*hi));
   hi->method = method;
+  hi->method_len = strlen(method);
+  hi->method_hash = mg_rpc_hash(mg_mk_str_n(method, hi->method_len));
   hi->cb = cb;
   hi->cb_arg = cb_arg;
-  hi->args_fmt = args_fmt;
+  if (opts != NULL) {
+    hi->args_fmt = opts->args_fmt;
+    hi->cache_ttl_ms = opts->cache_ttl_ms;
+    hi->rate_limit = opts->rate_limit;
+    hi->rate_burst = opts->rate_burst;
+    hi->offload = opts->offload;
+    hi->max_concurrency = opts->max_concurrency;
+    hi->args_offsets = opts->args_offsets;
+    hi->args_size = opts->args_size;
+  }
+  mg_rpc_compile_args_fmt(hi);
+  if (hi->args_offsets != NULL && hi->args == NULL) {
+    LOG(LL_ERROR, ("%s: args_fmt can't be decoded into a struct", method));
+    hi->args_offsets = NULL;
+  }
+  SLIST_INIT(&hi->cache);
   SLIST_INSERT_HEAD(&c->handlers, hi, handlers);
+  c->num_handlers++;
+  if (c->num_handlers * 2 > c->htab_size && !mg_rpc_htab_grow(c)) {
+    if (c->num_handlers >= c->htab_size) {
+      LOG(LL_ERROR, ("Failed to grow handler table"));
+      return;
+    }
+  }
+  /* Replaces the previous handler for the same method, if any. */
+  *mg_rpc_htab_slot(c->htab, c->htab_size, hi->method_hash,
+                    mg_mk_str_n(hi->method, hi->method_len)) = hi;
+}
+
+static void mg_rpc_free_prehandlers(struct mg_rpc *c) {
+  struct mg_rpc_prehandler_info *pi;
+  while ((pi = SLIST_FIRST(&c->prehandlers)) != NULL) {
+    SLIST_REMOVE_HEAD(&c->prehandlers, prehandlers);
+    free(pi);
+  }
 }
 
 void mg_rpc_set_prehandler(struct mg_rpc *c, mg_prehandler_cb_t cb,
                            void *cb_arg) {
-  c->prehandler = cb;
-  c->prehandler_arg = cb_arg;
+  if (c == NULL) return;
+  mg_rpc_free_prehandlers(c);
+  if (cb != NULL) mg_rpc_add_prehandler(c, cb, cb_arg);
+}
+
+void mg_rpc_add_handlers_from(struct mg_rpc *c, const struct mg_rpc *from) {
+  const struct mg_rpc_handler_info *hi;
+  if (c == NULL || from == NULL) return;
+  /* List head is the most recent, it wins for duplicate methods. */
+  SLIST_FOREACH(hi, &from->handlers, handlers) {
+    struct mg_str method = mg_mk_str_n(hi->method, hi->method_len);
+    if (mg_rpc_find_handler(c, method) != NULL) continue;
+    struct mg_rpc_handler_opts opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.args_fmt = hi->args_fmt;
+    opts.cache_ttl_ms = hi->cache_ttl_ms;
+    opts.rate_limit = hi->rate_limit;
+    opts.rate_burst = hi->rate_burst;
+    opts.offload = hi->offload;
+    opts.max_concurrency = hi->max_concurrency;
+    opts.args_offsets = hi->args_offsets;
+    opts.args_size = hi->args_size;
+    mg_rpc_add_handler_opt(c, hi->method, hi->cb, hi->cb_arg, &opts);
+  }
+}
+
+void mg_rpc_set_offload_executor(struct mg_rpc *c,
+                                 mg_rpc_offload_executor_t ex) {
+  if (c == NULL) return;
+  c->offload_executor = ex;
+}
+
+void mg_rpc_add_prehandler(struct mg_rpc *c, mg_prehandler_cb_t cb,
+                           void *cb_arg) {
+  if (c == NULL || cb == NULL) return;
+  struct mg_rpc_prehandler_info *pi =
+      (struct mg_rpc_prehandler_info *) calloc(1, sizeof(*pi));
+  if (pi == NULL) return;
+  pi->cb = cb;
+  pi->cb_arg = cb_arg;
+  /* Few of them, walk to the end to keep the order. */
+  struct mg_rpc_prehandler_info *last = SLIST_FIRST(&c->prehandlers);
+  while (last != NULL && SLIST_NEXT(last, prehandlers) != NULL) {
+    last = SLIST_NEXT(last, prehandlers);
+  }
+  if (last != NULL) {
+    SLIST_INSERT_AFTER(last, pi, prehandlers);
+  } else {
+    SLIST_INSERT_HEAD(&c->prehandlers, pi, prehandlers);
+  }
+}
+
+void mg_rpc_batch_begin(struct mg_rpc *c) {
+  if (c == NULL) return;
+  c->batch_depth++;
+}
+
+/* Single frames are left alone, otherwise head gets the array frame. */
+static void mg_rpc_finish_batch_entry(struct mg_rpc_queue_entry *head,
+                                      struct mbuf *bb, int num_frames) {
+  if (num_frames > 1) {
+    mbuf_append(bb, "]", 1);
+    mbuf_free(&head->frame);
+    head->frame = *bb;
+    head->id = 0;
+    head->is_array = true;
+    mbuf_init(bb, 0);
+  } else {
+    mbuf_free(bb);
+  }
+}
+
+/*
+ * Replaces runs of adjacent frames in the channel's batch with array frames,
+ * keeping each under max_frame_size, if set. Frames queued outside the batch
+ * split the runs, so the order of frames on the channel stays the same.
+ */
+static void mg_rpc_coalesce_batch(struct mg_rpc *c,
+                                  struct mg_rpc_channel_info_internal *ci) {
+  const size_t hr = MG_RPC_CHANNEL_FRAME_HEADROOM;
+  size_t max_size = (c->cfg->max_frame_size > 0 ? c->cfg->max_frame_size : 0);
+  struct mg_rpc_queue_entry *qe, *tqe, *head = NULL;
+  struct mbuf bb;
+  int num_frames = 0;
+  mbuf_init(&bb, 0);
+  STAILQ_FOREACH_SAFE(qe, &ci->queue, queue, tqe) {
+    if (!qe->in_batch) {
+      if (head != NULL) mg_rpc_finish_batch_entry(head, &bb, num_frames);
+      head = NULL;
+      continue;
+    }
+    qe->in_batch = false;
+    size_t f_len = qe->frame.len - hr;
+    if (head != NULL && max_size > 0 &&
+        bb.len - hr + 1 + f_len + 1 > max_size) {
+      mg_rpc_finish_batch_entry(head, &bb, num_frames);
+      head = NULL;
+    }
+    if (head == NULL) {
+      head = qe;
+      num_frames = 0;
+      mbuf_init(&bb, hr + 1 + f_len + 1);
+      bb.len = hr;
+    }
+    mbuf_append(&bb, (num_frames > 0 ? "," : "["), 1);
+    mbuf_append(&bb, qe->frame.buf + hr, f_len);
+    if (num_frames++ > 0) mg_rpc_remove_queue_entry(c, qe);
+  }
+  if (head != NULL) mg_rpc_finish_batch_entry(head, &bb, num_frames);
+}
+
+bool mg_rpc_batch_commit(struct mg_rpc *c) {
+  struct mg_rpc_channel_info_internal *ci;
+  if (c == NULL || c->batch_depth == 0) return false;
+  if (--c->batch_depth > 0) return true;
+  SLIST_FOREACH(ci, &c->channels, channels) {
+    mg_rpc_coalesce_batch(c, ci);
+  }
+  SLIST_FOREACH(ci, &c->channels, channels) {
+    mg_rpc_process_channel_queue(c, ci);
+  }
+  return true;
 }
 
 bool mg_rpc_is_connected(struct mg_rpc *c) {
@@ -915,18 +3392,38 @@ bool mg_rpc_can_send(struct mg_rpc *c) {
   struct mg_str dd = mg_mk_str(MG_RPC_DST_DEFAULT);
   struct mg_rpc_channel_info_internal *ci =
       mg_rpc_get_channel_info_internal_by_dst(c, &dd);
-  return (ci != NULL && ci->is_open && !ci->is_busy);
+  return mg_rpc_channel_can_send(ci);
 }
 
 void mg_rpc_free_request_info(struct mg_rpc_request_info *ri) {
-  free((void *) ri->src.p);
-  free((void *) ri->dst.p);
-  free((void *) ri->tag.p);
-  free((void *) ri->method.p);
-  free((void *) ri->auth.p);
+  struct mg_rpc_req_block *b = (struct mg_rpc_req_block *) ri;
+  struct mg_rpc *c = ri->rpc;
+  struct mg_rpc_batch *batch = b->batch;
+  struct mg_rpc_cache_entry *ce = b->cache_entry;
+  bool was_offloaded = b->is_offloaded;
+  if (b->hi != NULL) mg_rpc_stats_add_latency(b->hi->latency, b->start);
+  if (was_offloaded) {
+    b->hi->num_offloaded--;
+    c->num_offloaded--;
+  }
+  if (b->is_streaming) {
+    SLIST_REMOVE(&c->streams, b, mg_rpc_req_block, streams);
+  }
+  if (ce != NULL) ce->leader = NULL;
   mg_rpc_authn_info_free(&ri->authn_info);
   memset(ri, 0, sizeof(*ri));
-  free(ri);
+  if (b->size == MG_RPC_REQ_BLOCK_SIZE && c != NULL &&
+      c->num_free_req_blocks < MG_RPC_REQ_BLOCK_POOL_SIZE) {
+    b->next_free = c->free_req_blocks;
+    c->free_req_blocks = b;
+    c->num_free_req_blocks++;
+  } else {
+    free(b);
+  }
+  /* Request is done with, with or without a response. */
+  if (batch != NULL) mg_rpc_batch_unref(batch);
+  if (ce != NULL) mg_rpc_cache_abandon(c, ce);
+  if (was_offloaded) mg_rpc_offload_kick(c);
 }
 
 void mg_rpc_add_observer(struct mg_rpc *c, mg_observer_cb_t cb, void *cb_arg) {
@@ -953,6 +3450,23 @@ void mg_rpc_remove_observer(struct mg_rpc *c, mg_observer_cb_t cb,
 
 void mg_rpc_free(struct mg_rpc *c) {
   /* FIXME(rojer): free other stuff */
+  free(c->htab);
+  /* Pending requests are not freed, but must not time out later. */
+  for (size_t i = 0; i < c->num_req_buckets; i++) {
+    struct mg_rpc_sent_request_info *ri;
+    SLIST_FOREACH(ri, &c->req_buckets[i], requests) {
+      mg_rpc_timer_clear(&ri->deadline_timer);
+    }
+  }
+  if (c->own_timers) mg_rpc_timers_free(c->timers);
+  free(c->req_buckets);
+  free(c->dst_buckets);
+  while (c->free_req_blocks != NULL) {
+    struct mg_rpc_req_block *b = c->free_req_blocks;
+    c->free_req_blocks = b->next_free;
+    free(b);
+  }
+  mg_rpc_free_prehandlers(c);
   mbuf_free(&c->local_ids);
   free(c);
 }
@@ -992,30 +3506,121 @@ static void mg_rpc_describe_handler(struct mg_rpc_request_info *ri,
     return;
   }
   struct mg_str name = mg_mk_str_n(t.ptr, t.len);
-  SLIST_FOREACH(hi, &ri->rpc->handlers, handlers) {
-    if (mg_vcmp(&name, hi->method) == 0) {
-      struct mbuf mbuf;
-      struct json_out out = JSON_OUT_MBUF(&mbuf);
-      mbuf_init(&mbuf, 100);
-      json_printf(&out, "{name: %.*Q, args_fmt: %Q}", t.len, t.ptr,
-                  hi->args_fmt);
-      mg_rpc_send_responsef(ri, "%.*s", mbuf.len, mbuf.buf);
-      mbuf_free(&mbuf);
-      return;
+  hi = mg_rpc_find_handler(ri->rpc, name);
+  if (hi != NULL) {
+    struct mbuf mbuf;
+    struct json_out out = JSON_OUT_MBUF(&mbuf);
+    mbuf_init(&mbuf, 100);
+    json_printf(&out, "{name: %.*Q, args_fmt: %Q", t.len, t.ptr,
+                hi->args_fmt);
+    /* Compiled fields, if args_fmt is simple enough. */
+    if (hi->args != NULL) {
+      json_printf(&out, ", args: {");
+      for (int i = 0; i < hi->num_args; i++) {
+        const struct mg_rpc_arg_field *f = &hi->args[i];
+        json_printf(&out, "%s%.*Q: %Q", (i > 0 ? ", " : ""), (int) f->name.len,
+                    f->name.p, mg_rpc_arg_type_name(f->type));
+      }
+      json_printf(&out, "}");
     }
+    json_printf(&out, "}");
+    mg_rpc_send_responsef(ri, "%.*s", mbuf.len, mbuf.buf);
+    mbuf_free(&mbuf);
+    return;
   }
   mg_rpc_send_errorf(ri, 404, "name not found");
   (void) cb_arg;
   (void) fi;
 }
 
+static void mg_rpc_print_hist(struct json_out *out, const uint32_t *hist) {
+  json_printf(out, "[");
+  for (int i = 0; i < MG_RPC_STATS_NUM_BUCKETS; i++) {
+    json_printf(out, (i > 0 ? ",%u" : "%u"), (unsigned int) hist[i]);
+  }
+  json_printf(out, "]");
+}
+
+/*
+ * Return counters. Latency histograms are arrays, element i counts latencies
+ * under 2^i ms (first - under 1 ms), the last one - the rest.
+ * With reset: true, counters are zeroed after being reported, so that a load
+ * test can be measured on its own.
+ */
+static void mg_rpc_stats_handler(struct mg_rpc_request_info *ri, void *cb_arg,
+                                 struct mg_rpc_frame_info *fi,
+                                 struct mg_str args) {
+  struct mg_rpc *c = ri->rpc;
+  const struct mg_rpc_stats *st = &c->stats;
+  struct mg_rpc_handler_info *hi;
+  struct mbuf mbuf;
+  struct json_out out = JSON_OUT_MBUF(&mbuf);
+  bool first = true;
+
+  mbuf_init(&mbuf, 500);
+  json_printf(&out, "{channels: {");
+  for (int i = 0; i < MG_RPC_STATS_NUM_CH_TYPES; i++) {
+    const struct mg_rpc_ch_type_stats *cts = &st->ch_types[i];
+    if (cts->type == NULL) break;
+    json_printf(&out, "%s%Q: {frames_in: %u, frames_out: %u}",
+                (i > 0 ? "," : ""), cts->type, (unsigned int) cts->frames_in,
+                (unsigned int) cts->frames_out);
+  }
+  json_printf(&out,
+              "}, invalid_frames: %u, dropped_frames: %u, "
+              "evicted_frames: %u, queue_len: %d, queue_len_hwm: %d, "
+              "calls_timed_out: %u, rate_limited: %u, call_latency: ",
+              (unsigned int) st->invalid_frames,
+              (unsigned int) st->dropped_frames,
+              (unsigned int) st->evicted_frames, c->queue_len,
+              st->queue_len_hwm, (unsigned int) st->calls_timed_out,
+              (unsigned int) st->rate_limited);
+  mg_rpc_print_hist(&out, st->call_latency);
+  json_printf(&out, ", methods: {");
+  /* Only methods which have been called. */
+  SLIST_FOREACH(hi, &c->handlers, handlers) {
+    uint32_t n = 0;
+    for (int i = 0; i < MG_RPC_STATS_NUM_BUCKETS; i++) n += hi->latency[i];
+    if (n == 0) continue;
+    json_printf(&out, "%s%Q: {calls: %u, latency: ", (first ? "" : ","),
+                hi->method, (unsigned int) n);
+    mg_rpc_print_hist(&out, hi->latency);
+    json_printf(&out, "}");
+    first = false;
+  }
+  json_printf(&out, "}}");
+
+  bool reset = false;
+  json_scanf(args.p, args.len, ri->args_fmt, &reset);
+  if (reset) {
+    /* Channel type slots are kept, types are static strings. */
+    for (int i = 0; i < MG_RPC_STATS_NUM_CH_TYPES; i++) {
+      c->stats.ch_types[i].frames_in = c->stats.ch_types[i].frames_out = 0;
+    }
+    c->stats.invalid_frames = c->stats.dropped_frames = 0;
+    c->stats.evicted_frames = c->stats.calls_timed_out = 0;
+    c->stats.rate_limited = 0;
+    c->stats.queue_len_hwm = c->queue_len;
+    memset(c->stats.call_latency, 0, sizeof(c->stats.call_latency));
+    SLIST_FOREACH(hi, &c->handlers, handlers) {
+      memset(hi->latency, 0, sizeof(hi->latency));
+    }
+  }
+
+  mg_rpc_send_responsef(ri, "%.*s", mbuf.len, mbuf.buf);
+  mbuf_free(&mbuf);
+
+  (void) cb_arg;
+  (void) fi;
+}
+
 /* Reply with the peer info */
 static void mg_rpc_ping_handler(struct mg_rpc_request_info *ri, void *cb_arg,
                                 struct mg_rpc_frame_info *fi,
                                 struct mg_str args) {
-  char *info = ri->ch->get_info(ri->ch);
-  mg_rpc_send_responsef(ri, "{channel_info: %Q}", info == NULL ? "" : info);
-  free(info);
+  char info[64];
+  mg_rpc_channel_write_info(ri->ch, info, sizeof(info));
+  mg_rpc_send_responsef(ri, "{channel_info: %Q}", info);
   (void) fi;
   (void) cb_arg;
   (void) args;
@@ -1075,9 +3680,39 @@ void mg_rpc_channel_info_free_all(struct mg_rpc_channel_info *cici,
   free(cici);
 }
 
+int mg_rpc_foreach_channel(struct mg_rpc *c, char *info_buf, size_t info_size,
+                           mg_rpc_channel_visitor_t cb, void *cb_arg) {
+  int n = 0;
+  struct mg_rpc_channel_info_internal *ci;
+  if (c == NULL) return 0;
+  SLIST_FOREACH(ci, &c->channels, channels) {
+    struct mg_rpc_channel *ch = ci->ch;
+    struct mg_rpc_channel_view cv;
+    memset(&cv, 0, sizeof(cv));
+    cv.ch = ch;
+    cv.type = mg_mk_str(ch->get_type(ch));
+    cv.dst = ci->dst;
+    if (info_buf != NULL && info_size > 0) {
+      size_t len = mg_rpc_channel_write_info(ch, info_buf, info_size);
+      cv.info = mg_mk_str_n(info_buf, len);
+    }
+    cv.queue_len = ci->queue_len;
+    cv.num_in_flight = ci->num_in_flight;
+    cv.counters = &ci->counters;
+    cv.is_open = ci->is_open;
+    cv.is_persistent = ch->is_persistent(ch);
+    cv.is_broadcast_enabled = ch->is_broadcast_enabled(ch);
+    n++;
+    if (!cb(&cv, cb_arg)) break;
+  }
+  return n;
+}
+
 void mg_rpc_add_list_handler(struct mg_rpc *c) {
   mg_rpc_add_handler(c, "RPC.List", "", mg_rpc_list_handler, NULL);
   mg_rpc_add_handler(c, "RPC.Describe", "{name: %T}", mg_rpc_describe_handler,
                      NULL);
   mg_rpc_add_handler(c, "RPC.Ping", "", mg_rpc_ping_handler, NULL);
+  mg_rpc_add_handler(c, "RPC.Stats", "{reset: %B}", mg_rpc_stats_handler,
+                     NULL);
 }
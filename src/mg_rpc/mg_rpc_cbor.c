@@ -0,0 +1,807 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mg_rpc_cbor.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "frozen.h"
+
+/* Maximum nesting of arrays and maps, in either direction. */
+#define MG_RPC_CBOR_MAX_DEPTH 32
+
+#define MG_RPC_CBOR_INDEFINITE 31
+#define MG_RPC_CBOR_BREAK 0xff
+
+enum mg_rpc_cbor_major {
+  CBOR_UINT = 0,
+  CBOR_NINT = 1,
+  CBOR_BYTES = 2,
+  CBOR_TEXT = 3,
+  CBOR_ARRAY = 4,
+  CBOR_MAP = 5,
+  CBOR_TAG = 6,
+  CBOR_SIMPLE = 7,
+};
+
+/* JSON -> CBOR */
+
+struct mg_rpc_cbor_json_reader {
+  const char *p;
+  const char *end;
+};
+
+static void mg_rpc_cbor_put_byte(struct mbuf *out, uint8_t b) {
+  mbuf_append(out, &b, 1);
+}
+
+/* Writes item head using the shortest encoding of val. */
+static void mg_rpc_cbor_put_head(struct mbuf *out, int major, uint64_t val) {
+  uint8_t b[9];
+  size_t n, i;
+  if (val < 24) {
+    b[0] = (uint8_t)((major << 5) | val);
+    n = 1;
+  } else if (val <= 0xff) {
+    b[0] = (uint8_t)((major << 5) | 24);
+    n = 2;
+  } else if (val <= 0xffff) {
+    b[0] = (uint8_t)((major << 5) | 25);
+    n = 3;
+  } else if (val <= 0xffffffff) {
+    b[0] = (uint8_t)((major << 5) | 26);
+    n = 5;
+  } else {
+    b[0] = (uint8_t)((major << 5) | 27);
+    n = 9;
+  }
+  for (i = n - 1; i > 0; i--) {
+    b[i] = (uint8_t)(val & 0xff);
+    val >>= 8;
+  }
+  mbuf_append(out, b, n);
+}
+
+static void mg_rpc_cbor_put_double(struct mbuf *out, double d) {
+  uint8_t b[9];
+  uint64_t v;
+  int i;
+  memcpy(&v, &d, sizeof(v));
+  b[0] = (CBOR_SIMPLE << 5) | 27;
+  for (i = 8; i > 0; i--) {
+    b[i] = (uint8_t)(v & 0xff);
+    v >>= 8;
+  }
+  mbuf_append(out, b, sizeof(b));
+}
+
+static void mg_rpc_cbor_put_utf8(struct mbuf *out, uint32_t cp) {
+  uint8_t b[4];
+  size_t n;
+  if (cp < 0x80) {
+    b[0] = (uint8_t) cp;
+    n = 1;
+  } else if (cp < 0x800) {
+    b[0] = (uint8_t)(0xc0 | (cp >> 6));
+    b[1] = (uint8_t)(0x80 | (cp & 0x3f));
+    n = 2;
+  } else if (cp < 0x10000) {
+    b[0] = (uint8_t)(0xe0 | (cp >> 12));
+    b[1] = (uint8_t)(0x80 | ((cp >> 6) & 0x3f));
+    b[2] = (uint8_t)(0x80 | (cp & 0x3f));
+    n = 3;
+  } else {
+    b[0] = (uint8_t)(0xf0 | (cp >> 18));
+    b[1] = (uint8_t)(0x80 | ((cp >> 12) & 0x3f));
+    b[2] = (uint8_t)(0x80 | ((cp >> 6) & 0x3f));
+    b[3] = (uint8_t)(0x80 | (cp & 0x3f));
+    n = 4;
+  }
+  mbuf_append(out, b, n);
+}
+
+static void mg_rpc_cbor_json_skip_ws(struct mg_rpc_cbor_json_reader *r) {
+  while (r->p < r->end &&
+         (*r->p == ' ' || *r->p == '\t' || *r->p == '\r' || *r->p == '\n')) {
+    r->p++;
+  }
+}
+
+/* Parses 4 hex digits of a \u escape. */
+static bool mg_rpc_cbor_json_hex4(const char *p, const char *end,
+                                  uint32_t *cp) {
+  int i;
+  if (end - p < 4) return false;
+  *cp = 0;
+  for (i = 0; i < 4; i++) {
+    int c = p[i];
+    if (!isxdigit(c)) return false;
+    *cp = (*cp << 4) | (isdigit(c) ? c - '0' : (tolower(c) - 'a' + 10));
+  }
+  return true;
+}
+
+/* Decodes escape sequences of the string body s into out. */
+static bool mg_rpc_cbor_json_unescape(const char *s, const char *end,
+                                      struct mbuf *out) {
+  while (s < end) {
+    char c = *s++;
+    if (c != '\\') {
+      mbuf_append(out, &c, 1);
+      continue;
+    }
+    if (s >= end) return false;
+    c = *s++;
+    switch (c) {
+      case 'b':
+        c = '\b';
+        break;
+      case 'f':
+        c = '\f';
+        break;
+      case 'n':
+        c = '\n';
+        break;
+      case 'r':
+        c = '\r';
+        break;
+      case 't':
+        c = '\t';
+        break;
+      case 'u': {
+        uint32_t cp, lo;
+        if (!mg_rpc_cbor_json_hex4(s, end, &cp)) return false;
+        s += 4;
+        /* Surrogate pair. */
+        if (cp >= 0xd800 && cp < 0xdc00 && end - s >= 6 && s[0] == '\\' &&
+            s[1] == 'u' && mg_rpc_cbor_json_hex4(s + 2, end, &lo) &&
+            lo >= 0xdc00 && lo < 0xe000) {
+          cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+          s += 6;
+        }
+        mg_rpc_cbor_put_utf8(out, cp);
+        continue;
+      }
+      default:
+        /* \" \\ \/ and anything else stands for itself. */
+        break;
+    }
+    mbuf_append(out, &c, 1);
+  }
+  return true;
+}
+
+/* r->p points at the opening quote. */
+static bool mg_rpc_cbor_json_string(struct mg_rpc_cbor_json_reader *r,
+                                    struct mbuf *out) {
+  const char *s = ++r->p;
+  bool has_escapes = false;
+  while (r->p < r->end && *r->p != '"') {
+    if (*r->p == '\\') {
+      has_escapes = true;
+      r->p++;
+    }
+    r->p++;
+  }
+  if (r->p >= r->end) return false;
+  const char *e = r->p++;
+  if (!has_escapes) {
+    mg_rpc_cbor_put_head(out, CBOR_TEXT, e - s);
+    mbuf_append(out, s, e - s);
+    return true;
+  }
+  struct mbuf tmp;
+  mbuf_init(&tmp, e - s);
+  bool ok = mg_rpc_cbor_json_unescape(s, e, &tmp);
+  if (ok) {
+    mg_rpc_cbor_put_head(out, CBOR_TEXT, tmp.len);
+    mbuf_append(out, tmp.buf, tmp.len);
+  }
+  mbuf_free(&tmp);
+  return ok;
+}
+
+/* Object keys may be quoted or bare, as json_printf formats allow. */
+static bool mg_rpc_cbor_json_key(struct mg_rpc_cbor_json_reader *r,
+                                 struct mbuf *out) {
+  if (r->p < r->end && *r->p == '"') return mg_rpc_cbor_json_string(r, out);
+  const char *s = r->p;
+  while (r->p < r->end && (isalnum((int) *r->p) || *r->p == '_')) r->p++;
+  if (r->p == s) return false;
+  mg_rpc_cbor_put_head(out, CBOR_TEXT, r->p - s);
+  mbuf_append(out, s, r->p - s);
+  return true;
+}
+
+static bool mg_rpc_cbor_json_number(struct mg_rpc_cbor_json_reader *r,
+                                    struct mbuf *out) {
+  const char *s = r->p;
+  bool is_int = true;
+  char buf[40], *e;
+  if (r->p < r->end && *r->p == '-') r->p++;
+  while (r->p < r->end &&
+         (isdigit((int) *r->p) || *r->p == '.' || *r->p == 'e' ||
+          *r->p == 'E' || *r->p == '+' || *r->p == '-')) {
+    if (!isdigit((int) *r->p)) is_int = false;
+    r->p++;
+  }
+  size_t len = r->p - s;
+  if (len == 0 || len >= sizeof(buf)) return false;
+  memcpy(buf, s, len);
+  buf[len] = '\0';
+  if (is_int) {
+    errno = 0;
+    if (buf[0] == '-') {
+      long long v = strtoll(buf, &e, 10);
+      if (errno == 0 && *e == '\0') {
+        if (v >= 0) {
+          mg_rpc_cbor_put_head(out, CBOR_UINT, (uint64_t) v);
+        } else {
+          mg_rpc_cbor_put_head(out, CBOR_NINT, (uint64_t)(-(v + 1)));
+        }
+        return true;
+      }
+    } else {
+      unsigned long long v = strtoull(buf, &e, 10);
+      if (errno == 0 && *e == '\0') {
+        mg_rpc_cbor_put_head(out, CBOR_UINT, v);
+        return true;
+      }
+    }
+    /* Out of range, fall back to floating point. */
+  }
+  double d = strtod(buf, &e);
+  if (*e != '\0') return false;
+  mg_rpc_cbor_put_double(out, d);
+  return true;
+}
+
+static bool mg_rpc_cbor_json_literal(struct mg_rpc_cbor_json_reader *r,
+                                     const char *lit, uint8_t b,
+                                     struct mbuf *out) {
+  size_t len = strlen(lit);
+  if ((size_t)(r->end - r->p) < len || memcmp(r->p, lit, len) != 0) {
+    return false;
+  }
+  r->p += len;
+  mg_rpc_cbor_put_byte(out, b);
+  return true;
+}
+
+static bool mg_rpc_cbor_json_value(struct mg_rpc_cbor_json_reader *r,
+                                   struct mbuf *out, int depth) {
+  mg_rpc_cbor_json_skip_ws(r);
+  if (r->p >= r->end) return false;
+  switch (*r->p) {
+    case '{':
+    case '[': {
+      bool is_obj = (*r->p == '{');
+      char close = (is_obj ? '}' : ']');
+      if (depth >= MG_RPC_CBOR_MAX_DEPTH) return false;
+      r->p++;
+      /* Length is not known upfront, so use indefinite length encoding. */
+      int major = (is_obj ? CBOR_MAP : CBOR_ARRAY);
+      mg_rpc_cbor_put_byte(out, (major << 5) | MG_RPC_CBOR_INDEFINITE);
+      mg_rpc_cbor_json_skip_ws(r);
+      if (r->p < r->end && *r->p == close) {
+        r->p++;
+      } else {
+        while (true) {
+          if (is_obj) {
+            mg_rpc_cbor_json_skip_ws(r);
+            if (!mg_rpc_cbor_json_key(r, out)) return false;
+            mg_rpc_cbor_json_skip_ws(r);
+            if (r->p >= r->end || *r->p != ':') return false;
+            r->p++;
+          }
+          if (!mg_rpc_cbor_json_value(r, out, depth + 1)) return false;
+          mg_rpc_cbor_json_skip_ws(r);
+          if (r->p >= r->end) return false;
+          if (*r->p++ == close) break;
+          if (r->p[-1] != ',') return false;
+        }
+      }
+      mg_rpc_cbor_put_byte(out, MG_RPC_CBOR_BREAK);
+      return true;
+    }
+    case '"':
+      return mg_rpc_cbor_json_string(r, out);
+    case 't':
+      return mg_rpc_cbor_json_literal(r, "true", 0xf5, out);
+    case 'f':
+      return mg_rpc_cbor_json_literal(r, "false", 0xf4, out);
+    case 'n':
+      return mg_rpc_cbor_json_literal(r, "null", 0xf6, out);
+    default:
+      return mg_rpc_cbor_json_number(r, out);
+  }
+}
+
+bool mg_rpc_json_to_cbor(const struct mg_str json, struct mbuf *out) {
+  struct mg_rpc_cbor_json_reader r = {json.p, json.p + json.len};
+  size_t len = out->len;
+  bool ok = mg_rpc_cbor_json_value(&r, out, 0);
+  mg_rpc_cbor_json_skip_ws(&r);
+  if (!ok || r.p != r.end) {
+    out->len = len;
+    return false;
+  }
+  return true;
+}
+
+/* CBOR -> JSON */
+
+struct mg_rpc_cbor_reader {
+  const uint8_t *p;
+  const uint8_t *end;
+};
+
+/*
+ * Reads item head. ai is the additional information of the initial byte,
+ * val is the argument that follows (length, value, or float bits).
+ */
+static bool mg_rpc_cbor_get_head(struct mg_rpc_cbor_reader *r, int *major,
+                                 int *ai, uint64_t *val) {
+  if (r->p >= r->end) return false;
+  uint8_t ib = *r->p++;
+  *major = ib >> 5;
+  *ai = ib & 0x1f;
+  *val = *ai;
+  if (*ai < 24) return true;
+  if (*ai == MG_RPC_CBOR_INDEFINITE) {
+    return (*major >= CBOR_BYTES && *major <= CBOR_MAP);
+  }
+  if (*ai > 27) return false;
+  size_t n = (size_t) 1 << (*ai - 24);
+  if ((size_t)(r->end - r->p) < n) return false;
+  *val = 0;
+  while (n-- > 0) *val = (*val << 8) | *r->p++;
+  return true;
+}
+
+static bool mg_rpc_cbor_at_break(struct mg_rpc_cbor_reader *r) {
+  if (r->p < r->end && *r->p == MG_RPC_CBOR_BREAK) {
+    r->p++;
+    return true;
+  }
+  return false;
+}
+
+/*
+ * Reads string body. Chunks of indefinite length strings are concatenated
+ * into tmp; if tmp is NULL, only definite length strings are accepted.
+ */
+static bool mg_rpc_cbor_get_string(struct mg_rpc_cbor_reader *r, int major,
+                                   int ai, uint64_t len, struct mbuf *tmp,
+                                   struct mg_str *s) {
+  if (ai != MG_RPC_CBOR_INDEFINITE) {
+    if (len > (uint64_t)(r->end - r->p)) return false;
+    *s = mg_mk_str_n((const char *) r->p, (size_t) len);
+    r->p += len;
+    return true;
+  }
+  if (tmp == NULL) return false;
+  while (!mg_rpc_cbor_at_break(r)) {
+    int cmajor, cai;
+    uint64_t clen;
+    if (!mg_rpc_cbor_get_head(r, &cmajor, &cai, &clen) || cmajor != major ||
+        cai == MG_RPC_CBOR_INDEFINITE || clen > (uint64_t)(r->end - r->p)) {
+      return false;
+    }
+    mbuf_append(tmp, r->p, (size_t) clen);
+    r->p += clen;
+  }
+  *s = mg_mk_str_n(tmp->buf, tmp->len);
+  return true;
+}
+
+static double mg_rpc_cbor_half_to_double(uint16_t h) {
+  int e = (h >> 10) & 0x1f, m = h & 0x3ff;
+  double v;
+  if (e == 0) {
+    v = ldexp(m, -24);
+  } else if (e != 31) {
+    v = ldexp(m + 1024, e - 25);
+  } else {
+    v = (m == 0 ? INFINITY : NAN);
+  }
+  return (h & 0x8000 ? -v : v);
+}
+
+static void mg_rpc_cbor_print_double(struct json_out *out, double d,
+                                     int precision) {
+  if (isnan(d) || isinf(d)) {
+    json_printf(out, "null");
+  } else {
+    json_printf(out, "%.*g", precision, d);
+  }
+}
+
+static bool mg_rpc_cbor_item_to_json(struct mg_rpc_cbor_reader *r,
+                                     struct json_out *out, int depth) {
+  int major, ai;
+  uint64_t val, i;
+  if (depth > MG_RPC_CBOR_MAX_DEPTH) return false;
+  if (!mg_rpc_cbor_get_head(r, &major, &ai, &val)) return false;
+  bool indef = (ai == MG_RPC_CBOR_INDEFINITE);
+  switch (major) {
+    case CBOR_UINT:
+      json_printf(out, "%llu", (unsigned long long) val);
+      break;
+    case CBOR_NINT:
+      if (val <= INT64_MAX) {
+        json_printf(out, "%lld", -1 - (long long) val);
+      } else {
+        mg_rpc_cbor_print_double(out, -1.0 - (double) val, 17);
+      }
+      break;
+    case CBOR_BYTES:
+    case CBOR_TEXT: {
+      struct mbuf tmp;
+      struct mg_str s;
+      mbuf_init(&tmp, 0);
+      bool ok = mg_rpc_cbor_get_string(r, major, ai, val, &tmp, &s);
+      if (ok && major == CBOR_TEXT) {
+        json_printf(out, "%.*Q", (int) s.len, s.p);
+      } else if (ok) {
+        json_printf(out, "%V", s.p, (int) s.len);
+      }
+      mbuf_free(&tmp);
+      if (!ok) return false;
+      break;
+    }
+    case CBOR_ARRAY:
+    case CBOR_MAP: {
+      bool is_map = (major == CBOR_MAP);
+      json_printf(out, (is_map ? "{" : "["));
+      for (i = 0; (indef ? !mg_rpc_cbor_at_break(r) : i < val); i++) {
+        if (i > 0) json_printf(out, ",");
+        if (is_map) {
+          /* JSON keys are strings, integer keys are converted. */
+          int kmajor, kai;
+          uint64_t kval;
+          struct mg_str k;
+          if (!mg_rpc_cbor_get_head(r, &kmajor, &kai, &kval)) return false;
+          if (kmajor == CBOR_TEXT) {
+            if (!mg_rpc_cbor_get_string(r, kmajor, kai, kval, NULL, &k)) {
+              return false;
+            }
+            json_printf(out, "%.*Q:", (int) k.len, k.p);
+          } else if (kmajor == CBOR_UINT) {
+            json_printf(out, "\"%llu\":", (unsigned long long) kval);
+          } else if (kmajor == CBOR_NINT && kval <= INT64_MAX) {
+            json_printf(out, "\"%lld\":", -1 - (long long) kval);
+          } else {
+            return false;
+          }
+        }
+        if (!mg_rpc_cbor_item_to_json(r, out, depth + 1)) return false;
+      }
+      json_printf(out, (is_map ? "}" : "]"));
+      break;
+    }
+    case CBOR_TAG:
+      /* Tags (dates, bignums, etc.) are dropped, the item stays as is. */
+      return mg_rpc_cbor_item_to_json(r, out, depth + 1);
+    case CBOR_SIMPLE: {
+      switch (ai) {
+        case 20:
+          json_printf(out, "false");
+          break;
+        case 21:
+          json_printf(out, "true");
+          break;
+        case 25:
+          mg_rpc_cbor_print_double(
+              out, mg_rpc_cbor_half_to_double((uint16_t) val), 5);
+          break;
+        case 26: {
+          uint32_t bits = (uint32_t) val;
+          float f;
+          memcpy(&f, &bits, sizeof(f));
+          mg_rpc_cbor_print_double(out, f, 9);
+          break;
+        }
+        case 27: {
+          double d;
+          memcpy(&d, &val, sizeof(d));
+          mg_rpc_cbor_print_double(out, d, 17);
+          break;
+        }
+        default:
+          /* null, undefined and unassigned simple values. */
+          json_printf(out, "null");
+          break;
+      }
+      break;
+    }
+  }
+  return true;
+}
+
+bool mg_rpc_cbor_to_json(const struct mg_str cbor, struct mbuf *out) {
+  struct mg_rpc_cbor_reader r = {(const uint8_t *) cbor.p,
+                                 (const uint8_t *) cbor.p + cbor.len};
+  struct json_out jo = JSON_OUT_MBUF(out);
+  size_t len = out->len;
+  if (!mg_rpc_cbor_item_to_json(&r, &jo, 0) || r.p != r.end) {
+    out->len = len;
+    return false;
+  }
+  return true;
+}
+
+bool mg_rpc_cbor_is_array(const struct mg_str cbor) {
+  return (cbor.len > 0 && (((uint8_t) cbor.p[0]) >> 5) == CBOR_ARRAY);
+}
+
+/* Frames */
+
+static bool mg_rpc_cbor_get_int(struct mg_rpc_cbor_reader *r, int64_t *v) {
+  int major, ai;
+  uint64_t val;
+  if (!mg_rpc_cbor_get_head(r, &major, &ai, &val) || val > INT64_MAX) {
+    return false;
+  }
+  if (major == CBOR_UINT) {
+    *v = (int64_t) val;
+  } else if (major == CBOR_NINT) {
+    *v = -1 - (int64_t) val;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static bool mg_rpc_cbor_get_text(struct mg_rpc_cbor_reader *r,
+                                 struct mg_str *s) {
+  int major, ai;
+  uint64_t val;
+  return (mg_rpc_cbor_get_head(r, &major, &ai, &val) && major == CBOR_TEXT &&
+          mg_rpc_cbor_get_string(r, major, ai, val, NULL, s));
+}
+
+/* Skips an item of no interest, using buf as scratch space. */
+static bool mg_rpc_cbor_skip(struct mg_rpc_cbor_reader *r, struct mbuf *buf) {
+  struct json_out out = JSON_OUT_MBUF(buf);
+  size_t len = buf->len;
+  bool ok = mg_rpc_cbor_item_to_json(r, &out, 1);
+  buf->len = len;
+  return ok;
+}
+
+/* Iterates over members of a map, *key is set to the member name. */
+struct mg_rpc_cbor_map_iter {
+  uint64_t n, i;
+  bool indef;
+};
+
+static bool mg_rpc_cbor_map_begin(struct mg_rpc_cbor_reader *r,
+                                  struct mg_rpc_cbor_map_iter *it) {
+  int major, ai;
+  if (!mg_rpc_cbor_get_head(r, &major, &ai, &it->n) || major != CBOR_MAP) {
+    return false;
+  }
+  it->i = 0;
+  it->indef = (ai == MG_RPC_CBOR_INDEFINITE);
+  return true;
+}
+
+/* Returns 1 if there is a member, 0 at the end of the map, -1 on error. */
+static int mg_rpc_cbor_map_next(struct mg_rpc_cbor_reader *r,
+                                struct mg_rpc_cbor_map_iter *it,
+                                struct mg_str *key) {
+  if (it->indef ? mg_rpc_cbor_at_break(r) : it->i >= it->n) return 0;
+  it->i++;
+  return (mg_rpc_cbor_get_text(r, key) ? 1 : -1);
+}
+
+static bool mg_rpc_cbor_parse_error(struct mg_rpc_cbor_reader *r,
+                                    struct mg_rpc_frame *frame,
+                                    struct mbuf *buf) {
+  struct mg_rpc_cbor_map_iter it;
+  struct mg_str key;
+  int res;
+  if (!mg_rpc_cbor_map_begin(r, &it)) return false;
+  while ((res = mg_rpc_cbor_map_next(r, &it, &key)) > 0) {
+    bool ok;
+    if (mg_vcmp(&key, "code") == 0) {
+      int64_t code = 0;
+      ok = mg_rpc_cbor_get_int(r, &code);
+      frame->error_code = (int) code;
+    } else if (mg_vcmp(&key, "message") == 0) {
+      ok = mg_rpc_cbor_get_text(r, &frame->error_msg);
+    } else {
+      ok = mg_rpc_cbor_skip(r, buf);
+    }
+    if (!ok) return false;
+  }
+  return (res == 0);
+}
+
+/* JSON of a member is appended to buf, pointers are set once buf is final. */
+struct mg_rpc_cbor_json_span {
+  size_t off, len;
+};
+
+static bool mg_rpc_cbor_member_to_json(struct mg_rpc_cbor_reader *r,
+                                       struct mbuf *buf,
+                                       struct mg_rpc_cbor_json_span *span) {
+  struct json_out out = JSON_OUT_MBUF(buf);
+  span->off = buf->len;
+  if (!mg_rpc_cbor_item_to_json(r, &out, 1)) return false;
+  span->len = buf->len - span->off;
+  return true;
+}
+
+bool mg_rpc_cbor_parse_frame(const struct mg_str cbor,
+                             struct mg_rpc_frame *frame, struct mbuf *buf) {
+  struct mg_rpc_cbor_reader r = {(const uint8_t *) cbor.p,
+                                 (const uint8_t *) cbor.p + cbor.len};
+  struct mg_rpc_cbor_json_span args = {0, 0}, result = {0, 0}, auth = {0, 0};
+  struct mg_rpc_cbor_json_span chunk = {0, 0};
+  struct mg_rpc_cbor_map_iter it;
+  struct mg_str key;
+  int res;
+  memset(frame, 0, sizeof(*frame));
+  if (!mg_rpc_cbor_map_begin(&r, &it)) return false;
+  while ((res = mg_rpc_cbor_map_next(&r, &it, &key)) > 0) {
+    bool ok;
+    if (mg_vcmp(&key, "id") == 0) {
+      ok = mg_rpc_cbor_get_int(&r, &frame->id);
+    } else if (mg_vcmp(&key, "v") == 0) {
+      int64_t v = 0;
+      ok = mg_rpc_cbor_get_int(&r, &v);
+      frame->version = (int) v;
+    } else if (mg_vcmp(&key, "src") == 0) {
+      ok = mg_rpc_cbor_get_text(&r, &frame->src);
+    } else if (mg_vcmp(&key, "dst") == 0) {
+      ok = mg_rpc_cbor_get_text(&r, &frame->dst);
+    } else if (mg_vcmp(&key, "tag") == 0) {
+      ok = mg_rpc_cbor_get_text(&r, &frame->tag);
+    } else if (mg_vcmp(&key, "method") == 0) {
+      ok = mg_rpc_cbor_get_text(&r, &frame->method);
+    } else if (mg_vcmp(&key, "args") == 0) {
+      const uint8_t *start = r.p;
+      ok = mg_rpc_cbor_member_to_json(&r, buf, &args);
+      frame->args_cbor = mg_mk_str_n((const char *) start, r.p - start);
+    } else if (mg_vcmp(&key, "result") == 0) {
+      ok = mg_rpc_cbor_member_to_json(&r, buf, &result);
+    } else if (mg_vcmp(&key, "auth") == 0) {
+      ok = mg_rpc_cbor_member_to_json(&r, buf, &auth);
+    } else if (mg_vcmp(&key, "error") == 0) {
+      ok = mg_rpc_cbor_parse_error(&r, frame, buf);
+    } else if (mg_vcmp(&key, "chunk") == 0) {
+      /* Chunks are kept escaped, same as in JSON frames. */
+      ok = (r.p < r.end && (*r.p >> 5) == CBOR_TEXT &&
+            mg_rpc_cbor_member_to_json(&r, buf, &chunk));
+    } else if (mg_vcmp(&key, "last") == 0) {
+      frame->last_chunk = (r.p < r.end && *r.p == 0xf5 /* true */);
+      ok = mg_rpc_cbor_skip(&r, buf);
+    } else {
+      ok = mg_rpc_cbor_skip(&r, buf);
+    }
+    if (!ok) return false;
+  }
+  if (res < 0 || r.p != r.end) return false;
+  if (args.len > 0) frame->args = mg_mk_str_n(buf->buf + args.off, args.len);
+  if (result.len > 0) {
+    frame->result = mg_mk_str_n(buf->buf + result.off, result.len);
+  }
+  if (auth.len > 0) frame->auth = mg_mk_str_n(buf->buf + auth.off, auth.len);
+  if (chunk.len > 0) {
+    /* Without the quotes. */
+    frame->chunk = mg_mk_str_n(buf->buf + chunk.off + 1, chunk.len - 2);
+  }
+  return true;
+}
+
+static void mg_rpc_cbor_put_text(struct mbuf *out, const struct mg_str s) {
+  mg_rpc_cbor_put_head(out, CBOR_TEXT, s.len);
+  mbuf_append(out, s.p, s.len);
+}
+
+static void mg_rpc_cbor_put_int(struct mbuf *out, int64_t v) {
+  if (v >= 0) {
+    mg_rpc_cbor_put_head(out, CBOR_UINT, (uint64_t) v);
+  } else {
+    mg_rpc_cbor_put_head(out, CBOR_NINT, (uint64_t)(-(v + 1)));
+  }
+}
+
+bool mg_rpc_cbor_encode_frame(const struct mg_rpc_frame *frame,
+                              struct mbuf *out) {
+  size_t len = out->len;
+  bool has_error = (frame->error_code != 0);
+  uint64_t n = (frame->id != 0) + (frame->src.len > 0) +
+               (frame->dst.len > 0) + (frame->tag.len > 0) +
+               (frame->method.len > 0) +
+               (frame->args.len > 0 || frame->args_cbor.len > 0) +
+               (frame->result.len > 0) + (frame->auth.len > 0) + has_error;
+  mg_rpc_cbor_put_head(out, CBOR_MAP, n);
+  if (frame->id != 0) {
+    mg_rpc_cbor_put_text(out, mg_mk_str("id"));
+    mg_rpc_cbor_put_int(out, frame->id);
+  }
+  if (frame->src.len > 0) {
+    mg_rpc_cbor_put_text(out, mg_mk_str("src"));
+    mg_rpc_cbor_put_text(out, frame->src);
+  }
+  if (frame->dst.len > 0) {
+    mg_rpc_cbor_put_text(out, mg_mk_str("dst"));
+    mg_rpc_cbor_put_text(out, frame->dst);
+  }
+  if (frame->tag.len > 0) {
+    mg_rpc_cbor_put_text(out, mg_mk_str("tag"));
+    mg_rpc_cbor_put_text(out, frame->tag);
+  }
+  if (frame->method.len > 0) {
+    mg_rpc_cbor_put_text(out, mg_mk_str("method"));
+    mg_rpc_cbor_put_text(out, frame->method);
+  }
+  if (frame->args_cbor.len > 0) {
+    mg_rpc_cbor_put_text(out, mg_mk_str("args"));
+    mbuf_append(out, frame->args_cbor.p, frame->args_cbor.len);
+  } else if (frame->args.len > 0) {
+    mg_rpc_cbor_put_text(out, mg_mk_str("args"));
+    if (!mg_rpc_json_to_cbor(frame->args, out)) goto err;
+  }
+  if (frame->result.len > 0) {
+    mg_rpc_cbor_put_text(out, mg_mk_str("result"));
+    if (!mg_rpc_json_to_cbor(frame->result, out)) goto err;
+  }
+  if (frame->auth.len > 0) {
+    mg_rpc_cbor_put_text(out, mg_mk_str("auth"));
+    if (!mg_rpc_json_to_cbor(frame->auth, out)) goto err;
+  }
+  if (has_error) {
+    mg_rpc_cbor_put_text(out, mg_mk_str("error"));
+    mg_rpc_cbor_put_head(out, CBOR_MAP, (frame->error_msg.len > 0 ? 2 : 1));
+    mg_rpc_cbor_put_text(out, mg_mk_str("code"));
+    mg_rpc_cbor_put_int(out, frame->error_code);
+    if (frame->error_msg.len > 0) {
+      mg_rpc_cbor_put_text(out, mg_mk_str("message"));
+      mg_rpc_cbor_put_text(out, frame->error_msg);
+    }
+  }
+  return true;
+err:
+  out->len = len;
+  return false;
+}
+
+void mg_rpc_cbor_frame_recd(struct mg_rpc_channel *ch, const struct mg_str f) {
+  struct mg_rpc_frame frame;
+  struct mg_str jf = f;
+  struct mbuf buf;
+  /* Checked before decoding, which takes memory in proportion to size. */
+  if (!mg_rpc_channel_frame_size_ok(ch, f.len)) return;
+  mbuf_init(&buf, 0);
+  if (!mg_rpc_cbor_is_array(f) && mg_rpc_cbor_parse_frame(f, &frame, &buf)) {
+    ch->ev_handler(ch, MG_RPC_CHANNEL_FRAME_RECD_PARSED, &frame);
+  } else {
+    /* If it does not transcode either, it is passed as is and rejected. */
+    if (mg_rpc_cbor_to_json(f, &buf)) jf = mg_mk_str_n(buf.buf, buf.len);
+    ch->ev_handler(ch, MG_RPC_CHANNEL_FRAME_RECD, &jf);
+  }
+  mbuf_free(&buf);
+}
@@ -17,8 +17,21 @@
 
 #include "mg_rpc_channel.h"
 
+#include <stdlib.h>
+#include <string.h>
+
 #include "mg_rpc_channel_tcp_common.h"
 
+size_t mg_rpc_channel_tcp_write_info(struct mg_connection *c, char *buf,
+                                     size_t size) {
+  if (size == 0) return 0;
+  buf[0] = '\0';
+  if (c == NULL) return 0;
+  int flags = MG_SOCK_STRINGIFY_IP | MG_SOCK_STRINGIFY_REMOTE;
+  mg_conn_addr_to_str(c, buf, size, flags);
+  return strlen(buf);
+}
+
 char *mg_rpc_channel_tcp_get_info(struct mg_connection *c) {
   char buf[100] = {0}, *s = NULL;
   if (c != NULL) {
@@ -38,3 +51,19 @@ bool mg_rpc_channel_false(struct mg_rpc_channel *ch) {
   (void) ch;
   return false;
 }
+
+size_t mg_rpc_channel_write_info(struct mg_rpc_channel *ch, char *buf,
+                                 size_t size) {
+  size_t len = 0;
+  if (size == 0) return 0;
+  if (ch->write_info != NULL) return ch->write_info(ch, buf, size);
+  char *info = (ch->get_info != NULL ? ch->get_info(ch) : NULL);
+  if (info != NULL) {
+    len = strlen(info);
+    if (len >= size) len = size - 1;
+    memcpy(buf, info, len);
+    free(info);
+  }
+  buf[len] = '\0';
+  return len;
+}
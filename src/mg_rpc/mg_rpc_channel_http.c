@@ -17,41 +17,100 @@
 
 #include "mg_rpc_channel_http.h"
 #include "mg_rpc.h"
+#include "mg_rpc_cbor.h"
 #include "mg_rpc_channel.h"
 #include "mg_rpc_channel_tcp_common.h"
+#include "mg_rpc_htdigest.h"
 
 #include "common/cs_dbg.h"
+#include "common/queue.h"
 #include "frozen.h"
 
 #include "mgos_hal.h"
 
 #if defined(MGOS_HAVE_HTTP_SERVER) && MGOS_ENABLE_RPC_CHANNEL_HTTP
 
-static const char *s_headers =
+static const char *s_stream_headers =
     "Content-Type: application/json\r\n"
     "Access-Control-Allow-Origin: *\r\n"
-    "Connection: close\r\n";
+    "Transfer-Encoding: chunked\r\n";
+
+/* Number of released channels kept around for reuse. */
+#define MG_RPC_CHANNEL_HTTP_POOL_SIZE 2
 
 struct mg_rpc_channel_http_data {
   struct mg_connection *nc;
-  struct http_message *hm;
+  /*
+   * Copied from the request for digest authentication, which may be done
+   * after the request event: Authorization header, method, and URI with
+   * the query string. They point into auth_buf, NULL if there was no
+   * Authorization header.
+   */
+  char *auth_buf;
+  struct mg_str auth_hdr, auth_method, auth_uri;
   const char *default_auth_domain;
   const char *default_auth_file;
+  /* Connection handler we took over, all events are passed on to it. */
+  mg_event_handler_t orig_handler;
+  void *orig_user_data;
+  bool is_open;
+  /* A request is being handled, it has not been answered yet. */
+  bool in_request;
   bool is_rest;
+  /* Request body was CBOR, response is encoded the same way. */
+  bool is_cbor;
+  /* Response is being streamed with chunked encoding. */
+  bool is_streaming;
+  /* Connection stays open after the response. */
+  bool keep_alive;
+  int num_pending; /* Sends not confirmed with FRAME_SENT yet. */
 };
 
+/* Channel and its data are allocated together. */
+struct mg_rpc_channel_http_block {
+  struct mg_rpc_channel ch; /* Must be first. */
+  struct mg_rpc_channel_http_data chd;
+  SLIST_ENTRY(mg_rpc_channel_http_block) next_free;
+};
+
+static SLIST_HEAD(, mg_rpc_channel_http_block)
+    s_free_channels = SLIST_HEAD_INITIALIZER(s_free_channels);
+static int s_num_free_channels = 0;
+
 static void mg_rpc_channel_http_ch_connect(struct mg_rpc_channel *ch) {
   (void) ch;
 }
 
+/* Request has been answered, nothing is kept from it. */
+static void mg_rpc_channel_http_end_request(
+    struct mg_rpc_channel_http_data *chd) {
+  chd->in_request = false;
+  free(chd->auth_buf);
+  chd->auth_buf = NULL;
+}
+
 static void mg_rpc_channel_http_ch_close(struct mg_rpc_channel *ch) {
   struct mg_rpc_channel_http_data *chd =
       (struct mg_rpc_channel_http_data *) ch->channel_data;
-  if (chd->nc != NULL) {
+  if (chd->nc == NULL) return;
+  if (chd->is_streaming) {
+    /* Response has started, all we can do is cut it short. */
+    chd->nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+  } else if (chd->in_request) {
     mg_http_send_error(chd->nc, 400, "Invalid request");
     chd->nc->flags |= MG_F_SEND_AND_CLOSE;
-    chd->nc = NULL;
+    mg_rpc_channel_http_end_request(chd);
+  } else {
+    chd->nc->flags |= MG_F_SEND_AND_CLOSE;
   }
+  /* CLOSED is emitted once the connection is gone. */
+}
+
+/* Nonces we issue are timestamps, they are good for an hour. */
+static bool mg_rpc_channel_http_check_nonce(const char *nonce) {
+  unsigned long now = (unsigned long) mg_time();
+  unsigned long val = (unsigned long) strtoul(nonce, NULL, 16);
+  return (now >= val && now - val < 60 * 60);
 }
 
 static bool mg_rpc_channel_http_get_authn_info(
@@ -59,10 +118,9 @@ static bool mg_rpc_channel_http_get_authn_info(
     struct mg_rpc_authn_info *authn) {
   struct mg_rpc_channel_http_data *chd =
       (struct mg_rpc_channel_http_data *) ch->channel_data;
-  bool ret = false;
-  struct mg_str *hdr;
-  char username_buf[50];
-  char *username = username_buf;
+  struct mg_str *hdr = &chd->auth_hdr;
+  char username[50], cnonce[64], response[40], qop[20], nc[20];
+  char nonce[40];
 
   if (auth_domain == NULL || auth_file == NULL) {
     auth_domain = chd->default_auth_domain;
@@ -70,33 +128,34 @@ static bool mg_rpc_channel_http_get_authn_info(
   }
 
   if (auth_domain == NULL || auth_file == NULL) {
-    goto clean;
+    return false;
   }
 
-  if (!mg_http_is_authorized(chd->hm, chd->hm->uri, auth_domain, auth_file,
-                             MG_AUTH_FLAG_IS_GLOBAL_PASS_FILE)) {
-    goto clean;
+  /* Parse "Authorization:" header, fail fast on parse error */
+  if (!chd->in_request || chd->auth_buf == NULL ||
+      mg_http_parse_header(hdr, "username", username, sizeof(username)) == 0 ||
+      mg_http_parse_header(hdr, "cnonce", cnonce, sizeof(cnonce)) == 0 ||
+      mg_http_parse_header(hdr, "response", response, sizeof(response)) == 0 ||
+      mg_http_parse_header(hdr, "qop", qop, sizeof(qop)) == 0 ||
+      mg_http_parse_header(hdr, "nc", nc, sizeof(nc)) == 0 ||
+      mg_http_parse_header(hdr, "nonce", nonce, sizeof(nonce)) == 0 ||
+      !mg_rpc_channel_http_check_nonce(nonce)) {
+    return false;
   }
 
-  /* Parse "Authorization:" header, fail fast on parse error */
-  if (chd->hm == NULL ||
-      (hdr = mg_get_http_header(chd->hm, "Authorization")) == NULL ||
-      mg_http_parse_header2(hdr, "username", &username, sizeof(username_buf)) ==
-          0) {
-    /* No auth header is present */
-    goto clean;
+  /* Credentials are cached, the file is only re-read when it changes. */
+  if (mg_rpc_htdigest_check(auth_file, chd->auth_method, chd->auth_uri,
+                            mg_mk_str(username), mg_mk_str(cnonce),
+                            mg_mk_str(response), mg_mk_str(qop),
+                            mg_mk_str(nc), mg_mk_str(nonce),
+                            mg_mk_str(auth_domain)) != 1) {
+    return false;
   }
 
   /* Got username from the Authorization header */
   authn->username = mg_strdup(mg_mk_str(username));
 
-  ret = true;
-
-clean:
-  if (username != username_buf) {
-    free(username);
-  }
-  return ret;
+  return true;
 }
 
 static void mg_rpc_channel_http_send_not_authorized(struct mg_rpc_channel *ch,
@@ -115,6 +174,7 @@ static void mg_rpc_channel_http_send_not_authorized(struct mg_rpc_channel *ch,
   }
 
   mg_http_send_digest_auth_request(chd->nc, auth_domain);
+  mg_rpc_channel_http_end_request(chd);
 }
 
 static const char *mg_rpc_channel_http_get_type(struct mg_rpc_channel *ch) {
@@ -128,25 +188,59 @@ static char *mg_rpc_channel_http_get_info(struct mg_rpc_channel *ch) {
   return (chd->nc != NULL ? mg_rpc_channel_tcp_get_info(chd->nc) : NULL);
 }
 
-/*
- * Timer callback which emits SENT and CLOSED events to mg_rpc.
- */
-static void mg_rpc_channel_http_frame_sent(void *param) {
-  struct mg_rpc_channel *ch = (struct mg_rpc_channel *) param;
-  ch->ev_handler(ch, MG_RPC_CHANNEL_FRAME_SENT, (void *) 1);
-  ch->ev_handler(ch, MG_RPC_CHANNEL_CLOSED, NULL);
+static size_t mg_rpc_channel_http_write_info(struct mg_rpc_channel *ch,
+                                             char *buf, size_t size) {
+  struct mg_rpc_channel_http_data *chd =
+      (struct mg_rpc_channel_http_data *) ch->channel_data;
+  return mg_rpc_channel_tcp_write_info(chd->nc, buf, size);
 }
 
 static void mg_rpc_channel_http_ch_destroy(struct mg_rpc_channel *ch) {
-  free(ch->channel_data);
-  free(ch);
+  struct mg_rpc_channel_http_block *b = (struct mg_rpc_channel_http_block *) ch;
+  mg_rpc_channel_http_end_request(&b->chd);
+  if (s_num_free_channels < MG_RPC_CHANNEL_HTTP_POOL_SIZE) {
+    SLIST_INSERT_HEAD(&s_free_channels, b, next_free);
+    s_num_free_channels++;
+  } else {
+    free(b);
+  }
+}
+
+/* Response is done with, connection is ready for the next request. */
+static void mg_rpc_channel_http_response_done(
+    struct mg_rpc_channel_http_data *chd) {
+  mg_rpc_channel_http_end_request(chd);
+  chd->is_streaming = false;
+  if (!chd->keep_alive) chd->nc->flags |= MG_F_SEND_AND_CLOSE;
+  chd->num_pending++;
+}
+
+/*
+ * Sends a complete response. Its length is known upfront, so the connection
+ * can be kept alive.
+ */
+static void mg_rpc_channel_http_send_response(
+    struct mg_rpc_channel_http_data *chd, const char *content_type,
+    const struct mg_str body, bool add_crlf) {
+  char headers[150];
+  snprintf(headers, sizeof(headers),
+           "Content-Type: %s\r\n"
+           "Access-Control-Allow-Origin: *\r\n"
+           "Content-Length: %d\r\n"
+           "Connection: %s\r\n",
+           content_type, (int) body.len + (add_crlf ? 2 : 0),
+           (chd->keep_alive ? "keep-alive" : "close"));
+  mg_send_response_line(chd->nc, 200, headers);
+  mg_send(chd->nc, body.p, body.len);
+  if (add_crlf) mg_send(chd->nc, "\r\n", 2);
 }
 
 static bool mg_rpc_channel_http_send_frame(struct mg_rpc_channel *ch,
                                            const struct mg_str f) {
   struct mg_rpc_channel_http_data *chd =
       (struct mg_rpc_channel_http_data *) ch->channel_data;
-  if (chd->nc == NULL) {
+  /* Exactly one response per request. */
+  if (chd->nc == NULL || !chd->in_request) {
     return false;
   }
 
@@ -159,82 +253,275 @@ static bool mg_rpc_channel_http_send_frame(struct mg_rpc_channel *ch,
 
     if (result_tok.type != JSON_TYPE_INVALID) {
       /* Got some result */
-      mg_send_response_line(chd->nc, 200, s_headers);
-      mg_printf(chd->nc, "%.*s\r\n", (int) result_tok.len, result_tok.ptr);
+      mg_rpc_channel_http_send_response(
+          chd, "application/json",
+          mg_mk_str_n(result_tok.ptr, result_tok.len), true);
     } else if (error_code != 0) {
       if (error_code != 404) error_code = 500;
-      /* Got some error */
+      /* Got some error, the connection is closed after it. */
       mg_http_send_error(chd->nc, error_code, error_msg);
     } else {
       /* Empty result - that is legal. */
-      mg_send_response_line(chd->nc, 200, s_headers);
+      mg_rpc_channel_http_send_response(chd, "application/json",
+                                        mg_mk_str_n(NULL, 0), false);
     }
     if (error_msg != NULL) {
       free(error_msg);
     }
+  } else if (chd->is_cbor) {
+    struct mbuf cbor;
+    mbuf_init(&cbor, f.len);
+    if (mg_rpc_json_to_cbor(f, &cbor)) {
+      mg_rpc_channel_http_send_response(
+          chd, "application/cbor", mg_mk_str_n(cbor.buf, cbor.len), false);
+    } else {
+      mg_http_send_error(chd->nc, 500, "Failed to encode response");
+    }
+    mbuf_free(&cbor);
   } else {
-    mg_send_response_line(chd->nc, 200, s_headers);
-    mg_printf(chd->nc, "%.*s\r\n", (int) f.len, f.p);
+    mg_rpc_channel_http_send_response(chd, "application/json", f, true);
   }
 
-  chd->nc->flags |= MG_F_SEND_AND_CLOSE;
-  chd->nc = NULL;
+  /* SENT is emitted once the response has been written out. */
+  mg_rpc_channel_http_response_done(chd);
 
-  /*
-   * Schedule a callback which will emit SENT and CLOSED events. mg_rpc expects
-   * those to be emitted asynchronously, therefore we can't emit them right
-   * here.
-   */
-  mgos_invoke_cb(mg_rpc_channel_http_frame_sent, ch, false /* from_isr */);
+  return true;
+}
 
+/* CBOR responses are encoded from the parsed frame, JSON is not built. */
+static bool mg_rpc_channel_http_send_parsed_frame(
+    struct mg_rpc_channel *ch, const struct mg_rpc_frame *frame) {
+  struct mg_rpc_channel_http_data *chd =
+      (struct mg_rpc_channel_http_data *) ch->channel_data;
+  if (chd->nc == NULL || !chd->in_request || !chd->is_cbor) return false;
+  struct mbuf cbor;
+  mbuf_init(&cbor, 50 + frame->result.len);
+  if (!mg_rpc_cbor_encode_frame(frame, &cbor)) {
+    mbuf_free(&cbor);
+    return false;
+  }
+  mg_rpc_channel_http_send_response(chd, "application/cbor",
+                                    mg_mk_str_n(cbor.buf, cbor.len), false);
+  mbuf_free(&cbor);
+  mg_rpc_channel_http_response_done(chd);
   return true;
 }
 
+static void mg_rpc_channel_http_sent(struct mg_rpc_channel *ch, bool success) {
+  struct mg_rpc_channel_http_data *chd =
+      (struct mg_rpc_channel_http_data *) ch->channel_data;
+  while (chd->num_pending > 0) {
+    chd->num_pending--;
+    ch->ev_handler(ch, MG_RPC_CHANNEL_FRAME_SENT, (void *) (intptr_t) success);
+  }
+}
+
+/*
+ * Connection handler for the lifetime of the channel: tracks writes and
+ * closure, everything is passed on to the original handler.
+ */
+static void mg_rpc_channel_http_conn_handler(struct mg_connection *nc, int ev,
+                                             void *ev_data, void *user_data) {
+#if !MG_ENABLE_CALLBACK_USERDATA
+  void *user_data = nc->user_data;
+#endif
+  struct mg_rpc_channel *ch = (struct mg_rpc_channel *) user_data;
+  struct mg_rpc_channel_http_data *chd =
+      (struct mg_rpc_channel_http_data *) ch->channel_data;
+  mg_event_handler_t orig_handler = chd->orig_handler;
+  void *orig_user_data = chd->orig_user_data;
+  switch (ev) {
+    case MG_EV_SEND: {
+      if (nc->send_mbuf.len == 0) mg_rpc_channel_http_sent(ch, true);
+      break;
+    }
+    case MG_EV_CLOSE: {
+      nc->user_data = orig_user_data;
+      nc->handler = orig_handler;
+      chd->nc = NULL;
+      mg_rpc_channel_http_end_request(chd);
+      mg_rpc_channel_http_sent(ch, false);
+      /* Channel is destroyed by mg_rpc, chd is not valid after this. */
+      ch->ev_handler(ch, MG_RPC_CHANNEL_CLOSED, NULL);
+      break;
+    }
+  }
+  orig_handler(nc, ev, ev_data MG_UD_ARG(orig_user_data));
+}
+
+/*
+ * Streamed response is sent with chunked encoding. In REST mode only the
+ * result is sent, without the frame around it.
+ */
+static bool mg_rpc_channel_http_send_stream(struct mg_rpc_channel *ch,
+                                            enum mg_rpc_channel_stream_op op,
+                                            const struct mg_str data) {
+  struct mg_rpc_channel_http_data *chd =
+      (struct mg_rpc_channel_http_data *) ch->channel_data;
+  struct mg_connection *nc = chd->nc;
+  if (nc == NULL) return false;
+  switch (op) {
+    case MG_RPC_CHANNEL_STREAM_BEGIN: {
+      /* CBOR can't be transcoded piecemeal, send a normal response. */
+      if (!chd->in_request || chd->is_streaming || chd->is_cbor) return false;
+      chd->is_streaming = true;
+      mg_send_response_line(nc, 200, s_stream_headers);
+      if (!chd->is_rest) mg_send_http_chunk(nc, data.p, data.len);
+      break;
+    }
+    case MG_RPC_CHANNEL_STREAM_DATA: {
+      if (!chd->is_streaming) return false;
+      /* Empty chunk would terminate the response. */
+      if (data.len > 0) mg_send_http_chunk(nc, data.p, data.len);
+      break;
+    }
+    case MG_RPC_CHANNEL_STREAM_END: {
+      if (!chd->is_streaming) return false;
+      if (!chd->is_rest && data.len > 0) {
+        mg_send_http_chunk(nc, data.p, data.len);
+      }
+      mg_send_http_chunk(nc, "", 0);
+      mg_rpc_channel_http_response_done(chd);
+      return true;
+    }
+  }
+  chd->num_pending++;
+  return true;
+}
+
+struct mg_rpc_channel *mg_rpc_channel_http_get(struct mg_connection *nc) {
+  if (nc->handler != mg_rpc_channel_http_conn_handler) return NULL;
+  return (struct mg_rpc_channel *) nc->user_data;
+}
+
 struct mg_rpc_channel *mg_rpc_channel_http(struct mg_connection *nc,
                                            const char *default_auth_domain,
                                            const char *default_auth_file) {
-  struct mg_rpc_channel *ch = (struct mg_rpc_channel *) calloc(1, sizeof(*ch));
+  struct mg_rpc_channel_http_block *b = SLIST_FIRST(&s_free_channels);
+  if (b != NULL) {
+    SLIST_REMOVE_HEAD(&s_free_channels, next_free);
+    s_num_free_channels--;
+    memset(b, 0, sizeof(*b));
+  } else {
+    b = (struct mg_rpc_channel_http_block *) calloc(1, sizeof(*b));
+  }
+  struct mg_rpc_channel *ch = &b->ch;
+  struct mg_rpc_channel_http_data *chd = &b->chd;
   ch->ch_connect = mg_rpc_channel_http_ch_connect;
   ch->send_frame = mg_rpc_channel_http_send_frame;
+  ch->send_stream = mg_rpc_channel_http_send_stream;
   ch->ch_close = mg_rpc_channel_http_ch_close;
   ch->ch_destroy = mg_rpc_channel_http_ch_destroy;
   ch->get_type = mg_rpc_channel_http_get_type;
   /*
-   * New channel is created for each incoming HTTP request, so the channel
-   * is not persistent.
+   * Channel lives as long as the connection, so it is not persistent.
    *
    * Rationale for this behaviour, instead of updating channel's destination on
    * each incoming frame, is that this won't work with asynchronous responses.
    */
   ch->is_persistent = mg_rpc_channel_false;
   /*
-   * HTTP channel expects exactly one response.
+   * HTTP channel expects exactly one response per request.
    * We don't want random broadcasts to be sent as a response.
    */
   ch->is_broadcast_enabled = mg_rpc_channel_false;
   ch->get_authn_info = mg_rpc_channel_http_get_authn_info;
   ch->send_not_authorized = mg_rpc_channel_http_send_not_authorized;
   ch->get_info = mg_rpc_channel_http_get_info;
+  ch->write_info = mg_rpc_channel_http_write_info;
 
-  struct mg_rpc_channel_http_data *chd =
-      (struct mg_rpc_channel_http_data *) calloc(1, sizeof(*chd));
+  chd->nc = nc;
   chd->default_auth_domain = default_auth_domain;
   chd->default_auth_file = default_auth_file;
+  chd->orig_handler = nc->handler;
+  chd->orig_user_data = nc->user_data;
   ch->channel_data = chd;
+  nc->handler = mg_rpc_channel_http_conn_handler;
   nc->user_data = ch;
   return ch;
 }
 
+/* Keeps what digest authentication needs, hm is gone after the event. */
+static void mg_rpc_channel_http_save_auth(struct mg_rpc_channel_http_data *chd,
+                                          struct http_message *hm) {
+  struct mg_str *hdr = mg_get_http_header(hm, "Authorization");
+  if (hdr == NULL) return;
+  /* Query string follows the URI, after the "?". */
+  size_t uri_len = hm->uri.len + (hm->query_string.len > 0
+                                      ? hm->query_string.len + 1 /* ? */
+                                      : 0);
+  char *buf = (char *) malloc(hdr->len + hm->method.len + uri_len);
+  if (buf == NULL) return;
+  memcpy(buf, hdr->p, hdr->len);
+  memcpy(buf + hdr->len, hm->method.p, hm->method.len);
+  memcpy(buf + hdr->len + hm->method.len, hm->uri.p, uri_len);
+  chd->auth_buf = buf;
+  chd->auth_hdr = mg_mk_str_n(buf, hdr->len);
+  chd->auth_method = mg_mk_str_n(buf + hdr->len, hm->method.len);
+  chd->auth_uri = mg_mk_str_n(buf + hdr->len + hm->method.len, uri_len);
+}
+
+/*
+ * Sets up the channel for a new request. Returns false if the previous one
+ * is still being handled.
+ */
+static bool mg_rpc_channel_http_begin_request(struct mg_rpc_channel *ch,
+                                              struct http_message *hm) {
+  struct mg_rpc_channel_http_data *chd =
+      (struct mg_rpc_channel_http_data *) ch->channel_data;
+  if (chd->in_request || chd->is_streaming) {
+    /*
+     * Pipelined request, responses can't be reordered. Finish the current
+     * one and close, the client will retry.
+     */
+    LOG(LL_ERROR, ("%p pipelined request dropped", chd->nc));
+    chd->keep_alive = false;
+    return false;
+  }
+  struct mg_str *conn = mg_get_http_header(hm, "Connection");
+  if (conn != NULL && mg_vcasecmp(conn, "close") == 0) {
+    chd->keep_alive = false;
+  } else if (conn != NULL && mg_vcasecmp(conn, "keep-alive") == 0) {
+    chd->keep_alive = true;
+  } else {
+    chd->keep_alive = (mg_vcmp(&hm->proto, "HTTP/1.1") == 0);
+  }
+  chd->in_request = true;
+  mg_rpc_channel_http_save_auth(chd, hm);
+  if (!chd->is_open) {
+    chd->is_open = true;
+    ch->ev_handler(ch, MG_RPC_CHANNEL_OPEN, NULL);
+  }
+  return true;
+}
+
+/* Only the media type counts, parameters ("; charset=...") are ignored. */
+static bool mg_rpc_channel_http_is_cbor(const struct mg_str *ct) {
+  if (ct == NULL) return false;
+  const char *semi = mg_strchr(*ct, ';');
+  struct mg_str mt = mg_strstrip(mg_mk_str_n(
+      ct->p, (semi != NULL ? (size_t)(semi - ct->p) : ct->len)));
+  return (mg_vcasecmp(&mt, "application/cbor") == 0);
+}
+
 void mg_rpc_channel_http_recd_frame(struct mg_connection *nc,
                                     struct http_message *hm,
                                     struct mg_rpc_channel *ch,
                                     const struct mg_str frame) {
   struct mg_rpc_channel_http_data *chd =
       (struct mg_rpc_channel_http_data *) ch->channel_data;
-  chd->nc = nc;
-  chd->hm = hm;
-  ch->ev_handler(ch, MG_RPC_CHANNEL_OPEN, NULL);
-  ch->ev_handler(ch, MG_RPC_CHANNEL_FRAME_RECD, (void *) &frame);
+  if (!mg_rpc_channel_http_begin_request(ch, hm)) return;
+  struct mg_str *ct = mg_get_http_header(hm, "Content-Type");
+  chd->is_rest = false;
+  chd->is_cbor = mg_rpc_channel_http_is_cbor(ct);
+  ch->send_parsed_frame =
+      (chd->is_cbor ? mg_rpc_channel_http_send_parsed_frame : NULL);
+  if (chd->is_cbor) {
+    mg_rpc_cbor_frame_recd(ch, frame);
+  } else {
+    ch->ev_handler(ch, MG_RPC_CHANNEL_FRAME_RECD, (void *) &frame);
+  }
+  (void) nc;
 }
 
 void mg_rpc_channel_http_recd_parsed_frame(struct mg_connection *nc,
@@ -244,9 +531,10 @@ void mg_rpc_channel_http_recd_parsed_frame(struct mg_connection *nc,
                                            const struct mg_str args) {
   struct mg_rpc_channel_http_data *chd =
       (struct mg_rpc_channel_http_data *) ch->channel_data;
-  chd->nc = nc;
-  chd->hm = hm;
+  if (!mg_rpc_channel_http_begin_request(ch, hm)) return;
   chd->is_rest = true;
+  chd->is_cbor = false;
+  ch->send_parsed_frame = NULL;
 
   /* Prepare "parsed" frame */
   struct mg_rpc_frame frame;
@@ -254,9 +542,8 @@ void mg_rpc_channel_http_recd_parsed_frame(struct mg_connection *nc,
   frame.method = method;
   frame.args = args;
 
-  /* "Open" the channel and send the frame */
-  ch->ev_handler(ch, MG_RPC_CHANNEL_OPEN, NULL);
   ch->ev_handler(ch, MG_RPC_CHANNEL_FRAME_RECD_PARSED, &frame);
+  (void) nc;
 }
 
 #endif /* defined(MGOS_HAVE_HTTP_SERVER) && MGOS_ENABLE_RPC_CHANNEL_HTTP */
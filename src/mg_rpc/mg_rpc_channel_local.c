@@ -0,0 +1,238 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mg_rpc_channel_local.h"
+#include "mg_rpc.h"
+#include "mg_rpc_channel.h"
+
+#include "common/cs_dbg.h"
+
+#include "mgos_hal.h"
+
+/*
+ * Frames accepted but not delivered yet. In the deferred mode this bounds
+ * the number of copies waiting, the rest wait in the channel queue.
+ */
+#define MG_RPC_CHANNEL_LOCAL_SEND_WINDOW 8
+
+struct mg_rpc_channel_local_data {
+  bool sync;
+  bool is_open;
+  bool is_destroyed;
+  int num_pending; /* Deliveries in progress or scheduled. */
+};
+
+/* Copy of a frame, for deferred delivery. Strings follow the struct. */
+struct mg_rpc_channel_local_msg {
+  struct mg_rpc_channel *ch;
+  bool parsed;
+  struct mg_rpc_frame frame;
+  struct mg_str f;
+};
+
+static void mg_rpc_channel_local_free(struct mg_rpc_channel *ch) {
+  free(ch->channel_data);
+  free(ch);
+}
+
+static void mg_rpc_channel_local_done(struct mg_rpc_channel *ch) {
+  struct mg_rpc_channel_local_data *chd =
+      (struct mg_rpc_channel_local_data *) ch->channel_data;
+  if (--chd->num_pending == 0 && chd->is_destroyed) {
+    mg_rpc_channel_local_free(ch);
+  }
+}
+
+/* Hands the frame (parsed, if frame is not NULL) to the receiving side. */
+static void mg_rpc_channel_local_deliver(struct mg_rpc_channel *ch,
+                                         const struct mg_rpc_frame *frame,
+                                         struct mg_str f) {
+  struct mg_rpc_channel_local_data *chd =
+      (struct mg_rpc_channel_local_data *) ch->channel_data;
+  /* Closed while the frame was waiting. */
+  if (!chd->is_open) return;
+  if (frame != NULL) {
+    ch->ev_handler(ch, MG_RPC_CHANNEL_FRAME_RECD_PARSED, (void *) frame);
+  } else {
+    ch->ev_handler(ch, MG_RPC_CHANNEL_FRAME_RECD, &f);
+  }
+  /* Confirmed once delivered, the window limits delivery in progress. */
+  if (chd->is_open) {
+    ch->ev_handler(ch, MG_RPC_CHANNEL_FRAME_SENT, (void *) 1);
+  }
+}
+
+static void mg_rpc_channel_local_deliver_cb(void *arg) {
+  struct mg_rpc_channel_local_msg *m = (struct mg_rpc_channel_local_msg *) arg;
+  struct mg_rpc_channel *ch = m->ch;
+  mg_rpc_channel_local_deliver(ch, (m->parsed ? &m->frame : NULL), m->f);
+  free(m);
+  mg_rpc_channel_local_done(ch);
+}
+
+static size_t mg_rpc_channel_local_frame_len(const struct mg_rpc_frame *frame) {
+  return frame->src.len + frame->dst.len + frame->tag.len + frame->method.len +
+         frame->args.len + frame->result.len + frame->error_msg.len +
+         frame->auth.len + frame->chunk.len;
+}
+
+/* Copies s to *p, NULL stays NULL (chunks are told apart by that). */
+static struct mg_str mg_rpc_channel_local_copy_str(const struct mg_str s,
+                                                   char **p) {
+  if (s.p == NULL) return mg_mk_str(NULL);
+  struct mg_str res = mg_mk_str_n(*p, s.len);
+  memcpy(*p, s.p, s.len);
+  *p += s.len;
+  return res;
+}
+
+/* Either frame or f is copied, delivery happens later. */
+static bool mg_rpc_channel_local_defer(struct mg_rpc_channel *ch,
+                                       const struct mg_rpc_frame *frame,
+                                       const struct mg_str f) {
+  struct mg_rpc_channel_local_data *chd =
+      (struct mg_rpc_channel_local_data *) ch->channel_data;
+  size_t len = (frame != NULL ? mg_rpc_channel_local_frame_len(frame) : f.len);
+  struct mg_rpc_channel_local_msg *m =
+      (struct mg_rpc_channel_local_msg *) calloc(1, sizeof(*m) + len);
+  if (m == NULL) return false;
+  char *p = (char *) (m + 1);
+  m->ch = ch;
+  if (frame != NULL) {
+    m->parsed = true;
+    m->frame = *frame;
+    m->frame.src = mg_rpc_channel_local_copy_str(frame->src, &p);
+    m->frame.dst = mg_rpc_channel_local_copy_str(frame->dst, &p);
+    m->frame.tag = mg_rpc_channel_local_copy_str(frame->tag, &p);
+    m->frame.method = mg_rpc_channel_local_copy_str(frame->method, &p);
+    m->frame.args = mg_rpc_channel_local_copy_str(frame->args, &p);
+    m->frame.result = mg_rpc_channel_local_copy_str(frame->result, &p);
+    m->frame.error_msg = mg_rpc_channel_local_copy_str(frame->error_msg, &p);
+    m->frame.auth = mg_rpc_channel_local_copy_str(frame->auth, &p);
+    m->frame.chunk = mg_rpc_channel_local_copy_str(frame->chunk, &p);
+    /* CBOR only ever arrives from the network. */
+    m->frame.args_cbor = mg_mk_str(NULL);
+  } else {
+    m->f = mg_rpc_channel_local_copy_str(f, &p);
+  }
+  if (!mgos_invoke_cb(mg_rpc_channel_local_deliver_cb, m, false)) {
+    free(m);
+    return false;
+  }
+  chd->num_pending++;
+  return true;
+}
+
+static bool mg_rpc_channel_local_send(struct mg_rpc_channel *ch,
+                                      const struct mg_rpc_frame *frame,
+                                      const struct mg_str f) {
+  struct mg_rpc_channel_local_data *chd =
+      (struct mg_rpc_channel_local_data *) ch->channel_data;
+  if (!chd->is_open) return false;
+  if (!chd->sync) return mg_rpc_channel_local_defer(ch, frame, f);
+  /* Handlers may close the channel, keep it around until we are done. */
+  chd->num_pending++;
+  mg_rpc_channel_local_deliver(ch, frame, f);
+  mg_rpc_channel_local_done(ch);
+  return true;
+}
+
+static bool mg_rpc_channel_local_send_frame(struct mg_rpc_channel *ch,
+                                            const struct mg_str f) {
+  return mg_rpc_channel_local_send(ch, NULL, f);
+}
+
+static bool mg_rpc_channel_local_send_parsed_frame(
+    struct mg_rpc_channel *ch, const struct mg_rpc_frame *frame) {
+  return mg_rpc_channel_local_send(ch, frame, mg_mk_str(NULL));
+}
+
+static int mg_rpc_channel_local_get_send_window(struct mg_rpc_channel *ch) {
+  (void) ch;
+  return MG_RPC_CHANNEL_LOCAL_SEND_WINDOW;
+}
+
+static void mg_rpc_channel_local_ch_connect(struct mg_rpc_channel *ch) {
+  struct mg_rpc_channel_local_data *chd =
+      (struct mg_rpc_channel_local_data *) ch->channel_data;
+  if (chd->is_open) return;
+  chd->is_open = true;
+  ch->ev_handler(ch, MG_RPC_CHANNEL_OPEN, NULL);
+}
+
+static void mg_rpc_channel_local_ch_close(struct mg_rpc_channel *ch) {
+  struct mg_rpc_channel_local_data *chd =
+      (struct mg_rpc_channel_local_data *) ch->channel_data;
+  if (!chd->is_open) return;
+  chd->is_open = false;
+  ch->ev_handler(ch, MG_RPC_CHANNEL_CLOSED, NULL);
+}
+
+static void mg_rpc_channel_local_ch_destroy(struct mg_rpc_channel *ch) {
+  struct mg_rpc_channel_local_data *chd =
+      (struct mg_rpc_channel_local_data *) ch->channel_data;
+  /* Scheduled deliveries still point to it, the last one frees it. */
+  chd->is_destroyed = true;
+  if (chd->num_pending == 0) mg_rpc_channel_local_free(ch);
+}
+
+static const char *mg_rpc_channel_local_get_type(struct mg_rpc_channel *ch) {
+  (void) ch;
+  return "local";
+}
+
+static char *mg_rpc_channel_local_get_info(struct mg_rpc_channel *ch) {
+  (void) ch;
+  return NULL;
+}
+
+static bool mg_rpc_channel_local_get_authn_info(
+    struct mg_rpc_channel *ch, const char *auth_domain, const char *auth_file,
+    struct mg_rpc_authn_info *authn) {
+  (void) ch;
+  (void) auth_domain;
+  (void) auth_file;
+  (void) authn;
+  return false;
+}
+
+struct mg_rpc_channel *mg_rpc_channel_local(
+    const struct mg_rpc_channel_local_cfg *cfg) {
+  struct mg_rpc_channel *ch = (struct mg_rpc_channel *) calloc(1, sizeof(*ch));
+  struct mg_rpc_channel_local_data *chd =
+      (struct mg_rpc_channel_local_data *) calloc(1, sizeof(*chd));
+  if (ch == NULL || chd == NULL) {
+    free(ch);
+    free(chd);
+    return NULL;
+  }
+  chd->sync = cfg->sync;
+  ch->ch_connect = mg_rpc_channel_local_ch_connect;
+  ch->send_frame = mg_rpc_channel_local_send_frame;
+  ch->send_parsed_frame = mg_rpc_channel_local_send_parsed_frame;
+  ch->get_send_window = mg_rpc_channel_local_get_send_window;
+  ch->ch_close = mg_rpc_channel_local_ch_close;
+  ch->ch_destroy = mg_rpc_channel_local_ch_destroy;
+  ch->get_type = mg_rpc_channel_local_get_type;
+  ch->is_persistent = mg_rpc_channel_true;
+  ch->is_broadcast_enabled = mg_rpc_channel_false;
+  ch->get_info = mg_rpc_channel_local_get_info;
+  ch->get_authn_info = mg_rpc_channel_local_get_authn_info;
+  ch->channel_data = chd;
+  LOG(LL_DEBUG, ("%p %s", ch, (chd->sync ? "sync" : "deferred")));
+  return ch;
+}
@@ -0,0 +1,255 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mg_rpc_channel_shard.h"
+#include "mg_rpc_channel.h"
+
+#include "common/cs_dbg.h"
+
+/*
+ * One direction. head is only written by the producer, tail only by the
+ * consumer. Both only grow (and wrap around), head - tail is the fill.
+ */
+struct mg_rpc_shard_ring {
+  char **slots; /* Frames: size_t length, then the data. */
+  uint32_t mask;
+  uint32_t head;
+  uint32_t tail;
+};
+
+/* State shared by the two ends, the only thing they both touch. */
+struct mg_rpc_shard_link {
+  struct mg_rpc_shard_ring rings[2];
+  int closed; /* Set by the end that closes first. */
+  int refcnt; /* Ends not destroyed yet. */
+};
+
+struct mg_rpc_channel_shard_data {
+  struct mg_rpc_shard_link *link;
+  struct mg_rpc_shard_ring *out, *in;
+  uint32_t num_confirmed; /* Frames of out reported with FRAME_SENT. */
+  bool is_open;
+  bool in_poll;
+  bool is_destroyed; /* While in poll, freed when it returns. */
+};
+
+/* Producer side. */
+static bool mg_rpc_shard_ring_push(struct mg_rpc_shard_ring *r, char *m) {
+  uint32_t head = r->head;
+  uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+  if (head - tail > r->mask) return false;
+  r->slots[head & r->mask] = m;
+  __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+/* Consumer side. */
+static char *mg_rpc_shard_ring_pop(struct mg_rpc_shard_ring *r) {
+  uint32_t tail = r->tail;
+  uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+  if (tail == head) return NULL;
+  char *m = r->slots[tail & r->mask];
+  __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+  return m;
+}
+
+/* Last end to go frees the link, along with frames nobody took. */
+static void mg_rpc_shard_link_unref(struct mg_rpc_shard_link *l) {
+  if (__atomic_sub_fetch(&l->refcnt, 1, __ATOMIC_ACQ_REL) > 0) return;
+  for (int i = 0; i < 2; i++) {
+    char *m;
+    while ((m = mg_rpc_shard_ring_pop(&l->rings[i])) != NULL) free(m);
+    free(l->rings[i].slots);
+  }
+  free(l);
+}
+
+static void mg_rpc_channel_shard_free(struct mg_rpc_channel *ch) {
+  struct mg_rpc_channel_shard_data *chd =
+      (struct mg_rpc_channel_shard_data *) ch->channel_data;
+  mg_rpc_shard_link_unref(chd->link);
+  free(chd);
+  free(ch);
+}
+
+static void mg_rpc_channel_shard_set_closed(struct mg_rpc_channel *ch) {
+  struct mg_rpc_channel_shard_data *chd =
+      (struct mg_rpc_channel_shard_data *) ch->channel_data;
+  if (!chd->is_open) return;
+  chd->is_open = false;
+  ch->ev_handler(ch, MG_RPC_CHANNEL_CLOSED, NULL);
+}
+
+void mg_rpc_channel_shard_poll(struct mg_rpc_channel *ch) {
+  struct mg_rpc_channel_shard_data *chd =
+      (struct mg_rpc_channel_shard_data *) ch->channel_data;
+  struct mg_rpc_shard_link *l = chd->link;
+  char *m;
+  if (!chd->is_open) return;
+  chd->in_poll = true;
+  if (__atomic_load_n(&l->closed, __ATOMIC_ACQUIRE)) {
+    mg_rpc_channel_shard_set_closed(ch);
+  }
+  while (chd->is_open && (m = mg_rpc_shard_ring_pop(chd->in)) != NULL) {
+    size_t len;
+    memcpy(&len, m, sizeof(len));
+    struct mg_str f = mg_mk_str_n(m + sizeof(len), len);
+    ch->ev_handler(ch, MG_RPC_CHANNEL_FRAME_RECD, &f);
+    free(m);
+  }
+  /* Frames the other end has taken free up the window. */
+  uint32_t taken = __atomic_load_n(&chd->out->tail, __ATOMIC_ACQUIRE);
+  while (chd->is_open && chd->num_confirmed != taken) {
+    chd->num_confirmed++;
+    ch->ev_handler(ch, MG_RPC_CHANNEL_FRAME_SENT, (void *) 1);
+  }
+  chd->in_poll = false;
+  if (chd->is_destroyed) mg_rpc_channel_shard_free(ch);
+}
+
+static bool mg_rpc_channel_shard_send_frame(struct mg_rpc_channel *ch,
+                                            const struct mg_str f) {
+  struct mg_rpc_channel_shard_data *chd =
+      (struct mg_rpc_channel_shard_data *) ch->channel_data;
+  if (!chd->is_open || __atomic_load_n(&chd->link->closed, __ATOMIC_ACQUIRE)) {
+    return false;
+  }
+  char *m = (char *) malloc(sizeof(f.len) + f.len);
+  if (m == NULL) return false;
+  memcpy(m, &f.len, sizeof(f.len));
+  memcpy(m + sizeof(f.len), f.p, f.len);
+  if (!mg_rpc_shard_ring_push(chd->out, m)) {
+    free(m);
+    return false;
+  }
+  return true;
+}
+
+static int mg_rpc_channel_shard_get_send_window(struct mg_rpc_channel *ch) {
+  struct mg_rpc_channel_shard_data *chd =
+      (struct mg_rpc_channel_shard_data *) ch->channel_data;
+  return (int) chd->out->mask + 1;
+}
+
+static void mg_rpc_channel_shard_ch_connect(struct mg_rpc_channel *ch) {
+  struct mg_rpc_channel_shard_data *chd =
+      (struct mg_rpc_channel_shard_data *) ch->channel_data;
+  /* Once closed, the link is gone for good. */
+  if (chd->is_open || __atomic_load_n(&chd->link->closed, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+  chd->is_open = true;
+  ch->ev_handler(ch, MG_RPC_CHANNEL_OPEN, NULL);
+}
+
+static void mg_rpc_channel_shard_ch_close(struct mg_rpc_channel *ch) {
+  struct mg_rpc_channel_shard_data *chd =
+      (struct mg_rpc_channel_shard_data *) ch->channel_data;
+  /* The other end notices on its next poll. */
+  __atomic_store_n(&chd->link->closed, 1, __ATOMIC_RELEASE);
+  mg_rpc_channel_shard_set_closed(ch);
+}
+
+static void mg_rpc_channel_shard_ch_destroy(struct mg_rpc_channel *ch) {
+  struct mg_rpc_channel_shard_data *chd =
+      (struct mg_rpc_channel_shard_data *) ch->channel_data;
+  if (chd->in_poll) {
+    chd->is_destroyed = true;
+    return;
+  }
+  mg_rpc_channel_shard_free(ch);
+}
+
+static const char *mg_rpc_channel_shard_get_type(struct mg_rpc_channel *ch) {
+  (void) ch;
+  return "shard";
+}
+
+static char *mg_rpc_channel_shard_get_info(struct mg_rpc_channel *ch) {
+  (void) ch;
+  return NULL;
+}
+
+static bool mg_rpc_channel_shard_get_authn_info(
+    struct mg_rpc_channel *ch, const char *auth_domain, const char *auth_file,
+    struct mg_rpc_authn_info *authn) {
+  (void) ch;
+  (void) auth_domain;
+  (void) auth_file;
+  (void) authn;
+  return false;
+}
+
+static struct mg_rpc_channel *mg_rpc_channel_shard_end(
+    struct mg_rpc_shard_link *l, int out) {
+  struct mg_rpc_channel *ch = (struct mg_rpc_channel *) calloc(1, sizeof(*ch));
+  struct mg_rpc_channel_shard_data *chd =
+      (struct mg_rpc_channel_shard_data *) calloc(1, sizeof(*chd));
+  if (ch == NULL || chd == NULL) {
+    free(ch);
+    free(chd);
+    return NULL;
+  }
+  chd->link = l;
+  chd->out = &l->rings[out];
+  chd->in = &l->rings[!out];
+  ch->ch_connect = mg_rpc_channel_shard_ch_connect;
+  ch->send_frame = mg_rpc_channel_shard_send_frame;
+  ch->get_send_window = mg_rpc_channel_shard_get_send_window;
+  ch->ch_close = mg_rpc_channel_shard_ch_close;
+  ch->ch_destroy = mg_rpc_channel_shard_ch_destroy;
+  ch->get_type = mg_rpc_channel_shard_get_type;
+  ch->is_persistent = mg_rpc_channel_false;
+  ch->is_broadcast_enabled = mg_rpc_channel_false;
+  ch->get_info = mg_rpc_channel_shard_get_info;
+  ch->get_authn_info = mg_rpc_channel_shard_get_authn_info;
+  ch->channel_data = chd;
+  return ch;
+}
+
+bool mg_rpc_channel_shard_pair(int ring_size, struct mg_rpc_channel **a,
+                               struct mg_rpc_channel **b) {
+  uint32_t size = 1;
+  while (size < (uint32_t) ring_size) size <<= 1;
+  struct mg_rpc_shard_link *l =
+      (struct mg_rpc_shard_link *) calloc(1, sizeof(*l));
+  if (l == NULL) return false;
+  l->refcnt = 2;
+  for (int i = 0; i < 2; i++) {
+    l->rings[i].slots = (char **) calloc(size, sizeof(char *));
+    l->rings[i].mask = size - 1;
+  }
+  *a = mg_rpc_channel_shard_end(l, 0);
+  *b = mg_rpc_channel_shard_end(l, 1);
+  if (l->rings[0].slots == NULL || l->rings[1].slots == NULL || *a == NULL ||
+      *b == NULL) {
+    free(l->rings[0].slots);
+    free(l->rings[1].slots);
+    if (*a != NULL) free((*a)->channel_data);
+    if (*b != NULL) free((*b)->channel_data);
+    free(*a);
+    free(*b);
+    free(l);
+    *a = *b = NULL;
+    return false;
+  }
+  return true;
+}
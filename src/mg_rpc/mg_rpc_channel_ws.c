@@ -15,25 +15,108 @@
  * limitations under the License.
  */
 
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "mg_rpc.h"
+#include "mg_rpc_cbor.h"
 #include "mg_rpc_channel.h"
 #include "mg_rpc_channel_tcp_common.h"
 #include "mg_rpc_channel_ws.h"
+#include "mg_rpc_deflate.h"
+#include "mg_rpc_timer.h"
 
+#include "common/cs_base64.h"
 #include "common/cs_dbg.h"
+#include "common/cs_sha1.h"
 
 #define MG_RPC_WS_ORIGIN "https://api.cesanta.com/"
 #define MG_RPC_WS_PROTOCOL "clubby.cesanta.com"
+#define MG_RPC_WS_PROTOCOL_CBOR "clubby.cesanta.com.cbor"
 #define MG_RPC_WS_URI "/api"
+#define MG_RPC_WS_ORIGIN_HDR "Origin: " MG_RPC_WS_ORIGIN "\r\n"
+#define MG_RPC_WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+/*
+ * permessage-deflate (RFC 7692). No context takeover either way: each
+ * message is compressed on its own, nothing is kept between messages.
+ */
+#define MG_RPC_WS_DEFLATE "permessage-deflate"
+#define MG_RPC_WS_DEFLATE_PARAMS \
+  "; client_no_context_takeover; server_no_context_takeover"
+#define MG_RPC_WS_DEFLATE_WINDOW_BITS 10
+#define MG_RPC_WS_DEFLATE_HDR \
+  "Sec-WebSocket-Extensions: " MG_RPC_WS_DEFLATE MG_RPC_WS_DEFLATE_PARAMS "\r\n"
+#define MG_RPC_WS_FLAG_RSV1 0x40 /* Message is compressed. */
+/* Set on the connection by mg_rpc_channel_ws_in_handshake. */
+#define MG_RPC_WS_F_DEFLATE MG_F_USER_5
+#define MG_RPC_WS_F_CBOR MG_F_USER_4
 
 /* Inbound WebSocket channel. */
 
 struct mg_rpc_channel_ws_data {
   struct mg_connection *nc;
+  /* 0 - send one frame at a time. */
+  int send_high_water_mark;
+  /* Total number of bytes written to the socket so far. */
+  uint64_t num_sent;
+  /*
+   * Frames in flight: for each, value of num_sent at which it will have been
+   * written out completely.
+   */
+  struct mbuf in_flight;
+  /* Authenticated peer, if any. Reset when connection closes. */
+  struct mg_rpc_authn_info authn;
+  /* Frames smaller than this are not compressed. */
+  int deflate_min_size;
+  /* Limit on decompressed size of incoming frames, 0 - no limit. */
+  int max_inflated_size;
   unsigned int is_open : 1;
-  unsigned int sending : 1;
   unsigned int free_data : 1;
+  /*
+   * Frames are sent CBOR-encoded, as binary. Agreed on during handshake as
+   * the subprotocol. Incoming frames are decoded according to their type.
+   */
+  unsigned int is_cbor : 1;
+  /* permessage-deflate has been agreed on during handshake. */
+  unsigned int deflate : 1;
 };
 
+static size_t mg_rpc_ws_num_in_flight(struct mg_rpc_channel_ws_data *chd) {
+  return chd->in_flight.len / sizeof(uint64_t);
+}
+
+/*
+ * Reports completed frames. If success is false or the send buffer is empty,
+ * all the frames in flight are done with.
+ */
+static void mg_rpc_ws_frames_sent(struct mg_rpc_channel *ch, bool success) {
+  struct mg_rpc_channel_ws_data *chd =
+      (struct mg_rpc_channel_ws_data *) ch->channel_data;
+  bool all = (!success || chd->nc == NULL || chd->nc->send_mbuf.len == 0);
+  while (mg_rpc_ws_num_in_flight(chd) > 0) {
+    uint64_t end;
+    memcpy(&end, chd->in_flight.buf, sizeof(end));
+    if (!all && end > chd->num_sent) break;
+    mbuf_remove(&chd->in_flight, sizeof(end));
+    ch->ev_handler(ch, MG_RPC_CHANNEL_FRAME_SENT, (void *) (intptr_t) success);
+  }
+}
+
+/* Sender removes the sync flush marker, it needs to be put back. */
+static bool mg_rpc_ws_inflate(struct mg_rpc_channel_ws_data *chd,
+                              const struct mg_str data, struct mbuf *out) {
+  struct mbuf in;
+  mbuf_init(&in, data.len + 4);
+  mbuf_append(&in, data.p, data.len);
+  mbuf_append(&in, "\x00\x00\xff\xff", 4);
+  bool res = mg_rpc_inflate(mg_mk_str_n(in.buf, in.len),
+                            (size_t) chd->max_inflated_size, out);
+  mbuf_free(&in);
+  return res;
+}
+
 static void mg_rpc_ws_handler(struct mg_connection *nc, int ev, void *ev_data,
                               void *user_data) {
 #if !MG_ENABLE_CALLBACK_USERDATA
@@ -49,7 +132,8 @@ static void mg_rpc_ws_handler(struct mg_connection *nc, int ev, void *ev_data,
   if (chd == NULL) return;
   switch (ev) {
     case MG_EV_WEBSOCKET_HANDSHAKE_DONE: {
-      LOG(LL_INFO, ("%p WS HANDSHAKE DONE", ch));
+      LOG(LL_INFO, ("%p WS HANDSHAKE DONE%s", ch,
+                    (chd->deflate ? " (deflate)" : "")));
       chd->is_open = true;
       ch->ev_handler(ch, MG_RPC_CHANNEL_OPEN, NULL);
       break;
@@ -57,29 +141,38 @@ static void mg_rpc_ws_handler(struct mg_connection *nc, int ev, void *ev_data,
     case MG_EV_WEBSOCKET_FRAME: {
       struct websocket_message *wm = (struct websocket_message *) ev_data;
       struct mg_str f = mg_mk_str_n((const char *) wm->data, wm->size);
-      ch->ev_handler(ch, MG_RPC_CHANNEL_FRAME_RECD, &f);
+      struct mbuf z;
+      mbuf_init(&z, 0);
+      if (wm->flags & MG_RPC_WS_FLAG_RSV1) {
+        if (!chd->deflate || !mg_rpc_ws_inflate(chd, f, &z)) {
+          LOG(LL_ERROR, ("%p Invalid compressed frame", ch));
+          nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+          mbuf_free(&z);
+          break;
+        }
+        f = mg_mk_str_n(z.buf, z.len);
+      }
+      if ((wm->flags & 0x0f) == WEBSOCKET_OP_BINARY) {
+        mg_rpc_cbor_frame_recd(ch, f);
+      } else {
+        ch->ev_handler(ch, MG_RPC_CHANNEL_FRAME_RECD, &f);
+      }
+      mbuf_free(&z);
       break;
     }
     case MG_EV_SEND: {
-      if (!chd->sending) break;
       int num_sent = *((int *) ev_data);
-      if (num_sent < 0) {
-        chd->sending = false;
-        ch->ev_handler(ch, MG_RPC_CHANNEL_FRAME_SENT, (void *) 0);
-      } else if (nc->send_mbuf.len == 0) {
-        chd->sending = false;
-        ch->ev_handler(ch, MG_RPC_CHANNEL_FRAME_SENT, (void *) 1);
-      }
+      if (num_sent > 0) chd->num_sent += num_sent;
+      mg_rpc_ws_frames_sent(ch, (num_sent >= 0));
       break;
     }
     case MG_EV_CLOSE: {
       nc->user_data = NULL;
       chd->nc = NULL;
+      mg_rpc_authn_info_free(&chd->authn);
       if (chd->is_open) {
         LOG(LL_DEBUG, ("%p CLOSED", ch));
-        if (chd->sending) {
-          ch->ev_handler(ch, MG_RPC_CHANNEL_FRAME_SENT, (void *) 0);
-        }
+        mg_rpc_ws_frames_sent(ch, false /* success */);
         ch->ev_handler(ch, MG_RPC_CHANNEL_CLOSED, NULL);
       }
       break;
@@ -91,16 +184,164 @@ static void mg_rpc_channel_ws_in_ch_connect(struct mg_rpc_channel *ch) {
   (void) ch;
 }
 
+static bool mg_rpc_ws_can_send(struct mg_rpc_channel_ws_data *chd) {
+  struct mg_connection *nc = chd->nc;
+  if (nc == NULL) return false;
+  /* First frame is always accepted, so FRAME_SENT is guaranteed to follow. */
+  if (mg_rpc_ws_num_in_flight(chd) == 0) return true;
+  return (chd->send_high_water_mark > 0 &&
+          nc->send_mbuf.len < (size_t) chd->send_high_water_mark);
+}
+
+/* Frame has been appended to the send buffer, track it. */
+static void mg_rpc_ws_frame_queued(struct mg_rpc_channel_ws_data *chd) {
+  uint64_t end = chd->num_sent + chd->nc->send_mbuf.len;
+  mbuf_append(&chd->in_flight, &end, sizeof(end));
+}
+
+/*
+ * mg_send_websocket_frame can't set RSV1, so compressed messages are framed
+ * here. Frames sent by the client must be masked.
+ */
+static void mg_rpc_ws_send_compressed(struct mg_connection *nc, int op,
+                                      const struct mg_str data) {
+  uint8_t hdr[14];
+  size_t hlen = 2, len = data.len, off;
+  bool mask = (nc->listener == NULL);
+  hdr[0] = 0x80 /* FIN */ | MG_RPC_WS_FLAG_RSV1 | op;
+  if (len < 126) {
+    hdr[1] = (uint8_t) len;
+  } else if (len <= 0xffff) {
+    hdr[1] = 126;
+    hdr[2] = (uint8_t)(len >> 8);
+    hdr[3] = (uint8_t)(len & 0xff);
+    hlen = 4;
+  } else {
+    hdr[1] = 127;
+    for (int i = 0; i < 8; i++) {
+      hdr[2 + i] = (uint8_t)((uint64_t) len >> (56 - 8 * i));
+    }
+    hlen = 10;
+  }
+  if (mask) {
+    uint32_t key = (uint32_t) rand();
+    hdr[1] |= 0x80;
+    memcpy(hdr + hlen, &key, sizeof(key));
+    hlen += sizeof(key);
+  }
+  mg_send(nc, hdr, hlen);
+  off = nc->send_mbuf.len;
+  mg_send(nc, data.p, len);
+  if (mask) {
+    for (size_t i = 0; i < len; i++) {
+      nc->send_mbuf.buf[off + i] ^= hdr[hlen - 4 + i % 4];
+    }
+  }
+}
+
+/* Compresses the message if it's been agreed on and is worth it. */
+static void mg_rpc_ws_send(struct mg_rpc_channel_ws_data *chd, int op,
+                           const struct mg_str data) {
+  if (chd->deflate && data.len >= (size_t) chd->deflate_min_size) {
+    struct mbuf z;
+    mbuf_init(&z, data.len / 2);
+    if (mg_rpc_deflate(data, MG_RPC_WS_DEFLATE_WINDOW_BITS, &z) &&
+        z.len - 4 < data.len) {
+      /* Sync flush marker is not sent. */
+      mg_rpc_ws_send_compressed(chd->nc, op, mg_mk_str_n(z.buf, z.len - 4));
+      mbuf_free(&z);
+      return;
+    }
+    mbuf_free(&z);
+  }
+  mg_send_websocket_frame(chd->nc, op, data.p, data.len);
+}
+
 static bool mg_rpc_channel_ws_send_frame(struct mg_rpc_channel *ch,
                                          const struct mg_str f) {
   struct mg_rpc_channel_ws_data *chd =
       (struct mg_rpc_channel_ws_data *) ch->channel_data;
-  if (chd->nc == NULL || chd->sending) return false;
-  chd->sending = true;
-  mg_send_websocket_frame(chd->nc, WEBSOCKET_OP_TEXT, f.p, f.len);
+  if (!mg_rpc_ws_can_send(chd)) return false;
+  if (chd->is_cbor) {
+    struct mbuf cbor;
+    mbuf_init(&cbor, f.len);
+    if (!mg_rpc_json_to_cbor(f, &cbor)) {
+      LOG(LL_ERROR, ("%p Failed to encode frame", ch));
+      mbuf_free(&cbor);
+      return false;
+    }
+    mg_rpc_ws_send(chd, WEBSOCKET_OP_BINARY, mg_mk_str_n(cbor.buf, cbor.len));
+    mbuf_free(&cbor);
+  } else {
+    mg_rpc_ws_send(chd, WEBSOCKET_OP_TEXT, f);
+  }
+  mg_rpc_ws_frame_queued(chd);
+  return true;
+}
+
+/* CBOR frames are encoded from the parsed frame, JSON is not built. */
+static bool mg_rpc_channel_ws_send_parsed_frame(
+    struct mg_rpc_channel *ch, const struct mg_rpc_frame *frame) {
+  struct mg_rpc_channel_ws_data *chd =
+      (struct mg_rpc_channel_ws_data *) ch->channel_data;
+  if (!chd->is_cbor || !mg_rpc_ws_can_send(chd)) return false;
+  struct mbuf cbor;
+  mbuf_init(&cbor, 50 + frame->args.len + frame->result.len);
+  if (!mg_rpc_cbor_encode_frame(frame, &cbor)) {
+    mbuf_free(&cbor);
+    return false;
+  }
+  mg_rpc_ws_send(chd, WEBSOCKET_OP_BINARY, mg_mk_str_n(cbor.buf, cbor.len));
+  mbuf_free(&cbor);
+  mg_rpc_ws_frame_queued(chd);
+  return true;
+}
+
+static void mg_rpc_ws_set_cbor(struct mg_rpc_channel *ch, bool is_cbor) {
+  struct mg_rpc_channel_ws_data *chd =
+      (struct mg_rpc_channel_ws_data *) ch->channel_data;
+  chd->is_cbor = is_cbor;
+  ch->send_parsed_frame =
+      (is_cbor ? mg_rpc_channel_ws_send_parsed_frame : NULL);
+}
+
+/*
+ * Server frames are not masked, so if the frame needs a 4 byte header
+ * (length is 126 - 64K) and there's nothing else in the send buffer,
+ * the header goes into the headroom and the buffer becomes the send buffer.
+ * Anything else, including CBOR and compressed frames, is copied.
+ */
+static bool mg_rpc_channel_ws_in_send_frame_owned(struct mg_rpc_channel *ch,
+                                                  struct mbuf *fb) {
+  struct mg_rpc_channel_ws_data *chd =
+      (struct mg_rpc_channel_ws_data *) ch->channel_data;
+  size_t len = fb->len - MG_RPC_CHANNEL_FRAME_HEADROOM;
+  if (!mg_rpc_ws_can_send(chd)) return false;
+  struct mg_connection *nc = chd->nc;
+  if (nc->send_mbuf.len > 0 || len < 126 || len > 0xffff || chd->is_cbor ||
+      (chd->deflate && len >= (size_t) chd->deflate_min_size)) {
+    return mg_rpc_channel_ws_send_frame(
+        ch, mg_mk_str_n(fb->buf + MG_RPC_CHANNEL_FRAME_HEADROOM, len));
+  }
+  uint8_t *hdr = (uint8_t *) fb->buf;
+  hdr[0] = 0x80 /* FIN */ | WEBSOCKET_OP_TEXT;
+  hdr[1] = 126;
+  hdr[2] = (uint8_t)(len >> 8);
+  hdr[3] = (uint8_t)(len & 0xff);
+  mbuf_free(&nc->send_mbuf);
+  nc->send_mbuf = *fb;
+  mbuf_init(fb, 0);
+  mg_rpc_ws_frame_queued(chd);
   return true;
 }
 
+static int mg_rpc_channel_ws_get_send_window(struct mg_rpc_channel *ch) {
+  struct mg_rpc_channel_ws_data *chd =
+      (struct mg_rpc_channel_ws_data *) ch->channel_data;
+  /* With high water mark set, buffer size is the limit, see send_frame. */
+  return (chd->send_high_water_mark > 0 ? INT_MAX : 1);
+}
+
 static void mg_rpc_channel_ws_ch_close(struct mg_rpc_channel *ch) {
   struct mg_rpc_channel_ws_data *chd =
       (struct mg_rpc_channel_ws_data *) ch->channel_data;
@@ -114,6 +355,8 @@ static void mg_rpc_channel_ws_ch_close(struct mg_rpc_channel *ch) {
 static void mg_rpc_channel_ws_ch_destroy(struct mg_rpc_channel *ch) {
   struct mg_rpc_channel_ws_data *chd =
       (struct mg_rpc_channel_ws_data *) ch->channel_data;
+  mbuf_free(&chd->in_flight);
+  mg_rpc_authn_info_free(&chd->authn);
   if (chd->free_data) {
     free(chd);
     ch->channel_data = NULL;
@@ -126,15 +369,27 @@ static const char *mg_rpc_channel_ws_in_get_type(struct mg_rpc_channel *ch) {
   return "WS_in";
 }
 
-static bool mg_rpc_channel_ws_in_get_authn_info(
-    struct mg_rpc_channel *ch, const char *auth_domain, const char *auth_file,
-    struct mg_rpc_authn_info *authn) {
-  (void) ch;
+/* Returns authentication remembered for this connection. */
+static bool mg_rpc_channel_ws_get_authn_info(struct mg_rpc_channel *ch,
+                                             const char *auth_domain,
+                                             const char *auth_file,
+                                             struct mg_rpc_authn_info *authn) {
+  struct mg_rpc_channel_ws_data *chd =
+      (struct mg_rpc_channel_ws_data *) ch->channel_data;
+  if (chd->authn.username.len == 0) return false;
+  authn->username = mg_strdup(chd->authn.username);
   (void) auth_domain;
   (void) auth_file;
-  (void) authn;
+  return true;
+}
 
-  return false;
+static void mg_rpc_channel_ws_set_authn_info(
+    struct mg_rpc_channel *ch, const struct mg_rpc_authn_info *authn) {
+  struct mg_rpc_channel_ws_data *chd =
+      (struct mg_rpc_channel_ws_data *) ch->channel_data;
+  if (chd->nc == NULL) return;
+  mg_rpc_authn_info_free(&chd->authn);
+  chd->authn.username = mg_strdup(authn->username);
 }
 
 static char *mg_rpc_channel_ws_get_info(struct mg_rpc_channel *ch) {
@@ -143,22 +398,162 @@ static char *mg_rpc_channel_ws_get_info(struct mg_rpc_channel *ch) {
   return (chd->nc != NULL ? mg_rpc_channel_tcp_get_info(chd->nc) : NULL);
 }
 
+static size_t mg_rpc_channel_ws_write_info(struct mg_rpc_channel *ch,
+                                           char *buf, size_t size) {
+  struct mg_rpc_channel_ws_data *chd =
+      (struct mg_rpc_channel_ws_data *) ch->channel_data;
+  return mg_rpc_channel_tcp_write_info(chd->nc, buf, size);
+}
+
+/*
+ * Only the first offer is looked at. If the client limits our window,
+ * the limit has to be confirmed in the response.
+ */
+static bool mg_rpc_ws_in_accept_deflate(struct mg_str offer,
+                                        bool *confirm_window) {
+  static const char wb_param[] = "server_max_window_bits=";
+  const char *comma = mg_strchr(offer, ',');
+  const char *wb;
+  if (comma != NULL) offer.len = comma - offer.p;
+  offer = mg_strstrip(offer);
+  if (mg_strncmp(offer, mg_mk_str(MG_RPC_WS_DEFLATE),
+                 sizeof(MG_RPC_WS_DEFLATE) - 1) != 0) {
+    return false;
+  }
+  wb = mg_strstr(offer, mg_mk_str(wb_param));
+  *confirm_window = (wb != NULL);
+  return (wb == NULL || strtol(wb + sizeof(wb_param) - 1, NULL, 10) >=
+                            MG_RPC_WS_DEFLATE_WINDOW_BITS);
+}
+
+/* Returns true if the comma-separated list of subprotocols has proto. */
+static bool mg_rpc_ws_has_protocol(struct mg_str list, const char *proto) {
+  while (list.len > 0) {
+    const char *comma = mg_strchr(list, ',');
+    struct mg_str p = mg_strstrip(mg_mk_str_n(
+        list.p, (comma != NULL ? (size_t)(comma - list.p) : list.len)));
+    if (mg_vcmp(&p, proto) == 0) return true;
+    if (comma == NULL) break;
+    list.len -= comma + 1 - list.p;
+    list.p = comma + 1;
+  }
+  return false;
+}
+
+/*
+ * Picks the subprotocol to answer with: CBOR if it is offered and accepted,
+ * JSON otherwise. Other clients get the first one they offered, as mongoose
+ * does, unless it is CBOR.
+ */
+static struct mg_str mg_rpc_ws_in_pick_protocol(
+    const struct mg_str *offer, const struct mg_rpc_channel_ws_in_cfg *cfg) {
+  if (offer == NULL) return mg_mk_str_n(NULL, 0);
+  if (cfg->cbor && mg_rpc_ws_has_protocol(*offer, MG_RPC_WS_PROTOCOL_CBOR)) {
+    return mg_mk_str(MG_RPC_WS_PROTOCOL_CBOR);
+  }
+  if (mg_rpc_ws_has_protocol(*offer, MG_RPC_WS_PROTOCOL)) {
+    return mg_mk_str(MG_RPC_WS_PROTOCOL);
+  }
+  const char *comma = mg_strchr(*offer, ',');
+  struct mg_str first = mg_strstrip(mg_mk_str_n(
+      offer->p, (comma != NULL ? (size_t)(comma - offer->p) : offer->len)));
+  if (mg_vcmp(&first, MG_RPC_WS_PROTOCOL_CBOR) == 0) {
+    return mg_mk_str_n(NULL, 0);
+  }
+  return first;
+}
+
+bool mg_rpc_channel_ws_in_handshake(struct mg_connection *nc,
+                                    struct http_message *hm) {
+  struct mg_rpc_channel_ws_in_cfg cfg;
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.deflate = true;
+  cfg.cbor = true;
+  return mg_rpc_channel_ws_in_handshake_opt(nc, hm, &cfg);
+}
+
+bool mg_rpc_channel_ws_in_handshake_opt(
+    struct mg_connection *nc, struct http_message *hm,
+    const struct mg_rpc_channel_ws_in_cfg *cfg) {
+  struct mg_str *ext = mg_get_http_header(hm, "Sec-WebSocket-Extensions");
+  struct mg_str *key = mg_get_http_header(hm, "Sec-WebSocket-Key");
+  struct mg_str *proto = mg_get_http_header(hm, "Sec-WebSocket-Protocol");
+  bool confirm_window = false;
+  unsigned char sha[20];
+  char accept[sizeof(sha) * 4 / 3 + 4];
+  cs_sha1_ctx ctx;
+  bool deflate = (cfg->deflate && ext != NULL &&
+                  mg_rpc_ws_in_accept_deflate(*ext, &confirm_window));
+  /* CBOR offers are always answered here, mongoose would echo them. */
+  bool cbor_offered = (proto != NULL && mg_rpc_ws_has_protocol(
+                                            *proto, MG_RPC_WS_PROTOCOL_CBOR));
+  if (key == NULL || nc->send_mbuf.len > 0 || (!deflate && !cbor_offered)) {
+    return false;
+  }
+  cs_sha1_init(&ctx);
+  cs_sha1_update(&ctx, (const unsigned char *) key->p, key->len);
+  cs_sha1_update(&ctx, (const unsigned char *) MG_RPC_WS_GUID,
+                 sizeof(MG_RPC_WS_GUID) - 1);
+  cs_sha1_final(sha, &ctx);
+  cs_base64_encode(sha, sizeof(sha), accept);
+  mg_printf(nc, "%s",
+            "HTTP/1.1 101 Switching Protocols\r\n"
+            "Upgrade: websocket\r\n"
+            "Connection: Upgrade\r\n");
+  struct mg_str p = mg_rpc_ws_in_pick_protocol(proto, cfg);
+  if (p.len > 0) {
+    mg_printf(nc, "Sec-WebSocket-Protocol: %.*s\r\n", (int) p.len, p.p);
+    if (mg_vcmp(&p, MG_RPC_WS_PROTOCOL_CBOR) == 0) {
+      nc->flags |= MG_RPC_WS_F_CBOR;
+    }
+  }
+  if (deflate) {
+    mg_printf(nc, "%s",
+              "Sec-WebSocket-Extensions: " MG_RPC_WS_DEFLATE
+                  MG_RPC_WS_DEFLATE_PARAMS);
+    if (confirm_window) {
+      mg_printf(nc, "; server_max_window_bits=%d",
+                MG_RPC_WS_DEFLATE_WINDOW_BITS);
+    }
+    mg_printf(nc, "\r\n");
+    nc->flags |= MG_RPC_WS_F_DEFLATE;
+  }
+  mg_printf(nc, "Sec-WebSocket-Accept: %s\r\n\r\n", accept);
+  return true;
+}
+
 struct mg_rpc_channel *mg_rpc_channel_ws_in(struct mg_connection *nc) {
+  struct mg_rpc_channel_ws_in_cfg cfg;
+  memset(&cfg, 0, sizeof(cfg));
+  return mg_rpc_channel_ws_in_opt(nc, &cfg);
+}
+
+struct mg_rpc_channel *mg_rpc_channel_ws_in_opt(
+    struct mg_connection *nc, const struct mg_rpc_channel_ws_in_cfg *cfg) {
   struct mg_rpc_channel *ch = (struct mg_rpc_channel *) calloc(1, sizeof(*ch));
   ch->ch_connect = mg_rpc_channel_ws_in_ch_connect;
   ch->send_frame = mg_rpc_channel_ws_send_frame;
+  ch->send_frame_owned = mg_rpc_channel_ws_in_send_frame_owned;
+  ch->get_send_window = mg_rpc_channel_ws_get_send_window;
   ch->ch_close = mg_rpc_channel_ws_ch_close;
   ch->ch_destroy = mg_rpc_channel_ws_ch_destroy;
   ch->get_type = mg_rpc_channel_ws_in_get_type;
   ch->is_persistent = mg_rpc_channel_false;
   ch->is_broadcast_enabled = mg_rpc_channel_true;
-  ch->get_authn_info = mg_rpc_channel_ws_in_get_authn_info;
+  ch->get_authn_info = mg_rpc_channel_ws_get_authn_info;
+  ch->set_authn_info = mg_rpc_channel_ws_set_authn_info;
   ch->get_info = mg_rpc_channel_ws_get_info;
+  ch->write_info = mg_rpc_channel_ws_write_info;
   struct mg_rpc_channel_ws_data *chd =
       (struct mg_rpc_channel_ws_data *) calloc(1, sizeof(*chd));
   chd->free_data = true;
   chd->is_open = true;
+  chd->send_high_water_mark = cfg->send_high_water_mark;
+  chd->deflate = ((nc->flags & MG_RPC_WS_F_DEFLATE) != 0);
+  chd->deflate_min_size = cfg->deflate_min_size;
+  chd->max_inflated_size = cfg->max_inflated_size;
   ch->channel_data = chd;
+  mg_rpc_ws_set_cbor(ch, (nc->flags & MG_RPC_WS_F_CBOR) != 0);
   nc->user_data = ch;
   nc->handler = mg_rpc_ws_handler;
   chd->nc = nc;
@@ -172,20 +567,53 @@ struct mg_rpc_channel_ws_out_data {
   struct mg_rpc_channel_ws_out_cfg *cfg;
   struct mg_mgr *mgr;
   int reconnect_interval;
-  struct mg_connection *fake_timer_connection;
+  struct mg_rpc_timer reconnect_timer;
+  struct mg_rpc_timer idle_timer;
 };
 
 static void reset_idle_timer(struct mg_rpc_channel *ch) {
   struct mg_rpc_channel_ws_out_data *chd =
       (struct mg_rpc_channel_ws_out_data *) ch->channel_data;
   if (chd->cfg->idle_close_timeout > 0 && chd->wsd.nc != NULL) {
-    chd->wsd.nc->ev_timer_time = mg_time() + chd->cfg->idle_close_timeout;
+    mg_rpc_timer_extend(&chd->idle_timer, chd->cfg->idle_close_timeout);
   }
 }
 
 static void mg_rpc_channel_ws_out_ch_close(struct mg_rpc_channel *ch);
 static void mg_rpc_channel_ws_out_reconnect(struct mg_rpc_channel *ch);
 
+/* CBOR is only used if the server picked it out of the offered protocols. */
+static bool mg_rpc_ws_out_check_cbor(struct mg_rpc_channel_ws_out_data *chd,
+                                     struct http_message *hm) {
+  struct mg_str *proto =
+      (chd->cfg->cbor && hm != NULL
+           ? mg_get_http_header(hm, "Sec-WebSocket-Protocol")
+           : NULL);
+  if (proto == NULL) return false;
+  struct mg_str p = mg_strstrip(*proto);
+  return (mg_vcmp(&p, MG_RPC_WS_PROTOCOL_CBOR) == 0);
+}
+
+/*
+ * Checks server's answer to our permessage-deflate offer. Having asked for
+ * server_no_context_takeover, we can't accept compression without it.
+ */
+static bool mg_rpc_ws_out_check_deflate(struct mg_rpc_channel_ws_out_data *chd,
+                                        struct http_message *hm) {
+  struct mg_str *ext =
+      (chd->cfg->deflate && hm != NULL
+           ? mg_get_http_header(hm, "Sec-WebSocket-Extensions")
+           : NULL);
+  if (ext == NULL || mg_strstr(*ext, mg_mk_str(MG_RPC_WS_DEFLATE)) == NULL) {
+    return true;
+  }
+  if (mg_strstr(*ext, mg_mk_str("server_no_context_takeover")) == NULL) {
+    return false;
+  }
+  chd->wsd.deflate = true;
+  return true;
+}
+
 static void mg_rpc_ws_out_handler(struct mg_connection *nc, int ev,
                                   void *ev_data, void *user_data) {
 #if !MG_ENABLE_CALLBACK_USERDATA
@@ -198,11 +626,23 @@ static void mg_rpc_ws_out_handler(struct mg_connection *nc, int ev,
     case MG_EV_CONNECT: {
       int success = (*(int *) ev_data == 0);
       LOG(LL_DEBUG, ("%p CONNECT (%d)", ch, success));
-      chd->wsd.sending = false;
+      chd->wsd.num_sent = 0;
+      mg_rpc_ws_set_cbor(ch, false);
+      chd->wsd.deflate = false;
       (void) success;
       break;
     }
     case MG_EV_WEBSOCKET_HANDSHAKE_DONE: {
+      if (!mg_rpc_ws_out_check_deflate(chd, (struct http_message *) ev_data)) {
+        LOG(LL_ERROR, ("%p Server wants deflate context takeover", ch));
+        nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+        break;
+      }
+      mg_rpc_ws_set_cbor(
+          ch, mg_rpc_ws_out_check_cbor(chd, (struct http_message *) ev_data));
+      if (chd->cfg->cbor && !chd->wsd.is_cbor) {
+        LOG(LL_INFO, ("%p Server did not agree to CBOR, using JSON", ch));
+      }
       mg_rpc_ws_handler(nc, ev, ev_data, user_data);
       chd->reconnect_interval = chd->cfg->reconnect_interval_min;
       reset_idle_timer(ch);
@@ -214,19 +654,14 @@ static void mg_rpc_ws_out_handler(struct mg_connection *nc, int ev,
       reset_idle_timer(ch);
       break;
     }
-    case MG_EV_TIMER: {
-      LOG(LL_INFO, ("%p CLOSING (idle)", ch));
-      mg_rpc_channel_ws_out_ch_close(ch);
-      break;
-    }
     case MG_EV_CLOSE: {
       /* If the channel is being closed, we need to be careful because channel
        * data has already been destroyed. */
       bool is_persistent = ch->is_persistent(ch);
+      mg_rpc_timer_clear(&chd->idle_timer);
       mg_rpc_ws_handler(nc, ev, ev_data, user_data);
       if (is_persistent) {
         chd->wsd.nc = NULL;
-        chd->wsd.sending = false;
         mg_rpc_channel_ws_out_reconnect(ch);
       }
       break;
@@ -234,6 +669,20 @@ static void mg_rpc_ws_out_handler(struct mg_connection *nc, int ev,
   }
 }
 
+static void mg_rpc_channel_ws_out_idle_cb(void *arg) {
+  struct mg_rpc_channel *ch = (struct mg_rpc_channel *) arg;
+  struct mg_rpc_channel_ws_out_data *chd =
+      (struct mg_rpc_channel_ws_out_data *) ch->channel_data;
+  if (chd->wsd.nc == NULL) return;
+  if (mg_rpc_ws_num_in_flight(&chd->wsd) > 0) {
+    /* Frames are still going out, not idle yet. */
+    reset_idle_timer(ch);
+    return;
+  }
+  LOG(LL_INFO, ("%p CLOSING (idle)", ch));
+  mg_rpc_channel_ws_out_ch_close(ch);
+}
+
 static void mg_rpc_channel_ws_out_ch_connect(struct mg_rpc_channel *ch) {
   struct mg_rpc_channel_ws_out_data *chd =
       (struct mg_rpc_channel_ws_out_data *) ch->channel_data;
@@ -255,7 +704,10 @@ static void mg_rpc_channel_ws_out_ch_connect(struct mg_rpc_channel *ch) {
                     ));
   chd->wsd.nc = mg_connect_ws_opt(
       chd->mgr, MG_CB(mg_rpc_ws_out_handler, ch), opts, cfg->server_address.p,
-      MG_RPC_WS_PROTOCOL, "Origin: " MG_RPC_WS_ORIGIN "\r\n");
+      (cfg->cbor ? MG_RPC_WS_PROTOCOL_CBOR ", " MG_RPC_WS_PROTOCOL
+                 : MG_RPC_WS_PROTOCOL),
+      (cfg->deflate ? MG_RPC_WS_ORIGIN_HDR MG_RPC_WS_DEFLATE_HDR
+                    : MG_RPC_WS_ORIGIN_HDR));
   if (chd->wsd.nc == NULL) {
     mg_rpc_channel_ws_out_reconnect(ch);
   }
@@ -272,17 +724,6 @@ static const char *mg_rpc_channel_ws_out_get_type(struct mg_rpc_channel *ch) {
 #endif
 }
 
-static bool mg_rpc_channel_ws_out_get_authn_info(
-    struct mg_rpc_channel *ch, const char *auth_domain, const char *auth_file,
-    struct mg_rpc_authn_info *authn) {
-  (void) ch;
-  (void) auth_domain;
-  (void) auth_file;
-  (void) authn;
-
-  return false;
-}
-
 static bool mg_rpc_channel_ws_out_is_persistent(struct mg_rpc_channel *ch) {
   struct mg_rpc_channel_ws_out_data *chd =
       (struct mg_rpc_channel_ws_out_data *) ch->channel_data;
@@ -303,27 +744,53 @@ static void mg_rpc_channel_ws_out_ch_destroy(struct mg_rpc_channel *ch) {
   struct mg_rpc_channel_ws_out_data *chd =
       (struct mg_rpc_channel_ws_out_data *) ch->channel_data;
   mg_rpc_channel_ws_out_destroy_cfg(chd->cfg);
-  if (chd->fake_timer_connection != NULL) {
-    chd->fake_timer_connection->ev_timer_time = 0;
-    chd->fake_timer_connection->flags |= MG_F_CLOSE_IMMEDIATELY;
-  }
+  mg_rpc_timer_clear(&chd->reconnect_timer);
+  mg_rpc_timer_clear(&chd->idle_timer);
   mg_rpc_channel_ws_ch_destroy(ch);
 }
 
-static void reconnect_ev_handler(struct mg_connection *c, int ev, void *p,
-                                 void *user_data) {
-  if (ev != MG_EV_TIMER) return;
-#if !MG_ENABLE_CALLBACK_USERDATA
-  void *user_data = nc->user_data;
-#endif
-  struct mg_rpc_channel *ch = (struct mg_rpc_channel *) user_data;
-  struct mg_rpc_channel_ws_out_data *chd =
-      (struct mg_rpc_channel_ws_out_data *) ch->channel_data;
-  if (c->flags & MG_F_CLOSE_IMMEDIATELY) return;
-  chd->fake_timer_connection = NULL;
-  mg_rpc_channel_ws_out_ch_connect(ch);
-  c->flags |= MG_F_CLOSE_IMMEDIATELY;
-  (void) p;
+static void mg_rpc_channel_ws_out_reconnect_cb(void *arg) {
+  mg_rpc_channel_ws_out_ch_connect((struct mg_rpc_channel *) arg);
+}
+
+/*
+ * Reconnect jitter has its own generator (xorshift32). rand() starts from
+ * the same seed on every device, which would then all pick the same delays.
+ */
+static uint32_t s_jitter_state;
+
+void mg_rpc_channel_ws_out_seed_jitter(const struct mg_str seed) {
+  /* FNV-1a, on top of what's been mixed in already. */
+  uint32_t h = 2166136261u ^ s_jitter_state;
+  for (size_t i = 0; i < seed.len; i++) {
+    h ^= (uint8_t) seed.p[i];
+    h *= 16777619u;
+  }
+  s_jitter_state = (h != 0 ? h : 1);
+}
+
+static uint32_t mg_rpc_ws_jitter_rand(void) {
+  uint32_t x = s_jitter_state;
+  if (x == 0) {
+    /* Not seeded, the time of the first reconnect is still better than 1. */
+    double now = mg_time();
+    x = (uint32_t) now ^ (uint32_t)((now - (uint32_t) now) * 1e9);
+    if (x == 0) x = 1;
+  }
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  s_jitter_state = x;
+  return x;
+}
+
+/*
+ * Half of the interval plus a random part of the other half, so that devices
+ * which lost the connection at the same time don't all come back at once.
+ */
+static double mg_rpc_channel_ws_out_reconnect_delay(int interval) {
+  return interval / 2.0 +
+         interval / 2.0 * ((double) mg_rpc_ws_jitter_rand() / UINT32_MAX);
 }
 
 static void mg_rpc_channel_ws_out_reconnect(struct mg_rpc_channel *ch) {
@@ -333,24 +800,10 @@ static void mg_rpc_channel_ws_out_reconnect(struct mg_rpc_channel *ch) {
     chd->reconnect_interval = chd->cfg->reconnect_interval_max;
   }
   if (chd->reconnect_interval == 0) return;
-  LOG(LL_DEBUG, ("reconnect in %d", chd->reconnect_interval));
-
-  /* Set reconnect timer */
-  {
-    struct mg_add_sock_opts opts;
-    struct mg_connection *c;
-    memset(&opts, 0, sizeof(opts));
-#if !MG_ENABLE_CALLBACK_USERDATA
-    opts.user_data = ch;
-#endif
-    c = mg_add_sock_opt(chd->mgr, INVALID_SOCKET,
-                        MG_CB(reconnect_ev_handler, ch), opts);
-    if (c != NULL) {
-      c->ev_timer_time = mg_time() + chd->reconnect_interval;
-      chd->reconnect_interval *= 2;
-    }
-    chd->fake_timer_connection = c;
-  }
+  double delay = mg_rpc_channel_ws_out_reconnect_delay(chd->reconnect_interval);
+  LOG(LL_DEBUG, ("reconnect in %.2f", delay));
+  mg_rpc_timer_set(&chd->reconnect_timer, delay);
+  chd->reconnect_interval *= 2;
 }
 
 static struct mg_rpc_channel_ws_out_cfg *mg_rpc_channel_ws_out_copy_cfg(
@@ -368,6 +821,12 @@ static struct mg_rpc_channel_ws_out_cfg *mg_rpc_channel_ws_out_copy_cfg(
   out->reconnect_interval_min = in->reconnect_interval_min;
   out->reconnect_interval_max = in->reconnect_interval_max;
   out->idle_close_timeout = in->idle_close_timeout;
+  out->send_high_water_mark = in->send_high_water_mark;
+  out->cbor = in->cbor;
+  out->deflate = in->deflate;
+  out->deflate_min_size = in->deflate_min_size;
+  out->max_inflated_size = in->max_inflated_size;
+  out->timers = in->timers;
   return out;
 }
 
@@ -388,19 +847,30 @@ struct mg_rpc_channel *mg_rpc_channel_ws_out(
   struct mg_rpc_channel *ch = (struct mg_rpc_channel *) calloc(1, sizeof(*ch));
   ch->ch_connect = mg_rpc_channel_ws_out_ch_connect;
   ch->send_frame = mg_rpc_channel_ws_send_frame;
+  ch->get_send_window = mg_rpc_channel_ws_get_send_window;
   ch->ch_close = mg_rpc_channel_ws_out_ch_close;
   ch->ch_destroy = mg_rpc_channel_ws_out_ch_destroy;
   ch->get_type = mg_rpc_channel_ws_out_get_type;
   ch->is_persistent = mg_rpc_channel_ws_out_is_persistent;
   ch->is_broadcast_enabled = mg_rpc_channel_true;
-  ch->get_authn_info = mg_rpc_channel_ws_out_get_authn_info;
+  ch->get_authn_info = mg_rpc_channel_ws_get_authn_info;
+  ch->set_authn_info = mg_rpc_channel_ws_set_authn_info;
   ch->get_info = mg_rpc_channel_ws_get_info;
+  ch->write_info = mg_rpc_channel_ws_write_info;
   struct mg_rpc_channel_ws_out_data *chd =
       (struct mg_rpc_channel_ws_out_data *) calloc(1, sizeof(*chd));
   chd->wsd.free_data = false;
+  chd->wsd.send_high_water_mark = cfg->send_high_water_mark;
+  chd->wsd.deflate_min_size = cfg->deflate_min_size;
+  chd->wsd.max_inflated_size = cfg->max_inflated_size;
   chd->cfg = mg_rpc_channel_ws_out_copy_cfg(cfg);
   chd->mgr = mgr;
   chd->reconnect_interval = cfg->reconnect_interval_min;
+  struct mg_rpc_timers *ts =
+      (cfg->timers != NULL ? cfg->timers : mg_rpc_timers_default());
+  mg_rpc_timer_init(&chd->reconnect_timer, ts,
+                    mg_rpc_channel_ws_out_reconnect_cb, ch);
+  mg_rpc_timer_init(&chd->idle_timer, ts, mg_rpc_channel_ws_out_idle_cb, ch);
   ch->channel_data = chd;
   return ch;
 }
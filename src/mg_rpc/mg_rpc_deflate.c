@@ -0,0 +1,374 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mg_rpc_deflate.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MG_RPC_DEFLATE_HASH_BITS 9
+#define MG_RPC_DEFLATE_MIN_MATCH 3
+#define MG_RPC_DEFLATE_MAX_MATCH 258
+
+static const uint16_t s_len_base[29] = {
+    3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+    31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t s_len_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                        1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                        4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t s_dist_base[30] = {
+    1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+    33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+    1025, 1537, 2049, 3073, 4097, 6145,  8193,  12289, 16385, 24577};
+static const uint8_t s_dist_extra[30] = {0, 0, 0, 0, 1, 1, 2,  2,  3,  3,
+                                         4, 4, 5, 5, 6, 6, 7,  7,  8,  8,
+                                         9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+/* Compression. */
+
+struct mg_rpc_deflate_state {
+  struct mbuf *out;
+  uint32_t bits;
+  int num_bits;
+};
+
+static void mg_rpc_deflate_put_bits(struct mg_rpc_deflate_state *s,
+                                    uint32_t v, int n) {
+  s->bits |= (v << s->num_bits);
+  s->num_bits += n;
+  while (s->num_bits >= 8) {
+    uint8_t b = (uint8_t)(s->bits & 0xff);
+    mbuf_append(s->out, &b, 1);
+    s->bits >>= 8;
+    s->num_bits -= 8;
+  }
+}
+
+/* Huffman codes are packed starting with the most significant bit. */
+static void mg_rpc_deflate_put_code(struct mg_rpc_deflate_state *s,
+                                    uint32_t code, int n) {
+  uint32_t rev = 0;
+  for (int i = 0; i < n; i++) {
+    rev = (rev << 1) | (code & 1);
+    code >>= 1;
+  }
+  mg_rpc_deflate_put_bits(s, rev, n);
+}
+
+/* Literal/length symbol, fixed code (RFC 1951, 3.2.6). */
+static void mg_rpc_deflate_put_sym(struct mg_rpc_deflate_state *s, int sym) {
+  if (sym < 144) {
+    mg_rpc_deflate_put_code(s, 0x30 + sym, 8);
+  } else if (sym < 256) {
+    mg_rpc_deflate_put_code(s, 0x190 + sym - 144, 9);
+  } else if (sym < 280) {
+    mg_rpc_deflate_put_code(s, sym - 256, 7);
+  } else {
+    mg_rpc_deflate_put_code(s, 0xc0 + sym - 280, 8);
+  }
+}
+
+static void mg_rpc_deflate_put_match(struct mg_rpc_deflate_state *s,
+                                     size_t len, size_t dist) {
+  int i = 28, j = 29;
+  while (s_len_base[i] > len) i--;
+  mg_rpc_deflate_put_sym(s, 257 + i);
+  mg_rpc_deflate_put_bits(s, len - s_len_base[i], s_len_extra[i]);
+  while (s_dist_base[j] > dist) j--;
+  mg_rpc_deflate_put_code(s, j, 5);
+  mg_rpc_deflate_put_bits(s, dist - s_dist_base[j], s_dist_extra[j]);
+}
+
+static uint32_t mg_rpc_deflate_hash(const uint8_t *p) {
+  uint32_t v = ((uint32_t) p[0] << 16) | ((uint32_t) p[1] << 8) | p[2];
+  return ((v * 2654435761U) >> (32 - MG_RPC_DEFLATE_HASH_BITS));
+}
+
+bool mg_rpc_deflate(const struct mg_str data, int window_bits,
+                    struct mbuf *out) {
+  const uint8_t *p = (const uint8_t *) data.p;
+  size_t window = ((size_t) 1 << window_bits), i = 0;
+  struct mg_rpc_deflate_state s = {.out = out};
+  if (window_bits < 8 || window_bits > 15) return false;
+  /*
+   * Last position + 1 for each hash, single candidate and no chains:
+   * frames are small, memory is what matters.
+   */
+  uint32_t *head =
+      (uint32_t *) calloc(1 << MG_RPC_DEFLATE_HASH_BITS, sizeof(*head));
+  if (head == NULL) return false;
+  mg_rpc_deflate_put_bits(&s, 0 /* BFINAL */, 1);
+  mg_rpc_deflate_put_bits(&s, 1 /* fixed Huffman */, 2);
+  while (i < data.len) {
+    size_t len = 0, dist = 0;
+    if (data.len - i >= MG_RPC_DEFLATE_MIN_MATCH) {
+      uint32_t h = mg_rpc_deflate_hash(p + i);
+      size_t cand = head[h];
+      head[h] = i + 1;
+      if (cand > 0 && i - (cand - 1) <= window) {
+        size_t max = data.len - i;
+        if (max > MG_RPC_DEFLATE_MAX_MATCH) max = MG_RPC_DEFLATE_MAX_MATCH;
+        cand--;
+        while (len < max && p[cand + len] == p[i + len]) len++;
+        dist = i - cand;
+      }
+    }
+    if (len < MG_RPC_DEFLATE_MIN_MATCH) {
+      mg_rpc_deflate_put_sym(&s, p[i++]);
+      continue;
+    }
+    mg_rpc_deflate_put_match(&s, len, dist);
+    /* Positions inside the match are indexed too. */
+    for (size_t end = i + len; ++i < end;) {
+      if (data.len - i < MG_RPC_DEFLATE_MIN_MATCH) {
+        i = end;
+        break;
+      }
+      head[mg_rpc_deflate_hash(p + i)] = i + 1;
+    }
+  }
+  mg_rpc_deflate_put_sym(&s, 256 /* end of block */);
+  /* Sync flush: empty stored block. */
+  mg_rpc_deflate_put_bits(&s, 0, 3);
+  if (s.num_bits > 0) mg_rpc_deflate_put_bits(&s, 0, 8 - s.num_bits);
+  mbuf_append(out, "\x00\x00\xff\xff", 4);
+  free(head);
+  return true;
+}
+
+/* Decompression, based on the structure of zlib's puff.c. */
+
+struct mg_rpc_huffman {
+  uint16_t count[16];  /* Number of codes of each length. */
+  uint16_t symbol[288]; /* Symbols ordered by code. */
+};
+
+struct mg_rpc_inflate_state {
+  const uint8_t *in;
+  size_t in_len, in_pos;
+  uint32_t bits;
+  int num_bits;
+  struct mbuf *out;
+  size_t out_start, max_len;
+  struct mg_rpc_huffman lencode, distcode;
+  uint8_t lengths[286 + 30];
+};
+
+static bool mg_rpc_inflate_bits(struct mg_rpc_inflate_state *s, int n,
+                                uint32_t *v) {
+  while (s->num_bits < n) {
+    if (s->in_pos >= s->in_len) return false;
+    s->bits |= ((uint32_t) s->in[s->in_pos++] << s->num_bits);
+    s->num_bits += 8;
+  }
+  *v = s->bits & ((1U << n) - 1);
+  s->bits >>= n;
+  s->num_bits -= n;
+  return true;
+}
+
+/* Builds decoding table from code lengths. Incomplete codes are allowed. */
+static bool mg_rpc_inflate_table(struct mg_rpc_huffman *h,
+                                 const uint8_t *lengths, int n) {
+  uint16_t offs[16];
+  int left = 1;
+  memset(h->count, 0, sizeof(h->count));
+  for (int i = 0; i < n; i++) h->count[lengths[i]]++;
+  for (int len = 1; len < 16; len++) {
+    left = (left << 1) - h->count[len];
+    if (left < 0) return false; /* Over-subscribed. */
+  }
+  offs[1] = 0;
+  for (int len = 1; len < 15; len++) offs[len + 1] = offs[len] + h->count[len];
+  for (int i = 0; i < n; i++) {
+    if (lengths[i] != 0) h->symbol[offs[lengths[i]]++] = i;
+  }
+  return true;
+}
+
+static int mg_rpc_inflate_decode(struct mg_rpc_inflate_state *s,
+                                 const struct mg_rpc_huffman *h) {
+  int code = 0, first = 0, index = 0;
+  for (int len = 1; len < 16; len++) {
+    uint32_t b;
+    if (!mg_rpc_inflate_bits(s, 1, &b)) return -1;
+    code |= b;
+    int count = h->count[len];
+    if (code - count < first) return h->symbol[index + (code - first)];
+    index += count;
+    first = (first + count) << 1;
+    code <<= 1;
+  }
+  return -1;
+}
+
+static bool mg_rpc_inflate_room(struct mg_rpc_inflate_state *s, size_t n) {
+  return (s->max_len == 0 || s->out->len - s->out_start + n <= s->max_len);
+}
+
+static bool mg_rpc_inflate_stored(struct mg_rpc_inflate_state *s) {
+  const uint8_t *p = s->in + s->in_pos;
+  s->bits = 0;
+  s->num_bits = 0;
+  if (s->in_len - s->in_pos < 4) return false;
+  size_t len = p[0] | (p[1] << 8);
+  if ((size_t)(p[2] | (p[3] << 8)) != (~len & 0xffff)) return false;
+  s->in_pos += 4;
+  if (s->in_len - s->in_pos < len || !mg_rpc_inflate_room(s, len)) {
+    return false;
+  }
+  mbuf_append(s->out, s->in + s->in_pos, len);
+  s->in_pos += len;
+  return true;
+}
+
+static bool mg_rpc_inflate_codes(struct mg_rpc_inflate_state *s) {
+  for (;;) {
+    uint32_t extra;
+    int sym = mg_rpc_inflate_decode(s, &s->lencode);
+    if (sym < 0) return false;
+    if (sym < 256) {
+      uint8_t c = (uint8_t) sym;
+      if (!mg_rpc_inflate_room(s, 1)) return false;
+      mbuf_append(s->out, &c, 1);
+      continue;
+    }
+    if (sym == 256) return true;
+    sym -= 257;
+    if (sym >= 29 || !mg_rpc_inflate_bits(s, s_len_extra[sym], &extra)) {
+      return false;
+    }
+    size_t len = s_len_base[sym] + extra;
+    sym = mg_rpc_inflate_decode(s, &s->distcode);
+    if (sym < 0 || sym >= 30 ||
+        !mg_rpc_inflate_bits(s, s_dist_extra[sym], &extra)) {
+      return false;
+    }
+    size_t dist = s_dist_base[sym] + extra;
+    if (dist > s->out->len - s->out_start || !mg_rpc_inflate_room(s, len)) {
+      return false;
+    }
+    /* Byte by byte, source and destination may overlap. */
+    mbuf_resize(s->out, s->out->len + len);
+    if (s->out->size < s->out->len + len) return false;
+    while (len-- > 0) {
+      s->out->buf[s->out->len] = s->out->buf[s->out->len - dist];
+      s->out->len++;
+    }
+  }
+}
+
+static bool mg_rpc_inflate_fixed(struct mg_rpc_inflate_state *s) {
+  uint8_t *l = s->lengths;
+  memset(l, 8, 144);
+  memset(l + 144, 9, 112);
+  memset(l + 256, 7, 24);
+  memset(l + 280, 8, 8);
+  mg_rpc_inflate_table(&s->lencode, l, 288);
+  memset(l, 5, 30);
+  mg_rpc_inflate_table(&s->distcode, l, 30);
+  return mg_rpc_inflate_codes(s);
+}
+
+static bool mg_rpc_inflate_dynamic(struct mg_rpc_inflate_state *s) {
+  static const uint8_t order[19] = {16, 17, 18, 0, 8,  7, 9,  6, 10, 5,
+                                    11, 4,  12, 3, 13, 2, 14, 1, 15};
+  uint32_t nlen, ndist, ncode, v;
+  uint8_t *l = s->lengths;
+  if (!mg_rpc_inflate_bits(s, 5, &nlen) || !mg_rpc_inflate_bits(s, 5, &ndist) ||
+      !mg_rpc_inflate_bits(s, 4, &ncode)) {
+    return false;
+  }
+  nlen += 257;
+  ndist += 1;
+  ncode += 4;
+  if (nlen > 286 || ndist > 30) return false;
+  memset(l, 0, 19);
+  for (uint32_t i = 0; i < ncode; i++) {
+    if (!mg_rpc_inflate_bits(s, 3, &v)) return false;
+    l[order[i]] = v;
+  }
+  if (!mg_rpc_inflate_table(&s->lencode, l, 19)) return false;
+  for (uint32_t i = 0; i < nlen + ndist;) {
+    int sym = mg_rpc_inflate_decode(s, &s->lencode);
+    uint8_t len = 0;
+    uint32_t rep;
+    if (sym < 0) return false;
+    if (sym < 16) {
+      l[i++] = sym;
+      continue;
+    }
+    if (sym == 16) {
+      if (i == 0 || !mg_rpc_inflate_bits(s, 2, &rep)) return false;
+      len = l[i - 1];
+      rep += 3;
+    } else if (sym == 17) {
+      if (!mg_rpc_inflate_bits(s, 3, &rep)) return false;
+      rep += 3;
+    } else {
+      if (!mg_rpc_inflate_bits(s, 7, &rep)) return false;
+      rep += 11;
+    }
+    if (i + rep > nlen + ndist) return false;
+    while (rep-- > 0) l[i++] = len;
+  }
+  if (l[256] == 0) return false; /* No end of block code. */
+  if (!mg_rpc_inflate_table(&s->lencode, l, nlen) ||
+      !mg_rpc_inflate_table(&s->distcode, l + nlen, ndist)) {
+    return false;
+  }
+  return mg_rpc_inflate_codes(s);
+}
+
+bool mg_rpc_inflate(const struct mg_str data, size_t max_len,
+                    struct mbuf *out) {
+  bool res = true;
+  struct mg_rpc_inflate_state *s =
+      (struct mg_rpc_inflate_state *) calloc(1, sizeof(*s));
+  if (s == NULL) return false;
+  s->in = (const uint8_t *) data.p;
+  s->in_len = data.len;
+  s->out = out;
+  s->out_start = out->len;
+  s->max_len = max_len;
+  for (uint32_t last = 0; res && !last;) {
+    uint32_t type;
+    /* Out of input on a block boundary, rest of the byte is padding. */
+    if (s->in_pos == s->in_len) break;
+    if (!mg_rpc_inflate_bits(s, 1, &last) ||
+        !mg_rpc_inflate_bits(s, 2, &type)) {
+      res = false;
+      break;
+    }
+    switch (type) {
+      case 0:
+        res = mg_rpc_inflate_stored(s);
+        break;
+      case 1:
+        res = mg_rpc_inflate_fixed(s);
+        break;
+      case 2:
+        res = mg_rpc_inflate_dynamic(s);
+        break;
+      default:
+        res = false;
+    }
+  }
+  free(s);
+  return res;
+}
@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mg_rpc_htdigest.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "common/cs_dbg.h"
+#include "common/cs_file.h"
+#include "common/cs_md5.h"
+#include "common/queue.h"
+
+#include "mongoose.h"
+
+/* Don't stat files more often than this, seconds. */
+#define MG_RPC_HTDIGEST_RECHECK_INTERVAL 5
+
+struct mg_rpc_htdigest_entry {
+  struct mg_str user;
+  struct mg_str realm;
+  struct mg_str ha1;
+};
+
+struct mg_rpc_htdigest_file {
+  char *name;
+  time_t mtime;
+  off_t size;
+  double check_time;
+  char *data; /* Entries point here. */
+  struct mg_rpc_htdigest_entry *entries;
+  int num_entries;
+  SLIST_ENTRY(mg_rpc_htdigest_file) files;
+};
+
+static SLIST_HEAD(files, mg_rpc_htdigest_file) s_files;
+
+static void mg_rpc_htdigest_file_clear(struct mg_rpc_htdigest_file *f) {
+  free(f->data);
+  free(f->entries);
+  f->data = NULL;
+  f->entries = NULL;
+  f->num_entries = 0;
+}
+
+/* Parses "user:realm:ha1" lines. */
+static bool mg_rpc_htdigest_file_load(struct mg_rpc_htdigest_file *f) {
+  size_t size;
+  mg_rpc_htdigest_file_clear(f);
+  f->data = cs_read_file(f->name, &size);
+  if (f->data == NULL) return false;
+  struct mg_str rest = mg_mk_str_n(f->data, size);
+  while (rest.len > 0) {
+    struct mg_str line, user, realm, ha1;
+    const char *eol = mg_strchr(rest, '\n');
+    line = mg_mk_str_n(rest.p,
+                       (eol != NULL ? (size_t)(eol - rest.p) : rest.len));
+    rest.p += line.len + (eol != NULL ? 1 : 0);
+    rest.len -= line.len + (eol != NULL ? 1 : 0);
+    while (line.len > 0 && isspace((unsigned char) line.p[line.len - 1])) {
+      line.len--;
+    }
+    const char *c1 = mg_strchr(line, ':');
+    if (c1 == NULL) continue;
+    user = mg_mk_str_n(line.p, c1 - line.p);
+    realm = mg_mk_str_n(c1 + 1, line.len - user.len - 1);
+    const char *c2 = mg_strchr(realm, ':');
+    if (c2 == NULL) continue;
+    ha1 = mg_mk_str_n(c2 + 1, realm.len - (c2 - realm.p) - 1);
+    realm.len = c2 - realm.p;
+    if (ha1.len != 32) continue;
+    struct mg_rpc_htdigest_entry *entries =
+        (struct mg_rpc_htdigest_entry *) realloc(
+            f->entries, (f->num_entries + 1) * sizeof(*entries));
+    if (entries == NULL) break;
+    entries[f->num_entries].user = user;
+    entries[f->num_entries].realm = realm;
+    entries[f->num_entries].ha1 = ha1;
+    f->entries = entries;
+    f->num_entries++;
+  }
+  LOG(LL_DEBUG, ("Loaded %d entries from %s", f->num_entries, f->name));
+  return true;
+}
+
+static struct mg_rpc_htdigest_file *mg_rpc_htdigest_get_file(
+    const char *name) {
+  struct mg_rpc_htdigest_file *f;
+  SLIST_FOREACH(f, &s_files, files) {
+    if (strcmp(f->name, name) == 0) break;
+  }
+  if (f == NULL) {
+    f = (struct mg_rpc_htdigest_file *) calloc(1, sizeof(*f));
+    if (f == NULL) return NULL;
+    f->name = strdup(name);
+    SLIST_INSERT_HEAD(&s_files, f, files);
+  }
+  double now = mg_time();
+  if (f->data != NULL &&
+      now < f->check_time + MG_RPC_HTDIGEST_RECHECK_INTERVAL) {
+    return f;
+  }
+  f->check_time = now;
+  struct stat st;
+  if (stat(name, &st) != 0) {
+    mg_rpc_htdigest_file_clear(f);
+    return NULL;
+  }
+  if (f->data == NULL || st.st_mtime != f->mtime || st.st_size != f->size) {
+    f->mtime = st.st_mtime;
+    f->size = st.st_size;
+    if (!mg_rpc_htdigest_file_load(f)) return NULL;
+  }
+  return f;
+}
+
+/* MD5 of the ':'-separated parts, as lowercase hex. */
+static void mg_rpc_htdigest_md5(char out[33], const struct mg_str *parts,
+                                int num_parts) {
+  cs_md5_ctx ctx;
+  unsigned char hash[16];
+  cs_md5_init(&ctx);
+  for (int i = 0; i < num_parts; i++) {
+    if (i > 0) cs_md5_update(&ctx, (const unsigned char *) ":", 1);
+    cs_md5_update(&ctx, (const unsigned char *) parts[i].p, parts[i].len);
+  }
+  cs_md5_final(hash, &ctx);
+  cs_to_hex(out, hash, sizeof(hash));
+}
+
+/* Case-insensitive, does not bail out early. */
+static bool mg_rpc_htdigest_hex_eq(const struct mg_str a, const char *b,
+                                   size_t b_len) {
+  int diff = (a.len != b_len);
+  for (size_t i = 0; i < a.len && i < b_len; i++) {
+    diff |= (tolower((unsigned char) a.p[i]) ^ tolower((unsigned char) b[i]));
+  }
+  return (diff == 0);
+}
+
+int mg_rpc_htdigest_check(const char *file, struct mg_str method,
+                          struct mg_str uri, struct mg_str username,
+                          struct mg_str cnonce, struct mg_str response,
+                          struct mg_str qop, struct mg_str nc,
+                          struct mg_str nonce, struct mg_str realm) {
+  if (file == NULL) return -1;
+  struct mg_rpc_htdigest_file *f = mg_rpc_htdigest_get_file(file);
+  if (f == NULL) return -1;
+  for (int i = 0; i < f->num_entries; i++) {
+    const struct mg_rpc_htdigest_entry *e = &f->entries[i];
+    if (mg_strcmp(e->user, username) != 0 ||
+        mg_strcmp(e->realm, realm) != 0) {
+      continue;
+    }
+    char ha2[33], expected[33];
+    struct mg_str ha2_parts[2] = {method, uri};
+    mg_rpc_htdigest_md5(ha2, ha2_parts, 2);
+    struct mg_str parts[6] = {e->ha1, nonce, nc, cnonce, qop,
+                              mg_mk_str_n(ha2, 32)};
+    mg_rpc_htdigest_md5(expected, parts, 6);
+    return mg_rpc_htdigest_hex_eq(response, expected, 32);
+  }
+  return 0;
+}
+
+void mg_rpc_htdigest_invalidate(void) {
+  struct mg_rpc_htdigest_file *f;
+  SLIST_FOREACH(f, &s_files, files) {
+    mg_rpc_htdigest_file_clear(f);
+  }
+}
@@ -0,0 +1,273 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mg_rpc_timer.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "common/cs_dbg.h"
+
+#include "mgos_mongoose.h"
+#include "mgos_timers.h"
+
+#define MG_RPC_TIMER_TICK 0.01 /* Seconds. */
+#define MG_RPC_TIMER_LEVEL_BITS 6
+#define MG_RPC_TIMER_LEVEL_SIZE (1 << MG_RPC_TIMER_LEVEL_BITS)
+#define MG_RPC_TIMER_LEVEL_MASK (MG_RPC_TIMER_LEVEL_SIZE - 1)
+#define MG_RPC_TIMER_NUM_LEVELS 4
+/* Timers farther out than this (~46 hours) wait in the last level. */
+#define MG_RPC_TIMER_MAX_DELTA \
+  (((uint64_t) 1 << (MG_RPC_TIMER_LEVEL_BITS * MG_RPC_TIMER_NUM_LEVELS)) - 1)
+
+LIST_HEAD(mg_rpc_timer_slot, mg_rpc_timer);
+
+struct mg_rpc_timers {
+  /*
+   * Level n holds timers expiring in less than 64^(n+1) ticks, slot is
+   * picked by bits 6n - 6n+5 of the expiry tick. When time reaches a slot
+   * above level 0, its timers are cascaded down.
+   */
+  struct mg_rpc_timer_slot slots[MG_RPC_TIMER_NUM_LEVELS]
+                                [MG_RPC_TIMER_LEVEL_SIZE];
+  uint64_t now;  /* Ticks run so far. */
+  uint64_t wake; /* Tick the driver is set for, 0 - not set. */
+  double start;  /* mgos_uptime() at tick 0. */
+  int num_set;
+  struct mg_connection *nc; /* Driver, its MG_EV_TIMER runs the wheel. */
+};
+
+static struct mg_rpc_timers *s_default_timers = NULL;
+
+static uint64_t mg_rpc_timers_tick(const struct mg_rpc_timers *ts,
+                                   double delay, bool round_up) {
+  double t = (mgos_uptime() - ts->start + delay) / MG_RPC_TIMER_TICK;
+  uint64_t tick;
+  if (t < 0) t = 0;
+  tick = (uint64_t) t;
+  if (round_up && tick < t) tick++;
+  return tick;
+}
+
+/* Returns the tick at which the timer's slot will be looked at. */
+static uint64_t mg_rpc_timers_insert(struct mg_rpc_timers *ts,
+                                     struct mg_rpc_timer *t) {
+  uint64_t e = t->expires;
+  int level = 0, shift = 0;
+  if (e - ts->now > MG_RPC_TIMER_MAX_DELTA) {
+    e = ts->now + MG_RPC_TIMER_MAX_DELTA;
+  }
+  while (level < MG_RPC_TIMER_NUM_LEVELS - 1 &&
+         ((e - ts->now) >> (shift + MG_RPC_TIMER_LEVEL_BITS)) != 0) {
+    level++;
+    shift += MG_RPC_TIMER_LEVEL_BITS;
+  }
+  LIST_INSERT_HEAD(
+      &ts->slots[level][(e >> shift) & MG_RPC_TIMER_LEVEL_MASK], t, entries);
+  return ((e >> shift) << shift);
+}
+
+/*
+ * Earliest tick at which something has to be done: a timer expires or
+ * a slot is cascaded. 0 if no timers are set.
+ */
+static uint64_t mg_rpc_timers_next(const struct mg_rpc_timers *ts) {
+  uint64_t next = 0;
+  if (ts->num_set == 0) return 0;
+  /* Level 0 slots ahead of the current one hold now + 1 - now + 63. */
+  for (int i = 1; i < MG_RPC_TIMER_LEVEL_SIZE; i++) {
+    uint64_t tick = ts->now + i;
+    if (!LIST_EMPTY(&ts->slots[0][tick & MG_RPC_TIMER_LEVEL_MASK])) {
+      next = tick;
+      break;
+    }
+  }
+  for (int level = 1; level < MG_RPC_TIMER_NUM_LEVELS; level++) {
+    int shift = level * MG_RPC_TIMER_LEVEL_BITS;
+    uint64_t pos = ts->now >> shift;
+    for (int i = 1; i <= MG_RPC_TIMER_LEVEL_SIZE; i++) {
+      uint64_t tick = (pos + i) << shift;
+      if (next != 0 && tick >= next) break;
+      if (!LIST_EMPTY(
+              &ts->slots[level][(pos + i) & MG_RPC_TIMER_LEVEL_MASK])) {
+        next = tick;
+        break;
+      }
+    }
+  }
+  return next;
+}
+
+static void mg_rpc_timers_wake(struct mg_rpc_timers *ts, uint64_t tick) {
+  if (ts->wake != 0 && ts->wake <= tick) return;
+  ts->wake = tick;
+  if (ts->nc == NULL) return;
+  double delay = ts->start + tick * MG_RPC_TIMER_TICK - mgos_uptime();
+  ts->nc->ev_timer_time = mg_time() + (delay > 0 ? delay : 0);
+}
+
+static void mg_rpc_timers_run(struct mg_rpc_timers *ts, uint64_t until) {
+  while (ts->now < until) {
+    struct mg_rpc_timer_slot *slot;
+    struct mg_rpc_timer *t;
+    /* Nothing happens in between, skip right to it. */
+    uint64_t next = mg_rpc_timers_next(ts);
+    if (next == 0 || next > until) {
+      ts->now = until;
+      break;
+    }
+    ts->now = next;
+    for (int level = 1, shift = MG_RPC_TIMER_LEVEL_BITS;
+         level < MG_RPC_TIMER_NUM_LEVELS &&
+         (ts->now & (((uint64_t) 1 << shift) - 1)) == 0;
+         level++, shift += MG_RPC_TIMER_LEVEL_BITS) {
+      slot = &ts->slots[level][(ts->now >> shift) & MG_RPC_TIMER_LEVEL_MASK];
+      while ((t = LIST_FIRST(slot)) != NULL) {
+        LIST_REMOVE(t, entries);
+        mg_rpc_timers_insert(ts, t);
+      }
+    }
+    slot = &ts->slots[0][ts->now & MG_RPC_TIMER_LEVEL_MASK];
+    while ((t = LIST_FIRST(slot)) != NULL) {
+      LIST_REMOVE(t, entries);
+      if (t->expires > ts->now) {
+        /* Extended. */
+        mg_rpc_timers_insert(ts, t);
+        continue;
+      }
+      t->is_set = false;
+      ts->num_set--;
+      t->cb(t->arg);
+    }
+  }
+}
+
+static void mg_rpc_timers_ev_handler(struct mg_connection *nc, int ev,
+                                     void *ev_data, void *user_data) {
+#if !MG_ENABLE_CALLBACK_USERDATA
+  void *user_data = nc->user_data;
+#endif
+  struct mg_rpc_timers *ts = (struct mg_rpc_timers *) user_data;
+  if (ts == NULL) return;
+  switch (ev) {
+    case MG_EV_TIMER: {
+      uint64_t next;
+      mg_rpc_timers_run(ts, mg_rpc_timers_tick(ts, 0, false /* round_up */));
+      ts->wake = 0;
+      next = mg_rpc_timers_next(ts);
+      if (next != 0) mg_rpc_timers_wake(ts, next);
+      break;
+    }
+    case MG_EV_CLOSE: {
+      /* Manager is being freed. */
+      LOG(LL_DEBUG, ("%p timers stopped", ts));
+      ts->nc = NULL;
+      break;
+    }
+  }
+  (void) ev_data;
+}
+
+struct mg_rpc_timers *mg_rpc_timers_create(struct mg_mgr *mgr) {
+  struct mg_add_sock_opts opts;
+  struct mg_rpc_timers *ts =
+      (struct mg_rpc_timers *) calloc(1, sizeof(*ts));
+  if (ts == NULL) return NULL;
+  for (int level = 0; level < MG_RPC_TIMER_NUM_LEVELS; level++) {
+    for (int i = 0; i < MG_RPC_TIMER_LEVEL_SIZE; i++) {
+      LIST_INIT(&ts->slots[level][i]);
+    }
+  }
+  ts->start = mgos_uptime();
+  memset(&opts, 0, sizeof(opts));
+#if !MG_ENABLE_CALLBACK_USERDATA
+  opts.user_data = ts;
+#endif
+  ts->nc = mg_add_sock_opt(mgr, INVALID_SOCKET,
+                           MG_CB(mg_rpc_timers_ev_handler, ts), opts);
+  if (ts->nc == NULL) {
+    LOG(LL_ERROR, ("Failed to create timer connection"));
+    free(ts);
+    return NULL;
+  }
+  return ts;
+}
+
+void mg_rpc_timers_free(struct mg_rpc_timers *ts) {
+  if (ts == NULL) return;
+  if (ts == s_default_timers) s_default_timers = NULL;
+  for (int level = 0; level < MG_RPC_TIMER_NUM_LEVELS; level++) {
+    for (int i = 0; i < MG_RPC_TIMER_LEVEL_SIZE; i++) {
+      struct mg_rpc_timer *t;
+      while ((t = LIST_FIRST(&ts->slots[level][i])) != NULL) {
+        LIST_REMOVE(t, entries);
+        t->is_set = false;
+        t->timers = NULL;
+      }
+    }
+  }
+  if (ts->nc != NULL) {
+    ts->nc->user_data = NULL;
+    ts->nc->ev_timer_time = 0;
+    ts->nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+  }
+  free(ts);
+}
+
+struct mg_rpc_timers *mg_rpc_timers_default(void) {
+  if (s_default_timers == NULL) {
+    s_default_timers = mg_rpc_timers_create(mgos_get_mgr());
+  }
+  return s_default_timers;
+}
+
+void mg_rpc_timer_init(struct mg_rpc_timer *t, struct mg_rpc_timers *ts,
+                       mg_rpc_timer_cb_t cb, void *arg) {
+  memset(t, 0, sizeof(*t));
+  t->timers = ts;
+  t->cb = cb;
+  t->arg = arg;
+}
+
+void mg_rpc_timer_set(struct mg_rpc_timer *t, double delay) {
+  struct mg_rpc_timers *ts = t->timers;
+  if (ts == NULL) return;
+  mg_rpc_timer_clear(t);
+  t->expires = mg_rpc_timers_tick(ts, delay, true /* round_up */);
+  if (t->expires <= ts->now) t->expires = ts->now + 1;
+  t->is_set = true;
+  ts->num_set++;
+  mg_rpc_timers_wake(ts, mg_rpc_timers_insert(ts, t));
+}
+
+/* The timer stays where it is and is moved on when its slot comes up. */
+void mg_rpc_timer_extend(struct mg_rpc_timer *t, double delay) {
+  uint64_t expires;
+  if (!t->is_set) {
+    mg_rpc_timer_set(t, delay);
+    return;
+  }
+  expires = mg_rpc_timers_tick(t->timers, delay, true /* round_up */);
+  if (expires > t->expires) t->expires = expires;
+}
+
+void mg_rpc_timer_clear(struct mg_rpc_timer *t) {
+  if (!t->is_set) return;
+  LIST_REMOVE(t, entries);
+  t->is_set = false;
+  t->timers->num_set--;
+}
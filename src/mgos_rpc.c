@@ -17,12 +17,16 @@
 
 #include "mgos_rpc.h"
 
+#include <stddef.h>
+#include <sys/stat.h>
+
 #include "common/cs_dbg.h"
 #include "common/cs_file.h"
 
 #include "frozen.h"
 
 #include "mg_rpc_channel_http.h"
+#include "mg_rpc_channel_local.h"
 #include "mg_rpc_channel_ws.h"
 
 #include "mgos_config_util.h"
@@ -57,23 +61,49 @@ struct mg_rpc_cfg *mgos_rpc_cfg_from_sys(const struct mgos_config *scfg) {
   struct mg_rpc_cfg *ccfg = (struct mg_rpc_cfg *) calloc(1, sizeof(*ccfg));
   mgos_conf_set_str(&ccfg->id, scfg->device.id);
   mgos_conf_set_str(&ccfg->psk, scfg->device.password);
+  ccfg->max_frame_size = scfg->rpc.max_frame_size;
   ccfg->max_queue_length = scfg->rpc.max_queue_length;
+  ccfg->max_channel_queue_length = scfg->rpc.max_channel_queue_length;
+  ccfg->max_broadcast_queue_length = scfg->rpc.max_broadcast_queue_length;
   ccfg->default_out_channel_idle_close_timeout =
       scfg->rpc.default_out_channel_idle_close_timeout;
+  ccfg->max_warm_out_channels = scfg->rpc.max_warm_out_channels;
+  ccfg->out_channel_keep_warm_timeout =
+      scfg->rpc.out_channel_keep_warm_timeout;
+  ccfg->default_call_timeout_ms = scfg->rpc.default_call_timeout_ms;
+  ccfg->rate_limit = scfg->rpc.rate_limit;
+  ccfg->rate_burst = scfg->rpc.rate_burst;
+  ccfg->max_offload_queue_length = scfg->rpc.max_offload_queue_length;
+  ccfg->max_stream_result_size = scfg->rpc.max_stream_result_size;
   return ccfg;
 }
 
 #if defined(MGOS_HAVE_HTTP_SERVER) && MGOS_ENABLE_RPC_CHANNEL_HTTP
+#if MGOS_ENABLE_RPC_CHANNEL_WS
+static void mgos_rpc_ws_in_cfg_from_sys(
+    struct mg_rpc_channel_ws_in_cfg *chcfg) {
+  memset(chcfg, 0, sizeof(*chcfg));
+  chcfg->send_high_water_mark =
+      mgos_sys_config_get_rpc_ws_send_high_water_mark();
+  chcfg->deflate = mgos_sys_config_get_rpc_ws_deflate();
+  chcfg->deflate_min_size = mgos_sys_config_get_rpc_ws_deflate_min_size();
+  chcfg->max_inflated_size = mgos_sys_config_get_rpc_ws_deflate_max_size();
+  chcfg->cbor = true;
+}
+#endif
+
 static void mgos_rpc_http_handler(struct mg_connection *nc, int ev,
                                   void *ev_data, void *user_data) {
   if (ev == MG_EV_HTTP_REQUEST) {
-    /* Create and add the channel to mg_rpc */
-    struct mg_rpc_channel *ch =
-        mg_rpc_channel_http(nc, mgos_sys_config_get_http_auth_domain(),
-                            mgos_sys_config_get_http_auth_file());
+    /* Kept-alive connection reuses its channel, otherwise create one. */
+    struct mg_rpc_channel *ch = mg_rpc_channel_http_get(nc);
     struct http_message *hm = (struct http_message *) ev_data;
     size_t prefix_len = sizeof(HTTP_URI_PREFIX) - 1;
-    mg_rpc_add_channel(mgos_rpc_get_global(), mg_mk_str(""), ch);
+    if (ch == NULL) {
+      ch = mg_rpc_channel_http(nc, mgos_sys_config_get_http_auth_domain(),
+                               mgos_sys_config_get_http_auth_file());
+      mg_rpc_add_channel(mgos_rpc_get_global(), mg_mk_str(""), ch);
+    }
 
     /*
      * Handle the request. If there is method name after /rpc,
@@ -88,16 +118,23 @@ static void mgos_rpc_http_handler(struct mg_connection *nc, int ev,
       mg_rpc_channel_http_recd_frame(nc, hm, ch, hm->body);
     }
   } else if (ev == MG_EV_WEBSOCKET_HANDSHAKE_REQUEST) {
-/* Allow handshake to proceed */
 #if MGOS_ENABLE_RPC_CHANNEL_WS
-    if (!mgos_sys_config_get_rpc_ws_enable())
+    if (mgos_sys_config_get_rpc_ws_enable()) {
+      /* Answered here if compression or CBOR is offered, by mongoose else. */
+      struct mg_rpc_channel_ws_in_cfg chcfg;
+      mgos_rpc_ws_in_cfg_from_sys(&chcfg);
+      mg_rpc_channel_ws_in_handshake_opt(nc, (struct http_message *) ev_data,
+                                         &chcfg);
+    } else
 #endif
     {
       mg_http_send_error(nc, 503, "WS is disabled");
     }
 #if MGOS_ENABLE_RPC_CHANNEL_WS
   } else if (ev == MG_EV_WEBSOCKET_HANDSHAKE_DONE) {
-    struct mg_rpc_channel *ch = mg_rpc_channel_ws_in(nc);
+    struct mg_rpc_channel_ws_in_cfg chcfg;
+    mgos_rpc_ws_in_cfg_from_sys(&chcfg);
+    struct mg_rpc_channel *ch = mg_rpc_channel_ws_in_opt(nc, &chcfg);
     mg_rpc_add_channel(mgos_rpc_get_global(), mg_mk_str(""), ch);
     ch->ev_handler(ch, MG_RPC_CHANNEL_OPEN, NULL);
 #endif
@@ -108,11 +145,20 @@ static void mgos_rpc_http_handler(struct mg_connection *nc, int ev,
 #endif /* defined(MGOS_HAVE_HTTP_SERVER) && MGOS_ENABLE_RPC_CHANNEL_HTTP */
 
 #if MGOS_ENABLE_SYS_SERVICE
+struct mgos_sys_reboot_args {
+  int delay_ms;
+};
+
+static const size_t s_sys_reboot_args_offsets[] = {
+    offsetof(struct mgos_sys_reboot_args, delay_ms),
+};
+
 static void mgos_sys_reboot_handler(struct mg_rpc_request_info *ri,
                                     void *cb_arg, struct mg_rpc_frame_info *fi,
                                     struct mg_str args) {
-  int delay_ms = 100;
-  json_scanf(args.p, args.len, ri->args_fmt, &delay_ms);
+  const struct mgos_sys_reboot_args *a =
+      (const struct mgos_sys_reboot_args *) fi->args_struct;
+  int delay_ms = (fi->args_present & 1 ? a->delay_ms : 100);
   if (delay_ms < 0) {
     mg_rpc_send_errorf(ri, 400, "invalid delay value");
     ri = NULL;
@@ -122,7 +168,7 @@ static void mgos_sys_reboot_handler(struct mg_rpc_request_info *ri,
   mg_rpc_send_responsef(ri, NULL);
   ri = NULL;
   (void) cb_arg;
-  (void) fi;
+  (void) args;
 }
 
 int mgos_print_sys_info(struct json_out *out) {
@@ -246,15 +292,56 @@ enum acl_parse_state {
   ACL_PARSE_STATE_ITERATE,
 };
 
+struct acl_entry {
+  struct mg_str method; /* Pattern, for mg_match_prefix_n. */
+  struct mg_str acl;
+  /*
+   * Length of the literal prefix any matching method must start with.
+   * Compared ignoring case, same as mg_match_prefix_n does.
+   */
+  size_t literal_len;
+};
+
+/* How often, in seconds, the ACL file is checked for changes. */
+#define ACL_RECHECK_INTERVAL 5
+
+/*
+ * ACL compiled from rpc.acl_file. Entries point into data and are checked
+ * in order, first match wins.
+ */
+struct acl {
+  char *file_name;
+  time_t mtime;
+  off_t size;
+  double check_time;
+  char *data;
+  struct acl_entry *entries;
+  int num_entries;
+};
+
+static struct acl s_acl;
+
 struct acl_ctx {
-  struct mg_str called_method;
   enum acl_parse_state state;
   int entry_depth;
-
-  struct mg_str acl_entry;
+  struct acl *acl;
   bool done;
 };
 
+static size_t acl_literal_len(const struct mg_str pattern) {
+  size_t i;
+  for (i = 0; i < pattern.len; i++) {
+    char ch = pattern.p[i];
+    /* Alternatives, no common prefix. */
+    if (ch == '|' || ch == ',') return 0;
+    if (ch == '*' || ch == '?' || ch == '$') break;
+  }
+  for (size_t j = i; j < pattern.len; j++) {
+    if (pattern.p[j] == '|' || pattern.p[j] == ',') return 0;
+  }
+  return i;
+}
+
 static void acl_parse_cb(void *callback_data, const char *name, size_t name_len,
                          const char *path, const struct json_token *token) {
   struct acl_ctx *d = (struct acl_ctx *) callback_data;
@@ -287,13 +374,20 @@ static void acl_parse_cb(void *callback_data, const char *name, size_t name_len,
               LOG(LL_ERROR, ("failed to parse ACL JSON: every item should have "
                              "\"method\" and \"acl\" properties"));
               d->done = true;
+              break;
             }
-
-            if (mg_match_prefix_n(mg_mk_str_n(method.ptr, method.len),
-                                  d->called_method) == d->called_method.len) {
-              d->acl_entry = mg_mk_str_n(acl.ptr, acl.len);
+            struct acl *a = d->acl;
+            struct acl_entry *entries = (struct acl_entry *) realloc(
+                a->entries, (a->num_entries + 1) * sizeof(*entries));
+            if (entries == NULL) {
               d->done = true;
+              break;
             }
+            struct acl_entry *e = &entries[a->num_entries++];
+            e->method = mg_mk_str_n(method.ptr, method.len);
+            e->acl = mg_mk_str_n(acl.ptr, acl.len);
+            e->literal_len = acl_literal_len(e->method);
+            a->entries = entries;
           }
           break;
 
@@ -320,6 +414,92 @@ static void acl_parse_cb(void *callback_data, const char *name, size_t name_len,
   (void) path;
 }
 
+static void acl_free(struct acl *a) {
+  free(a->file_name);
+  free(a->data);
+  free(a->entries);
+  memset(a, 0, sizeof(*a));
+}
+
+/*
+ * (Re)loads the ACL. Entries up to the first invalid one are used,
+ * if the file is not valid JSON, the ACL is empty and denies everything.
+ */
+bool mgos_rpc_acl_reload(void) {
+  const char *file_name = mgos_sys_config_get_rpc_acl_file();
+  acl_free(&s_acl);
+  if (file_name == NULL) return true;
+  s_acl.file_name = strdup(file_name);
+  s_acl.check_time = mg_time();
+  struct stat st;
+  if (stat(file_name, &st) == 0) {
+    s_acl.mtime = st.st_mtime;
+    s_acl.size = st.st_size;
+  }
+  size_t size;
+  s_acl.data = cs_read_file(file_name, &size);
+  if (s_acl.data == NULL) {
+    LOG(LL_ERROR, ("failed to read ACL file %s", file_name));
+    return false;
+  }
+  struct acl_ctx ctx;
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.acl = &s_acl;
+  int walk_res = json_walk(s_acl.data, size, acl_parse_cb, &ctx);
+  if (walk_res < 0) {
+    LOG(LL_ERROR, ("error parsing ACL JSON: %d", walk_res));
+    free(s_acl.entries);
+    s_acl.entries = NULL;
+    s_acl.num_entries = 0;
+    return false;
+  }
+  LOG(LL_DEBUG, ("Loaded %d ACL entries from %s", s_acl.num_entries,
+                 file_name));
+  return true;
+}
+
+/* Returns acl for the method, or an empty string if there isn't one. */
+static struct mg_str acl_lookup(const struct mg_str method) {
+  const char *file_name = mgos_sys_config_get_rpc_acl_file();
+  if (s_acl.file_name == NULL || strcmp(s_acl.file_name, file_name) != 0) {
+    mgos_rpc_acl_reload();
+  } else {
+    /* Same file, reload if it has been changed. */
+    double now = mg_time();
+    if (now >= s_acl.check_time + ACL_RECHECK_INTERVAL) {
+      struct stat st;
+      s_acl.check_time = now;
+      if (stat(file_name, &st) != 0 || st.st_mtime != s_acl.mtime ||
+          st.st_size != s_acl.size) {
+        mgos_rpc_acl_reload();
+      }
+    }
+  }
+  for (int i = 0; i < s_acl.num_entries; i++) {
+    const struct acl_entry *e = &s_acl.entries[i];
+    if (method.len < e->literal_len ||
+        mg_ncasecmp(method.p, e->method.p, e->literal_len) != 0) {
+      continue;
+    }
+    if (mg_match_prefix_n(e->method, method) == method.len) return e->acl;
+  }
+  return mg_mk_str_n(NULL, 0);
+}
+
+static void mgos_rpc_reload_acl_handler(struct mg_rpc_request_info *ri,
+                                        void *cb_arg,
+                                        struct mg_rpc_frame_info *fi,
+                                        struct mg_str args) {
+  if (mgos_rpc_acl_reload()) {
+    mg_rpc_send_responsef(ri, "{num_entries: %d}", s_acl.num_entries);
+  } else {
+    mg_rpc_send_errorf(ri, 500, "failed to load ACL");
+  }
+  (void) cb_arg;
+  (void) fi;
+  (void) args;
+}
+
 /*
  * Mgos-specific middleware which is called for every incoming RPC request
  */
@@ -328,7 +508,6 @@ static bool mgos_rpc_req_prehandler(struct mg_rpc_request_info *ri,
                                     struct mg_str args) {
   bool ret = true;
   struct mg_str acl_entry = mg_mk_str("*");
-  char *acl_data = NULL;
   const char *auth_domain = NULL;
   const char *auth_file = NULL;
 
@@ -336,20 +515,8 @@ static bool mgos_rpc_req_prehandler(struct mg_rpc_request_info *ri,
     /* acl_file is set: then, by default, deny everything */
     acl_entry = mg_mk_str("-*");
 
-    struct acl_ctx ctx;
-    memset(&ctx, 0, sizeof(ctx));
-
-    ctx.called_method = ri->method;
-
-    size_t size;
-    acl_data = cs_read_file(mgos_sys_config_get_rpc_acl_file(), &size);
-    int walk_res = json_walk(acl_data, size, acl_parse_cb, &ctx);
-
-    if (walk_res < 0) {
-      LOG(LL_ERROR, ("error parsing ACL JSON: %d", walk_res));
-    } else if (ctx.acl_entry.len > 0) {
-      acl_entry = ctx.acl_entry;
-    }
+    struct mg_str e = acl_lookup(ri->method);
+    if (e.len > 0) acl_entry = e;
   }
 
   LOG(LL_DEBUG, ("Called '%.*s', acl for it: '%.*s'", (int) ri->method.len,
@@ -429,7 +596,6 @@ static bool mgos_rpc_req_prehandler(struct mg_rpc_request_info *ri,
   (void) args;
 
 clean:
-  free(acl_data);
   return ret;
 }
 
@@ -442,6 +608,12 @@ static void observer_cb(struct mg_rpc *c, void *cb_arg, enum mg_rpc_event ev,
     case MG_RPC_EV_CHANNEL_CLOSED:
       mgos_event_trigger(MGOS_RPC_EV_CHANNEL_CLOSED, ev_arg);
       break;
+    case MG_RPC_EV_QUEUE_FULL:
+      mgos_event_trigger(MGOS_RPC_EV_QUEUE_FULL, ev_arg);
+      break;
+    case MG_RPC_EV_QUEUE_DRAINED:
+      mgos_event_trigger(MGOS_RPC_EV_QUEUE_DRAINED, ev_arg);
+      break;
   }
   (void) c;
   (void) cb_arg;
@@ -465,9 +637,14 @@ bool mgos_rpc_common_init(void) {
   struct mg_rpc *c = mg_rpc_create(ccfg);
 
   /* Add mgos-specific prehandler */
+  mgos_rpc_acl_reload();
   mg_rpc_set_prehandler(c, mgos_rpc_req_prehandler, NULL);
 
 #if MGOS_ENABLE_RPC_CHANNEL_WS
+  mg_rpc_channel_ws_out_seed_jitter(
+      mg_mk_str(mgos_sys_ro_vars_get_mac_address()));
+  mg_rpc_channel_ws_out_seed_jitter(
+      mg_mk_str(mgos_sys_config_get_device_id()));
   if (sccfg->ws.server_address != NULL && sccfg->ws.enable) {
     struct mg_rpc_channel_ws_out_cfg chcfg;
     mgos_rpc_channel_ws_out_cfg_from_sys(&mgos_sys_config, &chcfg);
@@ -479,6 +656,16 @@ bool mgos_rpc_common_init(void) {
   }
 #endif /* MGOS_ENABLE_RPC_CHANNEL_WS */
 
+  if (sccfg->local.enable) {
+    struct mg_rpc_channel_local_cfg chcfg = {.sync = sccfg->local.sync};
+    struct mg_rpc_channel *ch = mg_rpc_channel_local(&chcfg);
+    if (ch == NULL) return false;
+    /* Frames addressed to it are ours. */
+    mg_rpc_add_local_id(c, mg_mk_str(MG_RPC_LOCAL_DST));
+    mg_rpc_add_channel(c, mg_mk_str(MG_RPC_LOCAL_DST), ch);
+    ch->ch_connect(ch);
+  }
+
 #if defined(MGOS_HAVE_HTTP_SERVER) && MGOS_ENABLE_RPC_CHANNEL_HTTP
   {
     struct mg_http_endpoint_opts opts;
@@ -490,12 +677,23 @@ bool mgos_rpc_common_init(void) {
 #endif
 
   mg_rpc_add_list_handler(c);
+  mg_rpc_add_handler(c, "RPC.ReloadACL", "", mgos_rpc_reload_acl_handler,
+                     NULL);
   s_global_mg_rpc = c;
 
 #if MGOS_ENABLE_SYS_SERVICE
-  mg_rpc_add_handler(c, "Sys.Reboot", "{delay_ms: %d}", mgos_sys_reboot_handler,
-                     NULL);
-  mg_rpc_add_handler(c, "Sys.GetInfo", "", mgos_sys_get_info_handler, NULL);
+  struct mg_rpc_handler_opts rb_opts;
+  memset(&rb_opts, 0, sizeof(rb_opts));
+  rb_opts.args_fmt = "{delay_ms: %d}";
+  rb_opts.args_offsets = s_sys_reboot_args_offsets;
+  rb_opts.args_size = sizeof(struct mgos_sys_reboot_args);
+  mg_rpc_add_handler_opt(c, "Sys.Reboot", mgos_sys_reboot_handler, NULL,
+                         &rb_opts);
+  struct mg_rpc_handler_opts gi_opts;
+  memset(&gi_opts, 0, sizeof(gi_opts));
+  gi_opts.cache_ttl_ms = mgos_sys_config_get_rpc_sys_info_cache_ttl_ms();
+  mg_rpc_add_handler_opt(c, "Sys.GetInfo", mgos_sys_get_info_handler, NULL,
+                         &gi_opts);
   mg_rpc_add_handler(c, "Sys.SetDebug",
                      "{udp_log_addr: %Q, level: %d, filter:%Q}",
                      mgos_sys_set_debug_handler, NULL);
@@ -520,6 +718,11 @@ void mgos_rpc_channel_ws_out_cfg_from_sys(
 #endif
   chcfg->reconnect_interval_min = wscfg->reconnect_interval_min;
   chcfg->reconnect_interval_max = wscfg->reconnect_interval_max;
+  chcfg->send_high_water_mark = wscfg->send_high_water_mark;
+  chcfg->cbor = wscfg->cbor;
+  chcfg->deflate = wscfg->deflate;
+  chcfg->deflate_min_size = wscfg->deflate_min_size;
+  chcfg->max_inflated_size = wscfg->deflate_max_size;
 }
 #endif /* MGOS_ENABLE_RPC_CHANNEL_WS */
 